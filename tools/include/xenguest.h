@@ -26,6 +26,10 @@
 
 #define XCFLAGS_LIVE      (1 << 0)
 #define XCFLAGS_DEBUG     (1 << 1)
+#define XCFLAGS_COMPRESS  (1 << 2)
+#define XCFLAGS_SKIP_UNCHANGED (1 << 3)
+#define XCFLAGS_POSTCOPY  (1 << 4)
+#define XCFLAGS_ZERO_PAGES (1 << 5)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -439,6 +443,14 @@ struct precopy_stats
     unsigned int iteration;
     unsigned long total_written;
     long dirty_count; /* -1 if unknown */
+
+    /* Measured over the previous iteration, 0 if unknown. */
+    unsigned long dirty_rate;  /* Pages dirtied per second */
+    unsigned long bandwidth;   /* Bytes of page data written per second */
+
+    /* Time to send dirty_count pages at the current bandwidth, -1 if unknown */
+    long est_downtime_ms;
+    unsigned int throttle;     /* Percentage of vcpu time withheld, 0 if none */
 };
 
 /*
@@ -469,6 +481,19 @@ struct save_callbacks {
                                         * remaining dirty pages. */
     precopy_policy_t precopy_policy;
 
+    /*
+     * Without a precopy_policy, a non-zero max_downtime_ms selects the
+     * adaptive policy instead of the simple one.  It stops once the remaining
+     * dirty pages are estimated to be sent within max_downtime_ms, given the
+     * observed bandwidth.
+     *
+     * If the guest dirties memory faster than it can be sent, the adaptive
+     * policy caps the guest's vcpus through the scheduler, withholding up to
+     * max_throttle percent of their time (credit and credit2 only).
+     */
+    unsigned int max_downtime_ms;
+    unsigned int max_throttle;
+
     /*
      * Called after the guest's dirty pages have been
      *  copied into an output buffer.
@@ -526,9 +551,14 @@ typedef enum {
  * @param flags XCFLAGS_xxx
  * @param stream_type XC_STREAM_PLAIN if the far end of the stream
  *        doesn't use checkpointing
- * @param recv_fd Only used for XC_STREAM_COLO.  Contains backchannel from
- *        the destination side.
+ * @param recv_fd Only used for XC_STREAM_COLO and XCFLAGS_POSTCOPY.
+ *        Contains backchannel from the destination side.
  * @return 0 on success, -1 on failure
+ *
+ * With XCFLAGS_POSTCOPY (HVM guests and XC_STREAM_PLAIN only), the guest is
+ * suspended straight away and only its vcpu and platform state is sent
+ * before the destination resumes it.  Memory follows in the background, with
+ * pages the guest touches first sent on request of the destination.
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags, struct save_callbacks *callbacks,
@@ -554,6 +584,10 @@ struct restore_callbacks {
      * Called after the secondary vm is ready to resume.
      * Callback function resumes the guest & the device model,
      * returns to xc_domain_restore.
+     *
+     * Also called for a postcopy stream, once the guest can run with its
+     * remaining memory still to be fetched from the source.
+     * xc_domain_restore returns once all of the memory has arrived.
      */
     int (*postcopy)(void *data);
 
@@ -605,8 +639,8 @@ struct restore_callbacks {
  *        checkpointing
  * @param callbacks non-NULL to receive a callback to restore toolstack
  *        specific data
- * @param send_back_fd Only used for XC_STREAM_COLO.  Contains backchannel to
- *        the source side.
+ * @param send_back_fd Only used for XC_STREAM_COLO and postcopy streams.
+ *        Contains backchannel to the source side.
  * @return 0 on success, -1 on failure
  */
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
@@ -42,8 +42,16 @@ void xenstat_uninit(xenstat_handle * handle);
 #define XENSTAT_NETWORK 0x2
 #define XENSTAT_XEN_VERSION 0x4
 #define XENSTAT_VBD 0x8
+#define XENSTAT_SCHED_LAT 0x10	/* Several hypfs reads per domain, not in ALL */
 #define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD)
 
+/* Scheduling latency histograms, see docs/misc/hypfs-paths.pandoc */
+#define XENSTAT_SCHED_LAT_WAKE 0	/* Runnable after wakeup until running */
+#define XENSTAT_SCHED_LAT_WAIT 1	/* Runnable after preemption until running */
+#define XENSTAT_SCHED_LAT_RUN 2		/* Running until preempted */
+#define XENSTAT_SCHED_LAT_NR 3
+#define XENSTAT_SCHED_LAT_BUCKETS 24
+
 /* Get all available information about a node */
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags);
 
@@ -134,6 +142,16 @@ unsigned int xenstat_domain_num_vbds(xenstat_domain *);
 xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 				    unsigned int vbd);
 
+/* Get the number of periods counted in a bucket of a scheduling latency
+ * histogram of the domain (0 if the hypervisor doesn't provide them) */
+unsigned long long xenstat_domain_sched_lat(xenstat_domain * domain,
+					    unsigned int which,
+					    unsigned int bucket);
+
+/* Get the upper bound in ns of a scheduling latency histogram bucket (the
+ * last bucket also counts all longer periods) */
+unsigned long long xenstat_sched_lat_bucket_ns(unsigned int bucket);
+
 /*
  * VCPU functions - extract information from a xenstat_vcpu
  */
@@ -168,6 +168,14 @@ static int xendevicemodel_op(
 int xendevicemodel_create_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
     ioservid_t *id)
+{
+    return xendevicemodel_create_ioreq_server2(dmod, domid, handle_bufioreq,
+                                               0, id);
+}
+
+int xendevicemodel_create_ioreq_server2(
+    xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
+    unsigned int flags, ioservid_t *id)
 {
     struct xen_dm_op op;
     struct xen_dm_op_create_ioreq_server *data;
@@ -179,6 +187,7 @@ int xendevicemodel_create_ioreq_server(
     data = &op.u.create_ioreq_server;
 
     data->handle_bufioreq = handle_bufioreq;
+    data->flags = flags;
 
     rc = xendevicemodel_op(dmod, domid, 1, &op, sizeof(op));
     if (rc)
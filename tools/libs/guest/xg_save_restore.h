@@ -29,6 +29,9 @@
 /* When pinning page tables at the end of restore, we also use batching. */
 #define MAX_PIN_BATCH  1024
 
+/* Postcopy pfns are listed in records of up to 64k pfns (512kB). */
+#define MAX_POSTCOPY_PFNS (64 * 1024)
+
 
 /*
 ** Save/restore deal with the mfn_to_pfn (M2P) and pfn_to_mfn (P2M) tables.
@@ -8,6 +8,7 @@
 #include "xc_bitops.h"
 
 #include "xg_sr_stream_format.h"
+#include "xg_sr_page_hash.h"
 
 /* String representation of Domain Header types. */
 const char *dhdr_type_to_str(uint32_t type);
@@ -237,10 +238,40 @@ struct xc_sr_context
             /* Further debugging information in the stream. */
             bool debug;
 
+            /* Send page data as COMPRESSED_PAGE_DATA records. */
+            bool compress;
+            /* Workers compressing batches of pages, if compress is set. */
+            struct xc_sr_workqueue *wq;
+
+            /* Flag zero pages as ZERO rather than sending their data. */
+            bool zero_pages;
+
+            /* Don't resend pages whose contents haven't changed. */
+            bool skip_unchanged;
+            /* Hash of each pfn's contents when last sent, if skip_unchanged. */
+            struct xc_sr_page_hash *page_hashes;
+            /* Bitmap of pfns with a valid entry in page_hashes. */
+            unsigned long *hashed_pages;
+
+            /* Resume the guest on the destination before sending memory. */
+            bool postcopy;
+
             unsigned long p2m_size;
 
             struct precopy_stats stats;
 
+            /* Bytes of page data written into the stream so far. */
+            uint64_t bytes_written;
+
+            /* Adaptive precopy policy, if max_downtime_ms is set. */
+            unsigned int max_downtime_ms;
+            unsigned int max_throttle;
+            /* Consecutive iterations without progress at max_throttle. */
+            unsigned int nr_stalled;
+            /* Scheduler and cap of the domain before throttling began. */
+            uint32_t sched_id;
+            uint16_t orig_cap;
+
             xen_pfn_t *batch_pfns;
             unsigned int nr_batch_pfns;
             unsigned long *deferred_pages;
@@ -297,6 +328,12 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Workers decompressing COMPRESSED_PAGE_DATA records. */
+            struct xc_sr_workqueue *wq;
+
+            /* Paging state, once a POSTCOPY_PFNS record has been seen. */
+            struct xc_sr_postcopy *postcopy;
         } restore;
     };
 
@@ -455,6 +492,57 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
 /* Handle a STATIC_DATA_END record. */
 int handle_static_data_end(struct xc_sr_context *ctx);
 
+/*
+ * A unit of work for a struct xc_sr_workqueue.  Typically embedded in a larger
+ * structure carrying the input and output of the work.
+ */
+struct xc_sr_work
+{
+    struct xc_sr_work *next;
+    /* Called from a worker thread to process the work. */
+    void (*fn)(struct xc_sr_work *work);
+    bool done;
+};
+
+struct xc_sr_workqueue;
+
+/* Suitable number of worker threads for the host. */
+unsigned int sr_nr_workers(void);
+
+/* Create/destroy a pool of nr_threads workers. */
+struct xc_sr_workqueue *sr_workqueue_create(unsigned int nr_threads);
+void sr_workqueue_destroy(struct xc_sr_workqueue *wq);
+
+/* Queue work for processing by the next idle worker. */
+void sr_workqueue_submit(struct xc_sr_workqueue *wq, struct xc_sr_work *work);
+
+/*
+ * Retrieve the oldest submitted work item, if it has been processed.  With
+ * wait set, block until it has been.  Work is handed back strictly in
+ * submission order.  Returns NULL if no (completed) work is available.
+ */
+struct xc_sr_work *sr_workqueue_get(struct xc_sr_workqueue *wq, bool wait);
+
+/* Whether enough work is outstanding to keep all workers busy. */
+bool sr_workqueue_full(struct xc_sr_workqueue *wq);
+
+/*
+ * Compress the nr pages (NULL entries are skipped) into a single zlib stream.
+ * On success, *data is a buffer allocated by malloc() of *len bytes.
+ *
+ * Returns 0 on success and non-0 on failure, with errno set.
+ */
+int sr_compress_pages(void *const *pages, unsigned int nr,
+                      void **data, size_t *len);
+
+/*
+ * Decompress a zlib stream which must expand to exactly pages_len bytes.
+ *
+ * Returns 0 on success and non-0 on failure, with errno set.
+ */
+int sr_decompress_pages(const void *data, size_t len,
+                        void *pages, size_t pages_len);
+
 /* Page type known to the migration logic? */
 static inline bool is_known_page_type(uint32_t type)
 {
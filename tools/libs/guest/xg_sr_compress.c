@@ -0,0 +1,286 @@
+#include <assert.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "xg_sr_common.h"
+
+/* Upper bound of worker threads for (de)compressing page data. */
+#define SR_MAX_WORKERS 8
+
+/* Compression level for page data: favour speed over ratio. */
+#define SR_COMPRESS_LEVEL Z_BEST_SPEED
+
+/*
+ * A pool of worker threads processing work items in parallel.  Work items may
+ * complete in any order, but are handed back to the caller in the order they
+ * were submitted, which keeps the ordering of records in the stream intact.
+ */
+struct xc_sr_workqueue
+{
+    pthread_mutex_t lock;
+    /* Signalled when new work is available, or the workers shall exit. */
+    pthread_cond_t work_cond;
+    /* Signalled when a work item has been completed. */
+    pthread_cond_t done_cond;
+
+    /* All work items not yet handed back, in submission order. */
+    struct xc_sr_work *head, **tail;
+    /* First work item not yet picked up by a worker. */
+    struct xc_sr_work *next;
+    unsigned int nr_pending;
+
+    bool exiting;
+
+    unsigned int nr_threads;
+    pthread_t threads[];
+};
+
+static void *sr_workqueue_worker(void *arg)
+{
+    struct xc_sr_workqueue *wq = arg;
+    struct xc_sr_work *work;
+
+    pthread_mutex_lock(&wq->lock);
+
+    for ( ; ; )
+    {
+        while ( !wq->next && !wq->exiting )
+            pthread_cond_wait(&wq->work_cond, &wq->lock);
+
+        work = wq->next;
+        if ( !work )
+            break;
+
+        wq->next = work->next;
+        pthread_mutex_unlock(&wq->lock);
+
+        work->fn(work);
+
+        pthread_mutex_lock(&wq->lock);
+        work->done = true;
+        pthread_cond_broadcast(&wq->done_cond);
+    }
+
+    pthread_mutex_unlock(&wq->lock);
+
+    return NULL;
+}
+
+unsigned int sr_nr_workers(void)
+{
+    long nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ( nr < 1 )
+        return 1;
+
+    return min_t(long, nr, SR_MAX_WORKERS);
+}
+
+struct xc_sr_workqueue *sr_workqueue_create(unsigned int nr_threads)
+{
+    struct xc_sr_workqueue *wq;
+    unsigned int i;
+    int rc;
+
+    assert(nr_threads);
+
+    wq = calloc(1, sizeof(*wq) + nr_threads * sizeof(*wq->threads));
+    if ( !wq )
+        return NULL;
+
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->work_cond, NULL);
+    pthread_cond_init(&wq->done_cond, NULL);
+    wq->tail = &wq->head;
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        rc = pthread_create(&wq->threads[i], NULL, sr_workqueue_worker, wq);
+        if ( rc )
+        {
+            sr_workqueue_destroy(wq);
+            errno = rc;
+            return NULL;
+        }
+        wq->nr_threads++;
+    }
+
+    return wq;
+}
+
+void sr_workqueue_destroy(struct xc_sr_workqueue *wq)
+{
+    unsigned int i;
+
+    if ( !wq )
+        return;
+
+    pthread_mutex_lock(&wq->lock);
+    wq->exiting = true;
+    pthread_cond_broadcast(&wq->work_cond);
+    pthread_mutex_unlock(&wq->lock);
+
+    for ( i = 0; i < wq->nr_threads; i++ )
+        pthread_join(wq->threads[i], NULL);
+
+    /* All work must have been handed back before destroying the queue. */
+    assert(!wq->head);
+
+    pthread_cond_destroy(&wq->done_cond);
+    pthread_cond_destroy(&wq->work_cond);
+    pthread_mutex_destroy(&wq->lock);
+    free(wq);
+}
+
+void sr_workqueue_submit(struct xc_sr_workqueue *wq, struct xc_sr_work *work)
+{
+    work->next = NULL;
+    work->done = false;
+
+    pthread_mutex_lock(&wq->lock);
+
+    *wq->tail = work;
+    wq->tail = &work->next;
+    if ( !wq->next )
+        wq->next = work;
+    wq->nr_pending++;
+
+    pthread_cond_signal(&wq->work_cond);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+struct xc_sr_work *sr_workqueue_get(struct xc_sr_workqueue *wq, bool wait)
+{
+    struct xc_sr_work *work;
+
+    pthread_mutex_lock(&wq->lock);
+
+    while ( wait && wq->head && !wq->head->done )
+        pthread_cond_wait(&wq->done_cond, &wq->lock);
+
+    work = wq->head;
+    if ( work && work->done )
+    {
+        wq->head = work->next;
+        if ( !wq->head )
+            wq->tail = &wq->head;
+        wq->nr_pending--;
+    }
+    else
+        work = NULL;
+
+    pthread_mutex_unlock(&wq->lock);
+
+    return work;
+}
+
+bool sr_workqueue_full(struct xc_sr_workqueue *wq)
+{
+    bool full;
+
+    /* Allow for one batch being prepared for each busy worker. */
+    pthread_mutex_lock(&wq->lock);
+    full = wq->nr_pending >= 2 * wq->nr_threads;
+    pthread_mutex_unlock(&wq->lock);
+
+    return full;
+}
+
+int sr_compress_pages(void *const *pages, unsigned int nr,
+                      void **data, size_t *len)
+{
+    z_stream zs = { 0 };
+    size_t bound;
+    unsigned int i, nr_pages = 0;
+    void *buf;
+    int rc;
+
+    if ( deflateInit(&zs, SR_COMPRESS_LEVEL) != Z_OK )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        if ( pages[i] )
+            nr_pages++;
+
+    bound = deflateBound(&zs, nr_pages * PAGE_SIZE);
+    buf = malloc(bound);
+    if ( !buf )
+    {
+        deflateEnd(&zs);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    zs.next_out = buf;
+    zs.avail_out = bound;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( !pages[i] )
+            continue;
+
+        zs.next_in = pages[i];
+        zs.avail_in = PAGE_SIZE;
+        if ( deflate(&zs, Z_NO_FLUSH) != Z_OK )
+            goto err;
+    }
+
+    rc = deflate(&zs, Z_FINISH);
+    if ( rc != Z_STREAM_END )
+        goto err;
+
+    *data = buf;
+    *len = zs.total_out;
+    deflateEnd(&zs);
+
+    return 0;
+
+ err:
+    free(buf);
+    deflateEnd(&zs);
+    errno = EIO;
+    return -1;
+}
+
+int sr_decompress_pages(const void *data, size_t len,
+                        void *pages, size_t pages_len)
+{
+    z_stream zs = { 0 };
+    int rc;
+
+    if ( inflateInit(&zs) != Z_OK )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    zs.next_in = (void *)data;
+    zs.avail_in = len;
+    zs.next_out = pages;
+    zs.avail_out = pages_len;
+
+    /* Z_STREAM_END includes a successful check of the Adler-32 checksum. */
+    rc = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    if ( rc != Z_STREAM_END || zs.avail_in || zs.avail_out )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
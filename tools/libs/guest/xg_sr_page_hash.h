@@ -0,0 +1,106 @@
+#ifndef __XG_SR_PAGE_HASH__H
+#define __XG_SR_PAGE_HASH__H
+
+/*
+ * 128-bit hash of a page's contents, used by the saver to spot pages which
+ * are unchanged since they were last sent.
+ *
+ * This is not a cryptographic hash.  Two independent 64-bit halves, each
+ * from four lanes which hide the latency of the multiplies, make a chance
+ * collision between a page and its previous contents about 2^-128 likely:
+ * negligible even over the lifetime of every migration ever run.  A guest
+ * deliberately crafting a collision only corrupts its own memory, which it
+ * could just as well write directly.  tools/tests/migration/test-page-hash
+ * checks that small changes of a page always change its hash.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct xc_sr_page_hash
+{
+    uint64_t lo, hi;
+};
+
+#define XC_SR_HASH_PRIME1 0x9e3779b185ebca87ULL
+#define XC_SR_HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define XC_SR_HASH_PRIME3 0x165667b19e3779f9ULL
+#define XC_SR_HASH_PRIME4 0xd6e8feb86659fd93ULL
+
+static inline uint64_t xc_sr_hash_rol(uint64_t x, unsigned int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+/* Mix a word into a lane. */
+static inline uint64_t xc_sr_hash_round(uint64_t acc, uint64_t word,
+                                        uint64_t mul, uint64_t prime)
+{
+    acc += word * mul;
+    acc = xc_sr_hash_rol(acc, 31);
+
+    return acc * prime;
+}
+
+/* Merge four lanes, each contributing all of its bits, into 64 bits. */
+static inline uint64_t xc_sr_hash_final(const uint64_t h[4], uint64_t mul,
+                                        uint64_t prime)
+{
+    uint64_t res = xc_sr_hash_rol(h[0], 1) + xc_sr_hash_rol(h[1], 7) +
+                   xc_sr_hash_rol(h[2], 12) + xc_sr_hash_rol(h[3], 18);
+    unsigned int i;
+
+    for ( i = 0; i < 4; ++i )
+    {
+        res ^= xc_sr_hash_round(0, h[i], mul, prime);
+        res = res * prime + XC_SR_HASH_PRIME4;
+    }
+
+    /* Final avalanche. */
+    res ^= res >> 33;
+    res *= XC_SR_HASH_PRIME2;
+    res ^= res >> 29;
+    res *= XC_SR_HASH_PRIME3;
+    res ^= res >> 32;
+
+    return res;
+}
+
+/* Hash size bytes at page, size being a multiple of 32. */
+static inline struct xc_sr_page_hash xc_sr_page_hash(const void *page,
+                                                     size_t size)
+{
+    const uint64_t *p = page;
+    uint64_t a[4] = { XC_SR_HASH_PRIME1, XC_SR_HASH_PRIME2,
+                      ~XC_SR_HASH_PRIME1, ~XC_SR_HASH_PRIME2 };
+    uint64_t b[4] = { XC_SR_HASH_PRIME3, XC_SR_HASH_PRIME4,
+                      ~XC_SR_HASH_PRIME3, ~XC_SR_HASH_PRIME4 };
+    struct xc_sr_page_hash res;
+    size_t i;
+    unsigned int j;
+
+    for ( i = 0; i < size / sizeof(*p); i += 4 )
+        for ( j = 0; j < 4; ++j )
+        {
+            a[j] = xc_sr_hash_round(a[j], p[i + j], XC_SR_HASH_PRIME2,
+                                    XC_SR_HASH_PRIME1);
+            b[j] = xc_sr_hash_round(b[j], p[i + j], XC_SR_HASH_PRIME4,
+                                    XC_SR_HASH_PRIME3);
+        }
+
+    res.lo = xc_sr_hash_final(a, XC_SR_HASH_PRIME2, XC_SR_HASH_PRIME1);
+    res.hi = xc_sr_hash_final(b, XC_SR_HASH_PRIME4, XC_SR_HASH_PRIME3);
+
+    return res;
+}
+
+#endif
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,9 +1,46 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <poll.h>
+
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
 
 #include "xg_sr_common.h"
 
+/*
+ * Postcopy state.  Pages yet to arrive from the source are paged out, so the
+ * guest touching one raises a request on the paging ring, which is answered
+ * once its contents have been received.
+ */
+struct xc_sr_postcopy
+{
+    /* Pfns whose contents are yet to arrive. */
+    unsigned long *pending;
+    unsigned long nr_pending;
+
+    /* Pending pfns which couldn't be paged out, needed before resuming. */
+    unsigned long *unpaged;
+    unsigned long nr_unpaged;
+
+    /* Pending pfns already requested from the source. */
+    unsigned long *requested;
+
+    /* Number of pfns covered by the bitmaps. */
+    xen_pfn_t nr_pfns;
+
+    /* Paging requests waiting for the contents of their pfn. */
+    vm_event_request_t *waiters;
+    unsigned int nr_waiters, max_waiters;
+
+    bool paging_enabled;
+    void *ring_page;
+    vm_event_back_ring_t back_ring;
+
+    xenevtchn_handle *xce;
+    int port;
+};
+
 /*
  * Read and validate the Image and Domain headers.
  */
@@ -195,28 +232,238 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
     return rc;
 }
 
+/*
+ * Clear the contents of count already populated pfns, sent as zero pages.
+ */
+static int clear_pages(struct xc_sr_context *ctx, unsigned int count,
+                       const xen_pfn_t *pfns)
+{
+    static const uint8_t zero_page[PAGE_SIZE];
+
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
+    int *map_errs = malloc(count * sizeof(*map_errs));
+    void *mapping = NULL, *guest_page;
+    unsigned int i;
+    int rc = -1;
+
+    if ( !mfns || !map_errs )
+    {
+        ERROR("Failed to allocate %zu bytes to clear pages",
+              count * (sizeof(*mfns) + sizeof(*map_errs)));
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+        mfns[i] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+
+    mapping = guest_page = xenforeignmemory_map(
+        xch->fmem, ctx->domid, PROT_READ | PROT_WRITE,
+        count, mfns, map_errs);
+    if ( !mapping )
+    {
+        PERROR("Unable to map %u mfns to clear", count);
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i, guest_page += PAGE_SIZE )
+    {
+        if ( map_errs[i] )
+        {
+            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn") failed with %d",
+                  pfns[i], mfns[i], map_errs[i]);
+            goto err;
+        }
+
+        if ( ctx->restore.verify )
+        {
+            if ( memcmp(guest_page, zero_page, PAGE_SIZE) )
+                ERROR("verify pfn %#"PRIpfn" failed (expected zero page)",
+                      pfns[i]);
+        }
+        else
+            memset(guest_page, 0, PAGE_SIZE);
+    }
+
+    rc = 0;
+
+ err:
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, count);
+
+    free(map_errs);
+    free(mfns);
+
+    return rc;
+}
+
+/*
+ * Answer a paging request, resuming the vcpu if it was paused on the page.
+ */
+static void put_response(struct xc_sr_postcopy *pc,
+                         const vm_event_request_t *req)
+{
+    vm_event_back_ring_t *back_ring = &pc->back_ring;
+    vm_event_response_t *rsp =
+        RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt);
+
+    memset(rsp, 0, sizeof(*rsp));
+    rsp->version = VM_EVENT_INTERFACE_VERSION;
+    rsp->vcpu_id = req->vcpu_id;
+    rsp->flags = req->flags;
+    rsp->reason = req->reason;
+    rsp->u.mem_paging.gfn = req->u.mem_paging.gfn;
+    rsp->u.mem_paging.flags = req->u.mem_paging.flags;
+
+    back_ring->rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(back_ring);
+}
+
+/*
+ * Answer the paging requests waiting for pfn.  Returns the number answered.
+ */
+static unsigned int wake_waiters(struct xc_sr_postcopy *pc, xen_pfn_t pfn)
+{
+    unsigned int i = 0, nr = 0;
+
+    while ( i < pc->nr_waiters )
+    {
+        if ( pc->waiters[i].u.mem_paging.gfn != pfn )
+        {
+            ++i;
+            continue;
+        }
+
+        put_response(pc, &pc->waiters[i]);
+        pc->waiters[i] = pc->waiters[--pc->nr_waiters];
+        ++nr;
+    }
+
+    return nr;
+}
+
+/*
+ * Postcopy counterpart of process_page_data().  The contents of pending pfns
+ * are paged back into the guest, waking any vcpus waiting for them.  Pfns no
+ * longer pending (e.g. dropped by the guest meanwhile) are ignored.
+ */
+static int postcopy_page_data(struct xc_sr_context *ctx, unsigned int count,
+                              const xen_pfn_t *pfns, const uint32_t *types,
+                              const unsigned long *zero, void *page_data)
+{
+    static const uint8_t zero_page[PAGE_SIZE];
+
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    unsigned int i, woken = 0;
+    void *page, *mapping;
+    xen_pfn_t pfn;
+    int err, rc;
+
+    for ( i = 0; i < count; ++i )
+    {
+        pfn = pfns[i];
+        page = NULL;
+
+        if ( page_type_has_stream_data(types[i]) &&
+             !(zero && test_bit(i, zero)) )
+        {
+            page = page_data;
+            page_data += PAGE_SIZE;
+        }
+
+        if ( pfn >= pc->nr_pfns || !test_bit(pfn, pc->pending) )
+            continue;
+
+        if ( page )
+        {
+            rc = ctx->restore.ops.localise_page(ctx, types[i], page);
+            if ( rc )
+            {
+                ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                      pfn, types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+                return rc;
+            }
+        }
+        else
+            page = (void *)zero_page;
+
+        if ( test_bit(pfn, pc->unpaged) )
+        {
+            /* Never paged out, so write it in place. */
+            mapping = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                           PROT_READ | PROT_WRITE,
+                                           1, &pfn, &err);
+            if ( !mapping || err )
+            {
+                ERROR("Mapping pfn %#"PRIpfn" failed with %d",
+                      pfn, mapping ? err : errno);
+                if ( mapping )
+                    xenforeignmemory_unmap(xch->fmem, mapping, 1);
+                return -1;
+            }
+
+            memcpy(mapping, page, PAGE_SIZE);
+            xenforeignmemory_unmap(xch->fmem, mapping, 1);
+
+            clear_bit(pfn, pc->unpaged);
+            --pc->nr_unpaged;
+        }
+        else if ( xc_mem_paging_load(xch, ctx->domid, pfn, page) )
+        {
+            PERROR("Failed to page in pfn %#"PRIpfn, pfn);
+            return -1;
+        }
+
+        ctx->restore.ops.set_page_type(ctx, pfn, types[i]);
+        clear_bit(pfn, pc->pending);
+        --pc->nr_pending;
+
+        if ( test_and_clear_bit(pfn, pc->requested) )
+            woken += wake_waiters(pc, pfn);
+    }
+
+    if ( woken && xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  Pfns set in the zero bitmap (which may be NULL)
+ * have no data in the block, and are to be cleared instead.
  */
 static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
-                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+                             xen_pfn_t *pfns, uint32_t *types,
+                             const unsigned long *zero, void *page_data)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
-    int *map_errs = malloc(count * sizeof(*map_errs));
+    xen_pfn_t *mfns, *zeroed = NULL;
+    int *map_errs;
     int rc;
     void *mapping = NULL, *guest_page = NULL;
     unsigned int i, /* i indexes the pfns from the record. */
         j,          /* j indexes the subset of pfns we decide to map. */
-        nr_pages = 0;
+        nr_pages = 0, nr_zeroed = 0;
 
-    if ( !mfns || !map_errs )
+    if ( ctx->restore.postcopy )
+        return postcopy_page_data(ctx, count, pfns, types, zero, page_data);
+
+    mfns = malloc(count * sizeof(*mfns));
+    map_errs = malloc(count * sizeof(*map_errs));
+    if ( zero )
+        zeroed = malloc(count * sizeof(*zeroed));
+    if ( !mfns || !map_errs || (zero && !zeroed) )
     {
         rc = -1;
         ERROR("Failed to allocate %zu bytes to process page data",
-              count * (sizeof(*mfns) + sizeof(*map_errs)));
+              count * (sizeof(*mfns) + sizeof(*map_errs) +
+                       (zero ? sizeof(*zeroed) : 0)));
         goto err;
     }
 
@@ -231,10 +478,27 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
     {
         ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
 
-        if ( page_type_has_stream_data(types[i]) )
+        if ( !page_type_has_stream_data(types[i]) )
+            continue;
+
+        if ( zero && test_bit(i, zero) )
+            zeroed[nr_zeroed++] = pfns[i];
+        else
             mfns[nr_pages++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
     }
 
+    /*
+     * Zero pages are always cleared explicitly.  Freshly populated memory
+     * need not be zero: debug builds of Xen deliberately fill scrubbed pages
+     * with a poison pattern, and bootscrub=off leaves them as they were.
+     */
+    if ( nr_zeroed )
+    {
+        rc = clear_pages(ctx, nr_zeroed, zeroed);
+        if ( rc )
+            goto err;
+    }
+
     /* Nothing to do? */
     if ( nr_pages == 0 )
         goto done;
@@ -252,7 +516,8 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
 
     for ( i = 0, j = 0; i < count; ++i )
     {
-        if ( !page_type_has_stream_data(types[i]) )
+        if ( !page_type_has_stream_data(types[i]) ||
+             (zero && test_bit(i, zero)) )
             continue;
 
         if ( map_errs[j] )
@@ -290,127 +555,627 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
         page_data += PAGE_SIZE;
     }
 
- done:
-    rc = 0;
+ done:
+    rc = 0;
+
+ err:
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+
+    free(zeroed);
+    free(map_errs);
+    free(mfns);
+
+    return rc;
+}
+
+/*
+ * Check that page data may be processed at this point in the stream.
+ */
+static int check_page_data_allowed(struct xc_sr_context *ctx)
+{
+    /*
+     * v2 compatibility only exists for x86 streams.  This is a bit of a
+     * bodge, but it is less bad than duplicating handle_page_data() between
+     * different architectures.
+     */
+#if defined(__i386__) || defined(__x86_64__)
+    xc_interface *xch = ctx->xch;
+    int rc;
+
+    /* v2 compat.  Infer the position of STATIC_DATA_END. */
+    if ( ctx->restore.format_version < 3 && !ctx->restore.seen_static_data_end )
+    {
+        rc = handle_static_data_end(ctx);
+        if ( rc )
+        {
+            ERROR("Inferred STATIC_DATA_END record failed");
+            return rc;
+        }
+    }
+
+    if ( !ctx->restore.seen_static_data_end )
+    {
+        ERROR("No STATIC_DATA_END seen");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Decode the count pfns of a page data record into pfns[] and types[], and a
+ * bitmap of the pfns sent as zero pages, which are allocated by malloc() and
+ * must be passed to free() by the caller.  *pages_of_data is set to the number
+ * of pages of data expected.
+ */
+static int decode_page_data_pfns(struct xc_sr_context *ctx,
+                                 unsigned int count, const uint64_t *rec_pfns,
+                                 xen_pfn_t **pfns_out, uint32_t **types_out,
+                                 unsigned long **zero_out,
+                                 unsigned int *pages_of_data)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+    xen_pfn_t *pfns = NULL, pfn;
+    uint32_t *types = NULL, type;
+    unsigned long *zero = NULL;
+
+    *pages_of_data = 0;
+
+    pfns = malloc(count * sizeof(*pfns));
+    types = malloc(count * sizeof(*types));
+    zero = bitmap_alloc(count);
+    if ( !pfns || !types || !zero )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns", count);
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        pfn = rec_pfns[i] & PAGE_DATA_PFN_MASK;
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            goto err;
+        }
+
+        type = (rec_pfns[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( !is_known_page_type(type) )
+        {
+            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
+            goto err;
+        }
+
+        if ( rec_pfns[i] & PAGE_DATA_ZERO )
+        {
+            if ( !page_type_has_stream_data(type) )
+            {
+                ERROR("Zero page flag on pfn %#"PRIpfn" (index %u) of type "
+                      "%#"PRIx32" without data", pfn, i, type);
+                goto err;
+            }
+
+            set_bit(i, zero);
+        }
+        else if ( page_type_has_stream_data(type) )
+            /* NOTAB and all L1 through L4 tables (including pinned) should
+             * have a page worth of data in the record. */
+            (*pages_of_data)++;
+
+        pfns[i] = pfn;
+        types[i] = type;
+    }
+
+    *pfns_out = pfns;
+    *types_out = types;
+    *zero_out = zero;
+
+    return 0;
+
+ err:
+    free(zero);
+    free(types);
+    free(pfns);
+
+    return -1;
+}
+
+/*
+ * Validate a PAGE_DATA record from the stream, and pass the results to
+ * process_page_data() to actually perform the legwork.
+ */
+static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned int pages_of_data;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+    unsigned long *zero = NULL;
+
+    if ( check_page_data_allowed(ctx) )
+        goto err;
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        goto err;
+    }
+
+    if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        goto err;
+    }
+
+    if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    {
+        ERROR("PAGE_DATA record (length %u) too short to contain %u"
+              " pfns worth of information", rec->length, pages->count);
+        goto err;
+    }
+
+    if ( decode_page_data_pfns(ctx, pages->count, pages->pfn,
+                               &pfns, &types, &zero, &pages_of_data) )
+        goto err;
+
+    if ( rec->length != (sizeof(*pages) +
+                         (sizeof(uint64_t) * pages->count) +
+                         (PAGE_SIZE * pages_of_data)) )
+    {
+        ERROR("PAGE_DATA record wrong size: length %u, expected "
+              "%zu + %zu + %lu", rec->length, sizeof(*pages),
+              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        goto err;
+    }
+
+    rc = process_page_data(ctx, pages->count, pfns, types, zero,
+                           &pages->pfn[pages->count]);
+ err:
+    free(zero);
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * A COMPRESSED_PAGE_DATA record handed to the workers for decompression.
+ */
+struct decompress_batch
+{
+    struct xc_sr_work work;
+
+    unsigned int count, pages_of_data;
+    xen_pfn_t *pfns;
+    uint32_t *types;
+    unsigned long *zero;
+
+    /* The record data, containing the compressed pages. */
+    void *rec_data;
+    const void *compressed;
+    size_t compressed_length;
+
+    /* Result of the decompression. */
+    int rc, err;
+    void *page_data;
+};
+
+static void decompress_batch_fn(struct xc_sr_work *work)
+{
+    struct decompress_batch *batch =
+        container_of(work, struct decompress_batch, work);
+
+    batch->rc = sr_decompress_pages(batch->compressed,
+                                    batch->compressed_length,
+                                    batch->page_data,
+                                    batch->pages_of_data * PAGE_SIZE);
+    batch->err = errno;
+}
+
+static void free_decompress_batch(struct decompress_batch *batch)
+{
+    free(batch->page_data);
+    free(batch->rec_data);
+    free(batch->zero);
+    free(batch->types);
+    free(batch->pfns);
+    free(batch);
+}
+
+/*
+ * Process decompressed batches in the order their records were received.
+ * Unless all is set, only wait for the workers while the queue is full, so
+ * further records can be read while the current ones decompress.
+ */
+static int process_decompressed_batches(struct xc_sr_context *ctx, bool all)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_workqueue *wq = ctx->restore.wq;
+    struct xc_sr_work *work;
+    struct decompress_batch *batch;
+    int rc;
+
+    if ( !wq )
+        return 0;
+
+    while ( (work = sr_workqueue_get(wq, all || sr_workqueue_full(wq))) )
+    {
+        batch = container_of(work, struct decompress_batch, work);
+
+        if ( batch->rc )
+        {
+            errno = batch->err;
+            PERROR("Failed to decompress %u pages of data",
+                   batch->pages_of_data);
+            rc = -1;
+        }
+        else
+            rc = process_page_data(ctx, batch->count, batch->pfns,
+                                   batch->types, batch->zero,
+                                   batch->page_data);
+
+        free_decompress_batch(batch);
+        if ( rc )
+            return rc;
+    }
+
+    return 0;
+}
+
+/*
+ * Validate a COMPRESSED_PAGE_DATA record from the stream, and queue it for
+ * decompression.  The pages are processed once decompressed, strictly in
+ * stream order.
+ */
+static int handle_compressed_page_data(struct xc_sr_context *ctx,
+                                       struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_compressed_page_data_header *pages = rec->data;
+    struct decompress_batch *batch = NULL;
+    size_t hdr_length;
+
+    if ( check_page_data_allowed(ctx) )
+        return -1;
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("COMPRESSED_PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        return -1;
+    }
+
+    if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in COMPRESSED_PAGE_DATA record");
+        return -1;
+    }
+
+    hdr_length = sizeof(*pages) + (pages->count * sizeof(uint64_t));
+    if ( rec->length != hdr_length + pages->compressed_length )
+    {
+        ERROR("COMPRESSED_PAGE_DATA record wrong size: length %u, expected "
+              "%zu + %zu + %u", rec->length, sizeof(*pages),
+              (sizeof(uint64_t) * pages->count), pages->compressed_length);
+        return -1;
+    }
+
+    batch = calloc(1, sizeof(*batch));
+    if ( !batch )
+    {
+        ERROR("Unable to allocate decompression batch");
+        return -1;
+    }
+
+    if ( decode_page_data_pfns(ctx, pages->count, pages->pfn, &batch->pfns,
+                               &batch->types, &batch->zero,
+                               &batch->pages_of_data) )
+        goto err;
+
+    if ( batch->pages_of_data < 1 )
+    {
+        ERROR("Expected at least 1 page of data in COMPRESSED_PAGE_DATA record");
+        goto err;
+    }
+
+    batch->page_data = malloc(batch->pages_of_data * PAGE_SIZE);
+    if ( !batch->page_data )
+    {
+        ERROR("Unable to allocate %lu bytes for decompressed page data",
+              batch->pages_of_data * PAGE_SIZE);
+        goto err;
+    }
+
+    if ( !ctx->restore.wq )
+    {
+        ctx->restore.wq = sr_workqueue_create(sr_nr_workers());
+        if ( !ctx->restore.wq )
+        {
+            PERROR("Unable to create decompression workers");
+            goto err;
+        }
+    }
+
+    /* Ownership of the record data passes to the batch. */
+    batch->work.fn = decompress_batch_fn;
+    batch->count = pages->count;
+    batch->compressed = (void *)pages + hdr_length;
+    batch->compressed_length = pages->compressed_length;
+    batch->rec_data = rec->data;
+    rec->data = NULL;
+
+    sr_workqueue_submit(ctx->restore.wq, &batch->work);
+
+    return process_decompressed_batches(ctx, false);
+
+ err:
+    free_decompress_batch(batch);
+
+    return -1;
+}
+
+/*
+ * Send a POSTCOPY_PAGE_REQUEST record for count pfns to the source.
+ */
+static int send_page_request(struct xc_sr_context *ctx, unsigned int count,
+                             uint64_t *pfns)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns hdr = { .count = count };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_POSTCOPY_PAGE_REQUEST,
+        .length = sizeof(hdr) + count * sizeof(*pfns),
+    };
+    struct iovec iov[] = {
+        { &rec.type, sizeof(rec.type) },
+        { &rec.length, sizeof(rec.length) },
+        { &hdr, sizeof(hdr) },
+        { pfns, count * sizeof(*pfns) },
+    };
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to write page request to the source");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Enable paging for the guest, so pages can be left to arrive after it has
+ * been resumed.
+ */
+static int postcopy_setup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct restore_callbacks *callbacks = ctx->restore.callbacks;
+    struct xc_sr_postcopy *pc;
+    uint64_t ring_pfn;
+    uint32_t port;
+    int rc;
+
+    if ( ctx->restore.guest_type != DHDR_TYPE_X86_HVM )
+    {
+        ERROR("Postcopy is only supported for HVM guests");
+        return -1;
+    }
+
+    if ( ctx->restore.send_back_fd < 0 || !callbacks ||
+         !callbacks->postcopy || !callbacks->restore_results )
+    {
+        ERROR("Postcopy requires send_back_fd, and the postcopy and"
+              " restore_results callbacks");
+        return -1;
+    }
+
+    pc = calloc(1, sizeof(*pc));
+    if ( !pc )
+    {
+        ERROR("Unable to allocate postcopy state");
+        return -1;
+    }
+
+    /* Any partial setup is undone by cleanup(). */
+    pc->port = -1;
+    ctx->restore.postcopy = pc;
+
+    rc = xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_PAGING_RING_PFN,
+                          &ring_pfn);
+    if ( rc || !ring_pfn )
+    {
+        ERROR("No paging ring pfn for the guest");
+        return -1;
+    }
+
+    pc->ring_page = xc_vm_event_enable(xch, ctx->domid,
+                                       HVM_PARAM_PAGING_RING_PFN, &port);
+    if ( !pc->ring_page )
+    {
+        PERROR("Failed to enable paging");
+        return -1;
+    }
+    pc->paging_enabled = true;
+
+    pc->xce = xenevtchn_open(NULL, 0);
+    if ( !pc->xce )
+    {
+        PERROR("Failed to open event channel handle");
+        return -1;
+    }
+
+    rc = xenevtchn_bind_interdomain(pc->xce, ctx->domid, port);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to bind paging event channel %u", port);
+        return -1;
+    }
+    pc->port = rc;
+
+    SHARED_RING_INIT((vm_event_sring_t *)pc->ring_page);
+    BACK_RING_INIT(&pc->back_ring, (vm_event_sring_t *)pc->ring_page,
+                   XC_PAGE_SIZE);
+
+    return 0;
+}
+
+static void postcopy_cleanup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+
+    if ( !pc )
+        return;
+
+    if ( pc->paging_enabled && xc_mem_paging_disable(xch, ctx->domid) )
+        PERROR("Failed to disable paging");
+
+    if ( pc->ring_page )
+        munmap(pc->ring_page, XC_PAGE_SIZE);
 
- err:
-    if ( mapping )
-        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+    if ( pc->port >= 0 )
+        xenevtchn_unbind(pc->xce, pc->port);
 
-    free(map_errs);
-    free(mfns);
+    if ( pc->xce )
+        xenevtchn_close(pc->xce);
 
-    return rc;
+    free(pc->waiters);
+    free(pc->requested);
+    free(pc->unpaged);
+    free(pc->pending);
+    free(pc);
+
+    ctx->restore.postcopy = NULL;
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Grow the postcopy bitmaps to cover pfn.  Like populated_pfns, they are
+ * sized by the pfns found in the stream, rather than the guest's p2m.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+static int postcopy_track_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn)
 {
     xc_interface *xch = ctx->xch;
-    struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned int i, pages_of_data = 0;
-    int rc = -1;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    unsigned long **bitmaps[] = { &pc->pending, &pc->unpaged, &pc->requested };
+    size_t old_sz = bitmap_size(pc->nr_pfns), new_sz;
+    xen_pfn_t nr_pfns = max_t(xen_pfn_t, pc->nr_pfns, 32 * 1024);
+    unsigned long *p;
+    unsigned int i;
 
-    xen_pfn_t *pfns = NULL, pfn;
-    uint32_t *types = NULL, type;
+    if ( pfn < pc->nr_pfns )
+        return 0;
 
-    /*
-     * v2 compatibility only exists for x86 streams.  This is a bit of a
-     * bodge, but it is less bad than duplicating handle_page_data() between
-     * different architectures.
-     */
-#if defined(__i386__) || defined(__x86_64__)
-    /* v2 compat.  Infer the position of STATIC_DATA_END. */
-    if ( ctx->restore.format_version < 3 && !ctx->restore.seen_static_data_end )
+    while ( nr_pfns <= pfn )
+        nr_pfns *= 2;
+    new_sz = bitmap_size(nr_pfns);
+
+    for ( i = 0; i < ARRAY_SIZE(bitmaps); ++i )
     {
-        rc = handle_static_data_end(ctx);
-        if ( rc )
+        p = realloc(*bitmaps[i], new_sz);
+        if ( !p )
         {
-            ERROR("Inferred STATIC_DATA_END record failed");
-            goto err;
+            ERROR("Failed to realloc postcopy bitmaps");
+            return -1;
         }
-        rc = -1;
-    }
 
-    if ( !ctx->restore.seen_static_data_end )
-    {
-        ERROR("No STATIC_DATA_END seen");
-        goto err;
+        memset((uint8_t *)p + old_sz, 0x00, new_sz - old_sz);
+        *bitmaps[i] = p;
     }
-#endif
 
-    if ( rec->length < sizeof(*pages) )
-    {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
-        goto err;
-    }
+    pc->nr_pfns = nr_pfns;
 
-    if ( pages->count < 1 )
-    {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
-        goto err;
-    }
+    return 0;
+}
 
-    if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+/*
+ * Validate a POSTCOPY_PFNS record from the stream.  The pfns listed are
+ * populated and paged out straight away, to be paged back in as their
+ * contents arrive.  Pfns which can't be paged out are fetched before the
+ * guest is resumed.
+ */
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns *hdr = rec->data;
+    struct xc_sr_postcopy *pc;
+    xen_pfn_t *pfns;
+    unsigned int i, j, nr;
+    int rc = -1;
+
+    if ( rec->length < sizeof(*hdr) ||
+         rec->length != sizeof(*hdr) + hdr->count * sizeof(*hdr->pfn) )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
-        goto err;
+        ERROR("POSTCOPY_PFNS record wrong size: length %u", rec->length);
+        return -1;
     }
 
-    pfns = malloc(pages->count * sizeof(*pfns));
-    types = malloc(pages->count * sizeof(*types));
-    if ( !pfns || !types )
+    if ( !ctx->restore.postcopy && postcopy_setup(ctx) )
+        return -1;
+    pc = ctx->restore.postcopy;
+
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
+    if ( !pfns )
     {
-        ERROR("Unable to allocate enough memory for %u pfns",
-              pages->count);
-        goto err;
+        ERROR("Unable to allocate memory for a batch of %u pfns",
+              MAX_BATCH_SIZE);
+        return -1;
     }
 
-    for ( i = 0; i < pages->count; ++i )
+    for ( i = 0; i < hdr->count; i += nr )
     {
-        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
-        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        nr = min_t(unsigned int, MAX_BATCH_SIZE, hdr->count - i);
+
+        for ( j = 0; j < nr; ++j )
         {
-            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
-            goto err;
+            pfns[j] = hdr->pfn[i + j];
+            if ( (hdr->pfn[i + j] & ~PAGE_DATA_PFN_MASK) ||
+                 !ctx->restore.ops.pfn_is_valid(ctx, pfns[j]) ||
+                 postcopy_track_pfn(ctx, pfns[j]) ||
+                 test_bit(pfns[j], pc->pending) )
+            {
+                ERROR("Invalid or repeated postcopy pfn %#"PRIx64,
+                      hdr->pfn[i + j]);
+                goto err;
+            }
         }
 
-        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
-        if ( !is_known_page_type(type) )
-        {
-            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
-                  type, pfn, i);
+        rc = populate_pfns(ctx, nr, pfns, NULL);
+        if ( rc )
             goto err;
-        }
+        rc = -1;
 
-        if ( page_type_has_stream_data(type) )
-            /* NOTAB and all L1 through L4 tables (including pinned) should
-             * have a page worth of data in the record. */
-            pages_of_data++;
+        for ( j = 0; j < nr; ++j )
+        {
+            if ( xc_mem_paging_nominate(xch, ctx->domid, pfns[j]) ||
+                 xc_mem_paging_evict(xch, ctx->domid, pfns[j]) )
+            {
+                if ( errno != EBUSY )
+                {
+                    PERROR("Failed to page out pfn %#"PRIpfn, pfns[j]);
+                    goto err;
+                }
 
-        pfns[i] = pfn;
-        types[i] = type;
-    }
+                set_bit(pfns[j], pc->unpaged);
+                ++pc->nr_unpaged;
+            }
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
-    {
-        ERROR("PAGE_DATA record wrong size: length %u, expected "
-              "%zu + %zu + %lu", rec->length, sizeof(*pages),
-              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
-        goto err;
+            set_bit(pfns[j], pc->pending);
+            ++pc->nr_pending;
+        }
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+    rc = 0;
+
  err:
-    free(types);
     free(pfns);
 
     return rc;
@@ -534,6 +1299,10 @@ static int handle_checkpoint(struct xc_sr_context *ctx)
                 goto err;
         }
         ctx->restore.buffered_rec_num = 0;
+
+        rc = process_decompressed_batches(ctx, true);
+        if ( rc )
+            goto err;
         IPRINTF("All records processed");
     }
     else
@@ -648,6 +1417,14 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     xc_interface *xch = ctx->xch;
     int rc = 0;
 
+    /* Pages from earlier records must be in place before anything else. */
+    if ( rec->type != REC_TYPE_COMPRESSED_PAGE_DATA )
+    {
+        rc = process_decompressed_batches(ctx, true);
+        if ( rc )
+            goto out;
+    }
+
     switch ( rec->type )
     {
     case REC_TYPE_END:
@@ -657,6 +1434,10 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_COMPRESSED_PAGE_DATA:
+        rc = handle_compressed_page_data(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -670,17 +1451,293 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_static_data_end(ctx);
         break;
 
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        /* Acted upon by restore(), once the record has been processed. */
+        if ( !ctx->restore.postcopy )
+        {
+            ERROR("POSTCOPY_TRANSITION without preceding POSTCOPY_PFNS");
+            rc = -1;
+        }
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
     }
 
+ out:
     free(rec->data);
     rec->data = NULL;
 
     return rc;
 }
 
+/*
+ * Process a record, ignoring optional records which aren't understood.
+ */
+static int process_stream_record(struct xc_sr_context *ctx,
+                                 struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    int rc = process_record(ctx, rec);
+
+    if ( rc == RECORD_NOT_PROCESSED )
+    {
+        if ( rec->type & REC_TYPE_OPTIONAL )
+        {
+            DPRINTF("Ignoring optional record %#x (%s)",
+                    rec->type, rec_type_to_str(rec->type));
+            rc = 0;
+        }
+        else
+        {
+            ERROR("Mandatory record %#x (%s) not handled",
+                  rec->type, rec_type_to_str(rec->type));
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * Consume the requests on the paging ring.  Pending pfns are requested from
+ * the source, with the request answered once their contents arrive.  Requests
+ * for pfns already in place are answered straight away.
+ */
+static int handle_paging_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    vm_event_back_ring_t *back_ring = &pc->back_ring;
+    vm_event_request_t req, *waiters;
+    uint64_t pfns[64];
+    unsigned int nr = 0, woken = 0, max;
+    xen_pfn_t gfn;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION )
+        {
+            ERROR("Paging request version %u, expected %u",
+                  req.version, VM_EVENT_INTERFACE_VERSION);
+            return -1;
+        }
+
+        gfn = req.u.mem_paging.gfn;
+
+        if ( gfn < pc->nr_pfns && test_bit(gfn, pc->pending) )
+        {
+            if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+            {
+                /* Freed by the guest, so its contents are no longer needed. */
+                clear_bit(gfn, pc->pending);
+                --pc->nr_pending;
+                if ( test_and_clear_bit(gfn, pc->requested) )
+                    woken += wake_waiters(pc, gfn);
+            }
+            else
+            {
+                if ( pc->nr_waiters == pc->max_waiters )
+                {
+                    max = pc->max_waiters ? 2 * pc->max_waiters : 16;
+                    waiters = realloc(pc->waiters, max * sizeof(*waiters));
+                    if ( !waiters )
+                    {
+                        ERROR("Unable to allocate %u paging waiters", max);
+                        return -1;
+                    }
+
+                    pc->waiters = waiters;
+                    pc->max_waiters = max;
+                }
+
+                pc->waiters[pc->nr_waiters++] = req;
+
+                if ( !test_and_set_bit(gfn, pc->requested) )
+                {
+                    pfns[nr++] = gfn;
+                    if ( nr == ARRAY_SIZE(pfns) )
+                    {
+                        if ( send_page_request(ctx, nr, pfns) )
+                            return -1;
+                        nr = 0;
+                    }
+                }
+
+                continue;
+            }
+        }
+
+        /* The page is in place.  Resume the vcpu if it is waiting. */
+        if ( (req.flags & VM_EVENT_FLAG_VCPU_PAUSED) ||
+             (req.u.mem_paging.flags & MEM_PAGING_EVICT_FAIL) )
+        {
+            put_response(pc, &req);
+            ++woken;
+        }
+    }
+
+    if ( nr && send_page_request(ctx, nr, pfns) )
+        return -1;
+
+    if ( woken && xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Complete a postcopy stream, after its POSTCOPY_TRANSITION record.  Once
+ * any pages which couldn't be paged out have arrived, the guest is resumed.
+ * The rest of its memory is then received until the END record, with pages
+ * the guest touches requested from the source on demand.
+ */
+static int postcopy_restore(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    struct restore_callbacks *callbacks = ctx->restore.callbacks;
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_TRANSITION };
+    struct pollfd pfds[2];
+    uint64_t *pfns;
+    xen_pfn_t pfn;
+    unsigned int nr = 0;
+    int rc, port;
+
+    if ( pc->nr_unpaged )
+    {
+        DPRINTF("Fetching %lu pages before resuming the guest",
+                pc->nr_unpaged);
+
+        pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
+        if ( !pfns )
+        {
+            ERROR("Unable to allocate memory for a batch of %u pfns",
+                  MAX_BATCH_SIZE);
+            return -1;
+        }
+
+        for ( pfn = 0, rc = 0; !rc && pfn < pc->nr_pfns; ++pfn )
+        {
+            if ( !test_bit(pfn, pc->unpaged) )
+                continue;
+
+            set_bit(pfn, pc->requested);
+            pfns[nr++] = pfn;
+            if ( nr == MAX_BATCH_SIZE )
+            {
+                rc = send_page_request(ctx, nr, pfns);
+                nr = 0;
+            }
+        }
+
+        if ( !rc && nr )
+            rc = send_page_request(ctx, nr, pfns);
+        free(pfns);
+        if ( rc )
+            return rc;
+
+        while ( pc->nr_unpaged && rec.type != REC_TYPE_END )
+        {
+            rc = read_record(ctx, ctx->fd, &rec);
+            if ( !rc )
+                rc = process_stream_record(ctx, &rec);
+            if ( !rc )
+                rc = process_decompressed_batches(ctx, true);
+            if ( rc )
+                return rc;
+        }
+    }
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+
+    callbacks->restore_results(ctx->restore.xenstore_gfn,
+                               ctx->restore.console_gfn, callbacks->data);
+
+    rc = callbacks->postcopy(callbacks->data);
+    if ( rc <= 0 )
+    {
+        ERROR("postcopy() callback failed: %d", rc);
+        return -1;
+    }
+
+    IPRINTF("Guest resumed with %lu pages outstanding", pc->nr_pending);
+
+    pfds[0].fd = ctx->fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = xenevtchn_fd(pc->xce);
+    pfds[1].events = POLLIN;
+
+    while ( rec.type != REC_TYPE_END )
+    {
+        rc = poll(pfds, ARRAY_SIZE(pfds), -1);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll the stream and paging event channel");
+            return -1;
+        }
+
+        if ( pfds[1].revents )
+        {
+            port = xenevtchn_pending(pc->xce);
+            if ( port < 0 )
+            {
+                PERROR("Failed to read paging event channel");
+                return -1;
+            }
+
+            if ( xenevtchn_unmask(pc->xce, port) )
+            {
+                PERROR("Failed to unmask paging event channel");
+                return -1;
+            }
+
+            rc = handle_paging_requests(ctx);
+            if ( rc )
+                return rc;
+        }
+
+        if ( pfds[0].revents )
+        {
+            rc = read_record(ctx, ctx->fd, &rec);
+            if ( !rc )
+                rc = process_stream_record(ctx, &rec);
+            /* Don't keep vcpus waiting on pages still being decompressed. */
+            if ( !rc && pc->nr_waiters )
+                rc = process_decompressed_batches(ctx, true);
+            if ( rc )
+                return rc;
+        }
+    }
+
+    if ( pc->nr_pending )
+    {
+        ERROR("Stream ended with %lu pages outstanding", pc->nr_pending);
+        return -1;
+    }
+
+    /* Resume anything which faulted on a page after it arrived. */
+    return handle_paging_requests(ctx);
+}
+
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -735,6 +1792,18 @@ static void cleanup(struct xc_sr_context *ctx)
     unsigned int i;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
+    struct xc_sr_work *work;
+
+    if ( ctx->restore.wq )
+    {
+        /* Discard batches left over from a failed restore. */
+        while ( (work = sr_workqueue_get(ctx->restore.wq, true)) )
+            free_decompress_batch(
+                container_of(work, struct decompress_batch, work));
+        sr_workqueue_destroy(ctx->restore.wq);
+    }
+
+    postcopy_cleanup(ctx);
 
     for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
         free(ctx->restore.buffered_records[i].data);
@@ -786,27 +1855,25 @@ static int restore(struct xc_sr_context *ctx)
         }
         else
         {
-            rc = process_record(ctx, &rec);
-            if ( rc == RECORD_NOT_PROCESSED )
-            {
-                if ( rec.type & REC_TYPE_OPTIONAL )
-                    DPRINTF("Ignoring optional record %#x (%s)",
-                            rec.type, rec_type_to_str(rec.type));
-                else
-                {
-                    ERROR("Mandatory record %#x (%s) not handled",
-                          rec.type, rec_type_to_str(rec.type));
-                    rc = -1;
-                    goto err;
-                }
-            }
-            else if ( rc == BROKEN_CHANNEL )
+            rc = process_stream_record(ctx, &rec);
+            if ( rc == BROKEN_CHANNEL )
                 goto remus_failover;
             else if ( rc )
                 goto err;
         }
 
-    } while ( rec.type != REC_TYPE_END );
+    } while ( rec.type != REC_TYPE_END &&
+              rec.type != REC_TYPE_POSTCOPY_TRANSITION );
+
+    if ( rec.type == REC_TYPE_POSTCOPY_TRANSITION )
+    {
+        rc = postcopy_restore(ctx);
+        if ( rc )
+            goto err;
+
+        IPRINTF("Restore successful");
+        goto done;
+    }
 
  remus_failover:
     if ( ctx->stream_type == XC_STREAM_COLO )
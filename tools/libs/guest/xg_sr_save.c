@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "xg_sr_common.h"
@@ -74,6 +76,234 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
     return write_record(ctx, &checkpoint);
 }
 
+/*
+ * Whether a page is entirely zero.  Checked in 128 byte blocks which the
+ * compiler can vectorise, bailing out early on the first non-zero block.
+ */
+static bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t acc;
+    unsigned int i, j;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 16 )
+    {
+        for ( acc = 0, j = 0; j < 16; ++j )
+            acc |= p[i + j];
+
+        if ( acc )
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Writes a PAGE_DATA record into the stream.  guest_data[] has nr_pfns
+ * entries, nr_pages of which point at page contents to send.
+ */
+static int write_page_data(struct xc_sr_context *ctx, unsigned int nr_pfns,
+                           uint64_t *rec_pfns, unsigned int nr_pages,
+                           void **guest_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct iovec *iov; int iovcnt = 0;
+    struct xc_sr_rec_page_data_header hdr = { 0 };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_PAGE_DATA,
+    };
+    unsigned int i;
+    int rc = -1;
+
+    /* iovec[] for writev(). */
+    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    if ( !iov )
+    {
+        ERROR("Unable to allocate iovec for a batch of %u pages", nr_pfns);
+        return -1;
+    }
+
+    hdr.count = nr_pfns;
+
+    rec.length = sizeof(hdr);
+    rec.length += nr_pfns * sizeof(*rec_pfns);
+    rec.length += nr_pages * PAGE_SIZE;
+
+    iov[0].iov_base = &rec.type;
+    iov[0].iov_len = sizeof(rec.type);
+
+    iov[1].iov_base = &rec.length;
+    iov[1].iov_len = sizeof(rec.length);
+
+    iov[2].iov_base = &hdr;
+    iov[2].iov_len = sizeof(hdr);
+
+    iov[3].iov_base = rec_pfns;
+    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+
+    iovcnt = 4;
+
+    if ( nr_pages )
+    {
+        for ( i = 0; i < nr_pfns; ++i )
+        {
+            if ( guest_data[i] )
+            {
+                iov[iovcnt].iov_base = guest_data[i];
+                iov[iovcnt].iov_len = PAGE_SIZE;
+                iovcnt++;
+                --nr_pages;
+            }
+        }
+    }
+
+    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    {
+        PERROR("Failed to write page data to stream");
+        goto err;
+    }
+    ctx->save.bytes_written += sizeof(rec.type) + sizeof(rec.length) +
+                               rec.length;
+
+    /* Sanity check we have sent all the pages we expected to. */
+    assert(nr_pages == 0);
+    rc = 0;
+
+ err:
+    free(iov);
+
+    return rc;
+}
+
+/*
+ * A batch of pages handed to the workers for compression.  It owns the page
+ * data until it has been written into the stream.
+ */
+struct compress_batch
+{
+    struct xc_sr_work work;
+
+    unsigned int nr_pfns, nr_pages;
+    uint64_t *rec_pfns;
+    void **guest_data;
+
+    /* Backing storage of guest_data[]. */
+    void *guest_mapping;
+    unsigned int nr_pages_mapped;
+    void **local_pages;
+    unsigned int nr_local_pages;
+
+    /* Result of the compression. */
+    int rc, err;
+    void *data;
+    size_t len;
+};
+
+static void compress_batch_fn(struct xc_sr_work *work)
+{
+    struct compress_batch *batch =
+        container_of(work, struct compress_batch, work);
+
+    batch->rc = sr_compress_pages(batch->guest_data, batch->nr_pfns,
+                                  &batch->data, &batch->len);
+    batch->err = errno;
+}
+
+static void free_compress_batch(struct xc_sr_context *ctx,
+                                struct compress_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    for ( i = 0; batch->local_pages && i < batch->nr_local_pages; ++i )
+        free(batch->local_pages[i]);
+    free(batch->local_pages);
+    free(batch->guest_data);
+    free(batch->rec_pfns);
+    free(batch->data);
+    free(batch);
+}
+
+/*
+ * Writes a compressed batch of memory as a COMPRESSED_PAGE_DATA record into
+ * the stream.
+ */
+static int write_compressed_page_data(struct xc_sr_context *ctx,
+                                      struct compress_batch *batch)
+{
+    static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_compressed_page_data_header hdr = {
+        .count = batch->nr_pfns,
+        .compressed_length = batch->len,
+    };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_COMPRESSED_PAGE_DATA,
+        .length = sizeof(hdr) + batch->nr_pfns * sizeof(*batch->rec_pfns) +
+                  batch->len,
+    };
+    struct iovec iov[] = {
+        { &rec.type,        sizeof(rec.type) },
+        { &rec.length,      sizeof(rec.length) },
+        { &hdr,             sizeof(hdr) },
+        { batch->rec_pfns,  batch->nr_pfns * sizeof(*batch->rec_pfns) },
+        { batch->data,      batch->len },
+        { (void *)zeroes,   ROUNDUP(rec.length, REC_ALIGN_ORDER) - rec.length },
+    };
+
+    if ( writev_exact(ctx->fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to write compressed page data to stream");
+        return -1;
+    }
+    ctx->save.bytes_written += sizeof(rec.type) + sizeof(rec.length) +
+                               ROUNDUP(rec.length, REC_ALIGN_ORDER);
+
+    return 0;
+}
+
+/*
+ * Writes completed compressed batches into the stream, in the order they were
+ * queued.  Unless all is set, only wait for the workers while the queue is
+ * full, so the next batch can be mapped while the current ones compress.
+ */
+static int write_compressed_batches(struct xc_sr_context *ctx, bool all)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_workqueue *wq = ctx->save.wq;
+    struct xc_sr_work *work;
+    struct compress_batch *batch;
+    int rc;
+
+    while ( (work = sr_workqueue_get(wq, all || sr_workqueue_full(wq))) )
+    {
+        batch = container_of(work, struct compress_batch, work);
+
+        if ( batch->rc )
+        {
+            errno = batch->err;
+            PERROR("Failed to compress batch of %u pages", batch->nr_pages);
+            rc = -1;
+        }
+        /* Incompressible data is sent as it is. */
+        else if ( batch->len >= batch->nr_pages * PAGE_SIZE )
+            rc = write_page_data(ctx, batch->nr_pfns, batch->rec_pfns,
+                                 batch->nr_pages, batch->guest_data);
+        else
+            rc = write_compressed_page_data(ctx, batch);
+
+        free_compress_batch(ctx, batch);
+        if ( rc )
+            return rc;
+    }
+
+    return 0;
+}
+
 /*
  * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
  * is constructed in ctx->save.batch_pfns.
@@ -82,7 +312,12 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
  * - gets the types for each pfn in the batch.
  * - for each pfn with real data:
  *   - maps and attempts to localise the pages.
+ * - with zero_pages, elides zero pages, and with skip_unchanged, pages whose
+ *   contents have not changed since they were last sent.
  * - construct and writes a PAGE_DATA record into the stream.
+ *
+ * When compressing, the mapped batch is instead handed to the workers, and
+ * written as a COMPRESSED_PAGE_DATA record once compressed.
  */
 static int write_batch(struct xc_sr_context *ctx)
 {
@@ -93,14 +328,13 @@ static int write_batch(struct xc_sr_context *ctx)
     void **local_pages = NULL;
     int *errors = NULL, rc = -1;
     unsigned int i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned int nr_pfns = ctx->save.nr_batch_pfns;
+    unsigned int nr_pfns = ctx->save.nr_batch_pfns, nr_rec_pfns;
     void *page, *orig_page;
     uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec = {
-        .type = REC_TYPE_PAGE_DATA,
-    };
+    struct xc_sr_page_hash hash;
+    xen_pfn_t pfn;
+    bool zero;
+    struct compress_batch *batch;
 
     assert(nr_pfns != 0);
 
@@ -114,10 +348,8 @@ static int write_batch(struct xc_sr_context *ctx)
     guest_data = calloc(nr_pfns, sizeof(*guest_data));
     /* Pointers to locally allocated pages.  Need freeing. */
     local_pages = calloc(nr_pfns, sizeof(*local_pages));
-    /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+    if ( !mfns || !types || !errors || !guest_data || !local_pages )
     {
         ERROR("Unable to allocate arrays for a batch of %u pages",
               nr_pfns);
@@ -216,51 +448,112 @@ static int write_batch(struct xc_sr_context *ctx)
         goto err;
     }
 
-    hdr.count = nr_pfns;
-
-    rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
-
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+    /*
+     * With zero_pages, zero pages are flagged rather than sent.  Pages which
+     * are unchanged since they were last sent are dropped from the batch
+     * altogether.
+     * guest_data[] is compacted alongside rec_pfns[].
+     */
+    for ( i = 0, nr_rec_pfns = 0; i < nr_pfns; ++i )
+    {
+        pfn = ctx->save.batch_pfns[i];
+        rec_pfns[nr_rec_pfns] = ((uint64_t)(types[i]) << 32) | pfn;
+        page = guest_data[i];
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+        if ( page )
+        {
+            /*
+             * The hash must describe exactly the data sent, but the guest may
+             * change its page until then: send and hash a snapshot.
+             */
+            if ( ctx->save.page_hashes && !local_pages[i] )
+            {
+                local_pages[i] = malloc(PAGE_SIZE);
+                if ( !local_pages[i] )
+                {
+                    ERROR("Unable to allocate a page for pfn %#"PRIpfn, pfn);
+                    goto err;
+                }
+                page = memcpy(local_pages[i], page, PAGE_SIZE);
+            }
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+            zero = ctx->save.zero_pages && page_is_zero(page);
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+            if ( ctx->save.page_hashes )
+            {
+                if ( zero )
+                    hash.lo = hash.hi = 0;
+                else
+                    hash = xc_sr_page_hash(page, PAGE_SIZE);
+                hash.lo ^= types[i];
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+                if ( test_bit(pfn, ctx->save.hashed_pages) &&
+                     ctx->save.page_hashes[pfn].lo == hash.lo &&
+                     ctx->save.page_hashes[pfn].hi == hash.hi )
+                {
+                    --nr_pages;
+                    continue;
+                }
 
-    iovcnt = 4;
+                ctx->save.page_hashes[pfn] = hash;
+                set_bit(pfn, ctx->save.hashed_pages);
+            }
 
-    if ( nr_pages )
-    {
-        for ( i = 0; i < nr_pfns; ++i )
-        {
-            if ( guest_data[i] )
+            if ( zero )
             {
-                iov[iovcnt].iov_base = guest_data[i];
-                iov[iovcnt].iov_len = PAGE_SIZE;
-                iovcnt++;
+                rec_pfns[nr_rec_pfns] |= PAGE_DATA_ZERO;
+                page = NULL;
                 --nr_pages;
             }
         }
+        else if ( ctx->save.page_hashes )
+            clear_bit(pfn, ctx->save.hashed_pages);
+
+        guest_data[nr_rec_pfns++] = page;
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    /* Nothing to send if the whole batch is unchanged. */
+    if ( nr_rec_pfns == 0 )
+        goto done;
+
+    if ( !ctx->save.compress )
     {
-        PERROR("Failed to write page data to stream");
-        goto err;
+        rc = write_page_data(ctx, nr_rec_pfns, rec_pfns, nr_pages, guest_data);
+        if ( rc )
+            goto err;
+    }
+    else
+    {
+        batch = calloc(1, sizeof(*batch));
+        if ( !batch )
+        {
+            ERROR("Unable to allocate compression batch");
+            goto err;
+        }
+
+        /* Ownership of the page data passes to the batch. */
+        batch->work.fn = compress_batch_fn;
+        batch->nr_pfns = nr_rec_pfns;
+        batch->nr_pages = nr_pages;
+        batch->rec_pfns = rec_pfns;
+        batch->guest_data = guest_data;
+        batch->guest_mapping = guest_mapping;
+        batch->nr_pages_mapped = nr_pages_mapped;
+        batch->local_pages = local_pages;
+        batch->nr_local_pages = nr_pfns;
+        rec_pfns = NULL;
+        guest_data = NULL;
+        guest_mapping = NULL;
+        local_pages = NULL;
+
+        sr_workqueue_submit(ctx->save.wq, &batch->work);
+
+        rc = write_compressed_batches(ctx, false);
+        if ( rc )
+            goto err;
     }
 
-    /* Sanity check we have sent all the pages we expected to. */
-    assert(nr_pages == 0);
+ done:
     rc = ctx->save.nr_batch_pfns = 0;
 
  err:
@@ -269,7 +562,6 @@ static int write_batch(struct xc_sr_context *ctx)
         xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
     for ( i = 0; local_pages && i < nr_pfns; ++i )
         free(local_pages[i]);
-    free(iov);
     free(local_pages);
     free(guest_data);
     free(errors);
@@ -317,6 +609,23 @@ static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
     return rc;
 }
 
+/*
+ * Flush the batch, and wait for all page data to be written into the stream.
+ */
+static int drain_batches(struct xc_sr_context *ctx)
+{
+    int rc;
+
+    rc = flush_batch(ctx);
+    if ( rc )
+        return rc;
+
+    if ( ctx->save.compress )
+        rc = write_compressed_batches(ctx, true);
+
+    return rc;
+}
+
 /*
  * Pause/suspend the domain, and refresh ctx->dominfo if required.
  */
@@ -388,7 +697,7 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
         ++written;
     }
 
-    rc = flush_batch(ctx);
+    rc = drain_batches(ctx);
     if ( rc )
         return rc;
 
@@ -489,6 +798,180 @@ static int simple_precopy_policy(struct precopy_stats stats, void *user)
         : XGS_POLICY_CONTINUE_PRECOPY;
 }
 
+/*
+ * The adaptive precopy policy, selected by a maximum downtime.  It proceeds to
+ * the stop-and-copy phase once the remaining dirty pages are estimated to be
+ * sent within that time, or once memory has stopped converging even with the
+ * guest throttled as far as permitted.
+ */
+#define APP_MAX_ITERATIONS 30
+#define APP_MAX_STALLED     3
+#define APP_THROTTLE_STEP  20
+
+static int adaptive_precopy_policy(struct precopy_stats stats, void *user)
+{
+    struct xc_sr_context *ctx = user;
+
+    /* Only decide once the dirty pages of an iteration are known. */
+    if ( stats.dirty_count < 0 )
+        return XGS_POLICY_CONTINUE_PRECOPY;
+
+    return ((stats.est_downtime_ms >= 0 &&
+             stats.est_downtime_ms <= ctx->save.max_downtime_ms) ||
+            stats.iteration >= APP_MAX_ITERATIONS ||
+            ctx->save.nr_stalled >= APP_MAX_STALLED)
+        ? XGS_POLICY_STOP_AND_COPY
+        : XGS_POLICY_CONTINUE_PRECOPY;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Withhold a percentage of the guest's vcpu time by lowering its scheduler
+ * cap, relative to the cap it had before.  A throttle of 0 restores the
+ * original cap.
+ */
+static int set_throttle(struct xc_sr_context *ctx, unsigned int throttle)
+{
+    xc_interface *xch = ctx->xch;
+    struct xen_domctl_sched_credit credit;
+    struct xen_domctl_sched_credit2 credit2;
+    xc_cpupoolinfo_t *info;
+    unsigned int cap;
+    int rc;
+
+    if ( !ctx->save.sched_id )
+    {
+        info = xc_cpupool_getinfo(xch, ctx->dominfo.cpupool);
+        if ( !info )
+        {
+            PERROR("Failed to get cpupool %u info", ctx->dominfo.cpupool);
+            return -1;
+        }
+
+        ctx->save.sched_id = info->sched_id;
+        xc_cpupool_infofree(xch, info);
+    }
+
+    switch ( ctx->save.sched_id )
+    {
+    case XEN_SCHEDULER_CREDIT:
+        rc = xc_sched_credit_domain_get(xch, ctx->domid, &credit);
+        cap = credit.cap;
+        break;
+
+    case XEN_SCHEDULER_CREDIT2:
+        rc = xc_sched_credit2_domain_get(xch, ctx->domid, &credit2);
+        cap = credit2.cap;
+        break;
+
+    default:
+        ERROR("Throttling not supported by scheduler %u", ctx->save.sched_id);
+        return -1;
+    }
+
+    if ( rc )
+    {
+        PERROR("Failed to get scheduler parameters");
+        return -1;
+    }
+
+    if ( !ctx->save.stats.throttle )
+        ctx->save.orig_cap = cap;
+
+    /* A cap of 0 means no cap, i.e. 100% of each vcpu. */
+    cap = ctx->save.orig_cap;
+    if ( throttle )
+        cap = max(1U, (cap ?: 100 * (ctx->dominfo.max_vcpu_id + 1)) *
+                      (100 - throttle) / 100);
+
+    if ( ctx->save.sched_id == XEN_SCHEDULER_CREDIT )
+    {
+        credit.cap = cap;
+        rc = xc_sched_credit_domain_set(xch, ctx->domid, &credit);
+    }
+    else
+    {
+        credit2.cap = cap;
+        rc = xc_sched_credit2_domain_set(xch, ctx->domid, &credit2);
+    }
+
+    if ( rc )
+    {
+        PERROR("Failed to set scheduler cap %u", cap);
+        return -1;
+    }
+
+    ctx->save.stats.throttle = throttle;
+
+    return 0;
+}
+
+/*
+ * Update the measurements of the adaptive precopy policy after an iteration,
+ * which sent nr_sent pages as bytes of stream data over send_us, while the
+ * now dirty pages were dirtied over dirty_us.
+ */
+static void update_precopy_stats(struct xc_sr_context *ctx,
+                                 unsigned long nr_sent, uint64_t bytes,
+                                 uint64_t send_us, uint64_t dirty_us)
+{
+    struct precopy_stats *stats = &ctx->save.stats;
+    uint64_t page_bytes;
+
+    if ( dirty_us )
+        stats->dirty_rate = stats->dirty_count * 1000000ULL / dirty_us;
+    if ( bytes && send_us )
+        stats->bandwidth = bytes * 1000000 / send_us;
+
+    /* Zero, unchanged and compressed pages take up less than a page. */
+    page_bytes = nr_sent ? (bytes + nr_sent - 1) / nr_sent : PAGE_SIZE;
+
+    stats->est_downtime_ms = stats->bandwidth
+        ? stats->dirty_count * page_bytes * 1000 / stats->bandwidth : -1;
+}
+
+/*
+ * Throttle the guest further if an iteration didn't leave at least 10% fewer
+ * pages dirty than it sent, and count the iterations without progress once
+ * fully throttled.
+ */
+static void adjust_throttle(struct xc_sr_context *ctx, unsigned long nr_sent)
+{
+    xc_interface *xch = ctx->xch;
+    struct precopy_stats *stats = &ctx->save.stats;
+
+    if ( (unsigned long)stats->dirty_count < nr_sent - nr_sent / 10 ||
+         (stats->est_downtime_ms >= 0 &&
+          stats->est_downtime_ms <= ctx->save.max_downtime_ms) )
+    {
+        ctx->save.nr_stalled = 0;
+        return;
+    }
+
+    if ( stats->throttle >= ctx->save.max_throttle )
+    {
+        ctx->save.nr_stalled++;
+        return;
+    }
+
+    if ( set_throttle(ctx, min(stats->throttle + APP_THROTTLE_STEP,
+                               ctx->save.max_throttle)) )
+    {
+        /* Not fatal, carry on without (further) throttling. */
+        ERROR("Unable to throttle d%u", ctx->domid);
+        ctx->save.max_throttle = stats->throttle;
+        ctx->save.nr_stalled++;
+    }
+}
+
 /*
  * Send memory while guest is running.
  */
@@ -500,12 +983,15 @@ static int send_memory_live(struct xc_sr_context *ctx)
     unsigned int x = 0;
     int rc;
     int policy_decision;
+    unsigned long nr_sent;
+    uint64_t bytes, send_us, clean_us, now;
 
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
     precopy_policy_t precopy_policy = ctx->save.callbacks->precopy_policy;
     void *data = ctx->save.callbacks->data;
+    bool adaptive = false;
 
     struct precopy_stats *policy_stats;
 
@@ -515,28 +1001,45 @@ static int send_memory_live(struct xc_sr_context *ctx)
 
     ctx->save.stats = (struct precopy_stats){
         .dirty_count = ctx->save.p2m_size,
+        .est_downtime_ms = -1,
     };
     policy_stats = &ctx->save.stats;
 
-    if ( precopy_policy == NULL )
+    if ( precopy_policy == NULL && ctx->save.max_downtime_ms )
+    {
+        precopy_policy = adaptive_precopy_policy;
+        data = ctx;
+        adaptive = true;
+    }
+    else if ( precopy_policy == NULL )
         precopy_policy = simple_precopy_policy;
 
     bitmap_set(dirty_bitmap, ctx->save.p2m_size);
+    clean_us = now_us();
 
     for ( ; ; )
     {
         policy_decision = precopy_policy(*policy_stats, data);
         x++;
 
+        nr_sent = bytes = send_us = 0;
+
         if ( stats.dirty_count > 0 && policy_decision != XGS_POLICY_ABORT )
         {
             rc = update_progress_string(ctx, &progress_str);
             if ( rc )
                 goto out;
 
+            nr_sent = stats.dirty_count;
+            bytes = ctx->save.bytes_written;
+            send_us = now_us();
+
             rc = send_dirty_pages(ctx, stats.dirty_count);
             if ( rc )
                 goto out;
+
+            bytes = ctx->save.bytes_written - bytes;
+            send_us = now_us() - send_us;
         }
 
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
@@ -561,8 +1064,19 @@ static int send_memory_live(struct xc_sr_context *ctx)
             goto out;
         }
 
+        now = now_us();
         policy_stats->dirty_count = stats.dirty_count;
+        update_precopy_stats(ctx, nr_sent, bytes, send_us, now - clean_us);
+        clean_us = now;
 
+        DPRINTF("Iteration %u: %ld pages dirty, dirtying %lu pages/s, "
+                "sending %lu bytes/s, est. downtime %ldms, throttle %u%%",
+                x, policy_stats->dirty_count, policy_stats->dirty_rate,
+                policy_stats->bandwidth, policy_stats->est_downtime_ms,
+                policy_stats->throttle);
+
+        if ( adaptive )
+            adjust_throttle(ctx, nr_sent);
     }
 
     if ( policy_decision == XGS_POLICY_ABORT )
@@ -706,6 +1220,10 @@ static int verify_frames(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
+    /* Every page must be sent to be verified, changed or not. */
+    if ( ctx->save.hashed_pages )
+        bitmap_clear(ctx->save.hashed_pages, ctx->save.p2m_size);
+
     xc_set_progress_prefix(xch, "Frames verify");
     rc = send_all_pages(ctx);
     if ( rc )
@@ -789,6 +1307,285 @@ static int send_domain_memory_nonlive(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Suspend the domain, and work out which pages are to be sent once the
+ * destination has resumed it: all of those with contents, which are left set
+ * in the dirty bitmap.
+ *
+ * Pages the destination uses (or clears) while processing the HVM params are
+ * sent straight away, so they are in place before the params are restored.
+ */
+static int send_domain_memory_postcopy(struct xc_sr_context *ctx)
+{
+    static const unsigned int eager_params[] = {
+        HVM_PARAM_CONSOLE_PFN,
+        HVM_PARAM_STORE_PFN,
+        HVM_PARAM_IOREQ_PFN,
+        HVM_PARAM_BUFIOREQ_PFN,
+        HVM_PARAM_PAGING_RING_PFN,
+    };
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *types, pfn;
+    uint64_t value;
+    unsigned int i, nr;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = suspend_domain(ctx);
+    if ( rc )
+        return rc;
+
+    types = malloc(MAX_BATCH_SIZE * sizeof(*types));
+    if ( !types )
+    {
+        ERROR("Unable to allocate types for a batch of %u pages",
+              MAX_BATCH_SIZE);
+        return -1;
+    }
+
+    bitmap_clear(dirty_bitmap, ctx->save.p2m_size);
+
+    for ( pfn = 0; pfn < ctx->save.p2m_size; pfn += nr )
+    {
+        nr = min_t(unsigned long, MAX_BATCH_SIZE, ctx->save.p2m_size - pfn);
+
+        for ( i = 0; i < nr; ++i )
+            types[i] = ctx->save.ops.pfn_to_gfn(ctx, pfn + i);
+
+        rc = xc_get_pfn_type_batch(xch, ctx->domid, nr, types);
+        if ( rc )
+        {
+            PERROR("Failed to get types for pfns %#"PRIpfn" - %#"PRIpfn,
+                   pfn, pfn + nr - 1);
+            goto out;
+        }
+
+        for ( i = 0; i < nr; ++i )
+            if ( page_type_has_stream_data(types[i]) )
+                set_bit(pfn + i, dirty_bitmap);
+    }
+
+    for ( i = 0; i < ARRAY_SIZE(eager_params); ++i )
+    {
+        if ( xc_hvm_param_get(xch, ctx->domid, eager_params[i], &value) ||
+             value == 0 || value >= ctx->save.p2m_size ||
+             !test_and_clear_bit(value, dirty_bitmap) )
+            continue;
+
+        rc = add_to_batch(ctx, value);
+        if ( rc )
+            goto out;
+    }
+
+    rc = drain_batches(ctx);
+
+ out:
+    free(types);
+
+    return rc;
+}
+
+/*
+ * Writes a record of type POSTCOPY_PFNS listing count pfns.
+ */
+static int write_postcopy_pfns(struct xc_sr_context *ctx, unsigned int count,
+                               uint64_t *pfns)
+{
+    struct xc_sr_rec_postcopy_pfns hdr = { .count = count };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_POSTCOPY_PFNS,
+        .length = sizeof(hdr),
+        .data = &hdr,
+    };
+
+    return write_split_record(ctx, &rec, pfns, count * sizeof(*pfns));
+}
+
+/*
+ * Read a POSTCOPY_PAGE_REQUEST record from the destination, and send the
+ * requested pages still pending.
+ */
+static int handle_page_request(struct xc_sr_context *ctx,
+                               unsigned long *pending)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    struct xc_sr_rec_postcopy_pfns *req;
+    unsigned int i;
+    uint64_t pfn;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = read_record(ctx, ctx->save.recv_fd, &rec);
+    if ( rc )
+        return rc;
+
+    rc = -1;
+    req = rec.data;
+
+    if ( rec.type != REC_TYPE_POSTCOPY_PAGE_REQUEST )
+    {
+        ERROR("Expected POSTCOPY_PAGE_REQUEST record, but received %#x (%s)",
+              rec.type, rec_type_to_str(rec.type));
+        goto err;
+    }
+
+    if ( rec.length < sizeof(*req) ||
+         rec.length != sizeof(*req) + req->count * sizeof(*req->pfn) )
+    {
+        ERROR("POSTCOPY_PAGE_REQUEST record wrong size: length %u",
+              rec.length);
+        goto err;
+    }
+
+    for ( i = 0; i < req->count; ++i )
+    {
+        pfn = req->pfn[i];
+        if ( pfn >= ctx->save.p2m_size )
+        {
+            ERROR("Invalid pfn %#"PRIx64" requested", pfn);
+            goto err;
+        }
+
+        /* Pages already sent will be with the destination shortly. */
+        if ( !test_and_clear_bit(pfn, dirty_bitmap) )
+            continue;
+
+        --*pending;
+        rc = add_to_batch(ctx, pfn);
+        if ( rc )
+            goto err;
+    }
+
+    /* The guest is waiting for these, so don't leave them queued. */
+    rc = drain_batches(ctx);
+
+ err:
+    free(rec.data);
+
+    return rc;
+}
+
+/*
+ * Send the memory of a guest already resumed by the destination.  The pages
+ * left in the dirty bitmap by send_domain_memory_postcopy() are listed in
+ * POSTCOPY_PFNS records, followed by the POSTCOPY_TRANSITION at which the
+ * destination resumes the guest.  The pages are then sent in pfn order,
+ * interleaved with any the destination requests on behalf of the guest.
+ */
+static int send_postcopy_memory(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record transition = { .type = REC_TYPE_POSTCOPY_TRANSITION };
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long p, cursor = 0, pending = 0, total;
+    unsigned int nr = 0;
+    uint64_t *pfns;
+    int rc = -1;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    pfns = malloc(MAX_POSTCOPY_PFNS * sizeof(*pfns));
+    if ( !pfns )
+    {
+        ERROR("Unable to allocate %zu bytes for postcopy pfns",
+              MAX_POSTCOPY_PFNS * sizeof(*pfns));
+        return -1;
+    }
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( !test_bit(p, dirty_bitmap) )
+            continue;
+
+        pfns[nr++] = p;
+        ++pending;
+
+        if ( nr == MAX_POSTCOPY_PFNS )
+        {
+            rc = write_postcopy_pfns(ctx, nr, pfns);
+            if ( rc )
+                goto out;
+            nr = 0;
+        }
+    }
+
+    if ( nr )
+    {
+        rc = write_postcopy_pfns(ctx, nr, pfns);
+        if ( rc )
+            goto out;
+    }
+
+    /* Nothing left to send?  Finish as an ordinary stream. */
+    rc = 0;
+    if ( !pending )
+        goto out;
+
+    rc = write_record(ctx, &transition);
+    if ( rc )
+        goto out;
+
+    xc_set_progress_prefix(xch, "Postcopy");
+    total = pending;
+
+    while ( pending )
+    {
+        /* Pages the guest is waiting for take priority. */
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll for page requests");
+            goto out;
+        }
+
+        if ( rc > 0 )
+        {
+            rc = handle_page_request(ctx, &pending);
+            if ( rc )
+                goto out;
+        }
+
+        /*
+         * Every pfn behind the cursor has been sent, so any still pending
+         * lie ahead of it.
+         */
+        for ( nr = 0; pending && nr < MAX_BATCH_SIZE; ++cursor )
+        {
+            assert(cursor < ctx->save.p2m_size);
+
+            if ( !test_and_clear_bit(cursor, dirty_bitmap) )
+                continue;
+
+            rc = add_to_batch(ctx, cursor);
+            if ( rc )
+                goto out;
+
+            --pending;
+            ++nr;
+        }
+
+        rc = flush_batch(ctx);
+        if ( rc )
+            goto out;
+
+        xc_report_progress_step(xch, total - pending, total);
+    }
+
+    rc = drain_batches(ctx);
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    free(pfns);
+
+    return rc;
+}
+
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -815,6 +1612,35 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    /*
+     * Skipping unchanged pages relies on the receiver's memory holding what
+     * was last sent, which isn't true of a running COLO secondary.
+     */
+    if ( ctx->save.skip_unchanged && ctx->stream_type != XC_STREAM_COLO )
+    {
+        ctx->save.page_hashes = malloc(ctx->save.p2m_size *
+                                       sizeof(*ctx->save.page_hashes));
+        ctx->save.hashed_pages = bitmap_alloc(ctx->save.p2m_size);
+        if ( !ctx->save.page_hashes || !ctx->save.hashed_pages )
+        {
+            ERROR("Unable to allocate memory for page hashes");
+            rc = -1;
+            errno = ENOMEM;
+            goto err;
+        }
+    }
+
+    if ( ctx->save.compress )
+    {
+        ctx->save.wq = sr_workqueue_create(sr_nr_workers());
+        if ( !ctx->save.wq )
+        {
+            PERROR("Unable to create compression workers");
+            rc = -1;
+            goto err;
+        }
+    }
+
     rc = 0;
 
  err:
@@ -826,16 +1652,30 @@ static void cleanup(struct xc_sr_context *ctx)
     xc_interface *xch = ctx->xch;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
+    struct xc_sr_work *work;
 
+    if ( ctx->save.wq )
+    {
+        /* Discard batches left over from a failed save. */
+        while ( (work = sr_workqueue_get(ctx->save.wq, true)) )
+            free_compress_batch(
+                ctx, container_of(work, struct compress_batch, work));
+        sr_workqueue_destroy(ctx->save.wq);
+    }
 
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0);
 
+    if ( ctx->save.stats.throttle && set_throttle(ctx, 0) )
+        ERROR("Failed to restore scheduler cap %u", ctx->save.orig_cap);
+
     if ( ctx->save.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    free(ctx->save.hashed_pages);
+    free(ctx->save.page_hashes);
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
 }
@@ -882,7 +1722,9 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
-        if ( ctx->save.live )
+        if ( ctx->save.postcopy )
+            rc = send_domain_memory_postcopy(ctx);
+        else if ( ctx->save.live )
             rc = send_domain_memory_live(ctx);
         else if ( ctx->stream_type != XC_STREAM_PLAIN )
             rc = send_domain_memory_checkpointed(ctx);
@@ -903,6 +1745,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy )
+        {
+            rc = send_postcopy_memory(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->stream_type != XC_STREAM_PLAIN )
         {
             /*
@@ -993,6 +1842,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.compress = !!(flags & XCFLAGS_COMPRESS);
+    ctx.save.skip_unchanged = !!(flags & XCFLAGS_SKIP_UNCHANGED);
+    ctx.save.zero_pages = !!(flags & XCFLAGS_ZERO_PAGES);
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
+    ctx.save.max_downtime_ms = callbacks->max_downtime_ms;
+    ctx.save.max_throttle = min(callbacks->max_throttle, 99U);
     ctx.save.recv_fd = recv_fd;
 
     if ( xc_domain_getinfo_single(xch, dom, &ctx.dominfo) < 0 )
@@ -1003,6 +1858,15 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
 
     hvm = ctx.dominfo.flags & XEN_DOMINF_hvm_guest;
 
+    /* Postcopy relies on paging at the destination, and a backchannel. */
+    if ( ctx.save.postcopy &&
+         (!hvm || stream_type != XC_STREAM_PLAIN || recv_fd < 0) )
+    {
+        ERROR("Postcopy requires a plain stream of an HVM domain, and recv_fd");
+        errno = EINVAL;
+        return -1;
+    }
+
     /* Sanity check stream_type-related parameters */
     switch ( stream_type )
     {
@@ -54,12 +54,15 @@ typedef struct xenstat_collector {
 
 static int  xenstat_collect_vcpus(xenstat_node * node);
 static int  xenstat_collect_xen_version(xenstat_node * node);
+static int  xenstat_collect_sched_lat(xenstat_node * node);
 static void xenstat_free_vcpus(xenstat_node * node);
 static void xenstat_free_networks(xenstat_node * node);
 static void xenstat_free_xen_version(xenstat_node * node);
 static void xenstat_free_vbds(xenstat_node * node);
+static void xenstat_free_sched_lat(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
+static void xenstat_uninit_sched_lat(xenstat_handle * handle);
 static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
 
@@ -71,7 +74,9 @@ static xenstat_collector collectors[] = {
 	{ XENSTAT_XEN_VERSION, xenstat_collect_xen_version,
 	  xenstat_free_xen_version, xenstat_uninit_xen_version },
 	{ XENSTAT_VBD, xenstat_collect_vbds,
-	  xenstat_free_vbds, xenstat_uninit_vbds }
+	  xenstat_free_vbds, xenstat_uninit_vbds },
+	{ XENSTAT_SCHED_LAT, xenstat_collect_sched_lat,
+	  xenstat_free_sched_lat, xenstat_uninit_sched_lat }
 };
 
 #define NUM_COLLECTORS (sizeof(collectors)/sizeof(xenstat_collector))
@@ -517,6 +522,89 @@ unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu)
 	return vcpu->ns;
 }
 
+/*
+ * Scheduling latency functions
+ */
+static const char *const sched_lat_names[XENSTAT_SCHED_LAT_NR] = {
+	[XENSTAT_SCHED_LAT_WAKE] = "wake",
+	[XENSTAT_SCHED_LAT_WAIT] = "wait",
+	[XENSTAT_SCHED_LAT_RUN] = "run",
+};
+
+/* Collect the scheduling latency histograms of all domains from hypfs.  A
+ * hypervisor without them (or without hypfs) just leaves them empty. */
+static int xenstat_collect_sched_lat(xenstat_node * node)
+{
+	xenstat_handle *handle = node->handle;
+	struct xenhypfs_dirent *dirent;
+	char path[64];
+	uint64_t *hist;
+	unsigned int i, which, bucket;
+
+	if (handle->hypfs_handle == NULL) {
+		handle->hypfs_handle = xenhypfs_open(NULL, 0);
+		if (handle->hypfs_handle == NULL)
+			return 1;
+	}
+
+	for (i = 0; i < node->num_domains; i++) {
+		for (which = 0; which < XENSTAT_SCHED_LAT_NR; which++) {
+			snprintf(path, sizeof(path), "/sched-latency/%u/%s",
+				 node->domains[i].id, sched_lat_names[which]);
+			hist = xenhypfs_read_raw(handle->hypfs_handle, path,
+						 &dirent);
+			if (hist == NULL) {
+				if (errno == ENOMEM)
+					return 0;
+				/* domain is gone or no histograms */
+				break;
+			}
+
+			if (dirent->type == xenhypfs_type_blob &&
+			    dirent->size == XENSTAT_SCHED_LAT_BUCKETS
+					    * sizeof(*hist))
+				for (bucket = 0;
+				     bucket < XENSTAT_SCHED_LAT_BUCKETS;
+				     bucket++)
+					node->domains[i].sched_lat[which][bucket]
+						= hist[bucket];
+
+			free(hist);
+			free(dirent);
+		}
+	}
+
+	return 1;
+}
+
+/* Free scheduling latency information - nothing to do */
+static void xenstat_free_sched_lat(xenstat_node * node)
+{
+}
+
+/* Free scheduling latency information in handle */
+static void xenstat_uninit_sched_lat(xenstat_handle * handle)
+{
+	if (handle->hypfs_handle != NULL)
+		xenhypfs_close(handle->hypfs_handle);
+}
+
+/* Get the count of a scheduling latency histogram bucket */
+unsigned long long xenstat_domain_sched_lat(xenstat_domain * domain,
+					    unsigned int which,
+					    unsigned int bucket)
+{
+	if (which < XENSTAT_SCHED_LAT_NR && bucket < XENSTAT_SCHED_LAT_BUCKETS)
+		return domain->sched_lat[which][bucket];
+	return 0;
+}
+
+/* Get the upper bound of a scheduling latency histogram bucket */
+unsigned long long xenstat_sched_lat_bucket_ns(unsigned int bucket)
+{
+	return 1024ULL << bucket;
+}
+
 /*
  * Network functions
  */
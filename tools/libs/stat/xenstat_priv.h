@@ -25,6 +25,7 @@
 
 #include <sys/types.h>
 #include <xenstore.h>
+#include <xenhypfs.h>
 #include "xenstat.h"
 
 #include "xenctrl.h"
@@ -35,6 +36,7 @@
 struct xenstat_handle {
 	xc_interface *xc_handle;
 	struct xs_handle *xshandle; /* xenstore handle */
+	xenhypfs_handle *hypfs_handle; /* hypfs handle, opened on first use */
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
@@ -66,6 +68,8 @@ struct xenstat_domain {
 	xenstat_network *networks;	/* Array of length num_networks */
 	unsigned int num_vbds;
 	xenstat_vbd *vbds;
+	unsigned long long sched_lat[XENSTAT_SCHED_LAT_NR]
+				    [XENSTAT_SCHED_LAT_BUCKETS];
 };
 
 struct xenstat_vcpu {
@@ -25,7 +25,7 @@ USELIBS_store := toolcore
 LIBS_LIBS += vchan
 USELIBS_vchan := toollog store gnttab evtchn
 LIBS_LIBS += stat
-USELIBS_stat := ctrl store
+USELIBS_stat := ctrl store hypfs
 LIBS_LIBS += light
 USELIBS_light := toollog evtchn toolcore ctrl store hypfs guest
 LIBS_LIBS += util
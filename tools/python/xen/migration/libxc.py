@@ -8,6 +8,7 @@ verification routines.
 """
 
 import sys
+import zlib
 
 from struct import calcsize, unpack
 
@@ -58,6 +59,10 @@ REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
 REC_TYPE_static_data_end            = 0x00000010
 REC_TYPE_x86_cpuid_policy           = 0x00000011
 REC_TYPE_x86_msr_policy             = 0x00000012
+REC_TYPE_compressed_page_data       = 0x00000013
+REC_TYPE_postcopy_pfns              = 0x00000014
+REC_TYPE_postcopy_transition        = 0x00000015
+REC_TYPE_postcopy_page_request      = 0x00000016
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -79,12 +84,23 @@ rec_type_to_str = {
     REC_TYPE_static_data_end            : "Static data end",
     REC_TYPE_x86_cpuid_policy           : "x86 CPUID policy",
     REC_TYPE_x86_msr_policy             : "x86 MSR policy",
+    REC_TYPE_compressed_page_data       : "Compressed page data",
+    REC_TYPE_postcopy_pfns              : "Postcopy pfns",
+    REC_TYPE_postcopy_transition        : "Postcopy transition",
+    REC_TYPE_postcopy_page_request      : "Postcopy page request",
 }
 
 # page_data
 PAGE_DATA_FORMAT             = "II"
 PAGE_DATA_PFN_MASK           = (1 << 52) - 1
-PAGE_DATA_PFN_RESZ_MASK      = ((1 << 60) - 1) & ~((1 << 52) - 1)
+PAGE_DATA_PFN_RESZ_MASK      = ((1 << 60) - 1) & ~((1 << 53) - 1)
+PAGE_DATA_ZERO               = (1 << 52) # Zero page, no page data
+
+# compressed_page_data
+COMPRESSED_PAGE_DATA_FORMAT  = "II"
+
+# postcopy_pfns
+POSTCOPY_PFNS_FORMAT         = "II"
 
 # flags from xen/public/domctl.h: XEN_DOMCTL_PFINFO_* shifted by 32 bits
 PAGE_DATA_TYPE_SHIFT         = 60
@@ -217,7 +233,7 @@ class VerifyLibxc(VerifyBase):
         contentsz = (length + 7) & ~7
         content = self.rdexact(contentsz)
 
-        if rtype != REC_TYPE_page_data:
+        if rtype not in (REC_TYPE_page_data, REC_TYPE_compressed_page_data):
 
             if self.squashed_pagedata_records > 0:
                 self.info("Squashed %d Page Data records together" %
@@ -271,6 +287,17 @@ class VerifyLibxc(VerifyBase):
                 "PAGE_DATA record must contain a pfn record for each count")
 
         pfns = list(unpack("=%dQ" % (count, ), content[minsz:minsz + pfnsz]))
+        nr_pages = self.verify_page_data_pfns(pfns)
+
+        pagesz = nr_pages * 4096
+        if len(content) != minsz + pfnsz + pagesz:
+            raise RecordError("Expected %u + %u + %u, got %u" %
+                              (minsz, pfnsz, pagesz, len(content)))
+
+
+    def verify_page_data_pfns(self, pfns):
+        """ Verify the pfns of a page data record, returning the number of
+        pages of data expected """
 
         nr_pages = 0
         for idx, pfn in enumerate(pfns):
@@ -283,15 +310,92 @@ class VerifyLibxc(VerifyBase):
                 raise RecordError("Invalid type value in pfn[%d]: 0x%016x" %
                                   (idx, pfn & PAGE_DATA_TYPE_LTAB_MASK))
 
-            # We expect page data for each normal page or pagetable
+            # We expect page data for each normal page or pagetable, unless
+            # it is flagged as a zero page
             if PAGE_DATA_TYPE_NOTAB <= (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) \
                     <= PAGE_DATA_TYPE_L4TAB:
-                nr_pages += 1
+                if not pfn & PAGE_DATA_ZERO:
+                    nr_pages += 1
+            elif pfn & PAGE_DATA_ZERO:
+                raise RecordError("Zero flag set on pfn[%d] without data: "
+                                  "0x%016x" % (idx, pfn))
 
-        pagesz = nr_pages * 4096
-        if len(content) != minsz + pfnsz + pagesz:
+        return nr_pages
+
+
+    def verify_record_compressed_page_data(self, content):
+        """ Compressed Page Data record """
+        minsz = calcsize(COMPRESSED_PAGE_DATA_FORMAT)
+
+        if len(content) <= minsz:
+            raise RecordError(
+                "COMPRESSED_PAGE_DATA record must be at least %d bytes long" %
+                (minsz, ))
+
+        count, complen = unpack(COMPRESSED_PAGE_DATA_FORMAT, content[:minsz])
+
+        pfnsz = count * 8
+        if (len(content) - minsz) < pfnsz:
+            raise RecordError(
+                "COMPRESSED_PAGE_DATA record must contain a pfn record for "
+                "each count")
+
+        if len(content) != minsz + pfnsz + complen:
             raise RecordError("Expected %u + %u + %u, got %u" %
-                              (minsz, pfnsz, pagesz, len(content)))
+                              (minsz, pfnsz, complen, len(content)))
+
+        pfns = list(unpack("=%dQ" % (count, ), content[minsz:minsz + pfnsz]))
+        nr_pages = self.verify_page_data_pfns(pfns)
+
+        if nr_pages == 0:
+            raise RecordError(
+                "COMPRESSED_PAGE_DATA record must contain page data")
+
+        try:
+            data = zlib.decompress(content[minsz + pfnsz:])
+        except zlib.error as e:
+            raise RecordError("Failed to decompress page data: %s" % (e, ))
+
+        pagesz = nr_pages * 4096
+        if len(data) != pagesz:
+            raise RecordError("Expected %u bytes of page data, got %u" %
+                              (pagesz, len(data)))
+
+
+    def verify_record_postcopy_pfns(self, content):
+        """ Postcopy pfns record """
+        minsz = calcsize(POSTCOPY_PFNS_FORMAT)
+
+        if len(content) < minsz:
+            raise RecordError(
+                "POSTCOPY_PFNS record must be at least %d bytes long" %
+                (minsz, ))
+
+        count, res1 = unpack(POSTCOPY_PFNS_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise RecordError("Reserved field not zero (0x%04x)" % (res1, ))
+
+        if len(content) != minsz + count * 8:
+            raise RecordError("Expected %u + %u, got %u" %
+                              (minsz, count * 8, len(content)))
+
+        for pfn in unpack("=%dQ" % (count, ), content[minsz:]):
+            if pfn & ~PAGE_DATA_PFN_MASK:
+                raise RecordError("Invalid postcopy pfn 0x%x" % (pfn, ))
+
+
+    def verify_record_postcopy_transition(self, content):
+        """ Postcopy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Postcopy transition record with non-zero "
+                              "length")
+
+
+    def verify_record_postcopy_page_request(self, content):
+        """ Postcopy page request record """
+        raise RecordError("Found postcopy page request record in stream")
 
 
     def verify_record_x86_pv_info(self, content):
@@ -525,4 +629,14 @@ record_verifiers = {
         VerifyLibxc.verify_record_x86_cpuid_policy,
     REC_TYPE_x86_msr_policy:
         VerifyLibxc.verify_record_x86_msr_policy,
+
+    REC_TYPE_compressed_page_data:
+        VerifyLibxc.verify_record_compressed_page_data,
+
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_page_request:
+        VerifyLibxc.verify_record_postcopy_page_request,
     }
@@ -0,0 +1,548 @@
+/*
+ * Tests and benchmark for the credit2 runqueue, with the scheduler driven
+ * the way the scheduler core would on a single 4-CPU runqueue, plus tests
+ * for SMT placement, and for the load balancer's migration costs on two
+ * runqueues.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* All of the scheduler is static: build it as part of the test. */
+#include "credit2.c"
+
+#define TEST_CPUS   4       /* A single socket, hence a single runqueue. */
+#define TEST_NODES  2       /* Two sockets (and nodes), two runqueues.   */
+#define TICK        MICROSECS(250)
+
+#define MODEL_UNITS 200
+#define MODEL_OPS   100000
+
+#define BENCH_STEPS 20000
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+s_time_t test_now;
+unsigned int test_cpu;
+bool tb_init_done;
+bool sched_smt_power_savings;
+unsigned int sched_smt_pack_load;
+int sched_ratelimit_us = SCHED_DEFAULT_RATELIMIT_US;
+cpumask_t cpu_online_map, test_softirq_pending;
+
+DEFINE_PER_CPU(struct sched_resource *, sched_res);
+DEFINE_PER_CPU(cpumask_t, cpumask_scratch);
+DEFINE_PER_CPU(cpumask_var_t, cpu_sibling_mask);
+DEFINE_PER_CPU(cpumask_var_t, cpu_core_mask);
+
+static struct scheduler ops;
+static struct cpupool pool;
+static cpumask_t pool_cpus;
+static struct sched_resource res[NR_CPUS];
+static cpumask_t res_cpus[NR_CPUS], siblings[NR_CPUS], cores[NR_CPUS];
+
+static struct domain idle_domain = { .domain_id = DOMID_IDLE };
+static struct vcpu idle_vcpus[NR_CPUS];
+static struct sched_unit idle_units[NR_CPUS];
+
+static struct domain domain = { .domain_id = 1 };
+static struct vcpu *vcpus;
+static struct sched_unit *units;
+static unsigned int nr_units;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void setup_cpus(unsigned int nr_cpus)
+{
+    unsigned int cpu;
+    int rc;
+
+    cpu_online_map.bits = (1UL << nr_cpus) - 1;
+    cpumask_copy(&pool_cpus, &cpu_online_map);
+    pool.cpu_valid = pool.res_valid = &pool_cpus;
+    pool.sched = &ops;
+    pool.gran = SCHED_GRAN_cpu;
+    pool.sched_gran = 1;
+
+    ops = sched_credit2_def;
+    ops.cpupool = &pool;
+    rc = ops.global_init();
+    assert(!rc);
+    rc = ops.init(&ops);
+    assert(!rc);
+
+    for_each_cpu ( cpu, &cpu_online_map )
+    {
+        struct sched_resource *sr = &res[cpu];
+        void *pdata, *vdata;
+        spinlock_t *lock;
+
+        __cpumask_set_cpu(cpu, &res_cpus[cpu]);
+        siblings[cpu].bits = 3UL << (cpu & ~1);
+        cores[cpu].bits = 0xfUL << (cpu & ~3);
+        per_cpu(cpu_sibling_mask, cpu) = &siblings[cpu];
+        per_cpu(cpu_core_mask, cpu) = &cores[cpu];
+
+        idle_vcpus[cpu].vcpu_id = cpu;
+        idle_vcpus[cpu].processor = cpu;
+        idle_vcpus[cpu].domain = &idle_domain;
+        idle_vcpus[cpu].sched_unit = &idle_units[cpu];
+        idle_vcpus[cpu].is_running = true;
+        idle_units[cpu].domain = &idle_domain;
+        idle_units[cpu].vcpu_list = &idle_vcpus[cpu];
+        idle_units[cpu].unit_id = cpu;
+        idle_units[cpu].is_running = true;
+        idle_units[cpu].runstate_cnt[RUNSTATE_running] = 1;
+        idle_units[cpu].cpu_hard_affinity = &res_cpus[cpu];
+        idle_units[cpu].cpu_soft_affinity = &res_cpus[cpu];
+        idle_units[cpu].res = sr;
+
+        sr->scheduler = &ops;
+        sr->cpupool = &pool;
+        sr->master_cpu = cpu;
+        sr->granularity = 1;
+        sr->cpus = &res_cpus[cpu];
+        sr->curr = sr->sched_unit_idle = &idle_units[cpu];
+        spin_lock_init(&sr->_lock);
+        sr->schedule_lock = &sr->_lock;
+        per_cpu(sched_res, cpu) = sr;
+
+        test_cpu = cpu;
+        pdata = ops.alloc_pdata(&ops, cpu);
+        vdata = ops.alloc_udata(&ops, &idle_units[cpu], NULL);
+        assert(pdata && !IS_ERR(pdata) && vdata);
+
+        spin_lock(&sr->_lock);
+        lock = ops.switch_sched(&ops, cpu, pdata, vdata);
+        sr->sched_priv = pdata;
+        spin_unlock(&sr->_lock);
+        sr->schedule_lock = lock;
+    }
+}
+
+/* Create nr units, all of them blocked. */
+static void setup_domain(unsigned int nr)
+{
+    unsigned int i;
+
+    vcpus = calloc(nr, sizeof(*vcpus));
+    units = calloc(nr, sizeof(*units));
+    assert(vcpus && units);
+    nr_units = nr;
+
+    domain.cpupool = &pool;
+    nodes_setall(domain.node_affinity);
+    domain.sched_priv = ops.alloc_domdata(&ops, &domain);
+    assert(domain.sched_priv && !IS_ERR(domain.sched_priv));
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct vcpu *v = &vcpus[i];
+        struct sched_unit *u = &units[i];
+
+        v->vcpu_id = i;
+        v->domain = &domain;
+        v->sched_unit = u;
+        v->pause_flags = VPF_blocked;
+        v->next_in_list = i + 1 < nr ? &vcpus[i + 1] : NULL;
+
+        u->domain = &domain;
+        u->vcpu_list = v;
+        u->unit_id = i;
+        u->runstate_cnt[RUNSTATE_blocked] = 1;
+        u->cpu_hard_affinity = &pool_cpus;
+        u->cpu_soft_affinity = &pool_cpus;
+        u->next_in_list = i + 1 < nr ? &units[i + 1] : NULL;
+        sched_set_res(u, &res[i % TEST_CPUS]);
+
+        u->priv = ops.alloc_udata(&ops, u, domain.sched_priv);
+        assert(u->priv);
+        ops.insert_unit(&ops, u);
+    }
+    domain.sched_unit_list = units;
+}
+
+static void unit_wake(struct sched_unit *u)
+{
+    spinlock_t *lock = unit_schedule_lock_irq(u);
+
+    u->vcpu_list->pause_flags &= ~VPF_blocked;
+    ops.wake(&ops, u);
+
+    unit_schedule_unlock_irq(lock, u);
+}
+
+static void unit_sleep(struct sched_unit *u)
+{
+    spinlock_t *lock = unit_schedule_lock_irq(u);
+
+    u->vcpu_list->pause_flags |= VPF_blocked;
+    ops.sleep(&ops, u);
+
+    unit_schedule_unlock_irq(lock, u);
+}
+
+static uint64_t schedule_ns, saved_ns;
+
+/* What the scheduler core does on a SCHEDULE_SOFTIRQ, as far as we care. */
+static void schedule(unsigned int cpu)
+{
+    struct sched_resource *sr = &res[cpu];
+    struct sched_unit *prev = sr->curr, *next;
+    spinlock_t *lock;
+    uint64_t t;
+
+    test_cpu = cpu;
+    __cpumask_clear_cpu(cpu, &test_softirq_pending);
+
+    lock = pcpu_schedule_lock_irq(cpu);
+
+    t = now_ns();
+    ops.do_schedule(&ops, prev, test_now, false);
+    schedule_ns += now_ns() - t;
+
+    next = prev->next_task;
+    if ( prev != next )
+    {
+        assert(!next->is_running);
+        next->is_running = true;
+        next->state_entry_time = test_now;
+        next->vcpu_list->processor = cpu;
+        sr->curr = next;
+    }
+
+    pcpu_schedule_unlock_irq(lock, cpu);
+
+    if ( prev != next )
+    {
+        prev->is_running = false;
+        prev->state_entry_time = test_now;
+
+        t = now_ns();
+        ops.context_saved(&ops, prev);
+        saved_ns += now_ns() - t;
+    }
+}
+
+/*
+ * The runqueue must be sorted by credit, have its first unit cached, and
+ * hold exactly the runnable units which aren't running.
+ */
+static void check_runq(void)
+{
+    const struct csched2_runqueue_data *rqd = c2rqd(0);
+    struct rb_node *iter;
+    unsigned int i, queued = 0, runnable = 0;
+    int credit = INT_MAX;
+
+    if ( rqd->runq_first != rb_first(&rqd->runq) )
+        fail("  Fail: runq_first isn't the leftmost unit\n");
+
+    for ( iter = rqd->runq_first; iter; iter = rb_next(iter) )
+    {
+        const struct csched2_unit *svc = runq_elem(iter);
+
+        if ( svc->credit > credit )
+            fail("  Fail: unit %u with %d credits after one with %d\n",
+                 svc->unit->unit_id, svc->credit, credit);
+        if ( svc->rqd != rqd )
+            fail("  Fail: unit %u queued on the wrong runqueue\n",
+                 svc->unit->unit_id);
+        credit = svc->credit;
+        queued++;
+    }
+
+    for ( i = 0; i < nr_units; i++ )
+    {
+        const struct csched2_unit *svc = units[i].priv;
+        bool queue = unit_runnable(&units[i]) && !units[i].is_running;
+
+        if ( queue != unit_on_runq(svc) )
+            fail("  Fail: unit %u is %srunnable but %son the runqueue\n",
+                 i, queue ? "" : "not ", unit_on_runq(svc) ? "" : "not ");
+        runnable += queue;
+    }
+
+    if ( queued != runnable )
+        fail("  Fail: %u units queued, %u runnable\n", queued, runnable);
+}
+
+/* Random wakeups, sleeps and reschedules against the runqueue invariants. */
+static void test_model(void)
+{
+    unsigned int i;
+
+    printf("Testing %u random operations on %u units\n", MODEL_OPS,
+           MODEL_UNITS);
+
+    setup_cpus(TEST_CPUS);
+    setup_domain(MODEL_UNITS);
+    srand(1);
+
+    for ( i = 0; i < MODEL_OPS && nr_failures < 10; i++ )
+    {
+        struct sched_unit *u = &units[rand() % nr_units];
+        unsigned int cpu;
+
+        switch ( rand() % 4 )
+        {
+        case 0:
+            if ( u->vcpu_list->pause_flags & VPF_blocked )
+                unit_wake(u);
+            break;
+
+        case 1:
+            if ( !(u->vcpu_list->pause_flags & VPF_blocked) )
+                unit_sleep(u);
+            break;
+
+        default:
+            test_now += rand() % TICK;
+            for_each_cpu ( cpu, &cpu_online_map )
+                if ( cpumask_test_cpu(cpu, &test_softirq_pending) ||
+                     !(rand() % 4) )
+                    schedule(cpu);
+            break;
+        }
+
+        check_runq();
+    }
+}
+
+/*
+ * A move must remove more imbalance than it costs: check what migrate_cost()
+ * charges, and that consider() only picks a move which pays for itself.
+ */
+static void test_balance(void)
+{
+    struct csched2_runqueue_data *rqd0, *rqd1;
+    s_time_t cpu_load, cache_cost, node_cost;
+    struct csched2_unit *svc;
+    balance_state_t st;
+    unsigned int cpu, reasons;
+    s_time_t cost;
+
+    printf("Testing load balancing costs\n");
+
+    setup_cpus(TEST_CPUS * TEST_NODES);
+    setup_domain(1);
+
+    cpu_load = 1LL << csched2_priv(&ops)->load_precision_shift;
+    cache_cost = opt_migrate_cache_cost * cpu_load / 100;
+    node_cost = opt_migrate_node_cost * cpu_load / 100;
+
+    /* rqd0 is where the unit was put, rqd1 is the other runqueue. */
+    svc = units[0].priv;
+    rqd0 = svc->rqd;
+    rqd1 = c2rqd(rqd0 == c2rqd(0) ? TEST_CPUS : 0);
+    cpu = cpumask_first(&rqd0->active);
+    if ( rqd0 == rqd1 )
+        fail("  Fail: expected two runqueues\n");
+
+    /* A unit which never ran, with no node affinity, moves for free. */
+    cost = migrate_cost(csched2_priv(&ops), svc, rqd1, test_now, &reasons);
+    if ( cost || reasons )
+        fail("  Fail: cold unit costs %"PRI_stime" (%#x)\n", cost, reasons);
+
+    /* It ran on cpu until just now, for longer: it's cache-hot. */
+    test_now = MILLISECS(10);
+    svc->last_cpu = cpu;
+    svc->last_runtime = MILLISECS(2);
+    svc->last_stop = test_now - MILLISECS(1);
+    cost = migrate_cost(csched2_priv(&ops), svc, rqd1, test_now, &reasons);
+    if ( cost != cache_cost ||
+         reasons != (CSCHED2_MCOST_HOT | CSCHED2_MCOST_LLC) )
+        fail("  Fail: hot unit costs %"PRI_stime" (%#x)\n", cost, reasons);
+
+    /* ... but not for moving within the socket it ran on. */
+    cost = migrate_cost(csched2_priv(&ops), svc, rqd0, test_now, &reasons);
+    if ( cost || reasons != CSCHED2_MCOST_HOT )
+        fail("  Fail: hot unit costs %"PRI_stime" (%#x) to stay\n",
+             cost, reasons);
+
+    /* Once off the cpu for longer than it ran, it's cold again. */
+    svc->last_stop = test_now - MILLISECS(3);
+    cost = migrate_cost(csched2_priv(&ops), svc, rqd1, test_now, &reasons);
+    if ( cost || reasons )
+        fail("  Fail: cooled unit costs %"PRI_stime" (%#x)\n", cost, reasons);
+
+    /* Leaving the domain's node costs, whichever the unit's cache state. */
+    nodes_clear(domain.node_affinity);
+    node_set(cpu_to_node(cpu), domain.node_affinity);
+    cost = migrate_cost(csched2_priv(&ops), svc, rqd1, test_now, &reasons);
+    if ( cost != node_cost || reasons != CSCHED2_MCOST_OFF_NODE )
+        fail("  Fail: off node move costs %"PRI_stime" (%#x)\n",
+             cost, reasons);
+
+    /*
+     * Pushing a unit with a fifth of a cpu of load out of a runqueue which
+     * is two fifths busier would balance them, but not make up for leaving
+     * the node. Without the node affinity, it is worth it.
+     */
+    svc->avgload = cpu_load / 5;
+    rqd0->b_avgload = 2 * svc->avgload;
+    rqd1->b_avgload = 0;
+
+    st = (balance_state_t){ .prv = csched2_priv(&ops), .now = test_now,
+                            .lrqd = rqd0, .orqd = rqd1,
+                            .load_delta = rqd0->b_avgload };
+    consider(&st, svc, NULL);
+    if ( st.best_push_svc )
+        fail("  Fail: unit pushed off its node\n");
+
+    nodes_setall(domain.node_affinity);
+    consider(&st, svc, NULL);
+    if ( st.best_push_svc != svc || st.load_delta )
+        fail("  Fail: unit not pushed to balance the load\n");
+}
+
+/*
+ * With one unit running, a second one waking up goes to the idle sibling of
+ * the busy core when packing, and to the idle core when spreading.
+ */
+static void smt(unsigned int pack_load)
+{
+    unsigned int cpu, busy;
+
+    printf("Testing SMT placement, sched_smt_pack_load=%u\n", pack_load);
+
+    sched_smt_pack_load = pack_load;
+    setup_cpus(TEST_CPUS);
+    setup_domain(2);
+
+    unit_wake(&units[0]);
+    busy = cpumask_first(&test_softirq_pending);
+    schedule(busy);
+    if ( res[busy].curr != &units[0] )
+        fail("  Fail: unit 0 not running on cpu %u\n", busy);
+
+    cpumask_clear(&test_softirq_pending);
+    unit_wake(&units[1]);
+    cpu = cpumask_first(&test_softirq_pending);
+    if ( cpu >= NR_CPUS || cpu == busy )
+        fail("  Fail: tickled cpu %u for unit 1\n", cpu);
+    else if ( sched_smt_pack(2, TEST_CPUS) !=
+              cpumask_test_cpu(cpu, &siblings[busy]) )
+        fail("  Fail: unit 1 %s cpu %u's core\n",
+             cpumask_test_cpu(cpu, &siblings[busy]) ? "packed on" : "not on",
+             busy);
+}
+
+static void bench(unsigned int nr)
+{
+    unsigned int i, cpu;
+
+    setup_cpus(TEST_CPUS);
+    setup_domain(nr);
+
+    for ( i = 0; i < nr; i++ )
+        unit_wake(&units[i]);
+
+    /* Let credits spread out before measuring. */
+    for ( i = 0; i < BENCH_STEPS; i++ )
+    {
+        cpu = i % TEST_CPUS;
+        test_now += TICK / TEST_CPUS;
+        schedule(cpu);
+    }
+
+    schedule_ns = saved_ns = 0;
+    for ( i = 0; i < BENCH_STEPS; i++ )
+    {
+        cpu = i % TEST_CPUS;
+        test_now += TICK / TEST_CPUS;
+        schedule(cpu);
+    }
+
+    printf("%5u runnable units: csched2_schedule() %"PRIu64" ns, "
+           "context_saved() %"PRIu64" ns\n", nr,
+           schedule_ns / BENCH_STEPS, saved_ns / BENCH_STEPS);
+
+    check_runq();
+}
+
+/* The scheduler keeps global state: run each case in a fresh process. */
+static void run(void (*fn)(unsigned int), unsigned int arg)
+{
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+
+    pid = fork();
+    if ( pid < 0 )
+    {
+        fail("fork failed\n");
+        return;
+    }
+
+    if ( pid == 0 )
+    {
+        fn(arg);
+        exit(!!nr_failures);
+    }
+
+    if ( waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+         WEXITSTATUS(status) )
+        fail("  Fail: child exited with status %#x\n", status);
+}
+
+static void model(unsigned int unused)
+{
+    test_model();
+}
+
+static void balance(unsigned int unused)
+{
+    test_balance();
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int bench_units[] = { 50, 500, 5000 };
+    unsigned int i;
+
+    run(model, 0);
+    run(balance, 0);
+    run(smt, 0);
+    run(smt, 100);
+
+    for ( i = 0; i < ARRAY_SIZE(bench_units); i++ )
+        run(bench, bench_units[i]);
+
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
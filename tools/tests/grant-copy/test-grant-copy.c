@@ -0,0 +1,306 @@
+/*
+ * GNTTABOP_copy between grants of a test domain, with and without the
+ * grants pinned via GNTTABOP_copy_cache, reporting copies per second.
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenforeignmemory.h>
+#include <xen-tools/common-macros.h>
+
+#define NR_PAGES   64               /* Granted for reading, then writing. */
+#define FIRST_REF  GNTTAB_NR_RESERVED_ENTRIES
+#define COPY_LEN   256              /* Bytes per copy, e.g. packet headers. */
+#define RUN_NS     1000000000ULL
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static xc_interface *xch;
+static xenforeignmemory_handle *fh;
+static uint32_t domid;
+
+static struct xen_domctl_createdomain create = {
+    .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+    .max_vcpus = 1,
+    .max_evtchn_port = -1,
+    .max_grant_frames = 1,
+    .grant_opts = XEN_DOMCTL_GRANT_version(1),
+
+    .arch = {
+#if defined(__x86_64__) || defined(__i386__)
+        .emulation_flags = XEN_X86_EMU_LAPIC,
+#endif
+    },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int copy_cache(uint16_t flags, grant_ref_t ref, uint32_t count)
+{
+    gnttab_copy_cache_t op = {
+        .domid = domid,
+        .flags = flags,
+        .ref = ref,
+        .count = count,
+    };
+
+    if ( xc_gnttab_op(xch, GNTTABOP_copy_cache, &op, sizeof(op), 1) )
+        return GNTST_general_error;
+
+    return op.status;
+}
+
+/* Copy COPY_LEN bytes from one grant to another, returning the status. */
+static int copy_one(grant_ref_t src, grant_ref_t dest)
+{
+    gnttab_copy_t op = {
+        .source.u.ref = src,
+        .source.domid = domid,
+        .dest.u.ref = dest,
+        .dest.domid = domid,
+        .len = COPY_LEN,
+        .flags = GNTCOPY_source_gref | GNTCOPY_dest_gref,
+    };
+
+    if ( xc_gnttab_op(xch, GNTTABOP_copy, &op, sizeof(op), 1) )
+        return -1;
+
+    return op.status;
+}
+
+/* Copy COPY_LEN bytes of each read-only grant to the matching writable one. */
+static int copy_all(gnttab_copy_t *ops)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_PAGES; i++ )
+        ops[i] = (gnttab_copy_t){
+            .source.u.ref = FIRST_REF + i,
+            .source.domid = domid,
+            .source.offset = i * 8,
+            .dest.u.ref = FIRST_REF + NR_PAGES + i,
+            .dest.domid = domid,
+            .dest.offset = i * 8,
+            .len = COPY_LEN,
+            .flags = GNTCOPY_source_gref | GNTCOPY_dest_gref,
+        };
+
+    if ( xc_gnttab_op(xch, GNTTABOP_copy, ops, sizeof(*ops), NR_PAGES) )
+        return -1;
+
+    for ( i = 0; i < NR_PAGES; i++ )
+        if ( ops[i].status != GNTST_okay )
+            return ops[i].status;
+
+    return 0;
+}
+
+static void run_copies(const char *name)
+{
+    gnttab_copy_t ops[NR_PAGES];
+    uint64_t start = now_ns(), end, nr = 0;
+    int rc;
+
+    do {
+        rc = copy_all(ops);
+        if ( rc )
+            return fail("  Fail: %s copy: %d (errno %d)\n", name, rc, errno);
+        nr += NR_PAGES;
+        end = now_ns();
+    } while ( end - start < RUN_NS );
+
+    printf("  %-8s %"PRIu64" copies/s\n", name,
+           (uint64_t)(nr * 1000000000ULL / (end - start)));
+}
+
+static void check_copies(const uint8_t *pages)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_PAGES; i++ )
+    {
+        const uint8_t *src = pages + i * XC_PAGE_SIZE + i * 8;
+        const uint8_t *dst = pages + (NR_PAGES + i) * XC_PAGE_SIZE + i * 8;
+
+        if ( memcmp(src, dst, COPY_LEN) )
+            fail("  Fail: page %u not copied\n", i);
+    }
+}
+
+static void run_tests(void)
+{
+    xenforeignmemory_resource_handle *res;
+    grant_entry_v1_t *gnttab = NULL;
+    xen_pfn_t pfns[2 * NR_PAGES];
+    uint8_t *pages;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < ARRAY_SIZE(pfns); i++ )
+        pfns[i] = i;
+
+    if ( xc_domain_populate_physmap_exact(xch, domid, ARRAY_SIZE(pfns), 0, 0,
+                                          pfns) )
+        return fail("  Fail: populate physmap: %d - %s\n",
+                    errno, strerror(errno));
+
+    pages = xenforeignmemory_map(fh, domid, PROT_READ | PROT_WRITE,
+                                 ARRAY_SIZE(pfns), pfns, NULL);
+    if ( !pages )
+        return fail("  Fail: map memory: %d - %s\n", errno, strerror(errno));
+
+    for ( i = 0; i < NR_PAGES * XC_PAGE_SIZE; i++ )
+        pages[i] = i * 7 + 1;
+
+    res = xenforeignmemory_map_resource(
+        fh, domid, XENMEM_resource_grant_table,
+        XENMEM_resource_grant_table_id_shared, 0, 1, (void **)&gnttab,
+        PROT_READ | PROT_WRITE, 0);
+    if ( !res )
+    {
+        fail("  Fail: map grant table: %d - %s\n", errno, strerror(errno));
+        goto unmap;
+    }
+
+    /* Grant the first half of the pages read-only, the rest writable. */
+    for ( i = 0; i < ARRAY_SIZE(pfns); i++ )
+    {
+        gnttab[FIRST_REF + i].domid = 0;
+        gnttab[FIRST_REF + i].frame = pfns[i];
+        gnttab[FIRST_REF + i].flags = GTF_permit_access |
+                                      (i < NR_PAGES ? GTF_readonly : 0);
+    }
+
+    printf("Test %u copies of %u bytes per hypercall\n", NR_PAGES, COPY_LEN);
+
+    run_copies("uncached");
+    check_copies(pages);
+    memset(pages + NR_PAGES * XC_PAGE_SIZE, 0, NR_PAGES * XC_PAGE_SIZE);
+
+    rc = copy_cache(GNTCOPY_CACHE_readonly, FIRST_REF, NR_PAGES);
+    if ( rc )
+    {
+        fail("  Fail: pin source grants: %d\n", rc);
+        goto unmap_gnttab;
+    }
+
+    rc = copy_cache(0, FIRST_REF + NR_PAGES, NR_PAGES);
+    if ( rc )
+    {
+        fail("  Fail: pin destination grants: %d\n", rc);
+        goto unpin_source;
+    }
+
+    /* Unlike mapped grants, pinned ones are only in use during copies. */
+    if ( gnttab[FIRST_REF].flags & GTF_reading ||
+         gnttab[FIRST_REF + NR_PAGES].flags & GTF_writing )
+        fail("  Fail: pinned grants marked in use: %#x %#x\n",
+             gnttab[FIRST_REF].flags, gnttab[FIRST_REF + NR_PAGES].flags);
+
+    /* Windows only get unpinned as a whole. */
+    if ( copy_cache(GNTCOPY_CACHE_unpin, FIRST_REF, NR_PAGES - 1) !=
+         GNTST_bad_gntref )
+        fail("  Fail: unpinned a window which isn't pinned\n");
+
+    run_copies("cached");
+    check_copies(pages);
+
+    /* Ending a pinned grant fails the next copy, and unpins the grant. */
+    gnttab[FIRST_REF].flags = 0;
+    rc = copy_one(FIRST_REF, FIRST_REF + NR_PAGES);
+    if ( rc != GNTST_bad_gntref )
+        fail("  Fail: copy from ended grant: %d\n", rc);
+
+    rc = copy_one(FIRST_REF, FIRST_REF + NR_PAGES);
+    if ( rc == GNTST_okay )
+        fail("  Fail: copy from ended grant succeeded\n");
+
+    gnttab[FIRST_REF].flags = GTF_permit_access | GTF_readonly;
+    rc = copy_one(FIRST_REF, FIRST_REF + NR_PAGES);
+    if ( rc != GNTST_okay )
+        fail("  Fail: copy from grant issued again: %d\n", rc);
+
+    rc = copy_cache(GNTCOPY_CACHE_unpin, FIRST_REF + NR_PAGES, NR_PAGES);
+    if ( rc )
+        fail("  Fail: unpin destination grants: %d\n", rc);
+
+ unpin_source:
+    rc = copy_cache(GNTCOPY_CACHE_unpin, FIRST_REF, NR_PAGES);
+    if ( rc )
+        fail("  Fail: unpin source grants: %d\n", rc);
+
+    if ( gnttab[FIRST_REF].flags & GTF_reading ||
+         gnttab[FIRST_REF + NR_PAGES].flags & GTF_writing )
+        fail("  Fail: unpinned grants still in use: %#x %#x\n",
+             gnttab[FIRST_REF].flags, gnttab[FIRST_REF + NR_PAGES].flags);
+
+ unmap_gnttab:
+    xenforeignmemory_unmap_resource(fh, res);
+ unmap:
+    xenforeignmemory_unmap(fh, pages, ARRAY_SIZE(pfns));
+}
+
+int main(int argc, char **argv)
+{
+    int rc;
+
+    printf("Grant copy tests\n");
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    fh = xenforeignmemory_open(NULL, 0);
+
+    if ( !xch || !fh )
+        err(1, "open handles");
+
+    rc = xc_domain_create(xch, &domid, &create);
+    if ( rc )
+    {
+        if ( errno == EINVAL || errno == EOPNOTSUPP )
+            printf("  Skip: %d - %s\n", errno, strerror(errno));
+        else
+            fail("  Domain create failure: %d - %s\n",
+                 errno, strerror(errno));
+        goto out;
+    }
+
+    printf("  Created d%u\n", domid);
+
+    if ( xc_domain_setmaxmem(xch, domid, -1) )
+        fail("  Fail: setmaxmem: %d - %s\n", errno, strerror(errno));
+    else
+        run_tests();
+
+    if ( xc_domain_destroy(xch, domid) )
+        fail("  Failed to destroy domain: %d - %s\n",
+             errno, strerror(errno));
+ out:
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,436 @@
+/*
+ * A minimal device model emulating one page of MMIO for a single vCPU HVM
+ * guest, which writes to it in a tight loop and reads back every 8th access.
+ * Compares the rate of emulated accesses, and of event channel notifications
+ * the device model has to handle, between a plain ioreq server and one using
+ * batched requests (XEN_DMOP_IOREQ_SERVER_batch).
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xendevicemodel.h>
+#include <xenevtchn.h>
+#include <xenforeignmemory.h>
+#include <xen-tools/common-macros.h>
+
+#include <xen/hvm/ioreq.h>
+#include <xen/hvm/save.h>
+
+#define CODE_ADDR   0x1000
+#define MMIO_ADDR   0xfe000000U
+#define RUN_NS      1000000000ULL
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static xc_interface *xch;
+static xendevicemodel_handle *dmod;
+static xenforeignmemory_handle *fmem;
+static xenevtchn_handle *xce;
+
+static struct xen_domctl_createdomain create = {
+    .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+    .max_vcpus = 1,
+    .max_evtchn_port = -1,
+    .max_grant_frames = 1,
+    .grant_opts = XEN_DOMCTL_GRANT_version(1),
+
+    .arch = {
+        .emulation_flags = XEN_X86_EMU_LAPIC,
+    },
+};
+
+/*
+ *     mov  $MMIO_ADDR, %ebx
+ *     xor  %ecx, %ecx
+ * 1:  mov  %ecx, (%ebx)
+ *     inc  %ecx
+ *     test $7, %cl
+ *     jnz  1b
+ *     mov  (%ebx), %eax
+ *     jmp  1b
+ */
+static const uint8_t guest_code[] = {
+    0xbb, 0x00, 0x00, 0x00, 0xfe,
+    0x31, 0xc9,
+    0x89, 0x0b,
+    0x41,
+    0xf6, 0xc1, 0x07,
+    0x75, 0xf8,
+    0x8b, 0x03,
+    0xeb, 0xf4,
+};
+
+struct stats {
+    unsigned long writes, reads, events;
+    uint32_t next;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Emulate one access.  The guest writes consecutive values. */
+static void handle_ioreq(struct stats *st, ioreq_t *req)
+{
+    if ( req->type != IOREQ_TYPE_COPY || req->data_is_ptr ||
+         req->addr != MMIO_ADDR || req->size != 4 )
+    {
+        fail("  Fail: unexpected ioreq type %u addr %#"PRIx64" size %u\n",
+             req->type, req->addr, req->size);
+        return;
+    }
+
+    if ( req->dir == IOREQ_READ )
+    {
+        req->data = st->next;
+        st->reads++;
+        return;
+    }
+
+    if ( (uint32_t)req->data != st->next )
+        fail("  Fail: write of %#"PRIx64", expected %#x\n",
+             req->data, st->next);
+
+    st->next = req->data + 1;
+    st->writes++;
+}
+
+static int setup_guest(uint32_t domid)
+{
+    struct {
+        struct hvm_save_descriptor header_d;
+        HVM_SAVE_TYPE(HEADER) header;
+        struct hvm_save_descriptor cpu_d;
+        HVM_SAVE_TYPE(CPU) cpu;
+        struct hvm_save_descriptor end_d;
+        HVM_SAVE_TYPE(END) end;
+    } ctx = {};
+    xen_pfn_t pfns[16];
+    uint8_t *full_ctx;
+    void *code;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < ARRAY_SIZE(pfns); i++ )
+        pfns[i] = i;
+
+    rc = xc_domain_setmaxmem(xch, domid, -1);
+    if ( !rc )
+        rc = xc_domain_populate_physmap_exact(xch, domid, ARRAY_SIZE(pfns),
+                                              0, 0, pfns);
+    if ( rc )
+    {
+        fail("  Fail: populate physmap: %d - %s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    code = xenforeignmemory_map(fmem, domid, PROT_READ | PROT_WRITE, 1,
+                                &pfns[CODE_ADDR >> XC_PAGE_SHIFT], NULL);
+    if ( !code )
+    {
+        fail("  Fail: map guest code: %d - %s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    memcpy(code, guest_code, sizeof(guest_code));
+    xenforeignmemory_unmap(fmem, code, 1);
+
+    /* The header can only be obtained from the full context. */
+    rc = xc_domain_hvm_getcontext(xch, domid, NULL, 0);
+    full_ctx = rc > 0 ? calloc(1, rc) : NULL;
+    if ( !full_ctx || xc_domain_hvm_getcontext(xch, domid, full_ctx, rc) <= 0 )
+    {
+        fail("  Fail: get HVM context: %d - %s\n", errno, strerror(errno));
+        free(full_ctx);
+        return -1;
+    }
+
+    memcpy(&ctx, full_ctx, sizeof(ctx.header_d) + sizeof(ctx.header));
+    free(full_ctx);
+
+    /* 32bit flat protected mode, no paging. */
+    ctx.cpu_d.typecode = HVM_SAVE_CODE(CPU);
+    ctx.cpu_d.length = HVM_SAVE_LENGTH(CPU);
+    ctx.cpu.cs_limit = ~0U;
+    ctx.cpu.ds_limit = ~0U;
+    ctx.cpu.es_limit = ~0U;
+    ctx.cpu.ss_limit = ~0U;
+    ctx.cpu.tr_limit = 0x67;
+    ctx.cpu.cs_arbytes = 0xc9b;
+    ctx.cpu.ds_arbytes = 0xc93;
+    ctx.cpu.es_arbytes = 0xc93;
+    ctx.cpu.ss_arbytes = 0xc93;
+    ctx.cpu.tr_arbytes = 0x8b;
+    ctx.cpu.cr0 = 0x11; /* PE | ET */
+    ctx.cpu.rip = CODE_ADDR;
+    ctx.cpu.dr6 = 0xffff0ff0;
+    ctx.cpu.dr7 = 0x400;
+    ctx.end_d.typecode = HVM_SAVE_CODE(END);
+    ctx.end_d.length = HVM_SAVE_LENGTH(END);
+
+    rc = xc_domain_hvm_setcontext(xch, domid, (uint8_t *)&ctx, sizeof(ctx));
+    if ( rc )
+        fail("  Fail: set HVM context: %d - %s\n", errno, strerror(errno));
+
+    return rc;
+}
+
+static void drain_sync(struct stats *st, shared_iopage_t *shared,
+                       evtchn_port_t port)
+{
+    ioreq_t *req = &shared->vcpu_ioreq[0];
+
+    if ( req->state != STATE_IOREQ_READY )
+        return;
+
+    xen_rmb();
+    handle_ioreq(st, req);
+    xen_wmb();
+    req->state = STATE_IORESP_READY;
+
+    xenevtchn_notify(xce, port);
+}
+
+static void drain_batch(struct stats *st, ioreq_batch_t *b, evtchn_port_t port)
+{
+    uint32_t cons = b->req_cons;
+
+    for ( ; ; )
+    {
+        while ( cons != b->req_prod )
+        {
+            xen_rmb();
+            handle_ioreq(st, &b->req[cons % IOREQ_BATCH_SLOT_NUM]);
+            xen_wmb();
+            b->req_cons = ++cons;
+        }
+
+        /* Check for requests queued while Xen saw us busy. */
+        xen_mb();
+        if ( cons == b->req_prod )
+            break;
+    }
+
+    xenevtchn_notify(xce, port);
+}
+
+static void run_test(const char *name, unsigned int flags)
+{
+    struct stats st = {};
+    uint32_t domid;
+    ioservid_t id;
+    xenforeignmemory_resource_handle *fres, *bres = NULL;
+    void *iopages = NULL, *batchpages = NULL;
+    evtchn_port_t remote, local;
+    struct pollfd pfd;
+    uint64_t start, end;
+    size_t size;
+    unsigned int nr_batch;
+    int rc;
+
+    printf("Test %s ioreq server\n", name);
+
+    rc = xc_domain_create(xch, &domid, &create);
+    if ( rc )
+    {
+        if ( errno == EINVAL || errno == EOPNOTSUPP )
+            printf("  Skip: %d - %s\n", errno, strerror(errno));
+        else
+            fail("  Domain create failure: %d - %s\n",
+                 errno, strerror(errno));
+        return;
+    }
+
+    if ( setup_guest(domid) )
+        goto out;
+
+    rc = xendevicemodel_create_ioreq_server2(dmod, domid,
+                                             HVM_IOREQSRV_BUFIOREQ_OFF,
+                                             flags, &id);
+    if ( rc )
+    {
+        if ( errno == EINVAL && flags )
+            printf("  Skip: batching not supported\n");
+        else
+            fail("  Fail: create ioreq server: %d - %s\n",
+                 errno, strerror(errno));
+        goto out;
+    }
+
+    /* Only batch frames extend the resource, up to the last of them. */
+    nr_batch = flags & XEN_DMOP_IOREQ_SERVER_batch
+               ? (create.max_vcpus + IOREQ_BATCH_PER_PAGE - 1) /
+                 IOREQ_BATCH_PER_PAGE : 0;
+    rc = xenforeignmemory_resource_size(fmem, domid,
+                                        XENMEM_resource_ioreq_server, id,
+                                        &size);
+    if ( rc )
+        fail("  Fail: resource size: %d - %s\n", errno, strerror(errno));
+    else if ( size != (nr_batch
+                       ? XENMEM_resource_ioreq_server_frame_batch(nr_batch)
+                       : 1 + (create.max_vcpus * sizeof(ioreq_t) +
+                              XC_PAGE_SIZE - 1) / XC_PAGE_SIZE) *
+                      XC_PAGE_SIZE )
+        fail("  Fail: resource size %#zx with %u batch frames\n",
+             size, nr_batch);
+
+    fres = xenforeignmemory_map_resource(
+        fmem, domid, XENMEM_resource_ioreq_server, id,
+        XENMEM_resource_ioreq_server_frame_ioreq(0), 1,
+        &iopages, PROT_READ | PROT_WRITE, 0);
+    if ( !fres )
+    {
+        fail("  Fail: map ioreq pages: %d - %s\n", errno, strerror(errno));
+        goto destroy;
+    }
+
+    if ( flags & XEN_DMOP_IOREQ_SERVER_batch )
+    {
+        bres = xenforeignmemory_map_resource(
+            fmem, domid, XENMEM_resource_ioreq_server, id,
+            XENMEM_resource_ioreq_server_frame_batch(0), nr_batch,
+            &batchpages, PROT_READ | PROT_WRITE, 0);
+        if ( !bres )
+        {
+            fail("  Fail: map batch pages: %d - %s\n",
+                 errno, strerror(errno));
+            goto unmap;
+        }
+    }
+
+    rc = xendevicemodel_map_io_range_to_ioreq_server(
+        dmod, domid, id, XEN_DMOP_IO_RANGE_MEMORY, MMIO_ADDR, MMIO_ADDR + XC_PAGE_SIZE - 1);
+    if ( !rc )
+        rc = xendevicemodel_set_ioreq_server_state(dmod, domid, id, 1);
+    if ( rc )
+    {
+        fail("  Fail: set up ioreq server: %d - %s\n",
+             errno, strerror(errno));
+        goto unmap;
+    }
+
+    remote = ((shared_iopage_t *)iopages)->vcpu_ioreq[0].vp_eport;
+    rc = xenevtchn_bind_interdomain(xce, domid, remote);
+    if ( rc < 0 )
+    {
+        fail("  Fail: bind event channel: %d - %s\n", errno, strerror(errno));
+        goto unmap;
+    }
+    local = rc;
+
+    pfd.fd = xenevtchn_fd(xce);
+    pfd.events = POLLIN;
+
+    if ( xc_domain_unpause(xch, domid) )
+    {
+        fail("  Fail: unpause: %d - %s\n", errno, strerror(errno));
+        goto unbind;
+    }
+
+    start = now_ns();
+    end = start + RUN_NS;
+
+    while ( now_ns() < end && !nr_failures )
+    {
+        xenevtchn_port_or_error_t port;
+
+        if ( poll(&pfd, 1, 100) <= 0 )
+            continue;
+
+        port = xenevtchn_pending(xce);
+        if ( port < 0 )
+            continue;
+
+        xenevtchn_unmask(xce, port);
+        st.events++;
+
+        if ( flags & XEN_DMOP_IOREQ_SERVER_batch )
+            drain_batch(&st, batchpages, local);
+        else
+            drain_sync(&st, iopages, local);
+    }
+
+    end = now_ns() - start;
+    xc_domain_pause(xch, domid);
+
+    /* The server can't be disabled while posted writes are still queued. */
+    while ( xendevicemodel_set_ioreq_server_state(dmod, domid, id, 0) )
+    {
+        if ( errno != EBUSY || !(flags & XEN_DMOP_IOREQ_SERVER_batch) )
+        {
+            fail("  Fail: disable ioreq server: %d - %s\n",
+                 errno, strerror(errno));
+            break;
+        }
+
+        drain_batch(&st, batchpages, local);
+    }
+
+    if ( !st.writes )
+        fail("  Fail: no accesses emulated\n");
+
+    printf("  %lu writes, %lu reads: %"PRIu64" accesses/s, "
+           "%"PRIu64" events/s\n", st.writes, st.reads,
+           (uint64_t)(st.writes + st.reads) * 1000000000 / end,
+           (uint64_t)st.events * 1000000000 / end);
+
+ unbind:
+    xenevtchn_unbind(xce, local);
+ unmap:
+    if ( bres )
+        xenforeignmemory_unmap_resource(fmem, bres);
+    xenforeignmemory_unmap_resource(fmem, fres);
+ destroy:
+    xendevicemodel_destroy_ioreq_server(dmod, domid, id);
+ out:
+    if ( xc_domain_destroy(xch, domid) )
+        fail("  Failed to destroy domain: %d - %s\n",
+             errno, strerror(errno));
+}
+
+int main(int argc, char **argv)
+{
+    printf("ioreq batching tests\n");
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    dmod = xendevicemodel_open(NULL, 0);
+    fmem = xenforeignmemory_open(NULL, 0);
+    xce = xenevtchn_open(NULL, 0);
+
+    if ( !xch || !dmod || !fmem || !xce )
+        err(1, "open handles");
+
+    run_test("synchronous", 0);
+    run_test("batched", XEN_DMOP_IOREQ_SERVER_batch);
+
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,195 @@
+/*
+ * Checks of the hash the saver uses to skip pages unchanged since they were
+ * last sent: small changes of a page, as a guest makes between iterations,
+ * must change its hash, and must not collide with each other.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xen-tools/common-macros.h>
+
+#include "xg_sr_page_hash.h"
+
+#define PAGE_SIZE 4096
+#define NR_WORDS  (PAGE_SIZE / sizeof(uint64_t))
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static uint64_t page[NR_WORDS];
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b;
+
+    return *x < *y ? -1 : *x > *y;
+}
+
+/* Number of values in a sorted array equal to their predecessor. */
+static unsigned int count_dups(uint64_t *vals, unsigned int nr)
+{
+    unsigned int i, nr_dup = 0;
+
+    qsort(vals, nr, sizeof(*vals), cmp_u64);
+    for ( i = 1; i < nr; ++i )
+        if ( vals[i - 1] == vals[i] )
+            nr_dup++;
+
+    return nr_dup;
+}
+
+/*
+ * Fails if any two of the hashes collide.  Each half on its own is expected
+ * to be collision free among so few pages, too.
+ */
+static void check_distinct(const char *what,
+                           const struct xc_sr_page_hash *hashes,
+                           unsigned int nr)
+{
+    uint64_t *vals = malloc(nr * sizeof(*vals));
+    unsigned int i, nr_lo, nr_hi;
+
+    if ( !vals )
+    {
+        fail("  Fail: %s: no memory\n", what);
+        return;
+    }
+
+    for ( i = 0; i < nr; ++i )
+        vals[i] = hashes[i].lo;
+    nr_lo = count_dups(vals, nr);
+
+    for ( i = 0; i < nr; ++i )
+        vals[i] = hashes[i].hi;
+    nr_hi = count_dups(vals, nr);
+
+    free(vals);
+
+    if ( nr_lo || nr_hi )
+        fail("  Fail: %s: %u/%u of %u half hashes collide\n",
+             what, nr_lo, nr_hi, nr);
+    else
+        printf("  %s: %u distinct hashes\n", what, nr);
+}
+
+static void fill_random(void)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_WORDS; ++i )
+        page[i] = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 11) ^ rand();
+}
+
+/* Every page differing from a random one in a single bit, and the original. */
+static void test_bit_flips(void)
+{
+    unsigned int nr = PAGE_SIZE * 8 + 1, i;
+    struct xc_sr_page_hash *hashes = malloc(nr * sizeof(*hashes));
+
+    if ( !hashes )
+    {
+        fail("  Fail: bit flips: no memory\n");
+        return;
+    }
+
+    fill_random();
+    hashes[0] = xc_sr_page_hash(page, PAGE_SIZE);
+    for ( i = 0; i < PAGE_SIZE * 8; ++i )
+    {
+        page[i / 64] ^= 1ULL << (i % 64);
+        hashes[i + 1] = xc_sr_page_hash(page, PAGE_SIZE);
+        page[i / 64] ^= 1ULL << (i % 64);
+    }
+
+    check_distinct("Bit flips", hashes, nr);
+    free(hashes);
+}
+
+/* Zero pages with one word set to each of a range of small values. */
+static void test_small_values(void)
+{
+    unsigned int nr_vals = 256, nr = NR_WORDS * nr_vals + 1, i, v;
+    struct xc_sr_page_hash *hashes = malloc(nr * sizeof(*hashes));
+
+    if ( !hashes )
+    {
+        fail("  Fail: small values: no memory\n");
+        return;
+    }
+
+    memset(page, 0, sizeof(page));
+    hashes[0] = xc_sr_page_hash(page, PAGE_SIZE);
+    for ( i = 0; i < NR_WORDS; ++i )
+    {
+        for ( v = 1; v <= nr_vals; ++v )
+        {
+            page[i] = v;
+            hashes[i * nr_vals + v] = xc_sr_page_hash(page, PAGE_SIZE);
+        }
+        page[i] = 0;
+    }
+
+    check_distinct("Small values", hashes, nr);
+    free(hashes);
+}
+
+/* A random page with each pair of words, near or far apart, swapped. */
+static void test_swaps(void)
+{
+    static const unsigned int dists[] = { 1, 2, 3, 4, 5, 8, 64, 256 };
+    unsigned int nr = 1, i, j;
+    struct xc_sr_page_hash *hashes =
+        malloc((NR_WORDS * ARRAY_SIZE(dists) + 1) * sizeof(*hashes));
+    uint64_t tmp;
+
+    if ( !hashes )
+    {
+        fail("  Fail: swaps: no memory\n");
+        return;
+    }
+
+    fill_random();
+    hashes[0] = xc_sr_page_hash(page, PAGE_SIZE);
+    for ( j = 0; j < ARRAY_SIZE(dists); ++j )
+        for ( i = 0; i + dists[j] < NR_WORDS; ++i )
+        {
+            tmp = page[i];
+            page[i] = page[i + dists[j]];
+            page[i + dists[j]] = tmp;
+            hashes[nr++] = xc_sr_page_hash(page, PAGE_SIZE);
+            page[i + dists[j]] = page[i];
+            page[i] = tmp;
+        }
+
+    check_distinct("Swapped words", hashes, nr);
+    free(hashes);
+}
+
+int main(int argc, char **argv)
+{
+    printf("Page hash tests\n");
+
+    srand(1);
+
+    test_bit_flips();
+    test_small_values();
+    test_swaps();
+
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
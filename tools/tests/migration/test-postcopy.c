@@ -0,0 +1,377 @@
+/*
+ * Postcopy migration of an HVM domain between two processes over a
+ * socketpair.  The destination resumes the domain before any of its memory
+ * has arrived, then reads all of its pages in reverse order, so most of them
+ * have to be requested from the source ahead of the background transfer.
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <xenctrl.h>
+#include <xenforeignmemory.h>
+#include <xenguest.h>
+#include <xen-tools/common-macros.h>
+
+#define NR_PAGES 4096               /* 16MB of guest RAM. */
+#define RING_PFN (NR_PAGES + 16)    /* Paging ring, outside of RAM. */
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static xc_interface *xch;
+static xenforeignmemory_handle *fmem;
+static uint32_t src_domid, dst_domid;
+
+static struct xen_domctl_createdomain create = {
+    .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+    .max_vcpus = 1,
+    .max_evtchn_port = -1,
+    .max_grant_frames = 1,
+    .grant_opts = XEN_DOMCTL_GRANT_version(1),
+
+    .arch = {
+        .emulation_flags = XEN_X86_EMU_LAPIC,
+    },
+};
+
+/* Destination side progress, reported once the restore completes. */
+static uint64_t start_ns, resumed_ns, touched_ns;
+static unsigned long nr_retries;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Every 8th page is zero, the rest hold a pattern unique to their pfn. */
+static void fill_page(uint32_t *page, xen_pfn_t pfn)
+{
+    unsigned int i;
+
+    for ( i = 0; i < XC_PAGE_SIZE / sizeof(*page); i++ )
+        page[i] = (pfn % 8) ? (pfn * 0x9e3779b9U) ^ i : 0;
+}
+
+static bool check_page(const uint32_t *page, xen_pfn_t pfn)
+{
+    static uint32_t expected[XC_PAGE_SIZE / sizeof(uint32_t)];
+
+    fill_page(expected, pfn);
+
+    return !memcmp(page, expected, XC_PAGE_SIZE);
+}
+
+static int create_domain(uint32_t *domid)
+{
+    int rc = xc_domain_create(xch, domid, &create);
+
+    if ( rc )
+        return rc;
+
+    rc = xc_domain_setmaxmem(xch, *domid, -1);
+    if ( rc )
+        fail("  Fail: setmaxmem d%u: %d - %s\n",
+             *domid, errno, strerror(errno));
+
+    return rc;
+}
+
+static int setup_source(void)
+{
+    xen_pfn_t pfns[NR_PAGES];
+    void *mapping;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < NR_PAGES; i++ )
+        pfns[i] = i;
+
+    rc = xc_domain_populate_physmap_exact(xch, src_domid, NR_PAGES, 0, 0,
+                                          pfns);
+    if ( rc )
+    {
+        fail("  Fail: populate physmap: %d - %s\n", errno, strerror(errno));
+        return rc;
+    }
+
+    mapping = xenforeignmemory_map(fmem, src_domid, PROT_READ | PROT_WRITE,
+                                   NR_PAGES, pfns, NULL);
+    if ( !mapping )
+    {
+        fail("  Fail: map source memory: %d - %s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    for ( i = 0; i < NR_PAGES; i++ )
+        fill_page(mapping + i * XC_PAGE_SIZE, i);
+
+    xenforeignmemory_unmap(fmem, mapping, NR_PAGES);
+
+    rc = xc_hvm_param_set(xch, src_domid, HVM_PARAM_PAGING_RING_PFN, RING_PFN);
+    if ( rc )
+        fail("  Fail: set paging ring pfn: %d - %s\n",
+             errno, strerror(errno));
+
+    return rc;
+}
+
+/*
+ * Read every page of the running destination, last to first.  Pages still
+ * paged out fail to map with ENOENT, having raised a request to page them in.
+ */
+static void *touch_pages(void *arg)
+{
+    xen_pfn_t pfn;
+    void *page;
+    int map_err;
+
+    for ( pfn = NR_PAGES; pfn-- > 0; )
+    {
+        for ( ; ; )
+        {
+            page = xenforeignmemory_map(fmem, dst_domid, PROT_READ, 1,
+                                        &pfn, &map_err);
+            if ( page && !map_err )
+                break;
+
+            if ( page )
+                xenforeignmemory_unmap(fmem, page, 1);
+
+            if ( (page ? map_err : -errno) != -ENOENT )
+            {
+                fail("  Fail: map pfn %#"PRI_xen_pfn": %d\n", pfn,
+                     page ? map_err : -errno);
+                return NULL;
+            }
+
+            nr_retries++;
+            usleep(50);
+        }
+
+        if ( !check_page(page, pfn) )
+            fail("  Fail: pfn %#"PRI_xen_pfn" has wrong contents\n", pfn);
+
+        xenforeignmemory_unmap(fmem, page, 1);
+    }
+
+    touched_ns = now_ns();
+
+    return NULL;
+}
+
+static pthread_t toucher;
+
+static int dst_postcopy(void *data)
+{
+    resumed_ns = now_ns();
+
+    if ( xc_domain_unpause(xch, dst_domid) )
+    {
+        fail("  Fail: unpause d%u: %d - %s\n",
+             dst_domid, errno, strerror(errno));
+        return 0;
+    }
+
+    if ( pthread_create(&toucher, NULL, touch_pages, NULL) )
+    {
+        fail("  Fail: create thread\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+static void dst_restore_results(xen_pfn_t store_gfn, xen_pfn_t console_gfn,
+                                void *data)
+{
+}
+
+static int run_destination(int fd)
+{
+    struct restore_callbacks callbacks = {
+        .postcopy = dst_postcopy,
+        .restore_results = dst_restore_results,
+    };
+    unsigned long store_gfn, console_gfn;
+    xen_pfn_t pfns[NR_PAGES];
+    void *mapping;
+    unsigned int i;
+    int rc;
+
+    /* Handles aren't to be shared with the parent. */
+    xch = xc_interface_open(NULL, NULL, 0);
+    fmem = xenforeignmemory_open(NULL, 0);
+    if ( !xch || !fmem )
+        err(1, "destination: open handles");
+
+    start_ns = now_ns();
+
+    rc = xc_domain_restore(xch, fd, dst_domid, 0, &store_gfn, 0, 0,
+                           &console_gfn, 0, XC_STREAM_PLAIN, &callbacks, fd);
+    if ( rc )
+        fail("  Fail: restore: %d - %s\n", errno, strerror(errno));
+
+    if ( resumed_ns )
+        pthread_join(toucher, NULL);
+    else
+        fail("  Fail: domain not resumed during the restore\n");
+
+    printf("  Resumed after %"PRIu64"us, touched all pages after %"PRIu64"us"
+           ", restored after %"PRIu64"us\n",
+           (resumed_ns - start_ns) / 1000, (touched_ns - start_ns) / 1000,
+           (now_ns() - start_ns) / 1000);
+    printf("  %lu retries waiting for pages\n", nr_retries);
+
+    /* All of memory is now in place.  Check it all again. */
+    for ( i = 0; i < NR_PAGES; i++ )
+        pfns[i] = i;
+
+    mapping = xenforeignmemory_map(fmem, dst_domid, PROT_READ, NR_PAGES,
+                                   pfns, NULL);
+    if ( !mapping )
+        fail("  Fail: map restored memory: %d - %s\n",
+             errno, strerror(errno));
+    else
+    {
+        for ( i = 0; i < NR_PAGES; i++ )
+            if ( !check_page(mapping + i * XC_PAGE_SIZE, i) )
+                fail("  Fail: pfn %#x has wrong contents after restore\n", i);
+
+        xenforeignmemory_unmap(fmem, mapping, NR_PAGES);
+    }
+
+    return !!nr_failures;
+}
+
+static int src_suspend(void *data)
+{
+    return !xc_domain_shutdown(xch, src_domid, SHUTDOWN_suspend);
+}
+
+static int src_switch_qemu_logdirty(uint32_t domid, unsigned int enable,
+                                    void *data)
+{
+    return 0;
+}
+
+static void run_tests(void)
+{
+    struct save_callbacks callbacks = {
+        .suspend = src_suspend,
+        .switch_qemu_logdirty = src_switch_qemu_logdirty,
+    };
+    uint64_t start;
+    int sv[2], status, rc;
+    pid_t pid;
+
+    printf("Test postcopy migration of %u pages\n", NR_PAGES);
+
+    if ( setup_source() )
+        return;
+
+    if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) )
+        return fail("  Fail: socketpair: %d - %s\n", errno, strerror(errno));
+
+    pid = fork();
+    if ( pid < 0 )
+        return fail("  Fail: fork: %d - %s\n", errno, strerror(errno));
+
+    if ( pid == 0 )
+    {
+        close(sv[0]);
+        exit(run_destination(sv[1]));
+    }
+
+    close(sv[1]);
+
+    start = now_ns();
+    rc = xc_domain_save(xch, sv[0], src_domid, XCFLAGS_POSTCOPY, &callbacks,
+                        XC_STREAM_PLAIN, sv[0]);
+    if ( rc )
+        fail("  Fail: save: %d - %s\n", errno, strerror(errno));
+    else
+        printf("  Saved in %"PRIu64"us\n", (now_ns() - start) / 1000);
+
+    /* Unblock the destination if the save failed part way. */
+    close(sv[0]);
+
+    if ( waitpid(pid, &status, 0) != pid )
+        return fail("  Fail: waitpid: %d - %s\n", errno, strerror(errno));
+
+    if ( !WIFEXITED(status) || WEXITSTATUS(status) )
+        fail("  Fail: destination failed (status %#x)\n", status);
+}
+
+int main(int argc, char **argv)
+{
+    int rc;
+
+    printf("Postcopy migration tests\n");
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    fmem = xenforeignmemory_open(NULL, 0);
+
+    if ( !xch || !fmem )
+        err(1, "open handles");
+
+    rc = create_domain(&src_domid);
+    if ( rc )
+    {
+        if ( errno == EINVAL || errno == EOPNOTSUPP )
+            printf("  Skip: %d - %s\n", errno, strerror(errno));
+        else
+            fail("  Domain create failure: %d - %s\n",
+                 errno, strerror(errno));
+        goto out;
+    }
+
+    rc = create_domain(&dst_domid);
+    if ( rc )
+    {
+        fail("  Domain create failure: %d - %s\n", errno, strerror(errno));
+        goto destroy_src;
+    }
+
+    printf("  Created d%u -> d%u\n", src_domid, dst_domid);
+
+    run_tests();
+
+    if ( xc_domain_destroy(xch, dst_domid) )
+        fail("  Failed to destroy domain: %d - %s\n",
+             errno, strerror(errno));
+ destroy_src:
+    if ( xc_domain_destroy(xch, src_domid) )
+        fail("  Failed to destroy domain: %d - %s\n",
+             errno, strerror(errno));
+ out:
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,336 @@
+/*
+ * Unit tests and benchmark for the rangeset code.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "emul.h"
+
+/* Values tracked by the reference model for the randomised tests. */
+#define MODEL_SIZE 1024
+#define MODEL_OPS  100000
+
+#define BENCH_OPS  1000000
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static bool model[MODEL_SIZE];
+
+struct check {
+    unsigned long next;
+    bool ok;
+};
+
+/*
+ * Ranges must be reported in ascending order, separated by at least one value
+ * not in the set, and match the model.
+ */
+static int cf_check check_range(unsigned long s, unsigned long e, void *data)
+{
+    struct check *c = data;
+
+    if ( s > e || s < c->next || e >= MODEL_SIZE )
+    {
+        c->ok = false;
+        return -EINVAL;
+    }
+
+    for ( ; c->next < s; c->next++ )
+        if ( model[c->next] )
+            c->ok = false;
+    for ( ; c->next <= e; c->next++ )
+        if ( !model[c->next] )
+            c->ok = false;
+
+    /* Skip the gap following a range. */
+    if ( c->next < MODEL_SIZE && model[c->next] )
+        c->ok = false;
+    c->next++;
+
+    return 0;
+}
+
+static bool check_model(struct rangeset *r)
+{
+    struct check c = { .next = 0, .ok = true };
+    unsigned long i;
+
+    if ( rangeset_report_ranges(r, 0, ~0UL, check_range, &c) )
+        return false;
+
+    for ( i = c.next; i < MODEL_SIZE; i++ )
+        if ( model[i] )
+            return false;
+
+    return c.ok;
+}
+
+static void test_random(void)
+{
+    struct rangeset *r = rangeset_new(NULL, "random", 0);
+    unsigned long s, e, i;
+    unsigned int op;
+    bool exp;
+
+    printf("Testing %u random operations: ", MODEL_OPS);
+
+    memset(model, 0, sizeof(model));
+    srandom(1);
+
+    for ( op = 0; op < MODEL_OPS; op++ )
+    {
+        s = random() % MODEL_SIZE;
+        e = s + random() % 64;
+        if ( e >= MODEL_SIZE )
+            e = MODEL_SIZE - 1;
+
+        switch ( random() % 4 )
+        {
+        case 0:
+            if ( rangeset_add_range(r, s, e) )
+                return fail("add [%lu, %lu] failed\n", s, e);
+            for ( i = s; i <= e; i++ )
+                model[i] = true;
+            break;
+
+        case 1:
+            if ( rangeset_remove_range(r, s, e) )
+                return fail("remove [%lu, %lu] failed\n", s, e);
+            for ( i = s; i <= e; i++ )
+                model[i] = false;
+            break;
+
+        case 2:
+            for ( exp = true, i = s; i <= e; i++ )
+                exp &= model[i];
+            if ( rangeset_contains_range(r, s, e) != exp )
+                return fail("contains [%lu, %lu] != %d\n", s, e, exp);
+            break;
+
+        case 3:
+            for ( exp = false, i = s; i <= e; i++ )
+                exp |= model[i];
+            if ( rangeset_overlaps_range(r, s, e) != exp )
+                return fail("overlaps [%lu, %lu] != %d\n", s, e, exp);
+            break;
+        }
+
+        if ( !(op % 1000) && !check_model(r) )
+            return fail("set differs from model after %u operations\n", op);
+    }
+
+    if ( !check_model(r) )
+        return fail("set differs from model\n");
+
+    rangeset_destroy(r);
+    printf("okay\n");
+}
+
+/*
+ * Removing a range starting in a gap must leave the range below the gap
+ * alone, rather than extending it up to the start of the removal.
+ */
+static void test_remove_from_gap(void)
+{
+    struct rangeset *r = rangeset_new(NULL, "gap", 0);
+
+    printf("Testing removal starting in a gap: ");
+
+    if ( rangeset_add_range(r, 0, 9) || rangeset_add_range(r, 20, 29) ||
+         rangeset_add_range(r, 40, 49) )
+        return fail("add failed\n");
+
+    if ( rangeset_remove_range(r, 15, 24) )
+        return fail("remove failed\n");
+    if ( rangeset_overlaps_range(r, 10, 24) ||
+         !rangeset_contains_range(r, 0, 9) ||
+         !rangeset_contains_range(r, 25, 29) )
+        return fail("range below the gap changed\n");
+
+    /* The same, with ranges to remove entirely in between. */
+    if ( rangeset_remove_range(r, 12, 44) )
+        return fail("remove failed\n");
+    if ( rangeset_overlaps_range(r, 10, 44) ||
+         !rangeset_contains_range(r, 0, 9) ||
+         !rangeset_contains_range(r, 45, 49) )
+        return fail("range below the gap changed\n");
+
+    rangeset_destroy(r);
+    printf("okay\n");
+}
+
+static int cf_check consume_half(unsigned long s, unsigned long e, void *data,
+                                 unsigned long *c)
+{
+    *c = (e - s) / 2 + 1;
+    ++*(unsigned int *)data;
+
+    return 0;
+}
+
+static void test_misc(void)
+{
+    struct rangeset *a = rangeset_new(NULL, "a", 0);
+    struct rangeset *b = rangeset_new(NULL, "b", 0);
+    unsigned long s;
+    unsigned int calls = 0;
+
+    printf("Testing claim, limit, swap and consume: ");
+
+    if ( rangeset_add_range(a, 0, 9) || rangeset_add_range(a, 20, 29) ||
+         rangeset_add_range(a, ~0UL - 9, ~0UL) )
+        return fail("add failed\n");
+
+    /* Claimed space is appended to the preceding range. */
+    if ( rangeset_claim_range(a, 10, &s) || s != 10 ||
+         !rangeset_contains_range(a, 0, 19) )
+        return fail("claim of gap failed\n");
+    if ( rangeset_claim_range(a, 11, &s) || s != 30 ||
+         !rangeset_contains_range(a, 20, 40) )
+        return fail("claim after ranges failed\n");
+    if ( rangeset_claim_range(a, ~0UL - 40, &s) != -ENOSPC )
+        return fail("oversized claim succeeded\n");
+
+    rangeset_limit(b, 2);
+    if ( rangeset_add_range(b, 0, 0) || rangeset_add_range(b, 2, 2) ||
+         rangeset_add_range(b, 4, 4) != -ENOMEM )
+        return fail("limit not enforced\n");
+    if ( rangeset_add_range(b, 1, 1) || rangeset_add_range(b, 4, 4) )
+        return fail("add after merge failed\n");
+    if ( rangeset_remove_range(b, 1, 1) != -ENOMEM ||
+         !rangeset_contains_range(b, 0, 2) )
+        return fail("limit not enforced on split\n");
+    if ( rangeset_remove_range(b, 4, 4) || rangeset_remove_range(b, 1, 1) )
+        return fail("split failed\n");
+
+    if ( rangeset_remove_range(a, ~0UL - 9, ~0UL) )
+        return fail("remove failed\n");
+
+    rangeset_swap(a, b);
+    if ( !rangeset_contains_range(a, 0, 0) ||
+         rangeset_contains_range(a, 1, 1) ||
+         !rangeset_contains_range(b, 30, 40) )
+        return fail("swap failed\n");
+
+    if ( rangeset_consume_ranges(b, consume_half, &calls) ||
+         !rangeset_is_empty(b) || calls < 4 )
+        return fail("consume failed\n");
+
+    rangeset_purge(a);
+    if ( !rangeset_is_empty(a) )
+        return fail("purge failed\n");
+
+    rangeset_destroy(a);
+    rangeset_destroy(b);
+    printf("okay\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Time adding and removing a singleton, and lookups, in a set of nr ranges
+ * [8i, 8i + 1], inserted in random order.
+ */
+static void bench(unsigned int nr)
+{
+    struct rangeset *r = rangeset_new(NULL, "bench", 0);
+    unsigned long *order = malloc(nr * sizeof(*order));
+    uint64_t start, add = 0, rem = 0, look;
+    unsigned long s;
+    unsigned int i, j;
+    bool found = true;
+
+    if ( !r || !order )
+        return fail("allocation failure\n");
+
+    for ( i = 0; i < nr; i++ )
+        order[i] = i;
+    for ( i = nr - 1; i > 0; i-- )
+    {
+        j = random() % (i + 1);
+        s = order[i];
+        order[i] = order[j];
+        order[j] = s;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        if ( rangeset_add_range(r, order[i] * 8, order[i] * 8 + 1) )
+            return fail("add failed\n");
+
+    for ( i = 0; i < BENCH_OPS; i++ )
+    {
+        s = order[i % nr] * 8 + 4;
+
+        start = now_ns();
+        if ( rangeset_add_singleton(r, s) )
+            return fail("add failed\n");
+        add += now_ns() - start;
+
+        start = now_ns();
+        if ( rangeset_remove_singleton(r, s) )
+            return fail("remove failed\n");
+        rem += now_ns() - start;
+    }
+
+    start = now_ns();
+    for ( i = 0; i < BENCH_OPS; i++ )
+        found &= rangeset_contains_singleton(r, order[i % nr] * 8 + 1);
+    look = now_ns() - start;
+
+    if ( !found )
+        fail("lookup failed\n");
+
+    printf("%7u ranges: add %"PRIu64" ns, remove %"PRIu64" ns, "
+           "contains %"PRIu64" ns\n", nr,
+           add / BENCH_OPS, rem / BENCH_OPS, look / BENCH_OPS);
+
+    rangeset_destroy(r);
+    free(order);
+}
+
+int main(int argc, char **argv)
+{
+    test_random();
+    test_remove_from_gap();
+    test_misc();
+
+    bench(10);
+    bench(1000);
+    bench(100000);
+
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,349 @@
+/*
+ * Test harness for building the hypervisor's RTDS scheduler in userspace.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_RTDS_
+#define _TEST_RTDS_
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xen-tools/common-macros.h>
+
+#define __XEN_TOOLS__
+#include <xen/xen.h>
+#include <xen/domctl.h>
+#include <xen/sysctl.h>
+#include <xen/trace.h>
+
+#define CONFIG_NR_CPUS 8
+#define NR_CPUS CONFIG_NR_CPUS
+
+#define smp_wmb()
+#define prefetch(x) __builtin_prefetch(x)
+#define ASSERT(x) assert(x)
+#define BUG() assert(0)
+#define BUG_ON(x) assert(!(x))
+#define ASSERT_UNREACHABLE() assert(0)
+#define cf_check
+#define __init
+#define __read_mostly
+#define __used_section(s) __attribute__((__unused__))
+#define always_inline inline
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define block_lock_speculation()
+#define fallthrough __attribute__((__fallthrough__))
+
+#define count_args_(dot, a1, a2, a3, a4, a5, a6, a7, a8, x, ...) x
+#define count_args(args...) \
+    count_args_(., ## args, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+
+#define IS_ERR(p) ((unsigned long)(p) > (unsigned long)-4096)
+#define ERR_PTR(e) ((void *)(long)(e))
+
+/* Time, under control of the test. */
+typedef int64_t s_time_t;
+#define PRI_stime PRId64
+#define STIME_MAX ((s_time_t)((uint64_t)~0ULL >> 1))
+#define STIME_DELTA_MAX ((s_time_t)((uint64_t)~0ULL >> 2))
+#define MILLISECS(ms) ((s_time_t)((ms) * 1000000ULL))
+#define MICROSECS(us) ((s_time_t)((us) * 1000ULL))
+extern s_time_t test_now;
+#define NOW() test_now
+
+#define do_div(n, base) ({                      \
+    uint32_t rem_ = (uint64_t)(n) % (base);     \
+    (n) = (uint64_t)(n) / (base);               \
+    rem_;                                       \
+})
+
+/* CPU the test is pretending to run on. */
+extern unsigned int test_cpu;
+#define smp_processor_id() test_cpu
+
+#define DECLARE_PER_CPU(type, name) \
+    extern __typeof__(type) per_cpu__##name[NR_CPUS]
+#define DEFINE_PER_CPU(type, name) __typeof__(type) per_cpu__##name[NR_CPUS]
+#define per_cpu(name, cpu) (per_cpu__##name[cpu])
+#define this_cpu(name) per_cpu(name, smp_processor_id())
+
+/* Locks don't really lock, but catch recursion and imbalances. */
+typedef int spinlock_t;
+#define DEFINE_SPINLOCK(l) spinlock_t l
+#define spin_lock_init(l) (*(l) = 0)
+#define _spin_lock(l) ({ assert(!*(l)); *(l) = 1; })
+#define _spin_lock_irq(l) _spin_lock(l)
+#define _spin_lock_irqsave(l) ({ _spin_lock(l); 0UL; })
+#define spin_lock(l) _spin_lock(l)
+#define spin_lock_irq(l) _spin_lock(l)
+#define spin_lock_irqsave(l, f) ((f) = _spin_lock_irqsave(l))
+#define spin_trylock(l) (*(l) ? false : (*(l) = 1, true))
+#define spin_unlock(l) ({ assert(*(l)); *(l) = 0; })
+#define spin_unlock_irq(l) spin_unlock(l)
+#define spin_unlock_irqrestore(l, f) ({ (void)(f); spin_unlock(l); })
+#define spin_is_locked(l) (*(l) != 0)
+
+typedef int rwlock_t;
+#define rwlock_init(l) (*(l) = 0)
+#define read_lock(l) ({ assert(*(l) >= 0); ++*(l); })
+#define read_trylock(l) (*(l) < 0 ? false : (++*(l), true))
+#define read_unlock(l) ({ assert(*(l) > 0); --*(l); })
+#define read_lock_irqsave(l, f) ({ (f) = 0; read_lock(l); })
+#define read_unlock_irqrestore(l, f) ({ (void)(f); read_unlock(l); })
+#define write_lock(l) ({ assert(!*(l)); *(l) = -1; })
+#define write_unlock(l) ({ assert(*(l) < 0); *(l) = 0; })
+#define write_lock_irqsave(l, f) ({ (f) = 0; write_lock(l); })
+#define write_unlock_irqrestore(l, f) ({ (void)(f); write_unlock(l); })
+#define rw_is_write_locked(l) (*(l) < 0)
+#define local_irq_is_enabled() false
+
+typedef int atomic_t;
+typedef int rcu_read_lock_t;
+struct rcu_head {};
+#define rcu_dereference(p) (p)
+#define rcu_assign_pointer(p, v) ((p) = (v))
+
+/* Command line options are made visible to the test as param_<var>. */
+#define integer_param(name, var) __typeof__(var) *const param_##var = &(var)
+#define boolean_param(name, var) __typeof__(var) *const param_##var = &(var)
+#define custom_param(name, fn) int (*const param_##fn)(const char *) = (fn)
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define __set_bit(nr, addr) (*(addr) |= 1UL << (nr))
+#define __clear_bit(nr, addr) (*(addr) &= ~(1UL << (nr)))
+#define set_bit(nr, addr) __set_bit(nr, addr)
+#define clear_bit(nr, addr) __clear_bit(nr, addr)
+#define test_bit(nr, addr) (!!(*(addr) & (1UL << (nr))))
+#define __test_and_clear_bit(nr, addr) ({       \
+    bool old_ = test_bit(nr, addr);             \
+    __clear_bit(nr, addr);                      \
+    old_;                                       \
+})
+
+/* CPU masks fit in a single long. */
+typedef struct cpumask {
+    unsigned long bits;
+} cpumask_t;
+typedef cpumask_t *cpumask_var_t;
+
+#define cpumask_bits(m) (&(m)->bits)
+#define cpumask_test_cpu(c, m) test_bit(c, cpumask_bits(m))
+#define __cpumask_set_cpu(c, m) __set_bit(c, cpumask_bits(m))
+#define __cpumask_clear_cpu(c, m) __clear_bit(c, cpumask_bits(m))
+#define cpumask_set_cpu(c, m) __cpumask_set_cpu(c, m)
+#define cpumask_clear_cpu(c, m) __cpumask_clear_cpu(c, m)
+#define __cpumask_test_and_clear_cpu(c, m) \
+    __test_and_clear_bit(c, cpumask_bits(m))
+#define cpumask_test_and_clear_cpu(c, m) __cpumask_test_and_clear_cpu(c, m)
+#define cpumask_clear(m) ((m)->bits = 0)
+#define cpumask_copy(d, s) ((d)->bits = (s)->bits)
+#define cpumask_and(d, a, b) ((d)->bits = (a)->bits & (b)->bits)
+#define cpumask_or(d, a, b) ((d)->bits = (a)->bits | (b)->bits)
+#define cpumask_andnot(d, a, b) ((d)->bits = (a)->bits & ~(b)->bits)
+#define cpumask_empty(m) (!(m)->bits)
+#define cpumask_intersects(a, b) (!!((a)->bits & (b)->bits))
+#define cpumask_subset(a, b) (!((a)->bits & ~(b)->bits))
+#define cpumask_weight(m) __builtin_popcountl((m)->bits)
+
+extern cpumask_t test_cpumask_of[NR_CPUS];
+#define cpumask_of(cpu) (&test_cpumask_of[cpu])
+
+static inline unsigned int cpumask_next(int n, const cpumask_t *m)
+{
+    unsigned long bits = (n + 1 < NR_CPUS) ? m->bits >> (n + 1) << (n + 1)
+                                           : 0;
+
+    return bits ? __builtin_ctzl(bits) : NR_CPUS;
+}
+#define cpumask_first(m) cpumask_next(-1, m)
+#define cpumask_any(m) cpumask_first(m)
+
+static inline unsigned int cpumask_cycle(int n, const cpumask_t *m)
+{
+    unsigned int nxt = cpumask_next(n, m);
+
+    return nxt < NR_CPUS ? nxt : cpumask_first(m);
+}
+
+static inline unsigned int cpumask_test_or_cycle(int n, const cpumask_t *m)
+{
+    return cpumask_test_cpu(n, m) ? n : cpumask_cycle(n, m);
+}
+
+#define for_each_cpu(cpu, m)                    \
+    for ( (cpu) = cpumask_first(m);             \
+          (cpu) < NR_CPUS;                      \
+          (cpu) = cpumask_next(cpu, m) )
+
+#define CPUMASK_PR(m) NR_CPUS, cpumask_bits(m)
+
+#define nr_cpu_ids NR_CPUS
+extern cpumask_t cpu_online_map;
+#define num_online_cpus() cpumask_weight(&cpu_online_map)
+
+/* Topology: 2 threads per core, 2 cores per socket, 1 socket per node. */
+#define cpu_to_core(cpu) ((cpu) / 2)
+#define cpu_to_socket(cpu) ((cpu) / 4)
+#define cpu_to_node(cpu) ((cpu) / 4)
+#define cpu_nr_siblings(cpu) 2
+DECLARE_PER_CPU(cpumask_var_t, cpu_sibling_mask);
+DECLARE_PER_CPU(cpumask_var_t, cpu_core_mask);
+
+/* Timers only record their state: the test fires them. */
+struct timer {
+    s_time_t expires;
+    unsigned int cpu;
+    uint8_t status;
+};
+#define TIMER_STATUS_invalid  0
+#define TIMER_STATUS_inactive 1
+#define TIMER_STATUS_killed   2
+#define TIMER_STATUS_in_heap  3
+#define init_timer(t, fn, data, c) \
+    ((void)(fn), (void)(data), (t)->cpu = (c), \
+     (t)->status = TIMER_STATUS_inactive)
+#define set_timer(t, e) \
+    ((t)->expires = (e), (t)->status = TIMER_STATUS_in_heap)
+#define stop_timer(t) ((t)->status = TIMER_STATUS_inactive)
+#define kill_timer(t) ((t)->status = TIMER_STATUS_killed)
+#define migrate_timer(t, c) ((t)->cpu = (c))
+
+#define SCHEDULE_SOFTIRQ 0
+extern cpumask_t test_softirq_pending;
+#define cpu_raise_softirq(cpu, nr) __cpumask_set_cpu(cpu, &test_softirq_pending)
+
+extern bool tb_init_done;
+#define trace_time(evt, sz, d) ((void)(evt), (void)(sz), (void)(d))
+#define trace(evt, sz, d) ((void)(evt), (void)(sz), (void)(d))
+#define TRACE_TIME(evt, ...) ((void)(evt))
+
+#define SCHED_STAT_CRANK(x) ((void)0)
+
+#define xzalloc(type) ((type *)calloc(1, sizeof(type)))
+#define xzalloc_array(type, nr) ((type *)calloc(nr, sizeof(type)))
+#define xfree(p) free(p)
+
+#define printk(fmt, args...) ((void)0)
+#define dprintk(lvl, fmt, args...) ((void)0)
+#define XENLOG_DEBUG
+#define XENLOG_INFO
+#define XENLOG_WARNING
+#define XENLOG_ERR
+
+/* Minimal domains and vCPUs, one vCPU per unit. */
+enum {
+    RUNSTATE_running,
+    RUNSTATE_runnable,
+    RUNSTATE_blocked,
+    RUNSTATE_offline,
+};
+
+#define _VPF_blocked 0
+#define VPF_blocked  (1UL << _VPF_blocked)
+#define _VPF_down    1
+#define VPF_down     (1UL << _VPF_down)
+#define _VPF_parked  2
+#define VPF_parked   (1UL << _VPF_parked)
+#define _VPF_migrating 3
+#define VPF_migrating  (1UL << _VPF_migrating)
+
+struct vcpu {
+    unsigned int vcpu_id;
+    unsigned int processor;
+    unsigned long pause_flags;
+    int pause_count;
+    bool is_running;
+    int new_state;
+    struct {
+        int state;
+    } runstate;
+    struct domain *domain;
+    struct sched_unit *sched_unit;
+    struct vcpu *next_in_list;
+};
+
+struct domain {
+    domid_t domain_id;
+    void *sched_priv;
+    struct cpupool *cpupool;
+    struct sched_unit *sched_unit_list;
+    struct vcpu **vcpu;
+    unsigned int max_vcpus;
+};
+
+struct sched_unit {
+    struct domain         *domain;
+    struct vcpu           *vcpu_list;
+    void                  *priv;
+    struct sched_unit     *next_in_list;
+    struct sched_resource *res;
+    unsigned int           unit_id;
+    bool                   is_running;
+    bool                   soft_aff_effective;
+    bool                   migrated;
+    uint64_t               state_entry_time;
+    unsigned int           runstate_cnt[4];
+    cpumask_var_t          cpu_hard_affinity;
+    cpumask_var_t          cpu_soft_affinity;
+    struct sched_unit     *next_task;
+    s_time_t               next_time;
+};
+
+#define for_each_sched_unit(d, u) \
+    for ( (u) = (d)->sched_unit_list; (u) != NULL; (u) = (u)->next_in_list )
+
+#define for_each_sched_unit_vcpu(u, v)          \
+    for ( (v) = (u)->vcpu_list; (v) != NULL && (v)->sched_unit == (u); \
+          (v) = (v)->next_in_list )
+
+#define is_idle_domain(d) ((d)->domain_id == DOMID_IDLE)
+#define is_idle_vcpu(v) is_idle_domain((v)->domain)
+#define is_vcpu_online(v) (!((v)->pause_flags & VPF_down))
+#define vcpu_runnable(v) (!(v)->pause_flags && !(v)->pause_count)
+#define vcpu_pause_nosync(v) ((v)->pause_count++)
+#define vcpu_unpause(v) ((v)->pause_count--)
+
+#define copy_from_guest_offset(dst, hnd, off, nr) \
+    (memcpy(dst, (hnd).p + (off), sizeof(*(dst)) * (nr)), 0)
+#define copy_to_guest_offset(hnd, off, src, nr) \
+    (memcpy((hnd).p + (off), src, sizeof(*(src)) * (nr)), 0)
+#define hypercall_preempt_check() false
+
+extern bool sched_smt_power_savings;
+extern unsigned int sched_smt_pack_load;
+
+#include "list.h"
+#include "rbtree.h"
+#include "private.h"
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
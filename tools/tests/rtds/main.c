@@ -0,0 +1,573 @@
+/*
+ * Tests and benchmark for the RTDS clusters, with the scheduler driven
+ * the way the scheduler core would on 8 CPUs in 2 sockets.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* All of the scheduler is static: build it as part of the test. */
+#include "rt.c"
+
+#define TEST_CPUS   8
+
+#define MODEL_UNITS 64
+#define MODEL_OPS   20000
+
+#define BENCH_STEPS 20000
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+s_time_t test_now;
+unsigned int test_cpu;
+bool tb_init_done;
+cpumask_t cpu_online_map, test_softirq_pending;
+cpumask_t test_cpumask_of[NR_CPUS];
+
+DEFINE_PER_CPU(struct sched_resource *, sched_res);
+DEFINE_PER_CPU(cpumask_t, cpumask_scratch);
+DEFINE_PER_CPU(cpumask_var_t, cpu_sibling_mask);
+DEFINE_PER_CPU(cpumask_var_t, cpu_core_mask);
+
+static struct scheduler ops;
+static struct cpupool pool;
+static cpumask_t pool_cpus;
+static struct sched_resource res[NR_CPUS];
+static s_time_t slice_end[NR_CPUS];
+
+static struct domain idle_domain = { .domain_id = DOMID_IDLE };
+static struct vcpu idle_vcpus[NR_CPUS];
+static struct sched_unit idle_units[NR_CPUS];
+
+static struct domain domain = { .domain_id = 1 };
+static struct vcpu *vcpus;
+static struct sched_unit *units;
+static unsigned int nr_units;
+
+/* Hard affinities of the units: all CPUs, a socket, or a single CPU. */
+static cpumask_t affinities[3 + TEST_CPUS];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void setup_cpus(const char *cluster)
+{
+    unsigned int cpu;
+    int rc;
+
+    rc = param_parse_rtds_cluster(cluster);
+    assert(!rc);
+
+    cpu_online_map.bits = (1UL << TEST_CPUS) - 1;
+    cpumask_copy(&pool_cpus, &cpu_online_map);
+    pool.cpu_valid = pool.res_valid = &pool_cpus;
+    pool.sched = &ops;
+    pool.gran = SCHED_GRAN_cpu;
+    pool.sched_gran = 1;
+
+    affinities[0] = pool_cpus;
+    affinities[1].bits = 0x0f;
+    affinities[2].bits = 0xf0;
+
+    ops = sched_rtds_def;
+    ops.cpupool = &pool;
+    rc = ops.init(&ops);
+    assert(!rc);
+
+    for_each_cpu ( cpu, &cpu_online_map )
+    {
+        struct sched_resource *sr = &res[cpu];
+        void *pdata, *vdata;
+        spinlock_t *lock;
+
+        __cpumask_set_cpu(cpu, &test_cpumask_of[cpu]);
+        affinities[3 + cpu] = test_cpumask_of[cpu];
+
+        idle_vcpus[cpu].vcpu_id = cpu;
+        idle_vcpus[cpu].processor = cpu;
+        idle_vcpus[cpu].domain = &idle_domain;
+        idle_vcpus[cpu].sched_unit = &idle_units[cpu];
+        idle_vcpus[cpu].is_running = true;
+        idle_units[cpu].domain = &idle_domain;
+        idle_units[cpu].vcpu_list = &idle_vcpus[cpu];
+        idle_units[cpu].unit_id = cpu;
+        idle_units[cpu].is_running = true;
+        idle_units[cpu].runstate_cnt[RUNSTATE_running] = 1;
+        idle_units[cpu].cpu_hard_affinity = &test_cpumask_of[cpu];
+        idle_units[cpu].cpu_soft_affinity = &test_cpumask_of[cpu];
+        idle_units[cpu].res = sr;
+
+        sr->scheduler = &ops;
+        sr->cpupool = &pool;
+        sr->master_cpu = cpu;
+        sr->granularity = 1;
+        sr->cpus = &test_cpumask_of[cpu];
+        sr->curr = sr->sched_unit_idle = &idle_units[cpu];
+        spin_lock_init(&sr->_lock);
+        sr->schedule_lock = &sr->_lock;
+        per_cpu(sched_res, cpu) = sr;
+        slice_end[cpu] = STIME_MAX;
+
+        test_cpu = cpu;
+        pdata = ops.alloc_pdata(&ops, cpu);
+        vdata = ops.alloc_udata(&ops, &idle_units[cpu], NULL);
+        assert(pdata && !IS_ERR(pdata) && vdata);
+
+        spin_lock(&sr->_lock);
+        lock = ops.switch_sched(&ops, cpu, pdata, vdata);
+        sr->sched_priv = pdata;
+        spin_unlock(&sr->_lock);
+        sr->schedule_lock = lock;
+    }
+}
+
+/* Create nr units, all of them blocked, with random affinities if asked. */
+static void setup_domain(unsigned int nr, bool random_affinity)
+{
+    unsigned int i;
+
+    vcpus = calloc(nr, sizeof(*vcpus));
+    units = calloc(nr, sizeof(*units));
+    assert(vcpus && units);
+    nr_units = nr;
+
+    domain.cpupool = &pool;
+    domain.sched_priv = ops.alloc_domdata(&ops, &domain);
+    assert(domain.sched_priv && !IS_ERR(domain.sched_priv));
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct vcpu *v = &vcpus[i];
+        struct sched_unit *u = &units[i];
+
+        v->vcpu_id = i;
+        v->domain = &domain;
+        v->sched_unit = u;
+        v->pause_flags = VPF_blocked;
+        v->next_in_list = i + 1 < nr ? &vcpus[i + 1] : NULL;
+
+        u->domain = &domain;
+        u->vcpu_list = v;
+        u->unit_id = i;
+        u->runstate_cnt[RUNSTATE_blocked] = 1;
+        u->cpu_hard_affinity =
+            &affinities[random_affinity ? rand() % ARRAY_SIZE(affinities) : 0];
+        u->cpu_soft_affinity = &pool_cpus;
+        u->next_in_list = i + 1 < nr ? &units[i + 1] : NULL;
+        sched_set_res(u, &res[cpumask_first(u->cpu_hard_affinity)]);
+
+        u->priv = ops.alloc_udata(&ops, u, domain.sched_priv);
+        assert(u->priv);
+        ops.insert_unit(&ops, u);
+    }
+    domain.sched_unit_list = units;
+}
+
+static void unit_wake(struct sched_unit *u)
+{
+    spinlock_t *lock = unit_schedule_lock_irq(u);
+
+    u->vcpu_list->pause_flags &= ~VPF_blocked;
+    ops.wake(&ops, u);
+
+    unit_schedule_unlock_irq(lock, u);
+}
+
+static void unit_sleep(struct sched_unit *u)
+{
+    spinlock_t *lock = unit_schedule_lock_irq(u);
+
+    u->vcpu_list->pause_flags |= VPF_blocked;
+    ops.sleep(&ops, u);
+
+    unit_schedule_unlock_irq(lock, u);
+}
+
+static uint64_t schedule_ns, saved_ns, repl_ns;
+static unsigned int nr_schedules, nr_switches, nr_repls;
+
+/* What the scheduler core does on a SCHEDULE_SOFTIRQ, as far as we care. */
+static void schedule(unsigned int cpu)
+{
+    struct sched_resource *sr = &res[cpu];
+    struct sched_unit *prev = sr->curr, *next;
+    spinlock_t *lock;
+    uint64_t t;
+
+    test_cpu = cpu;
+    __cpumask_clear_cpu(cpu, &test_softirq_pending);
+
+    lock = pcpu_schedule_lock_irq(cpu);
+
+    t = now_ns();
+    ops.do_schedule(&ops, prev, test_now, false);
+    schedule_ns += now_ns() - t;
+    nr_schedules++;
+
+    next = prev->next_task;
+    slice_end[cpu] = prev->next_time < 0 ? STIME_MAX
+                                         : test_now + prev->next_time;
+    if ( prev != next )
+    {
+        assert(!next->is_running);
+        assert(sched_unit_master(next) == cpu);
+        next->is_running = true;
+        next->state_entry_time = test_now;
+        sr->curr = next;
+    }
+
+    pcpu_schedule_unlock_irq(lock, cpu);
+
+    if ( prev != next )
+    {
+        prev->is_running = false;
+        prev->state_entry_time = test_now;
+
+        t = now_ns();
+        ops.context_saved(&ops, prev);
+        saved_ns += now_ns() - t;
+        nr_switches++;
+    }
+}
+
+/* Run the replenishment timers which are due, and then the scheduler. */
+static void run(void)
+{
+    const struct rt_private *prv = rt_priv(&ops);
+    struct rt_cluster *cl;
+    unsigned int cpu, rounds = 0;
+    bool again;
+    uint64_t t;
+
+    list_for_each_entry ( cl, &prv->clusters, cl_elem )
+    {
+        if ( cl->repl_timer.status != TIMER_STATUS_in_heap ||
+             cl->repl_timer.expires > test_now )
+            continue;
+
+        cl->repl_timer.status = TIMER_STATUS_inactive;
+        test_cpu = cl->repl_timer.cpu;
+        t = now_ns();
+        repl_timer_handler(cl);
+        repl_ns += now_ns() - t;
+        nr_repls++;
+    }
+
+    do {
+        again = false;
+        for_each_cpu ( cpu, &cpu_online_map )
+        {
+            if ( cpumask_test_cpu(cpu, &test_softirq_pending) ||
+                 slice_end[cpu] <= test_now )
+            {
+                schedule(cpu);
+                again = true;
+            }
+        }
+    } while ( again && ++rounds < 100 );
+
+    if ( again )
+        fail("  Fail: scheduler still busy after %u rounds\n", rounds);
+}
+
+/*
+ * The queues of each cluster must be sorted, have their first unit cached,
+ * and hold exactly the runnable units which aren't running. The units on
+ * the runqueues must have no idle CPU they could run on.
+ */
+static void check_queues(void)
+{
+    const struct rt_private *prv = rt_priv(&ops);
+    const struct rt_cluster *cl;
+    const struct rt_unit *svc;
+    unsigned int i, cpu, queued = 0, replq = 0;
+
+    list_for_each_entry ( cl, &prv->clusters, cl_elem )
+    {
+        const struct rt_unit *prev = NULL;
+        struct rb_node *iter;
+
+        if ( cl->runq_first != rb_first(&cl->runq) )
+            fail("  Fail: runq_first isn't the leftmost unit\n");
+        if ( cl->replq_first != rb_first(&cl->replq) )
+            fail("  Fail: replq_first isn't the leftmost unit\n");
+
+        for ( iter = cl->runq_first; iter; iter = rb_next(iter) )
+        {
+            svc = q_elem(iter);
+            if ( prev && compare_unit_priority(prev, svc) < 0 )
+                fail("  Fail: unit %u queued after a lower priority one\n",
+                     svc->unit->unit_id);
+            if ( unit_cluster(svc) != cl )
+                fail("  Fail: unit %u queued in the wrong cluster\n",
+                     svc->unit->unit_id);
+            for_each_cpu ( cpu, svc->unit->cpu_hard_affinity )
+                if ( is_idle_unit(curr_on_cpu(cpu)) )
+                    fail("  Fail: unit %u queued while cpu %u is idle\n",
+                         svc->unit->unit_id, cpu);
+            prev = svc;
+            queued++;
+        }
+
+        list_for_each_entry ( svc, &cl->depletedq, depletedq_elem )
+        {
+            if ( unit_cluster(svc) != cl )
+                fail("  Fail: unit %u depleted in the wrong cluster\n",
+                     svc->unit->unit_id);
+            queued++;
+        }
+
+        prev = NULL;
+        for ( iter = cl->replq_first; iter; iter = rb_next(iter) )
+        {
+            svc = replq_elem(iter);
+            if ( prev && prev->cur_deadline > svc->cur_deadline )
+                fail("  Fail: unit %u replenished after a later one\n",
+                     svc->unit->unit_id);
+            if ( unit_cluster(svc) != cl )
+                fail("  Fail: unit %u replenished in the wrong cluster\n",
+                     svc->unit->unit_id);
+            prev = svc;
+            replq++;
+        }
+
+        if ( cl->replq_first &&
+             (cl->repl_timer.status != TIMER_STATUS_in_heap ||
+              cl->repl_timer.expires !=
+              replq_elem(cl->replq_first)->cur_deadline) )
+            fail("  Fail: replenishment timer not set for the first unit\n");
+    }
+
+    for ( i = 0; i < nr_units; i++ )
+    {
+        bool runnable = unit_runnable(&units[i]);
+
+        svc = units[i].priv;
+        if ( (runnable && !units[i].is_running) != unit_on_q(svc) )
+            fail("  Fail: unit %u is %srunnable but %son a queue\n",
+                 i, runnable ? "" : "not ", unit_on_q(svc) ? "" : "not ");
+        if ( runnable != unit_on_replq(svc) )
+            fail("  Fail: unit %u is %srunnable but %son the replq\n",
+                 i, runnable ? "" : "not ", unit_on_replq(svc) ? "" : "not ");
+        if ( !cpumask_test_cpu(sched_unit_master(&units[i]),
+                               units[i].cpu_hard_affinity) )
+            fail("  Fail: unit %u on cpu %u, outside of its affinity\n",
+                 i, sched_unit_master(&units[i]));
+        queued -= unit_on_q(svc);
+        replq -= unit_on_replq(svc);
+    }
+
+    if ( queued || replq )
+        fail("  Fail: %d units queued and %d replenished unaccounted for\n",
+             queued, replq);
+}
+
+/* Random wakeups, sleeps and time steps against the queue invariants. */
+static void test_model(unsigned int cluster)
+{
+    unsigned int i;
+
+    printf("Testing %u random operations on %u units, %s clusters\n",
+           MODEL_OPS, MODEL_UNITS, opt_cluster_str[cluster]);
+
+    setup_cpus(opt_cluster_str[cluster]);
+    srand(cluster + 1);
+    setup_domain(MODEL_UNITS, true);
+
+    for ( i = 0; i < MODEL_OPS && nr_failures < 10; i++ )
+    {
+        struct sched_unit *u = &units[rand() % nr_units];
+
+        switch ( rand() % 4 )
+        {
+        case 0:
+            if ( u->vcpu_list->pause_flags & VPF_blocked )
+                unit_wake(u);
+            break;
+
+        case 1:
+            if ( !(u->vcpu_list->pause_flags & VPF_blocked) )
+                unit_sleep(u);
+            break;
+
+        default:
+            test_now += rand() % MILLISECS(1);
+            break;
+        }
+
+        run();
+        check_queues();
+    }
+}
+
+/*
+ * A unit pushed towards an idle CPU of another cluster must get there even
+ * if the pull finds the lock of the unit's cluster taken, as nobody will
+ * tickle that CPU again.
+ */
+static void test_pull_contended(unsigned int unused, unsigned int cluster)
+{
+    struct rt_unit *svc;
+    struct rt_cluster *cl;
+    unsigned int i, cpu;
+
+    printf("Testing a contended pull after a push, %s clusters\n",
+           opt_cluster_str[cluster]);
+
+    setup_cpus(opt_cluster_str[cluster]);
+    setup_domain(5, false);
+
+    /* Keep all CPUs of the cluster of the units busy... */
+    svc = units[0].priv;
+    cl = unit_cluster(svc);
+    for ( i = 0; i < 4; i++ )
+        unit_wake(&units[i]);
+    run();
+
+    /* ... so that waking another one pushes it to an idle CPU. */
+    unit_wake(&units[4]);
+    svc = units[4].priv;
+    cpu = cpumask_first(&test_softirq_pending);
+    if ( cpu >= nr_cpu_ids || cpumask_test_cpu(cpu, &cl->cpus) )
+    {
+        fail("  Fail: unit 4 not pushed to another cluster\n");
+        return;
+    }
+
+    /* The pull fails to get the lock, and has to be retried. */
+    spin_lock(&cl->lock);
+    schedule(cpu);
+    spin_unlock(&cl->lock);
+
+    if ( !cpumask_test_cpu(cpu, &test_softirq_pending) )
+        fail("  Fail: cpu %u gave up pulling after a contended trylock\n",
+             cpu);
+    if ( cpumask_test_cpu(cpu, &rt_priv(&ops)->idlers) )
+        fail("  Fail: cpu %u idle with a unit pushed to it\n", cpu);
+
+    run();
+
+    if ( !units[4].is_running )
+        fail("  Fail: unit 4 waiting with cpu %u idle\n", cpu);
+
+    check_queues();
+}
+
+static void bench(unsigned int nr, unsigned int cluster)
+{
+    unsigned int i;
+
+    setup_cpus(opt_cluster_str[cluster]);
+    setup_domain(nr, false);
+
+    for ( i = 0; i < nr; i++ )
+        unit_wake(&units[i]);
+    run();
+
+    /* Let deadlines spread out before measuring. */
+    for ( i = 0; i < BENCH_STEPS; i++ )
+    {
+        test_now += MICROSECS(100);
+        run();
+    }
+
+    schedule_ns = saved_ns = repl_ns = 0;
+    nr_schedules = nr_switches = nr_repls = 0;
+    for ( i = 0; i < BENCH_STEPS; i++ )
+    {
+        test_now += MICROSECS(100);
+        run();
+    }
+
+    printf("%5u units, %6s clusters: rt_schedule() %"PRIu64" ns, "
+           "context_saved() %"PRIu64" ns, repl_timer_handler() %"PRIu64" ns\n",
+           nr, opt_cluster_str[cluster], schedule_ns / nr_schedules,
+           saved_ns / (nr_switches ?: 1), repl_ns / (nr_repls ?: 1));
+
+    check_queues();
+}
+
+/* The scheduler keeps global state: run each case in a fresh process. */
+static void fork_run(void (*fn)(unsigned int, unsigned int),
+                     unsigned int arg1, unsigned int arg2)
+{
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+
+    pid = fork();
+    if ( pid < 0 )
+    {
+        fail("fork failed\n");
+        return;
+    }
+
+    if ( pid == 0 )
+    {
+        fn(arg1, arg2);
+        exit(!!nr_failures);
+    }
+
+    if ( waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+         WEXITSTATUS(status) )
+        fail("  Fail: child exited with status %#x\n", status);
+}
+
+static void model(unsigned int unused, unsigned int cluster)
+{
+    test_model(cluster);
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int bench_units[] = { 64, 512, 4096 };
+    static const unsigned int clusters[] = {
+        OPT_CLUSTER_ALL, OPT_CLUSTER_SOCKET, OPT_CLUSTER_CPU,
+    };
+    unsigned int i, j;
+
+    for ( j = 0; j < ARRAY_SIZE(clusters); j++ )
+        fork_run(model, 0, clusters[j]);
+
+    fork_run(test_pull_contended, 0, OPT_CLUSTER_SOCKET);
+
+    for ( i = 0; i < ARRAY_SIZE(bench_units); i++ )
+        for ( j = 0; j < ARRAY_SIZE(clusters) - 1; j++ )
+            fork_run(bench, bench_units[i], clusters[j]);
+
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,196 @@
+/*
+ * Test harness for building the hypervisor's timer code in userspace.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_TIMER_
+#define _TEST_TIMER_
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xen-tools/common-macros.h>
+
+#define CONFIG_NR_CPUS 4
+#define NR_CPUS CONFIG_NR_CPUS
+
+#define smp_wmb()
+#define prefetch(x) __builtin_prefetch(x)
+#define ASSERT(x) assert(x)
+#define BUG() assert(0)
+#define BUG_ON(x) assert(!(x))
+#define WARN_ON(x) assert(!(x))
+#define cf_check
+#define __init
+#define __read_mostly
+#define __cacheline_aligned
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define cpu_relax()
+
+typedef int64_t s_time_t;
+#define STIME_MAX ((s_time_t)((uint64_t)~0ULL >> 1))
+
+/* Current system time, under control of the test. */
+extern s_time_t test_now;
+#define NOW() test_now
+
+/* CPU the test is pretending to run on. */
+extern unsigned int test_cpu;
+#define smp_processor_id() test_cpu
+
+#define DECLARE_PER_CPU(type, name) \
+    extern __typeof__(type) per_cpu__##name[NR_CPUS]
+#define DEFINE_PER_CPU(type, name) __typeof__(type) per_cpu__##name[NR_CPUS]
+#define per_cpu(name, cpu) (per_cpu__##name[cpu])
+#define this_cpu(name) per_cpu(name, smp_processor_id())
+
+#define read_atomic(p) (*(p))
+#define write_atomic(p, v) (*(p) = (v))
+
+/* Locks don't nest: catch any imbalance in the timer code. */
+typedef bool spinlock_t;
+#define spin_lock_init(l) (*(l) = false)
+#define _spin_lock(l) ({ assert(!*(l)); *(l) = true; })
+#define spin_lock(l) _spin_lock(l)
+#define spin_unlock(l) ({ assert(*(l)); *(l) = false; })
+#define spin_lock_irq(l) spin_lock(l)
+#define spin_unlock_irq(l) spin_unlock(l)
+#define spin_lock_irqsave(l, f) ({ (f) = 0; spin_lock(l); })
+#define spin_unlock_irqrestore(l, f) ({ (void)(f); spin_unlock(l); })
+#define local_irq_save(f) ((f) = 0)
+#define local_irq_restore(f) ((void)(f))
+#define block_lock_speculation()
+
+#define DEFINE_RCU_READ_LOCK(x) int x
+#define rcu_read_lock(x) ((void)(x))
+#define rcu_read_unlock(x) ((void)(x))
+
+/* Command line options are made visible to the test as param_<var>. */
+#define integer_param(name, var) __typeof__(var) *const param_##var = &(var)
+#define boolean_param(name, var) __typeof__(var) *const param_##var = &(var)
+#define custom_param(name, fn) int (*const param_##fn)(const char *) = (fn)
+int parse_signed_integer(const char *name, const char *s, const char *e,
+                         long long *val);
+
+#define TIMER_SOFTIRQ 0
+extern bool test_softirq_pending[NR_CPUS];
+extern void (*test_timer_softirq)(void);
+#define open_softirq(nr, fn) (test_timer_softirq = (fn))
+#define cpu_raise_softirq(cpu, nr) (test_softirq_pending[cpu] = true)
+#define raise_softirq(nr) cpu_raise_softirq(smp_processor_id(), nr)
+
+#define register_keyhandler(key, fn, desc, diag) ((void)(fn))
+
+extern bool test_cpu_online[NR_CPUS];
+#define cpu_online_map test_cpu_online
+#define cpu_online(cpu) test_cpu_online[cpu]
+#define for_each_online_cpu(cpu) \
+    for ( (cpu) = 0; (cpu) < NR_CPUS; (cpu)++ ) if ( cpu_online(cpu) )
+static inline unsigned int test_first_online(void)
+{
+    unsigned int cpu;
+
+    for_each_online_cpu ( cpu )
+        return cpu;
+
+    return NR_CPUS;
+}
+#define cpumask_any(mask) test_first_online()
+
+#define park_offline_cpus false
+#define system_state 0
+#define SYS_STATE_suspend 1
+
+struct notifier_block {
+    int (*notifier_call)(struct notifier_block *nfb, unsigned long action,
+                         void *hcpu);
+    int priority;
+};
+#define NOTIFY_DONE 0
+#define notifier_from_errno(e) (e)
+#define CPU_UP_PREPARE    1
+#define CPU_UP_CANCELED   2
+#define CPU_DEAD          3
+#define CPU_RESUME_FAILED 4
+#define CPU_REMOVE        5
+extern struct notifier_block *test_cpu_notifier;
+#define register_cpu_notifier(nb) (test_cpu_notifier = (nb))
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define BITS_TO_LONGS(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+#define __set_bit(nr, addr) \
+    ((addr)[(nr) / BITS_PER_LONG] |= 1UL << ((nr) % BITS_PER_LONG))
+#define __clear_bit(nr, addr) \
+    ((addr)[(nr) / BITS_PER_LONG] &= ~(1UL << ((nr) % BITS_PER_LONG)))
+
+static inline unsigned int fls(unsigned int x)
+{
+    return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline unsigned int fls64(uint64_t x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline unsigned long find_next_bit(const unsigned long *addr,
+                                          unsigned long size,
+                                          unsigned long offset)
+{
+    while ( offset < size )
+    {
+        unsigned long word = addr[offset / BITS_PER_LONG] >>
+                             (offset % BITS_PER_LONG);
+
+        if ( word )
+            return min(offset + __builtin_ctzl(word), size);
+
+        offset = (offset | (BITS_PER_LONG - 1)) + 1;
+    }
+
+    return size;
+}
+#define find_first_bit(addr, size) find_next_bit(addr, size, 0)
+
+#define xzalloc(type) ((type *)calloc(1, sizeof(type)))
+#define xmalloc_array(type, nr) ((type *)malloc(sizeof(type) * (nr)))
+#define xfree(p) free(p)
+#define XFREE(p) do { free(p); (p) = NULL; } while ( 0 )
+
+#define XENLOG_WARNING
+#define printk printf
+#define printk_once printf
+
+#include "list.h"
+#include "timer.h"
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,445 @@
+/*
+ * Unit tests and benchmark for the timer code, with the timer heap and with
+ * the timer wheel.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "emul.h"
+
+#define MODEL_TIMERS 2000
+#define MODEL_OPS    200000
+
+#define BENCH_TIMERS 10000
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+s_time_t test_now;
+unsigned int test_cpu;
+bool test_softirq_pending[NR_CPUS];
+void (*test_timer_softirq)(void);
+bool test_cpu_online[NR_CPUS];
+struct notifier_block *test_cpu_notifier;
+
+extern bool *const param_opt_timer_wheel;
+extern unsigned int *const param_timer_slop;
+extern int (*const param_parse_timer_coalesce)(const char *s);
+
+/* Coalescing windows in the modes testing coalescing, in us. */
+static const unsigned int coalesce_us[TIMER_COALESCE_nr] = {
+    [TIMER_COALESCE_tick]  = 1000,
+    [TIMER_COALESCE_vpt]   = 100,
+    [TIMER_COALESCE_sched] = 20,
+};
+static unsigned int window[TIMER_COALESCE_nr];
+
+int parse_signed_integer(const char *name, const char *s, const char *e,
+                         long long *val)
+{
+    size_t nlen = strlen(name);
+    char *end;
+
+    if ( e - s <= nlen || strncmp(s, name, nlen) || s[nlen] != '=' )
+        return -1;
+
+    *val = strtoll(&s[nlen + 1], &end, 10);
+
+    return end == e ? 0 : -2;
+}
+
+/* Deadline programmed into each CPU's timer hardware, 0 if none. */
+static s_time_t hw_deadline[NR_CPUS];
+static unsigned long nr_interrupts;
+
+int reprogram_timer(s_time_t timeout)
+{
+    hw_deadline[test_cpu] = timeout;
+
+    return 1;
+}
+
+/*
+ * Move time forward to @now, delivering timer interrupts and running timer
+ * softirqs as they come due.
+ */
+static void advance(s_time_t now)
+{
+    unsigned int cpu;
+    bool again;
+
+    test_now = now;
+
+    do {
+        again = false;
+
+        for_each_online_cpu ( cpu )
+        {
+            if ( hw_deadline[cpu] && hw_deadline[cpu] <= now )
+            {
+                hw_deadline[cpu] = 0;
+                test_softirq_pending[cpu] = true;
+                nr_interrupts++;
+            }
+
+            if ( !test_softirq_pending[cpu] )
+                continue;
+
+            test_softirq_pending[cpu] = false;
+            test_cpu = cpu;
+            test_timer_softirq();
+            test_cpu = 0;
+            again = true;
+        }
+    } while ( again );
+}
+
+struct test_timer {
+    struct timer timer;
+    s_time_t expires;
+    unsigned int cpu;
+    bool armed;
+};
+
+static unsigned long nr_fired;
+
+static void cf_check timer_fn(void *data)
+{
+    struct test_timer *t = data;
+
+    nr_fired++;
+
+    if ( !t->armed )
+        fail("timer %p fired while not set\n", t);
+    else if ( t->expires >= test_now )
+        fail("timer %p expiring at %"PRId64" fired early at %"PRId64"\n",
+             t, t->expires, test_now);
+
+    if ( t->cpu != test_cpu )
+        fail("timer %p fired on CPU%u instead of CPU%u\n",
+             t, test_cpu, t->cpu);
+
+    t->armed = false;
+}
+
+static void set(struct test_timer *t, s_time_t expires)
+{
+    t->expires = expires;
+    t->armed = true;
+    set_timer(&t->timer, expires);
+}
+
+static void stop(struct test_timer *t)
+{
+    t->armed = false;
+    stop_timer(&t->timer);
+}
+
+static uint64_t rand64(void)
+{
+    return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ rand();
+}
+
+/* Mostly short timeouts, some long ones, and a few in the past. */
+static s_time_t random_expiry(void)
+{
+    switch ( rand() % 8 )
+    {
+    case 0:
+        return test_now - rand() % 100000;
+    case 1: case 2: case 3:
+        return test_now + rand() % 200000;
+    case 4: case 5:
+        return test_now + rand64() % 20000000;
+    case 6:
+        return test_now + rand64() % 20000000000ULL;
+    default:
+        /* Beyond what all levels of the timer wheel cover. */
+        return test_now + rand64() % (1ULL << 53);
+    }
+}
+
+static unsigned int random_online_cpu(void)
+{
+    unsigned int cpu;
+
+    do {
+        cpu = rand() % NR_CPUS;
+    } while ( !cpu_online(cpu) );
+
+    return cpu;
+}
+
+static void cpu_down(struct test_timer *tt, unsigned int nr, unsigned int cpu)
+{
+    unsigned int i;
+
+    test_cpu_online[cpu] = false;
+    test_cpu_notifier->notifier_call(test_cpu_notifier, CPU_DEAD,
+                                     (void *)(unsigned long)cpu);
+    hw_deadline[cpu] = 0;
+    test_softirq_pending[cpu] = false;
+
+    for ( i = 0; i < nr; i++ )
+        if ( tt[i].cpu == cpu )
+            tt[i].cpu = test_first_online();
+}
+
+static void cpu_up(unsigned int cpu)
+{
+    test_cpu_notifier->notifier_call(test_cpu_notifier, CPU_UP_PREPARE,
+                                     (void *)(unsigned long)cpu);
+    test_cpu_online[cpu] = true;
+}
+
+/*
+ * Timers must have fired once their expiry time, plus the coalescing window
+ * and the slop, has passed.
+ */
+static void check_late(const struct test_timer *tt, unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+        if ( tt[i].armed &&
+             tt[i].expires + window[tt[i].timer.coalesce] +
+             *param_timer_slop <= test_now )
+            fail("timer %u expiring at %"PRId64" still pending at %"PRId64"\n",
+                 i, tt[i].expires, test_now);
+}
+
+static void test_random(void)
+{
+    static struct test_timer tt[MODEL_TIMERS];
+    unsigned int i;
+    s_time_t end;
+
+    for ( i = 0; i < MODEL_TIMERS; i++ )
+    {
+        tt[i].cpu = i % NR_CPUS;
+        init_timer(&tt[i].timer, timer_fn, &tt[i], tt[i].cpu);
+        timer_set_coalesce(&tt[i].timer, i % TIMER_COALESCE_nr);
+    }
+
+    for ( i = 0; i < MODEL_OPS; i++ )
+    {
+        struct test_timer *t = &tt[rand() % MODEL_TIMERS];
+
+        switch ( rand() % 8 )
+        {
+        case 0: case 1: case 2: case 3: case 4:
+            set(t, random_expiry());
+            break;
+        case 5:
+            stop(t);
+            break;
+        case 6:
+            t->cpu = random_online_cpu();
+            migrate_timer(&t->timer, t->cpu);
+            break;
+        default:
+            if ( timer_is_active(&t->timer) != t->armed )
+                fail("timer %zu active %d, expected %d\n", t - tt,
+                     timer_is_active(&t->timer), t->armed);
+            break;
+        }
+
+        if ( i == MODEL_OPS / 2 )
+            cpu_down(tt, MODEL_TIMERS, NR_CPUS - 1);
+        if ( i == MODEL_OPS * 3 / 4 )
+            cpu_up(NR_CPUS - 1);
+
+        advance(test_now + rand() % 20000);
+        check_late(tt, MODEL_TIMERS);
+    }
+
+    /* Let all remaining timers expire, a day at a time. */
+    end = test_now + (1LL << 53) + 1000000000 + *param_timer_slop;
+    while ( test_now < end )
+    {
+        advance(min_t(s_time_t, test_now + 86400000000000LL, end));
+        check_late(tt, MODEL_TIMERS);
+    }
+
+    for ( i = 0; i < MODEL_TIMERS; i++ )
+        if ( timer_is_active(&tt[i].timer) )
+            fail("timer %u still active\n", i);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Set, stop and expire BENCH_TIMERS timers on a single CPU. */
+static void bench(const char *name)
+{
+    struct test_timer *bt = calloc(BENCH_TIMERS, sizeof(*bt));
+    s_time_t *when = malloc(BENCH_TIMERS * sizeof(*when));
+    uint64_t start, set_ns, stop_ns, expire_ns;
+    unsigned long fired, interrupts;
+    unsigned int i;
+
+    if ( !bt || !when )
+    {
+        fail("out of memory\n");
+        goto out;
+    }
+
+    for ( i = 0; i < BENCH_TIMERS; i++ )
+    {
+        init_timer(&bt[i].timer, timer_fn, &bt[i], 0);
+        timer_set_coalesce(&bt[i].timer, TIMER_COALESCE_tick);
+        when[i] = 1000000 + rand() % 100000000;
+    }
+
+    /* Let the timer heap grow to size before measuring. */
+    for ( i = 0; i < BENCH_TIMERS; i++ )
+        set(&bt[i], test_now + when[i]);
+    advance(test_now);
+    for ( i = 0; i < BENCH_TIMERS; i++ )
+        stop(&bt[i]);
+
+    start = now_ns();
+    for ( i = 0; i < BENCH_TIMERS; i++ )
+        set(&bt[i], test_now + when[i]);
+    set_ns = now_ns() - start;
+
+    advance(test_now);
+
+    start = now_ns();
+    for ( i = 0; i < BENCH_TIMERS; i++ )
+        stop(&bt[i]);
+    stop_ns = now_ns() - start;
+
+    for ( i = 0; i < BENCH_TIMERS; i++ )
+        set(&bt[i], test_now + when[i]);
+
+    fired = nr_fired;
+    interrupts = nr_interrupts;
+    start = now_ns();
+    for ( i = 0; nr_fired - fired < BENCH_TIMERS && i < 1000000; i++ )
+        advance(test_now + *param_timer_slop);
+    expire_ns = now_ns() - start;
+
+    if ( nr_fired - fired != BENCH_TIMERS )
+        fail("%lu of %u timers fired\n", nr_fired - fired, BENCH_TIMERS);
+
+    printf("%-14s %u timers: set %"PRIu64" ns, stop %"PRIu64" ns, "
+           "expire %"PRIu64" ns, %lu interrupts\n", name, BENCH_TIMERS,
+           set_ns / BENCH_TIMERS, stop_ns / BENCH_TIMERS,
+           expire_ns / BENCH_TIMERS, nr_interrupts - interrupts);
+
+    for ( i = 0; i < BENCH_TIMERS; i++ )
+        kill_timer(&bt[i].timer);
+
+ out:
+    free(when);
+    free(bt);
+}
+
+static int run(const char *name, bool wheel, bool coalesce)
+{
+    unsigned int cpu, i;
+    char opt[64];
+
+    *param_opt_timer_wheel = wheel;
+
+    if ( coalesce )
+    {
+        snprintf(opt, sizeof(opt), "tick=%u,vpt=%u,sched=%u",
+                 coalesce_us[TIMER_COALESCE_tick],
+                 coalesce_us[TIMER_COALESCE_vpt],
+                 coalesce_us[TIMER_COALESCE_sched]);
+        if ( param_parse_timer_coalesce(opt) )
+            fail("%s: parsing \"%s\" failed\n", name, opt);
+
+        for ( i = 0; i < TIMER_COALESCE_nr; i++ )
+            window[i] = coalesce_us[i] * 1000;
+    }
+
+    test_now = 1000000000;
+
+    test_cpu_online[0] = true;
+    timer_init();
+    for ( cpu = 1; cpu < NR_CPUS; cpu++ )
+        cpu_up(cpu);
+
+    test_random();
+    bench(name);
+
+    return !!nr_failures;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        bool wheel, coalesce;
+    } modes[] = {
+        { "heap", false, false },
+        { "wheel", true, false },
+        { "heap+coalesce", false, true },
+        { "wheel+coalesce", true, true },
+    };
+    unsigned int i;
+    int status;
+    pid_t pid;
+
+    /* The timer code keeps global state: test each mode in a fresh process. */
+    for ( i = 0; i < ARRAY_SIZE(modes); i++ )
+    {
+        fflush(stdout);
+
+        pid = fork();
+        if ( pid < 0 )
+        {
+            fail("fork failed\n");
+            break;
+        }
+
+        if ( pid == 0 )
+        {
+            nr_failures = 0;
+            exit(run(modes[i].name, modes[i].wheel, modes[i].coalesce));
+        }
+
+        if ( waitpid(pid, &status, 0) != pid ||
+             !WIFEXITED(status) || WEXITSTATUS(status) )
+            fail("%s: failed (status %#x)\n", modes[i].name, status);
+    }
+
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -20,9 +20,11 @@
  */
 
 #define _GNU_SOURCE
+#include <dirent.h>
 #include <err.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,6 +39,8 @@
 #define WRITE_BUFFERS_N    10
 #define WRITE_BUFFERS_SIZE 4000
 #define MAX_TA_LOOPS       100
+#define WATCH_WRITES       1000
+#define CLIENT_READS       100
 
 struct test {
     char *name;
@@ -53,6 +57,29 @@ static char *paths[WRITE_BUFFERS_N];
 static char write_buffers[WRITE_BUFFERS_N][WRITE_BUFFERS_SIZE];
 static int ta_loops;
 
+struct watch_bench {
+    unsigned int conns;
+    unsigned int watches;
+};
+
+static const struct watch_bench watch_benches[] = {
+    { 10, 100 },
+    { 100, 1000 },
+    { 500, 10000 },
+};
+static struct xs_handle **watch_xsh;
+static uint64_t watch_nsec;
+
+struct client {
+    struct xs_handle *xsh;
+    pthread_t thread;
+    int ret;
+    uint64_t *nsec;
+};
+
+static struct client *clients;
+static uint64_t clients_nsec, clients_cpu_nsec;
+
 static struct option options[] = {
     { "list-tests", 0, NULL, 'l' },
     { "test", 1, NULL, 't' },
@@ -405,6 +432,253 @@ static int test_ta3_deinit(uintptr_t par)
     return verify_node(paths[0], "b", 1);
 }
 
+static int test_watch_init(uintptr_t par)
+{
+    const struct watch_bench *wb = watch_benches + par;
+    char *wpath;
+    unsigned int i;
+
+    watch_xsh = calloc(wb->conns, sizeof(*watch_xsh));
+    if ( !watch_xsh )
+        return ENOMEM;
+
+    for ( i = 0; i < wb->conns; i++ )
+    {
+        watch_xsh[i] = xs_open(0);
+        if ( !watch_xsh[i] )
+            return errno;
+    }
+
+    /* Each connection mimics a backend domain watching its own devices. */
+    for ( i = 0; i < wb->watches; i++ )
+    {
+        if ( asprintf(&wpath, "%s/dom%u/dev%u", path, i % wb->conns, i) < 0 )
+            return ENOMEM;
+        if ( !xs_watch(watch_xsh[i % wb->conns], wpath, "bench") )
+        {
+            free(wpath);
+            return errno;
+        }
+        free(wpath);
+    }
+
+    return 0;
+}
+
+static int test_watch(uintptr_t par)
+{
+    struct timespec tp1, tp2;
+    unsigned int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+
+    for ( i = 0; i < WATCH_WRITES; i++ )
+        if ( !xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) )
+            return errno;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp2);
+    watch_nsec = tp2.tv_sec * 1000000000 + tp2.tv_nsec -
+                 tp1.tv_sec * 1000000000 - tp1.tv_nsec;
+
+    return 0;
+}
+
+static int test_watch_deinit(uintptr_t par)
+{
+    const struct watch_bench *wb = watch_benches + par;
+    unsigned int i;
+
+    for ( i = 0; i < wb->conns; i++ )
+        if ( watch_xsh[i] )
+            xs_close(watch_xsh[i]);
+    free(watch_xsh);
+    watch_xsh = NULL;
+
+    if ( watch_nsec )
+        printf("%-10s: %u domains, %u watches: %"PRIu64" writes/s\n",
+               "watch", wb->conns, wb->watches,
+               (uint64_t)WATCH_WRITES * 1000000000 / watch_nsec);
+
+    return 0;
+}
+
+static uint64_t now_nsec(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/*
+ * CPU time used by a local xenstored process, found via /proc.  Returns 0 if
+ * there is none, e.g. with xenstored running in a stub domain.
+ */
+static uint64_t xenstored_cpu_nsec(void)
+{
+    DIR *dir;
+    struct dirent *de;
+    char *fname, buf[512], *p;
+    unsigned long utime, stime;
+    uint64_t ret = 0;
+    FILE *f;
+
+    dir = opendir("/proc");
+    if ( !dir )
+        return 0;
+
+    while ( !ret && (de = readdir(dir)) )
+    {
+        if ( de->d_name[0] < '1' || de->d_name[0] > '9' )
+            continue;
+
+        if ( asprintf(&fname, "/proc/%s/stat", de->d_name) < 0 )
+            break;
+        f = fopen(fname, "r");
+        free(fname);
+        if ( !f )
+            continue;
+        p = fgets(buf, sizeof(buf), f);
+        fclose(f);
+
+        if ( !p || !strstr(p, "(xenstored)") )
+            continue;
+
+        /* utime and stime are the 12th and 13th fields after the name. */
+        p = strrchr(buf, ')');
+        if ( sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+                    " %lu %lu", &utime, &stime) == 2 )
+            ret = (uint64_t)(utime + stime) * 1000000000 /
+                  sysconf(_SC_CLK_TCK);
+    }
+
+    closedir(dir);
+
+    return ret;
+}
+
+static int test_clients_init(uintptr_t par)
+{
+    unsigned int i;
+
+    if ( !xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) )
+        return errno;
+
+    clients = calloc(par, sizeof(*clients));
+    if ( !clients )
+        return ENOMEM;
+
+    for ( i = 0; i < par; i++ )
+    {
+        clients[i].nsec = calloc(CLIENT_READS, sizeof(*clients[i].nsec));
+        if ( !clients[i].nsec )
+            return ENOMEM;
+        clients[i].xsh = xs_open(0);
+        if ( !clients[i].xsh )
+            return errno;
+    }
+
+    return 0;
+}
+
+static void *client_thread(void *arg)
+{
+    struct client *c = arg;
+    unsigned int i, len;
+    uint64_t start;
+    void *data;
+
+    for ( i = 0; i < CLIENT_READS; i++ )
+    {
+        start = now_nsec();
+        data = xs_read(c->xsh, XBT_NULL, paths[0], &len);
+        c->nsec[i] = now_nsec() - start;
+        if ( !data )
+        {
+            c->ret = errno;
+            break;
+        }
+        free(data);
+    }
+
+    return NULL;
+}
+
+static int test_clients(uintptr_t par)
+{
+    uint64_t start, cpu;
+    unsigned int i, started;
+    int ret = 0;
+
+    cpu = xenstored_cpu_nsec();
+    start = now_nsec();
+
+    for ( started = 0; started < par; started++ )
+    {
+        ret = pthread_create(&clients[started].thread, NULL, client_thread,
+                             clients + started);
+        if ( ret )
+            break;
+    }
+
+    for ( i = 0; i < started; i++ )
+    {
+        pthread_join(clients[i].thread, NULL);
+        if ( !ret )
+            ret = clients[i].ret;
+    }
+
+    clients_nsec = now_nsec() - start;
+    clients_cpu_nsec = cpu ? xenstored_cpu_nsec() - cpu : 0;
+
+    return ret;
+}
+
+static int cmp_nsec(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int test_clients_deinit(uintptr_t par)
+{
+    uint64_t *nsec;
+    unsigned int i, n = par * CLIENT_READS;
+
+    nsec = malloc(n * sizeof(*nsec));
+
+    for ( i = 0; i < par; i++ )
+    {
+        if ( nsec )
+            memcpy(nsec + i * CLIENT_READS, clients[i].nsec,
+                   CLIENT_READS * sizeof(*nsec));
+        if ( clients[i].xsh )
+            xs_close(clients[i].xsh);
+        free(clients[i].nsec);
+    }
+    free(clients);
+    clients = NULL;
+
+    if ( !nsec )
+        return ENOMEM;
+
+    qsort(nsec, n, sizeof(*nsec), cmp_nsec);
+
+    printf("%-10s: %u clients: p50 %"PRIu64" ns, p99 %"PRIu64" ns, "
+           "max %"PRIu64" ns", "clients", (unsigned int)par,
+           nsec[n / 2], nsec[n - n / 100 - 1], nsec[n - 1]);
+    if ( clients_cpu_nsec )
+        printf(", xenstored cpu %"PRIu64"%%",
+               clients_cpu_nsec * 100 / clients_nsec);
+    printf("\n");
+
+    free(nsec);
+
+    return 0;
+}
+
 #define TEST(s, f, p, l) { s, f ## _init, f, f ## _deinit, (uintptr_t)(p), l }
 struct test tests[] = {
 TEST("read 1", test_read, 1, "Read node with 1 byte data"),
@@ -419,6 +693,10 @@ TEST("ta empty x", test_ta1, 1, "Empty transaction abort"),
 TEST("ta rmw", test_ta2, 0, "Read-modify-write transaction"),
 TEST("ta rmw x", test_ta2, 1, "Read-modify-write transaction abort"),
 TEST("ta err", test_ta3, 0, "Transaction with conflict"),
+TEST("watch 10", test_watch, 0, "Writes with 100 watches of 10 domains"),
+TEST("watch 100", test_watch, 1, "Writes with 1000 watches of 100 domains"),
+TEST("watch 500", test_watch, 2, "Writes with 10000 watches of 500 domains"),
+TEST("clients 200", test_clients, 200, "Reads of 200 concurrent clients"),
 };
 
 static void cleanup(void)
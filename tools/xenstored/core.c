@@ -524,7 +524,7 @@ static void initialize_fds(int *ptimeout)
 			short events = POLLIN|POLLPRI;
 			if (!list_empty(&conn->out_list))
 				events |= POLLOUT;
-			conn->pollfd_idx = set_fd(conn->fd, events);
+			set_conn_fd(conn, events);
 			/*
 			 * For stalled connection, we want to process the
 			 * pending command as soon as live-update has aborted.
@@ -2219,11 +2219,49 @@ bad_client:
 	ignore_connection(conn, err);
 }
 
+/*
+ * A domain's ring can't hold more requests than this.  Processing them all in
+ * one go allows to send the replies with a single notification.
+ */
+#define MAX_REQUESTS_PER_PASS (XENSTORE_RING_SIZE / sizeof(struct xsd_sockmsg))
+
+/*
+ * Handle all complete requests queued by a domain.  Sockets are read only
+ * once, as further reads might block.
+ *
+ * The caller must hold a reference to conn.  Returns false if the connection
+ * has been freed, together with the reference.
+ */
+static bool handle_input_batch(struct connection *conn)
+{
+	unsigned int n = 0;
+	bool more;
+
+	do {
+		more = conn_can_read(conn);
+		if (more)
+			handle_input(conn);
+		if (talloc_free(conn) == 0)
+			return false;
+
+		talloc_increase_ref_count(conn);
+	} while (more && conn->domain && !conn->in &&
+		 ++n < MAX_REQUESTS_PER_PASS);
+
+	return true;
+}
+
 static void handle_output(struct connection *conn)
 {
-	/* Ignore the connection if an error occured */
-	if (!write_messages(conn))
-		ignore_connection(conn, XENSTORE_ERROR_RINGIDX);
+	/* Write as many messages to a domain's ring as fit. */
+	do {
+		/* Ignore the connection if an error occured */
+		if (!write_messages(conn)) {
+			ignore_connection(conn, XENSTORE_ERROR_RINGIDX);
+			return;
+		}
+	} while (conn->domain && !list_empty(&conn->out_list) &&
+		 conn_can_write(conn));
 }
 
 struct connection *new_connection(const struct interface_funcs *funcs)
@@ -2286,7 +2324,7 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
-static unsigned int hash_from_key_fn(const void *k)
+unsigned int hash_from_key_fn(const void *k)
 {
 	const char *str = k;
 	unsigned int hash = 5381;
@@ -2298,7 +2336,7 @@ static unsigned int hash_from_key_fn(const void *k)
 	return hash;
 }
 
-static int keys_equal_fn(const void *key1, const void *key2)
+int keys_equal_fn(const void *key1, const void *key2)
 {
 	return 0 == strcmp(key1, key2);
 }
@@ -2755,6 +2793,8 @@ int main(int argc, char *argv[])
 
 	domain_early_init();
 
+	watch_init();
+
 	/* Listen to hypervisor. */
 	if (!live_update) {
 		domain_init(-1);
@@ -2827,19 +2867,18 @@ int main(int argc, char *argv[])
 			if (&next->list != &connections)
 				talloc_increase_ref_count(next);
 
-			if (conn_can_read(conn))
-				handle_input(conn);
-			if (talloc_free(conn) == 0)
+			if (!handle_input_batch(conn))
 				continue;
 
-			talloc_increase_ref_count(conn);
-
 			if (conn_can_write(conn))
 				handle_output(conn);
+			if (conn->funcs->flush)
+				conn->funcs->flush(conn);
 			if (talloc_free(conn) == 0)
 				continue;
 
 			conn->pollfd_idx = -1;
+			conn->revents = 0;
 		}
 
 		if (delayed_requests) {
@@ -110,6 +110,8 @@ struct interface_funcs {
 	int (*read)(struct connection *, void *, unsigned int);
 	bool (*can_write)(struct connection *);
 	bool (*can_read)(struct connection *);
+	/* Optional: make data written or consumed visible to the peer. */
+	void (*flush)(struct connection *);
 };
 
 struct connection
@@ -120,6 +122,9 @@ struct connection
 	int fd;
 	/* The index of pollfd in global pollfd array */
 	int pollfd_idx;
+	/* Socket events waited for and reported, if not in the pollfd array. */
+	short events;
+	short revents;
 
 	/* Who am I? Domid of connection. */
 	unsigned int id;
@@ -395,6 +400,7 @@ void early_init(bool live_update, bool dofork, const char *pidfile);
 void late_init(bool live_update);
 
 int set_fd(int fd, short events);
+void set_conn_fd(struct connection *conn, short events);
 void set_special_fds(void);
 void handle_special_fds(void);
 
@@ -415,6 +421,10 @@ extern xengnttab_handle **xgt_handle;
 
 int remember_string(struct hashtable *hash, const char *str);
 
+/* Hash and compare functions for hashtables keyed by strings. */
+unsigned int hash_from_key_fn(const void *k);
+int keys_equal_fn(const void *key1, const void *key2);
+
 /* Data base access functions. */
 const struct node_hdr *db_fetch(const char *db_name, size_t *size);
 int db_write(struct connection *conn, const char *db_name, void *data,
@@ -122,6 +122,13 @@ struct domain
 	/* The connection associated with this. */
 	struct connection *conn;
 
+	/* Responses written to the ring, but not yet made visible. */
+	bool rsp_pending;
+	XENSTORE_RING_IDX rsp_prod;
+
+	/* Ring indexes have changed, the domain needs to be notified. */
+	bool notify;
+
 	/* Generation count at domain introduction time. */
 	uint64_t generation;
 
@@ -411,12 +418,13 @@ static int writechn(struct connection *conn,
 {
 	uint32_t avail;
 	void *dest;
-	struct xenstore_domain_interface *intf = conn->domain->interface;
+	struct domain *domain = conn->domain;
+	struct xenstore_domain_interface *intf = domain->interface;
 	XENSTORE_RING_IDX cons, prod;
 
 	/* Must read indexes once, and before anything else, and verified. */
 	cons = intf->rsp_cons;
-	prod = intf->rsp_prod;
+	prod = domain->rsp_pending ? domain->rsp_prod : intf->rsp_prod;
 	xen_mb();
 
 	if (!check_indexes(cons, prod)) {
@@ -428,11 +436,10 @@ static int writechn(struct connection *conn,
 	if (avail < len)
 		len = avail;
 
+	/* The producer index is updated by domain_flush(). */
 	memcpy(dest, data, len);
-	xen_mb();
-	intf->rsp_prod += len;
-
-	xenevtchn_notify(xce_handle, conn->domain->port);
+	domain->rsp_prod = prod + len;
+	domain->rsp_pending = true;
 
 	return len;
 }
@@ -462,16 +469,41 @@ static int readchn(struct connection *conn, void *data, unsigned int len)
 	xen_mb();
 	intf->req_cons += len;
 
-	xenevtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
 
+/*
+ * Publish the responses written since the last call and notify the domain
+ * once for all ring updates, instead of once per read or write.
+ */
+static void domain_flush(struct connection *conn)
+{
+	struct domain *domain = conn->domain;
+
+	if (domain->rsp_pending) {
+		xen_mb();
+		domain->interface->rsp_prod = domain->rsp_prod;
+		domain->rsp_pending = false;
+		domain->notify = true;
+	}
+
+	if (domain->notify) {
+		xenevtchn_notify(xce_handle, domain->port);
+		domain->notify = false;
+	}
+}
+
 static bool domain_can_write(struct connection *conn)
 {
-	struct xenstore_domain_interface *intf = conn->domain->interface;
+	struct domain *domain = conn->domain;
+	struct xenstore_domain_interface *intf = domain->interface;
+	XENSTORE_RING_IDX prod;
 
-	return ((intf->rsp_prod - intf->rsp_cons) != XENSTORE_RING_SIZE);
+	prod = domain->rsp_pending ? domain->rsp_prod : intf->rsp_prod;
+
+	return ((prod - intf->rsp_cons) != XENSTORE_RING_SIZE);
 }
 
 static bool domain_can_read(struct connection *conn)
@@ -497,6 +529,7 @@ static const struct interface_funcs domain_funcs = {
 	.read = readchn,
 	.can_write = domain_can_write,
 	.can_read = domain_can_read,
+	.flush = domain_flush,
 };
 
 static void *map_interface(domid_t domid)
@@ -624,15 +657,88 @@ static bool get_domain_info(unsigned int domid, xc_domaininfo_t *dominfo)
 	return xc_domain_getinfo_single(*xc_handle, domid, dominfo) == 0;
 }
 
+/*
+ * Snapshot of the state of all domains, taken by check_domains() with as few
+ * hypercalls as possible. Domains are reported by the hypervisor in ascending
+ * domid order, so the snapshot can be searched via bisection.
+ */
+#define DOMINFO_BATCH 256
+
+struct dominfo_snapshot {
+	xc_domaininfo_t *info;
+	unsigned int nr;
+};
+
+static int get_all_domain_info(const void *ctx, struct dominfo_snapshot *snap)
+{
+	unsigned int first = 0, size = 0;
+	int ret;
+
+	snap->info = NULL;
+	snap->nr = 0;
+
+	do {
+		if (snap->nr + DOMINFO_BATCH > size) {
+			size += DOMINFO_BATCH;
+			snap->info = talloc_realloc(ctx, snap->info,
+						    xc_domaininfo_t, size);
+			if (!snap->info)
+				return ENOMEM;
+		}
+
+		ret = xc_domain_getinfolist(*xc_handle, first, DOMINFO_BATCH,
+					    snap->info + snap->nr);
+		if (ret < 0)
+			return errno;
+
+		snap->nr += ret;
+		if (snap->nr)
+			first = snap->info[snap->nr - 1].domain + 1;
+	} while (ret == DOMINFO_BATCH && first < DOMID_FIRST_RESERVED);
+
+	return 0;
+}
+
+static bool get_domain_info_snap(const struct dominfo_snapshot *snap,
+				 unsigned int domid, xc_domaininfo_t *dominfo)
+{
+	unsigned int lo = 0, hi, mid;
+
+	/* No snapshot available, ask the hypervisor. */
+	if (!snap->info)
+		return get_domain_info(domid, dominfo);
+
+	hi = snap->nr;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (snap->info[mid].domain == domid) {
+			*dominfo = snap->info[mid];
+			return true;
+		}
+		if (snap->info[mid].domain < domid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return false;
+}
+
+struct check_domain_data {
+	struct dominfo_snapshot snap;
+	bool notify;
+};
+
 static int check_domain(const void *k, void *v, void *arg)
 {
 	xc_domaininfo_t dominfo;
 	struct connection *conn;
 	bool dom_valid;
 	struct domain *domain = v;
-	bool *notify = arg;
+	struct check_domain_data *data = arg;
+	bool *notify = &data->notify;
 
-	dom_valid = get_domain_info(domain->domid, &dominfo);
+	dom_valid = get_domain_info_snap(&data->snap, domain->domid, &dominfo);
 	if (!domain->introduced) {
 		if (!dom_valid)
 			talloc_free(domain);
@@ -663,12 +769,26 @@ static int check_domain(const void *k, void *v, void *arg)
 
 void check_domains(void)
 {
-	bool notify = false;
+	struct check_domain_data data = { .notify = false };
+	void *ctx = talloc_new(NULL);
 
-	while (hashtable_iterate(domhash, check_domain, &notify))
+	/*
+	 * Fetch the state of all domains in batches instead of issuing one
+	 * hypercall per known domain. This is not possible in case xenstored
+	 * is lacking the privilege to do so (e.g. when running in a stubdom),
+	 * so fall back to querying each domain individually then.
+	 */
+	if (!ctx || get_all_domain_info(ctx, &data.snap)) {
+		talloc_free(data.snap.info);
+		data.snap.info = NULL;
+	}
+
+	while (hashtable_iterate(domhash, check_domain, &data))
 		;
 
-	if (notify)
+	talloc_free(ctx);
+
+	if (data.notify)
 		fire_special_watches("@releaseDomain");
 }
 
@@ -932,6 +1052,7 @@ static void domain_conn_reset(struct domain *domain)
 
 	domain->interface->req_cons = domain->interface->req_prod = 0;
 	domain->interface->rsp_cons = domain->interface->rsp_prod = 0;
+	domain->rsp_pending = false;
 	xen_wmb();
 }
 
@@ -68,6 +68,10 @@ void late_init(bool live_update)
 {
 }
 
+void set_conn_fd(struct connection *conn, short events)
+{
+}
+
 void set_special_fds(void)
 {
 }
@@ -26,6 +26,10 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
 #if defined(HAVE_SYSTEMD)
 #include <xen-sd-notify.h>
 #endif
@@ -42,6 +46,18 @@ static int reopen_log_pipe[2];
 static int sock_pollfd_idx = -1;
 static int sock = -1;
 
+#ifdef USE_EPOLL
+/*
+ * Socket connections are registered with an epoll instance when created,
+ * instead of being added to the pollfd array on every loop iteration.  Only
+ * the epoll file descriptor itself is polled.
+ */
+#define EPOLL_MAX_EVENTS 64
+
+static int epoll_fd = -1;
+static int epoll_pollfd_idx = -1;
+#endif
+
 static void write_pidfile(const char *pidfile)
 {
 	char buf[100];
@@ -226,15 +242,23 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 
 static bool socket_can_process(struct connection *conn, int mask)
 {
+	short revents;
+
+#ifdef USE_EPOLL
+	revents = conn->revents;
+#else
 	if (conn->pollfd_idx == -1)
 		return false;
 
-	if (poll_fds[conn->pollfd_idx].revents & ~(POLLIN | POLLOUT)) {
+	revents = poll_fds[conn->pollfd_idx].revents;
+#endif
+
+	if (revents & ~(POLLIN | POLLOUT)) {
 		talloc_free(conn);
 		return false;
 	}
 
-	return (poll_fds[conn->pollfd_idx].revents & mask);
+	return (revents & mask);
 }
 
 static bool socket_can_write(struct connection *conn)
@@ -254,6 +278,37 @@ static const struct interface_funcs socket_funcs = {
 	.can_read = socket_can_read,
 };
 
+static struct connection *new_socket_connection(int fd)
+{
+	struct connection *conn;
+
+	conn = new_connection(&socket_funcs);
+	if (!conn)
+		return NULL;
+
+	conn->fd = fd;
+
+#ifdef USE_EPOLL
+	{
+		struct epoll_event ev = {
+			.events = POLLIN | POLLPRI,
+			.data.ptr = conn,
+		};
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+			syslog(LOG_ERR, "epoll_ctl failed, ignoring fd %d\n", fd);
+			/* Don't let destroy_conn() close the fd. */
+			conn->fd = -1;
+			talloc_free(conn);
+			return NULL;
+		}
+		conn->events = ev.events;
+	}
+#endif
+
+	return conn;
+}
+
 static void accept_connection(int sock)
 {
 	int fd;
@@ -263,11 +318,10 @@ static void accept_connection(int sock)
 	if (fd < 0)
 		return;
 
-	conn = new_connection(&socket_funcs);
-	if (conn) {
-		conn->fd = fd;
+	conn = new_socket_connection(fd);
+	if (conn)
 		conn->id = dom0_domid;
-	} else
+	else
 		close(fd);
 }
 
@@ -314,10 +368,9 @@ struct connection *add_socket_connection(int fd)
 {
 	struct connection *conn;
 
-	conn = new_connection(&socket_funcs);
+	conn = new_socket_connection(fd);
 	if (!conn)
 		barf("error restoring connection");
-	conn->fd = fd;
 
 	return conn;
 }
@@ -348,6 +401,33 @@ void early_init(bool live_update, bool dofork, const char *pidfile)
 		init_sockets();
 
 	init_pipe();
+
+#ifdef USE_EPOLL
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		barf_perror("Could not create epoll instance");
+#endif
+}
+
+void set_conn_fd(struct connection *conn, short events)
+{
+#ifdef USE_EPOLL
+	/* The poll and epoll event bits are the same on Linux. */
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = conn,
+	};
+
+	if (events == conn->events)
+		return;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev))
+		syslog(LOG_ERR, "epoll_ctl failed for fd %d\n", conn->fd);
+	else
+		conn->events = events;
+#else
+	conn->pollfd_idx = set_fd(conn->fd, events);
+#endif
 }
 
 void set_special_fds(void)
@@ -358,10 +438,50 @@ void set_special_fds(void)
 
 	if (sock != -1)
 		sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
+
+#ifdef USE_EPOLL
+	epoll_pollfd_idx = set_fd(epoll_fd, POLLIN);
+#endif
+}
+
+#ifdef USE_EPOLL
+static void handle_epoll_events(void)
+{
+	struct epoll_event ev[EPOLL_MAX_EVENTS];
+	struct connection *conn;
+	int i, n;
+
+	n = epoll_wait(epoll_fd, ev, ARRAY_SIZE(ev), 0);
+	if (n < 0) {
+		if (errno != EINTR)
+			barf_perror("epoll_wait failed");
+		return;
+	}
+
+	/*
+	 * The events are recorded in the connections, so they are still valid
+	 * should a connection be freed while processing an earlier one.
+	 * Further ready connections are reported by the next epoll_wait().
+	 */
+	for (i = 0; i < n; i++) {
+		conn = ev[i].data.ptr;
+		conn->revents = ev[i].events;
+	}
 }
+#endif
 
 void handle_special_fds(void)
 {
+#ifdef USE_EPOLL
+	if (epoll_pollfd_idx != -1) {
+		if (poll_fds[epoll_pollfd_idx].revents & ~POLLIN)
+			barf_perror("epoll fd poll failed");
+		else if (poll_fds[epoll_pollfd_idx].revents & POLLIN)
+			handle_epoll_events();
+		epoll_pollfd_idx = -1;
+	}
+#endif
+
 	if (reopen_log_pipe0_pollfd_idx != -1) {
 		if (poll_fds[reopen_log_pipe0_pollfd_idx].revents & ~POLLIN) {
 			close(reopen_log_pipe[0]);
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -36,6 +37,12 @@ struct watch
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path (linked via the watch index). */
+	struct list_head index_list;
+
+	/* Connection owning this watch. */
+	struct connection *conn;
+
 	/* Offset into path for skipping prefix (used for relative paths). */
 	unsigned int prefix_len;
 
@@ -43,22 +50,64 @@ struct watch
 	char *node;
 };
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
+/*
+ * All watches of all connections are indexed by their path, so firing watches
+ * for a modified node only needs to look at the watches registered for the
+ * node itself and its ancestors, instead of scanning all connections.
+ */
+struct watch_index_entry
 {
-	unsigned int len = strlen(parent);
+	/* Watched path, used as key of the index. */
+	char *path;
 
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
+	/* Watches registered for path. */
+	struct list_head watches;
+};
+
+static struct hashtable *watch_index;
+
+static struct watch_index_entry *watch_index_get(const char *path)
+{
+	return hashtable_search(watch_index, path);
+}
 
-	if (strncmp(child, parent, len) != 0)
-		return false;
+static int watch_index_add(struct watch *watch)
+{
+	struct watch_index_entry *entry;
+
+	entry = watch_index_get(watch->node);
+	if (!entry) {
+		entry = talloc(watch_index, struct watch_index_entry);
+		if (!entry)
+			return ENOMEM;
+		entry->path = talloc_strdup(entry, watch->node);
+		if (!entry->path) {
+			talloc_free(entry);
+			return ENOMEM;
+		}
+		INIT_LIST_HEAD(&entry->watches);
+		if (hashtable_add(watch_index, entry->path, entry)) {
+			talloc_free(entry);
+			return ENOMEM;
+		}
+	}
 
-	return child[len] == '/' || child[len] == '\0';
+	list_add_tail(&watch->index_list, &entry->watches);
+
+	return 0;
+}
+
+static void watch_index_del(struct watch *watch)
+{
+	struct watch_index_entry *entry;
+
+	list_del(&watch->index_list);
+
+	entry = watch_index_get(watch->node);
+	if (entry && list_empty(&entry->watches)) {
+		hashtable_remove(watch_index, entry->path);
+		talloc_free(entry);
+	}
 }
 
 static const char *get_watch_path(const struct watch *watch, const char *name)
@@ -118,12 +167,29 @@ static bool watch_permitted(struct connection *conn, const void *ctx,
  * as a watcher losing permissions to access a node should receive the
  * watch event, too.
  */
+static void fire_watches_path(struct buffered_data *req, const void *ctx,
+			      const char *path, const char *name,
+			      const struct node *node, struct node_perms *perms)
+{
+	struct watch_index_entry *entry;
+	struct watch *watch;
+
+	entry = watch_index_get(path);
+	if (!entry)
+		return;
+
+	list_for_each_entry(watch, &entry->watches, index_list) {
+		if (watch_permitted(watch->conn, ctx, name, node, perms))
+			send_event(req, watch->conn,
+				   get_watch_path(watch, name), watch->token);
+	}
+}
+
 void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		  const struct node *node, bool exact, struct node_perms *perms)
 {
-	struct connection *i;
 	struct buffered_data *req;
-	struct watch *watch;
+	char *path, *slash;
 
 	/* During transactions, don't fire watches, but queue them. */
 	if (conn && conn->transaction) {
@@ -133,29 +199,37 @@ void fire_watches(struct connection *conn, const void *ctx, const char *name,
 
 	req = domain_is_unprivileged(conn) ? conn->in : NULL;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		if (!watch_permitted(i, ctx, name, node, perms))
-			continue;
-
-		list_for_each_entry(watch, &i->watches, list) {
-			if (exact) {
-				if (streq(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			} else {
-				if (is_child(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			}
-		}
+	if (exact) {
+		fire_watches_path(req, ctx, name, name, node, perms);
+		return;
 	}
+
+	/*
+	 * Create an event for each watch on the node or one of its parents.
+	 * A watch on / should really be on "" for this to work, but that's a
+	 * usability nightmare, so / is handled explicitly at the end.
+	 */
+	path = talloc_strdup(ctx, name);
+	if (!path)
+		return;
+
+	for (;;) {
+		fire_watches_path(req, ctx, path, name, node, perms);
+		slash = strrchr(path, '/');
+		if (!slash || slash == path)
+			break;
+		*slash = 0;
+	}
+
+	if (!streq(name, "/"))
+		fire_watches_path(req, ctx, "/", name, node, perms);
+
+	talloc_free(path);
 }
 
 static int destroy_watch(void *_watch)
 {
+	watch_index_del(_watch);
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -187,6 +261,13 @@ static struct watch *add_watch(struct connection *conn, const char *path,
 		goto nomem;
 
 	watch->prefix_len = relative ? strlen(get_implicit_path(conn)) + 1 : 0;
+	watch->conn = conn;
+
+	if (watch_index_add(watch)) {
+		domain_memory_add_nochk(conn, conn->id,
+					-strlen(path) - strlen(token));
+		goto nomem;
+	}
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
@@ -342,6 +423,14 @@ void read_state_watch(const void *ctx, const void *state)
 		barf("error adding watch");
 }
 
+void watch_init(void)
+{
+	watch_index = create_hashtable(NULL, "watches", hash_from_key_fn,
+				       keys_equal_fn, 0);
+	if (!watch_index)
+		barf_perror("Could not create watch index");
+}
+
 /*
  * Local variables:
  *  mode: C
@@ -38,4 +38,6 @@ const char *dump_state_watches(FILE *fp, struct connection *conn,
 
 void read_state_watch(const void *ctx, const void *state);
 
+void watch_init(void);
+
 #endif /* _XENSTORED_WATCH_H */
@@ -138,6 +138,7 @@ static void do_domain(xenstat_domain *);
 static void do_vcpu(xenstat_domain *);
 static void do_network(xenstat_domain *);
 static void do_vbd(xenstat_domain *);
+static void do_sched_lat(xenstat_domain *);
 static void top(void);
 
 /* Field types */
@@ -210,6 +211,7 @@ unsigned int iterations = 0;
 int show_vcpus = 0;
 int show_networks = 0;
 int show_vbds = 0;
+int show_sched_lat = 0;
 int repeat_header = 0;
 int show_full_name = 0;
 int dom0_first = 0;
@@ -239,6 +241,7 @@ static void usage(const char *program)
 	       "-x, --vbds           output vbd block device data\n"
 	       "-r, --repeat-header  repeat table header before each domain\n"
 	       "-v, --vcpus          output vcpu data\n"
+	       "-l, --latency        output scheduling latency data\n"
 	       "-b, --batch	     output in batch mode, no user input accepted\n"
 	       "-i, --iterations     number of iterations before exiting\n"
 	       "-f, --full-name      output the full domain name (not truncated)\n"
@@ -373,6 +376,9 @@ static int handle_key(int ch)
 		case 'v': case 'V':
 			show_vcpus ^= 1;
 			break;
+		case 'l': case 'L':
+			show_sched_lat ^= 1;
+			break;
 		case KEY_DOWN:
 			first_domain_index++;
 			break;
@@ -1040,6 +1046,11 @@ void do_bottom_line(void)
 		attr_addstr(show_vcpus ? COLOR_PAIR(1) : 0, "CPUs");
 		addstr("  ");
 
+		/* scheduling latency */
+		addch(A_REVERSE | 'L');
+		attr_addstr(show_sched_lat ? COLOR_PAIR(1) : 0, "atency");
+		addstr("  ");
+
 		/* repeat */
 		addch(A_REVERSE | 'R');
 		attr_addstr(repeat_header ? COLOR_PAIR(1) : 0, "epeat header");
@@ -1173,6 +1184,79 @@ void do_vbd(xenstat_domain *domain)
 	}
 }
 
+/* Computes a percentile of a scheduling latency histogram of a domain in
+ * microseconds, over the interval since the previous sample if there is one.
+ * Returns 0 if there is nothing to report. */
+static unsigned long long get_sched_lat_pct(xenstat_domain *domain,
+					    unsigned int which,
+					    unsigned int pct)
+{
+	xenstat_domain *old_domain = NULL;
+	unsigned long long count[XENSTAT_SCHED_LAT_BUCKETS];
+	unsigned long long total = 0, sum = 0;
+	unsigned int i;
+
+	if (prev_node != NULL)
+		old_domain = xenstat_node_domain(prev_node,
+						 xenstat_domain_id(domain));
+
+	for (i = 0; i < XENSTAT_SCHED_LAT_BUCKETS; i++) {
+		count[i] = xenstat_domain_sched_lat(domain, which, i);
+		/* Don't get confused by a reused domain id */
+		if (old_domain != NULL &&
+		    xenstat_domain_sched_lat(old_domain, which, i) > count[i])
+			old_domain = NULL;
+	}
+
+	for (i = 0; i < XENSTAT_SCHED_LAT_BUCKETS; i++) {
+		if (old_domain != NULL)
+			count[i] -= xenstat_domain_sched_lat(old_domain,
+							     which, i);
+		total += count[i];
+	}
+
+	if (total == 0)
+		return 0;
+
+	for (i = 0; i < XENSTAT_SCHED_LAT_BUCKETS - 1; i++) {
+		sum += count[i];
+		if (sum * 100 >= total * pct)
+			break;
+	}
+
+	return xenstat_sched_lat_bucket_ns(i) / 1000;
+}
+
+/* Output scheduling latency information */
+void do_sched_lat(xenstat_domain *domain)
+{
+	static const struct {
+		unsigned int which;
+		const char *name;
+	} lats[] = {
+		{ XENSTAT_SCHED_LAT_WAKE, "Wake" },
+		{ XENSTAT_SCHED_LAT_WAIT, "Wait" },
+		{ XENSTAT_SCHED_LAT_RUN,  "Run" },
+	};
+	static const unsigned int pcts[] = { 50, 99 };
+	unsigned long long us;
+	unsigned int i, j;
+
+	print("Latency(us):");
+
+	for (i = 0; i < sizeof(lats)/sizeof(*lats); i++) {
+		print("  %s", lats[i].name);
+		for (j = 0; j < sizeof(pcts)/sizeof(*pcts); j++) {
+			us = get_sched_lat_pct(domain, lats[i].which, pcts[j]);
+			if (us)
+				print(" p%u: %8llu", pcts[j], us);
+			else
+				print(" p%u: %8c", pcts[j], '-');
+		}
+	}
+	print("\n");
+}
+
 static void top(void)
 {
 	xenstat_domain **domains;
@@ -1184,7 +1268,8 @@ static void top(void)
 	if (prev_node != NULL)
 		xenstat_free_node(prev_node);
 	prev_node = cur_node;
-	cur_node = xenstat_get_node(xhandle, XENSTAT_ALL);
+	cur_node = xenstat_get_node(xhandle, XENSTAT_ALL |
+				    (show_sched_lat ? XENSTAT_SCHED_LAT : 0));
 	if (cur_node == NULL)
 		fail("Failed to retrieve statistics from libxenstat\n");
 
@@ -1239,6 +1324,8 @@ static void top(void)
 		do_domain(domains[i]);
 		if (show_vcpus)
 			do_vcpu(domains[i]);
+		if (show_sched_lat)
+			do_sched_lat(domains[i]);
 		if (show_networks)
 			do_network(domains[i]);
 		if (show_vbds)
@@ -1270,6 +1357,7 @@ int main(int argc, char **argv)
 		{ "vbds",          no_argument,       NULL, 'x' },
 		{ "repeat-header", no_argument,       NULL, 'r' },
 		{ "vcpus",         no_argument,       NULL, 'v' },
+		{ "latency",       no_argument,       NULL, 'l' },
 		{ "delay",         required_argument, NULL, 'd' },
 		{ "batch",	   no_argument,	      NULL, 'b' },
 		{ "iterations",	   required_argument, NULL, 'i' },
@@ -1277,7 +1365,7 @@ int main(int argc, char **argv)
 		{ "dom0-first",    no_argument,       NULL, 'z' },
 		{ 0, 0, 0, 0 },
 	};
-	const char *sopts = "hVnxrvd:bi:fz";
+	const char *sopts = "hVnxrvld:bi:fz";
 
 	if (atexit(cleanup) != 0)
 		fail("Failed to install cleanup handler.\n");
@@ -1306,6 +1394,9 @@ int main(int argc, char **argv)
 		case 'v':
 			show_vcpus = 1;
 			break;
+		case 'l':
+			show_sched_lat = 1;
+			break;
 		case 'd':
 			delay = atoi(optarg);
 			break;
@@ -7999,6 +7999,24 @@ void sched_process(struct pcpu_info *p)
                        ri->dump_header, r->domid, r->vcpuid);
             }
             break;
+        case TRC_SCHED_CLASS_EVT(CSCHED2, 24): /* LOAD_MOVE        */
+            if(opt.dump_all) {
+                struct {
+                    unsigned int vcpuid:16, domid:16;
+                    unsigned int rqi:16, trqi:16;
+                    unsigned int cost, load_delta;
+                    unsigned int reasons;
+                } *r = (typeof(r))ri->d;
+
+                printf(" %s csched2:load_move d%uv%u rq# %u --> rq# %u, "
+                       "cost = %u, load_delta = %u%s%s%s\n",
+                       ri->dump_header, r->domid, r->vcpuid,
+                       r->rqi, r->trqi, r->cost, r->load_delta,
+                       r->reasons & 1 ? " [hot]" : "",
+                       r->reasons & 2 ? " [cross-llc]" : "",
+                       r->reasons & 4 ? " [off-node]" : "");
+            }
+            break;
         /* RTDS (TRC_RTDS_xxx) */
         case TRC_SCHED_CLASS_EVT(RTDS, 1): /* TICKLE           */
             if(opt.dump_all) {
@@ -62,19 +62,64 @@ void __init mapcache_override_current(struct vcpu *v)
     this_cpu(override) = v;
 }
 
-#define mapcache_l2_entry(e) ((e) >> PAGETABLE_ORDER)
-#define MAPCACHE_L2_ENTRIES (mapcache_l2_entry(MAPCACHE_ENTRIES - 1) + 1)
 #define MAPCACHE_L1ENT(idx) \
     __linear_l1_table[l1_linear_offset(MAPCACHE_VIRT_START + pfn_to_paddr(idx))]
 
+/*
+ * The mapcache is split into MAPCACHE_VCPU_ENTRIES slots per vCPU.  A vCPU's
+ * slots are only ever mapped and accessed by the vCPU itself, so remapping
+ * one only needs flushing from the local TLB: other CPUs may hold stale
+ * translations only until they next load the vCPU's page tables, which
+ * flushes them.
+ */
+static void lru_del(struct mapcache_vcpu *vcache, unsigned int i)
+{
+    const struct mapcache_slot *slot = &vcache->slot[i];
+
+    if ( slot->lru_prev != MAPCACHE_SLOT_NONE )
+        vcache->slot[slot->lru_prev].lru_next = slot->lru_next;
+    else
+        vcache->lru_head = slot->lru_next;
+
+    if ( slot->lru_next != MAPCACHE_SLOT_NONE )
+        vcache->slot[slot->lru_next].lru_prev = slot->lru_prev;
+    else
+        vcache->lru_tail = slot->lru_prev;
+}
+
+static void lru_add_tail(struct mapcache_vcpu *vcache, unsigned int i)
+{
+    struct mapcache_slot *slot = &vcache->slot[i];
+
+    slot->lru_prev = vcache->lru_tail;
+    slot->lru_next = MAPCACHE_SLOT_NONE;
+
+    if ( vcache->lru_tail != MAPCACHE_SLOT_NONE )
+        vcache->slot[vcache->lru_tail].lru_next = i;
+    else
+        vcache->lru_head = i;
+    vcache->lru_tail = i;
+}
+
+static void hash_del(struct mapcache_vcpu *vcache, unsigned int i)
+{
+    uint8_t *pi = &vcache->hash[MAPHASH_HASHFN(vcache->slot[i].mfn)];
+
+    while ( *pi != i )
+    {
+        ASSERT(*pi != MAPCACHE_SLOT_NONE);
+        pi = &vcache->slot[*pi].hash_next;
+    }
+    *pi = vcache->slot[i].hash_next;
+}
+
 void *map_domain_page(mfn_t mfn)
 {
     unsigned long flags;
-    unsigned int idx, i;
+    unsigned int base, i;
     struct vcpu *v;
-    struct mapcache_domain *dcache;
     struct mapcache_vcpu *vcache;
-    struct vcpu_maphash_entry *hashent;
+    struct mapcache_slot *slot;
 
 #ifdef NDEBUG
     if ( mfn_x(mfn) <= PFN_DOWN(__pa(HYPERVISOR_VIRT_END - 1)) )
@@ -82,104 +127,65 @@ void *map_domain_page(mfn_t mfn)
 #endif
 
     v = mapcache_current_vcpu();
-    if ( !v || !is_pv_vcpu(v) )
+    if ( !v || !is_pv_vcpu(v) || !v->domain->arch.pv.mapcache.enabled )
         return mfn_to_virt(mfn_x(mfn));
 
-    dcache = &v->domain->arch.pv.mapcache;
     vcache = &v->arch.pv.mapcache;
-    if ( !dcache->inuse )
-        return mfn_to_virt(mfn_x(mfn));
+    base = v->vcpu_id * MAPCACHE_VCPU_ENTRIES;
 
     perfc_incr(map_domain_page_count);
 
     local_irq_save(flags);
 
-    hashent = &vcache->hash[MAPHASH_HASHFN(mfn_x(mfn))];
-    if ( hashent->mfn == mfn_x(mfn) )
+    for ( i = vcache->hash[MAPHASH_HASHFN(mfn_x(mfn))];
+          i != MAPCACHE_SLOT_NONE; i = vcache->slot[i].hash_next )
+        if ( vcache->slot[i].mfn == mfn_x(mfn) )
+            break;
+
+    if ( i != MAPCACHE_SLOT_NONE )
     {
-        idx = hashent->idx;
-        ASSERT(idx < dcache->entries);
-        hashent->refcnt++;
-        ASSERT(hashent->refcnt);
-        ASSERT(mfn_eq(l1e_get_mfn(MAPCACHE_L1ENT(idx)), mfn));
+        slot = &vcache->slot[i];
+        if ( !slot->refcnt++ )
+            lru_del(vcache, i);
+        ASSERT(slot->refcnt);
+        ASSERT(mfn_eq(l1e_get_mfn(MAPCACHE_L1ENT(base + i)), mfn));
+        perfc_incr(map_domain_page_hit);
         goto out;
     }
 
-    spin_lock(&dcache->lock);
+    /* Recycle the least recently used slot. */
+    i = vcache->lru_head;
+    BUG_ON(i == MAPCACHE_SLOT_NONE);
+    slot = &vcache->slot[i];
+    lru_del(vcache, i);
 
-    /* Has some other CPU caused a wrap? We must flush if so. */
-    if ( unlikely(dcache->epoch != vcache->shadow_epoch) )
-    {
-        vcache->shadow_epoch = dcache->epoch;
-        if ( NEED_FLUSH(this_cpu(tlbflush_time), dcache->tlbflush_timestamp) )
-        {
-            perfc_incr(domain_page_tlb_flush);
-            flush_tlb_local();
-        }
-    }
+    l1e_write(&MAPCACHE_L1ENT(base + i),
+              l1e_from_mfn(mfn, __PAGE_HYPERVISOR_RW));
 
-    idx = find_next_zero_bit(dcache->inuse, dcache->entries, dcache->cursor);
-    if ( unlikely(idx >= dcache->entries) )
+    if ( slot->mfn != INVALID_MFN_RAW )
     {
-        unsigned long accum = 0, prev = 0;
-
-        /* /First/, clean the garbage map and update the inuse list. */
-        for ( i = 0; i < BITS_TO_LONGS(dcache->entries); i++ )
-        {
-            accum |= prev;
-            dcache->inuse[i] &= ~xchg(&dcache->garbage[i], 0);
-            prev = ~dcache->inuse[i];
-        }
-
-        if ( accum | (prev & BITMAP_LAST_WORD_MASK(dcache->entries)) )
-            idx = find_first_zero_bit(dcache->inuse, dcache->entries);
-        else
-        {
-            /* Replace a hash entry instead. */
-            i = MAPHASH_HASHFN(mfn_x(mfn));
-            do {
-                hashent = &vcache->hash[i];
-                if ( hashent->idx != MAPHASHENT_NOTINUSE && !hashent->refcnt )
-                {
-                    idx = hashent->idx;
-                    ASSERT(l1e_get_pfn(MAPCACHE_L1ENT(idx)) == hashent->mfn);
-                    l1e_write(&MAPCACHE_L1ENT(idx), l1e_empty());
-                    hashent->idx = MAPHASHENT_NOTINUSE;
-                    hashent->mfn = ~0UL;
-                    break;
-                }
-                if ( ++i == MAPHASH_ENTRIES )
-                    i = 0;
-            } while ( i != MAPHASH_HASHFN(mfn_x(mfn)) );
-        }
-        BUG_ON(idx >= dcache->entries);
-
-        /* /Second/, flush TLBs. */
+        hash_del(vcache, i);
         perfc_incr(domain_page_tlb_flush);
-        flush_tlb_local();
-        vcache->shadow_epoch = ++dcache->epoch;
-        dcache->tlbflush_timestamp = tlbflush_current_time();
+        flush_tlb_one_local(MAPCACHE_VIRT_START + pfn_to_paddr(base + i));
     }
 
-    set_bit(idx, dcache->inuse);
-    dcache->cursor = idx + 1;
-
-    spin_unlock(&dcache->lock);
-
-    l1e_write(&MAPCACHE_L1ENT(idx), l1e_from_mfn(mfn, __PAGE_HYPERVISOR_RW));
+    slot->mfn = mfn_x(mfn);
+    slot->refcnt = 1;
+    slot->hash_next = vcache->hash[MAPHASH_HASHFN(mfn_x(mfn))];
+    vcache->hash[MAPHASH_HASHFN(mfn_x(mfn))] = i;
+    perfc_incr(map_domain_page_miss);
 
  out:
     local_irq_restore(flags);
-    return (void *)MAPCACHE_VIRT_START + pfn_to_paddr(idx);
+    return (void *)MAPCACHE_VIRT_START + pfn_to_paddr(base + i);
 }
 
 void unmap_domain_page(const void *ptr)
 {
-    unsigned int idx;
+    unsigned int i;
     struct vcpu *v;
-    struct mapcache_domain *dcache;
-    unsigned long va = (unsigned long)ptr, mfn, flags;
-    struct vcpu_maphash_entry *hashent;
+    struct mapcache_vcpu *vcache;
+    unsigned long va = (unsigned long)ptr, flags;
 
     if ( !va || va >= DIRECTMAP_VIRT_START )
         return;
@@ -188,45 +194,21 @@ void unmap_domain_page(const void *ptr)
 
     v = mapcache_current_vcpu();
     ASSERT(v && is_pv_vcpu(v));
+    ASSERT(v->domain->arch.pv.mapcache.enabled);
 
-    dcache = &v->domain->arch.pv.mapcache;
-    ASSERT(dcache->inuse);
-
-    idx = PFN_DOWN(va - MAPCACHE_VIRT_START);
-    mfn = l1e_get_pfn(MAPCACHE_L1ENT(idx));
-    hashent = &v->arch.pv.mapcache.hash[MAPHASH_HASHFN(mfn)];
+    vcache = &v->arch.pv.mapcache;
+    i = PFN_DOWN(va - MAPCACHE_VIRT_START) - v->vcpu_id * MAPCACHE_VCPU_ENTRIES;
+    ASSERT(i < MAPCACHE_VCPU_ENTRIES);
 
     local_irq_save(flags);
 
-    if ( hashent->idx == idx )
-    {
-        ASSERT(hashent->mfn == mfn);
-        ASSERT(hashent->refcnt);
-        hashent->refcnt--;
-    }
-    else if ( !hashent->refcnt )
-    {
-        if ( hashent->idx != MAPHASHENT_NOTINUSE )
-        {
-            /* /First/, zap the PTE. */
-            ASSERT(l1e_get_pfn(MAPCACHE_L1ENT(hashent->idx)) ==
-                   hashent->mfn);
-            l1e_write(&MAPCACHE_L1ENT(hashent->idx), l1e_empty());
-            /* /Second/, mark as garbage. */
-            set_bit(hashent->idx, dcache->garbage);
-        }
-
-        /* Add newly-freed mapping to the maphash. */
-        hashent->mfn = mfn;
-        hashent->idx = idx;
-    }
-    else
-    {
-        /* /First/, zap the PTE. */
-        l1e_write(&MAPCACHE_L1ENT(idx), l1e_empty());
-        /* /Second/, mark as garbage. */
-        set_bit(idx, dcache->garbage);
-    }
+    ASSERT(vcache->slot[i].refcnt);
+    ASSERT(l1e_get_pfn(MAPCACHE_L1ENT(PFN_DOWN(va - MAPCACHE_VIRT_START))) ==
+           vcache->slot[i].mfn);
+
+    /* Leave the slot mapped, for it to be found again or else recycled. */
+    if ( !--vcache->slot[i].refcnt )
+        lru_add_tail(vcache, i);
 
     local_irq_restore(flags);
 }
@@ -234,7 +216,6 @@ void unmap_domain_page(const void *ptr)
 int mapcache_domain_init(struct domain *d)
 {
     struct mapcache_domain *dcache = &d->arch.pv.mapcache;
-    unsigned int bitmap_pages;
 
     ASSERT(is_pv_domain(d));
 
@@ -243,30 +224,23 @@ int mapcache_domain_init(struct domain *d)
         return 0;
 #endif
 
-    BUILD_BUG_ON(MAPCACHE_VIRT_END + PAGE_SIZE * (3 +
-                 2 * PFN_UP(BITS_TO_LONGS(MAPCACHE_ENTRIES) * sizeof(long))) >
+    BUILD_BUG_ON(MAPCACHE_VIRT_END >
                  MAPCACHE_VIRT_START + (PERDOMAIN_SLOT_MBYTES << 20));
-    bitmap_pages = PFN_UP(BITS_TO_LONGS(MAPCACHE_ENTRIES) * sizeof(long));
-    dcache->inuse = (void *)MAPCACHE_VIRT_END + PAGE_SIZE;
-    dcache->garbage = dcache->inuse +
-                      (bitmap_pages + 1) * PAGE_SIZE / sizeof(long);
+    BUILD_BUG_ON(MAPCACHE_VCPU_ENTRIES >= MAPCACHE_SLOT_NONE);
 
-    spin_lock_init(&dcache->lock);
+    dcache->enabled = true;
 
-    return create_perdomain_mapping(d, (unsigned long)dcache->inuse,
-                                    2 * bitmap_pages + 1,
-                                    NIL(l1_pgentry_t *), NULL);
+    return 0;
 }
 
 int mapcache_vcpu_init(struct vcpu *v)
 {
     struct domain *d = v->domain;
     struct mapcache_domain *dcache = &d->arch.pv.mapcache;
-    unsigned long i;
-    unsigned int ents = d->max_vcpus * MAPCACHE_VCPU_ENTRIES;
-    unsigned int nr = PFN_UP(BITS_TO_LONGS(ents) * sizeof(long));
+    struct mapcache_vcpu *vcache = &v->arch.pv.mapcache;
+    unsigned int i, ents = d->max_vcpus * MAPCACHE_VCPU_ENTRIES;
 
-    if ( !is_pv_vcpu(v) || !dcache->inuse )
+    if ( !is_pv_vcpu(v) || !dcache->enabled )
         return 0;
 
     if ( ents > dcache->entries )
@@ -275,28 +249,22 @@ int mapcache_vcpu_init(struct vcpu *v)
         int rc = create_perdomain_mapping(d, MAPCACHE_VIRT_START, ents,
                                           NIL(l1_pgentry_t *), NULL);
 
-        /* Populate bit maps. */
-        if ( !rc )
-            rc = create_perdomain_mapping(d, (unsigned long)dcache->inuse,
-                                          nr, NULL, NIL(struct page_info *));
-        if ( !rc )
-            rc = create_perdomain_mapping(d, (unsigned long)dcache->garbage,
-                                          nr, NULL, NIL(struct page_info *));
-
         if ( rc )
             return rc;
 
         dcache->entries = ents;
     }
 
-    /* Mark all maphash entries as not in use. */
-    BUILD_BUG_ON(MAPHASHENT_NOTINUSE < MAPCACHE_ENTRIES);
+    /* All slots start out unmapped, on the LRU list. */
     for ( i = 0; i < MAPHASH_ENTRIES; i++ )
-    {
-        struct vcpu_maphash_entry *hashent = &v->arch.pv.mapcache.hash[i];
+        vcache->hash[i] = MAPCACHE_SLOT_NONE;
 
-        hashent->mfn = ~0UL; /* never valid to map */
-        hashent->idx = MAPHASHENT_NOTINUSE;
+    vcache->lru_head = vcache->lru_tail = MAPCACHE_SLOT_NONE;
+    for ( i = 0; i < MAPCACHE_VCPU_ENTRIES; i++ )
+    {
+        vcache->slot[i].mfn = INVALID_MFN_RAW; /* never valid to map */
+        vcache->slot[i].refcnt = 0;
+        lru_add_tail(vcache, i);
     }
 
     return 0;
@@ -671,6 +671,9 @@ long arch_do_domctl(
                        "ioport_map: error %ld denying dom%d access to [%x,%x]\n",
                        ret, d->domain_id, fmp, fmp + np - 1);
         }
+
+        /* Lookups of the changed ports may now have a different result. */
+        hvm_io_dispatch_flush(d);
         break;
     }
 
@@ -213,6 +213,103 @@ int hvm_process_io_intercept(const struct hvm_io_handler *handler,
     return rc;
 }
 
+/* Layout of hvm_io_dispatch's cache entries. */
+#define PORTIO_CACHE_PORT  0x000000000000ffffULL
+#define PORTIO_CACHE_SIZE  0x0000000000ff0000ULL
+#define PORTIO_CACHE_IDX   0x00000000ff000000ULL
+#define PORTIO_CACHE_GEN   0xffffffff00000000ULL
+
+static unsigned int portio_cache_slot(unsigned int port)
+{
+    return (port ^ (port >> 6)) % HVM_PORTIO_CACHE_SIZE;
+}
+
+static const struct hvm_io_handler *hvm_find_portio_handler(
+    struct domain *d, const ioreq_t *p)
+{
+    struct hvm_io_dispatch *disp = d->arch.hvm.io_dispatch;
+    unsigned int port = p->addr, lo, hi, idx, seq;
+    uint64_t tag, ent, *slot = &disp->cache[portio_cache_slot(port)];
+    uint32_t dynamic;
+
+    tag = MASK_INSR(port, PORTIO_CACHE_PORT) |
+          MASK_INSR(p->size, PORTIO_CACHE_SIZE) |
+          MASK_INSR(ACCESS_ONCE(disp->cache_gen), PORTIO_CACHE_GEN);
+
+    ent = read_atomic(slot);
+    if ( (ent & ~PORTIO_CACHE_IDX) == tag && p->addr <= 0xffff )
+    {
+        perfc_incr(hvm_portio_cache_hit);
+        idx = MASK_EXTR(ent, PORTIO_CACHE_IDX);
+        return idx < NR_IO_HANDLERS ? &d->arch.hvm.io_handler[idx] : NULL;
+    }
+
+    perfc_incr(hvm_portio_cache_miss);
+
+    /* Retry if hvm_io_dispatch_flush() rebuilt the table meanwhile. */
+    for ( ; ; )
+    {
+        seq = read_atomic(&disp->seq);
+        if ( seq & 1 )
+        {
+            cpu_relax();
+            continue;
+        }
+        smp_rmb();
+
+        tag = MASK_INSR(port, PORTIO_CACHE_PORT) |
+              MASK_INSR(p->size, PORTIO_CACHE_SIZE) |
+              MASK_INSR(ACCESS_ONCE(disp->cache_gen), PORTIO_CACHE_GEN);
+
+        /* Find the last range starting at or below the port. */
+        lo = 0;
+        hi = min(ACCESS_ONCE(disp->nr_portio), NR_IO_HANDLERS + 0U);
+        while ( lo < hi )
+        {
+            unsigned int mid = (lo + hi) / 2;
+
+            if ( ACCESS_ONCE(disp->portio[mid].start) <= port )
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        idx = NR_IO_HANDLERS;
+        if ( lo && p->addr + p->size <= ACCESS_ONCE(disp->portio[lo - 1].end) )
+            idx = ACCESS_ONCE(disp->portio[lo - 1].idx);
+
+        dynamic = ACCESS_ONCE(disp->dynamic_portio);
+
+        smp_rmb();
+        if ( read_atomic(&disp->seq) == seq )
+            break;
+    }
+
+    /* Handlers with an accept hook registered earlier take precedence. */
+    if ( idx < NR_IO_HANDLERS )
+        dynamic &= (1U << idx) - 1;
+
+    while ( dynamic )
+    {
+        unsigned int i = ffs(dynamic) - 1;
+        const struct hvm_io_handler *handler = &d->arch.hvm.io_handler[i];
+
+        /*
+         * Hooks may record state for the access (e.g. g2m_portio_accept()),
+         * hence results of accepting hooks can't be cached.
+         */
+        if ( handler->ops->accept(handler, p) )
+            return handler;
+
+        dynamic &= dynamic - 1;
+    }
+
+    if ( p->addr <= 0xffff )
+        write_atomic(slot, tag | MASK_INSR(idx, PORTIO_CACHE_IDX));
+
+    return idx < NR_IO_HANDLERS ? &d->arch.hvm.io_handler[idx] : NULL;
+}
+
 static const struct hvm_io_handler *hvm_find_io_handler(const ioreq_t *p)
 {
     struct domain *curr_d = current->domain;
@@ -221,6 +318,10 @@ static const struct hvm_io_handler *hvm_find_io_handler(const ioreq_t *p)
     BUG_ON((p->type != IOREQ_TYPE_PIO) &&
            (p->type != IOREQ_TYPE_COPY));
 
+    if ( p->type == IOREQ_TYPE_PIO )
+        return hvm_find_portio_handler(curr_d, p);
+
+    /* MMIO handlers decide by state the guest may change, e.g. APIC base. */
     for ( i = 0; i < curr_d->arch.hvm.io_handler_count; i++ )
     {
         const struct hvm_io_handler *handler =
@@ -272,6 +373,77 @@ struct hvm_io_handler *hvm_next_io_handler(struct domain *d)
     return &d->arch.hvm.io_handler[i];
 }
 
+/*
+ * Mostly called while the domain is being built, but relocate_portio_handler()
+ * may rebuild the index while other vCPUs look ports up: the update is done
+ * under disp->seq, which makes lookups overlapping it retry.  Ranges
+ * overlapping one registered earlier are left to the accept hook, which keeps
+ * the first handler registered taking precedence.
+ */
+void hvm_io_dispatch_flush(struct domain *d)
+{
+    struct hvm_io_dispatch *disp = d->arch.hvm.io_dispatch;
+    unsigned int nr = min(d->arch.hvm.io_handler_count, NR_IO_HANDLERS + 0U);
+    typeof(disp->portio) portio;
+    unsigned int i, j, n = 0;
+    uint32_t dynamic = 0;
+
+    BUILD_BUG_ON(NR_IO_HANDLERS > 32);
+    BUILD_BUG_ON(NR_IO_HANDLERS >= MASK_EXTR(PORTIO_CACHE_IDX,
+                                             PORTIO_CACHE_IDX));
+
+    spin_lock(&disp->lock);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        const struct hvm_io_handler *handler = &d->arch.hvm.io_handler[i];
+        unsigned int start = handler->portio.port;
+        unsigned int end = start + handler->portio.size;
+
+        if ( handler->type != IOREQ_TYPE_PIO )
+            continue;
+
+        if ( handler->ops == &portio_ops )
+        {
+            for ( j = n; j && portio[j - 1].start > start; j-- )
+                continue;
+
+            if ( (!j || portio[j - 1].end <= start) &&
+                 (j == n || portio[j].start >= end) )
+            {
+                memmove(&portio[j + 1], &portio[j],
+                        (n - j) * sizeof(*portio));
+                portio[j].start = start;
+                portio[j].end = end;
+                portio[j].idx = i;
+                n++;
+                continue;
+            }
+        }
+
+        dynamic |= 1U << i;
+    }
+
+    write_atomic(&disp->seq, disp->seq + 1);
+    smp_wmb();
+
+    if ( n != disp->nr_portio || dynamic != disp->dynamic_portio ||
+         memcmp(portio, disp->portio, n * sizeof(*portio)) )
+    {
+        memcpy(disp->portio, portio, n * sizeof(*portio));
+        disp->nr_portio = n;
+        disp->dynamic_portio = dynamic;
+    }
+
+    /* Invalidate all cached lookups. */
+    write_atomic(&disp->cache_gen, disp->cache_gen + 1);
+
+    smp_wmb();
+    write_atomic(&disp->seq, disp->seq + 1);
+
+    spin_unlock(&disp->lock);
+}
+
 void register_mmio_handler(struct domain *d,
                            const struct hvm_mmio_ops *ops)
 {
@@ -298,6 +470,8 @@ void register_portio_handler(struct domain *d, unsigned int port,
     handler->portio.port = port;
     handler->portio.size = size;
     handler->portio.action = action;
+
+    hvm_io_dispatch_flush(d);
 }
 
 bool relocate_portio_handler(struct domain *d, unsigned int old_port,
@@ -317,6 +491,8 @@ bool relocate_portio_handler(struct domain *d, unsigned int old_port,
              (handler->portio.size = size) )
         {
             handler->portio.port = new_port;
+            if ( new_port != old_port )
+                hvm_io_dispatch_flush(d);
             return true;
         }
     }
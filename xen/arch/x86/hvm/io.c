@@ -234,6 +234,8 @@ void register_g2m_portio_handler(struct domain *d)
 
     handler->type = IOREQ_TYPE_PIO;
     handler->ops = &g2m_portio_ops;
+
+    hvm_io_dispatch_flush(d);
 }
 
 unsigned int hvm_pci_decode_addr(unsigned int cf8, unsigned int addr,
@@ -340,6 +342,8 @@ void register_vpci_portio_handler(struct domain *d)
 
     handler->type = IOREQ_TYPE_PIO;
     handler->ops = &vpci_portio_ops;
+
+    hvm_io_dispatch_flush(d);
 }
 
 struct hvm_mmcfg {
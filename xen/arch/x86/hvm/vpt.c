@@ -547,6 +547,7 @@ void create_periodic_time(
     pt->priv = data;
 
     init_timer(&pt->timer, pt_timer_fn, pt, v->processor);
+    timer_set_coalesce(&pt->timer, TIMER_COALESCE_vpt);
     set_timer(&pt->timer, pt->scheduled);
 
     pt_vcpu_lock(v);
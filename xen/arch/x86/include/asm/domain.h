@@ -41,36 +41,35 @@ struct trap_bounce {
     unsigned long eip;
 };
 
-#define MAPHASH_ENTRIES 8
+#define MAPHASH_ENTRIES 16
 #define MAPHASH_HASHFN(pfn) ((pfn) & (MAPHASH_ENTRIES-1))
-#define MAPHASHENT_NOTINUSE ((u32)~0U)
+#define MAPCACHE_SLOT_NONE 0xff
 struct mapcache_vcpu {
-    /* Shadow of mapcache_domain.epoch. */
-    unsigned int shadow_epoch;
-
-    /* Lock-free per-VCPU hash of recently-used mappings. */
-    struct vcpu_maphash_entry {
-        unsigned long mfn;
-        uint32_t      idx;
-        uint32_t      refcnt;
-    } hash[MAPHASH_ENTRIES];
+    /*
+     * Each vCPU owns MAPCACHE_VCPU_ENTRIES slots of the mapcache, which only
+     * it ever maps or accesses.  Slots stay mapped once unreferenced, on an
+     * LRU list, until they get recycled for another MFN.
+     */
+    struct mapcache_slot {
+        unsigned long mfn;      /* INVALID_MFN_RAW if never mapped. */
+        uint16_t      refcnt;
+        uint8_t       hash_next;
+        uint8_t       lru_prev, lru_next;
+    } slot[MAPCACHE_VCPU_ENTRIES];
+
+    /* Hash chains of mapped slots, by MFN. */
+    uint8_t hash[MAPHASH_ENTRIES];
+
+    /* Unreferenced slots, least recently used first. */
+    uint8_t lru_head, lru_tail;
 };
 
 struct mapcache_domain {
-    /* The number of array entries, and a cursor into the array. */
+    /* The number of array entries with page tables populated. */
     unsigned int entries;
-    unsigned int cursor;
-
-    /* Protects map_domain_page(). */
-    spinlock_t lock;
-
-    /* Garbage mappings are flushed from TLBs in batches called 'epochs'. */
-    unsigned int epoch;
-    u32 tlbflush_timestamp;
 
-    /* Which mappings are in use, and which are garbage to reap next epoch? */
-    unsigned long *inuse;
-    unsigned long *garbage;
+    /* Whether map_domain_page() needs to use the mapcache at all. */
+    bool enabled;
 };
 
 int mapcache_domain_init(struct domain *d);
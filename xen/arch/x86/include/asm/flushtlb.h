@@ -174,6 +174,9 @@ void flush_area_mask(const cpumask_t *mask, const void *va,
     flush_tlb_mask(&cpu_online_map)
 #define flush_tlb_one_all(v)                    \
     flush_tlb_one_mask(&cpu_online_map, v)
+/* Flush all CPUs' TLBs, including Xen's global mappings */
+#define flush_tlb_all_global()                  \
+    flush_mask(&cpu_online_map, FLUSH_TLB_GLOBAL)
 
 #define flush_root_pgtbl_domain(d)                                       \
 {                                                                        \
@@ -65,6 +65,7 @@ struct hvm_domain {
 
     struct hvm_io_handler *io_handler;
     unsigned int          io_handler_count;
+    struct hvm_io_dispatch *io_dispatch;
 
     /* Lock protects access to irq, vpic and vioapic. */
     spinlock_t             irq_lock;
@@ -46,6 +46,39 @@ struct hvm_io_handler {
     uint8_t type;
 };
 
+/* Number of entries in the direct-mapped cache of port I/O lookups. */
+#define HVM_PORTIO_CACHE_SIZE 64
+
+/*
+ * Per-domain structure to look up port I/O handlers without calling the
+ * accept hook of each in turn.
+ */
+struct hvm_io_dispatch {
+    /*
+     * Serialises rebuilds.  Lookups don't take it: they retry when seq, odd
+     * while a rebuild is updating the fields below, changed meanwhile.
+     */
+    spinlock_t lock;
+    unsigned int seq;
+
+    /* Ranges of the handlers registered by port, sorted by port. */
+    struct {
+        unsigned int start, end;
+        unsigned int idx;
+    } portio[NR_IO_HANDLERS];
+    unsigned int nr_portio;
+
+    /* Port I/O handlers deciding by their accept hook, by index. */
+    uint32_t dynamic_portio;
+
+    /*
+     * Results of previous lookups: port, access size, handler index and the
+     * generation the entry is valid for.
+     */
+    uint32_t cache_gen;
+    uint64_t cache[HVM_PORTIO_CACHE_SIZE];
+};
+
 typedef int (*hvm_io_read_t)(const struct hvm_io_handler *handler,
                              uint64_t addr,
                              uint32_t size,
@@ -72,6 +105,12 @@ int hvm_io_intercept(ioreq_t *p);
 
 struct hvm_io_handler *hvm_next_io_handler(struct domain *d);
 
+/*
+ * To be called after registering a port I/O handler, or when the decision of
+ * a port I/O handler's accept hook may have changed.
+ */
+void hvm_io_dispatch_flush(struct domain *d);
+
 bool hvm_mmio_internal(paddr_t gpa);
 
 void register_mmio_handler(struct domain *d,
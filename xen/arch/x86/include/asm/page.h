@@ -349,6 +349,7 @@ void efi_update_l4_pgtable(unsigned int l4idx, l4_pgentry_t l4e);
 #define __PAGE_HYPERVISOR_SHSTK   (__PAGE_HYPERVISOR_RO | _PAGE_DIRTY)
 
 #define MAP_SMALL_PAGES _PAGE_AVAIL0 /* don't use superpages mappings */
+#define MAP_NO_FLUSH    _PAGE_AVAIL1 /* caller flushes removed 4k mappings */
 
 #ifndef __ASSEMBLY__
 
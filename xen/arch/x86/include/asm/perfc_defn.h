@@ -33,8 +33,12 @@ PERFCOUNTER(page_faults,            "page faults")
 PERFCOUNTER(copy_user_faults,       "copy_user faults")
 
 PERFCOUNTER(map_domain_page_count,  "map_domain_page count")
+PERFCOUNTER(map_domain_page_hit,    "map_domain_page hits")
+PERFCOUNTER(map_domain_page_miss,   "map_domain_page misses")
 PERFCOUNTER(ptwr_emulations,        "writable pt emulations")
 PERFCOUNTER(mmio_ro_emulations,     "mmio ro emulations")
+PERFCOUNTER(hvm_portio_cache_hit,   "hvm port I/O dispatch cache hits")
+PERFCOUNTER(hvm_portio_cache_miss,  "hvm port I/O dispatch cache misses")
 
 PERFCOUNTER(exception_fixed,        "pre-exception fixed")
 
@@ -5211,6 +5211,7 @@ int map_pages_to_xen(
     unsigned int flags)
 {
     bool locking = system_state > SYS_STATE_boot;
+    bool no_flush = (flags & (MAP_NO_FLUSH | _PAGE_PRESENT)) == MAP_NO_FLUSH;
     l3_pgentry_t *pl3e = NULL, ol3e;
     l2_pgentry_t *pl2e = NULL, ol2e;
     l1_pgentry_t *pl1e, ol1e;
@@ -5232,6 +5233,8 @@ int map_pages_to_xen(
     }                                          \
 } while (0)
 
+    flags &= ~MAP_NO_FLUSH;
+
     L3T_INIT(current_l3page);
 
     while ( nr_mfns != 0 )
@@ -5474,7 +5477,7 @@ int map_pages_to_xen(
             ol1e  = *pl1e;
             l1e_write(pl1e, l1e_from_mfn(mfn, flags));
             UNMAP_DOMAIN_PAGE(pl1e);
-            if ( (l1e_get_flags(ol1e) & _PAGE_PRESENT) )
+            if ( (l1e_get_flags(ol1e) & _PAGE_PRESENT) && !no_flush )
             {
                 unsigned int flush_flags = FLUSH_TLB | FLUSH_ORDER(0);
 
@@ -60,6 +60,10 @@ CHECK_gnttab_swap_grant_ref;
 CHECK_gnttab_cache_flush;
 #undef xen_gnttab_cache_flush
 
+#define xen_gnttab_copy_cache gnttab_copy_cache
+CHECK_gnttab_copy_cache;
+#undef xen_gnttab_copy_cache
+
 int compat_grant_table_op(
     unsigned int cmd, XEN_GUEST_HANDLE_PARAM(void) uop, unsigned int count)
 {
@@ -130,6 +134,10 @@ int compat_grant_table_op(
     CASE(cache_flush);
 #endif
 
+#ifndef CHECK_gnttab_copy_cache
+    CASE(copy_cache);
+#endif
+
 #undef CASE
     default:
         return do_grant_table_op(cmd, uop, count);
@@ -258,6 +258,7 @@ static int vmtrace_alloc_buffer(struct vcpu *v)
 static int vcpu_teardown(struct vcpu *v)
 {
     vmtrace_free_buffer(v);
+    populate_vcpu_teardown(v);
 
     return 0;
 }
@@ -1078,6 +1079,8 @@ int domain_kill(struct domain *d)
          * have to be put before we call put_domain. */
         vm_event_cleanup(d);
         put_domain(d);
+        /* Get the scrubbing of the memory released above going. */
+        scrub_kick_idle_cpus();
         send_global_virq(VIRQ_DOM_EXC);
         /* fallthrough */
     case DOMDYING_dead:
@@ -1287,6 +1290,7 @@ void domain_destroy(struct domain *d)
 
     /* Schedule RCU asynchronous completion of domain destroy. */
     call_rcu(&d->rcu, complete_domain_destroy);
+    rcu_expedite();
 }
 
 void vcpu_pause(struct vcpu *v)
@@ -49,6 +49,9 @@
 #include <asm/guest.h>
 #endif
 
+/* Upper bound of grant windows a domain may pin for GNTTABOP_copy. */
+#define GNTTAB_MAX_COPY_WINDOWS 16
+
 /* Per-domain grant information. */
 struct grant_table {
     /*
@@ -96,6 +99,12 @@ struct grant_table {
      * protected by @lock, not @maptrack_lock.
      */
     struct radix_tree_root maptrack_tree;
+    /*
+     * Windows of other domains' grants pinned for GNTTABOP_copy, protected
+     * by @lock.  Like @maptrack, only ever used by the local domain.
+     */
+    unsigned int          nr_copy_windows;
+    struct gnttab_copy_window *copy_windows[GNTTAB_MAX_COPY_WINDOWS];
 
     /* Domain to which this struct grant_table belongs. */
     struct domain *domain;
@@ -282,6 +291,24 @@ struct grant_mapping {
     uint32_t pad;           /* round size to a power of 2 */
 };
 
+/*
+ * A window of another domain's grant references pinned via
+ * GNTTABOP_copy_cache.  Each grant holds a reference to the page it referred
+ * to when pinned, sparing copies the lookup of the frame.  Copies still
+ * acquire the grant itself, for the granting domain to be able to end it as
+ * usual.  Grants found ended, or referring to another frame, are dropped.
+ */
+struct gnttab_copy_window {
+    struct domain *domain;  /* granting domain, a reference is held */
+    grant_ref_t ref;        /* first grant ref */
+    unsigned int count;
+    bool read_only;
+    struct gnttab_copy_grant {
+        struct page_info *page; /* NULL once dropped */
+        gfn_t gfn;
+    } grants[];
+};
+
 /* Number of grant table frames. Caller must hold d's grant table lock. */
 static inline unsigned int nr_grant_frames(const struct grant_table *gt)
 {
@@ -528,6 +555,35 @@ static int get_paged_frame(unsigned long gfn, mfn_t *mfn,
     return GNTST_okay;
 }
 
+/*
+ * Like get_paged_frame(), but for a grant pinned in a copy window use the
+ * page found when pinning, as long as the grant still refers to the same
+ * frame.  When pinning, record the frame instead.
+ */
+static int get_frame_for_copy(unsigned long gfn,
+                              struct gnttab_copy_grant *cached, mfn_t *mfn,
+                              struct page_info **page, bool readonly,
+                              struct domain *rd)
+{
+    int rc;
+
+    if ( !cached || !cached->page )
+    {
+        rc = get_paged_frame(gfn, mfn, page, readonly, rd);
+        if ( cached && rc == GNTST_okay )
+            cached->gfn = _gfn(gfn);
+        return rc;
+    }
+
+    if ( !gfn_eq(cached->gfn, _gfn(gfn)) || !get_page(cached->page, rd) )
+        return GNTST_bad_gntref;
+
+    *page = cached->page;
+    *mfn = page_to_mfn(*page);
+
+    return GNTST_okay;
+}
+
 #define INVALID_MAPTRACK_HANDLE UINT_MAX
 
 static inline grant_handle_t
@@ -2560,12 +2616,16 @@ release_grant_for_copy(
  * and pin count as appropriate. If rc == GNTST_okay, note that this *does*
  * take one ref count on the target page, stored in *page.
  * If there is any error, *page = NULL, no ref taken.
+ * With cached set, the grant is (being) pinned in a copy window: see
+ * get_frame_for_copy().  A cached grant no longer referring to the pinned
+ * page yields GNTST_bad_gntref.
  */
 static int
 acquire_grant_for_copy(
     struct domain *rd, grant_ref_t gref, domid_t ldom, bool readonly,
     mfn_t *mfn, struct page_info **page, uint16_t *page_off,
-    uint16_t *length, bool allow_transitive)
+    uint16_t *length, bool allow_transitive,
+    struct gnttab_copy_grant *cached)
 {
     struct grant_table *rgt = rd->grant_table;
     grant_entry_v2_t *sha2;
@@ -2679,7 +2739,7 @@ acquire_grant_for_copy(
         rc = acquire_grant_for_copy(td, trans_gref, rd->domain_id,
                                     readonly, &grant_mfn, page,
                                     &trans_page_off, &trans_length,
-                                    false);
+                                    false, NULL);
 
         grant_read_lock(rgt);
         act = active_entry_acquire(rgt, gref);
@@ -2762,7 +2822,8 @@ acquire_grant_for_copy(
         {
             unsigned long gfn = shared_entry_v1(rgt, gref).frame;
 
-            rc = get_paged_frame(gfn, &grant_mfn, page, readonly, rd);
+            rc = get_frame_for_copy(gfn, cached, &grant_mfn, page, readonly,
+                                    rd);
             if ( rc != GNTST_okay )
                 goto unlock_out_clear;
             act_set_gfn(act, _gfn(gfn));
@@ -2772,8 +2833,8 @@ acquire_grant_for_copy(
         }
         else if ( !(sha2->hdr.flags & GTF_sub_page) )
         {
-            rc = get_paged_frame(sha2->full_page.frame, &grant_mfn, page,
-                                 readonly, rd);
+            rc = get_frame_for_copy(sha2->full_page.frame, cached,
+                                    &grant_mfn, page, readonly, rd);
             if ( rc != GNTST_okay )
                 goto unlock_out_clear;
             act_set_gfn(act, _gfn(sha2->full_page.frame));
@@ -2783,8 +2844,8 @@ acquire_grant_for_copy(
         }
         else
         {
-            rc = get_paged_frame(sha2->sub_page.frame, &grant_mfn, page,
-                                 readonly, rd);
+            rc = get_frame_for_copy(sha2->sub_page.frame, cached,
+                                    &grant_mfn, page, readonly, rd);
             if ( rc != GNTST_okay )
                 goto unlock_out_clear;
             act_set_gfn(act, _gfn(sha2->sub_page.frame));
@@ -2825,6 +2886,18 @@ acquire_grant_for_copy(
             rc = GNTST_bad_domain;
             goto unlock_out_clear;
         }
+
+        if ( cached && !cached->page )
+            cached->gfn = _gfn(evaluate_nospec(rgt->gt_version == 1) ?
+                               shared_entry_v1(rgt, gref).frame :
+                               shared_entry_v2(rgt, gref).full_page.frame);
+        else if ( cached && *page != cached->page )
+        {
+            put_page(*page);
+            *page = NULL;
+            rc = GNTST_bad_gntref;
+            goto unlock_out_clear;
+        }
     }
 
     act->pin += pin_incr;
@@ -2948,6 +3021,87 @@ static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
     }
 }
 
+/* Drop a grant from the windows which pinned it with the given page. */
+static void gnttab_copy_drop_cached(struct grant_table *lgt,
+                                    const struct domain *rd, grant_ref_t ref,
+                                    struct page_info *page)
+{
+    unsigned int i, nr = 0;
+
+    grant_write_lock(lgt);
+
+    for ( i = 0; i < ARRAY_SIZE(lgt->copy_windows); i++ )
+    {
+        struct gnttab_copy_window *win = lgt->copy_windows[i];
+
+        if ( win && win->domain == rd && ref - win->ref < win->count &&
+             win->grants[ref - win->ref].page == page )
+        {
+            win->grants[ref - win->ref].page = NULL;
+            nr++;
+        }
+    }
+
+    grant_write_unlock(lgt);
+
+    while ( nr-- )
+        put_page(page);
+}
+
+/*
+ * Acquire a grant of the buffer's domain pinned in one of the current domain's
+ * windows, sparing the lookup of its frame.  Returns false if the grant isn't
+ * pinned suitably for the buffer, for the caller to acquire it the usual way.
+ * A grant which can't be acquired any longer, because the granting domain
+ * ended it or the like, is dropped from the windows, failing the copy with
+ * GNTST_bad_gntref.
+ */
+static bool gnttab_copy_acquire_cached(struct gnttab_copy_buf *buf,
+                                       grant_ref_t ref, int *rc)
+{
+    struct domain *ld = current->domain, *rd = buf->domain;
+    struct grant_table *lgt = ld->grant_table;
+    struct gnttab_copy_grant grant = { .page = NULL };
+    unsigned int i;
+
+    if ( !lgt || !read_atomic(&lgt->nr_copy_windows) )
+        return false;
+
+    grant_read_lock(lgt);
+
+    for ( i = 0; i < ARRAY_SIZE(lgt->copy_windows); i++ )
+    {
+        const struct gnttab_copy_window *win = lgt->copy_windows[i];
+
+        if ( !win || win->domain != rd || ref - win->ref >= win->count ||
+             (win->read_only && !buf->read_only) )
+            continue;
+
+        grant = win->grants[array_index_nospec(ref - win->ref, win->count)];
+        if ( grant.page && (rd->is_dying || !get_page(grant.page, rd)) )
+            grant.page = NULL;
+        break;
+    }
+
+    grant_read_unlock(lgt);
+
+    if ( !grant.page )
+        return false;
+
+    *rc = acquire_grant_for_copy(rd, ref, ld->domain_id, buf->read_only,
+                                 &buf->mfn, &buf->page, &buf->ptr.offset,
+                                 &buf->len, false, &grant);
+    if ( *rc != GNTST_okay )
+    {
+        gnttab_copy_drop_cached(lgt, rd, ref, grant.page);
+        *rc = GNTST_bad_gntref;
+    }
+
+    put_page(grant.page);
+
+    return true;
+}
+
 static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
                                  const struct gnttab_copy_ptr *ptr,
                                  struct gnttab_copy_buf *buf,
@@ -2959,12 +3113,13 @@ static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
 
     if ( op->flags & gref_flag )
     {
-        rc = acquire_grant_for_copy(buf->domain, ptr->u.ref,
-                                    current->domain->domain_id,
-                                    buf->read_only,
-                                    &buf->mfn, &buf->page,
-                                    &buf->ptr.offset, &buf->len,
-                                    opt_transitive_grants);
+        if ( !gnttab_copy_acquire_cached(buf, ptr->u.ref, &rc) )
+            rc = acquire_grant_for_copy(buf->domain, ptr->u.ref,
+                                        current->domain->domain_id,
+                                        buf->read_only,
+                                        &buf->mfn, &buf->page,
+                                        &buf->ptr.offset, &buf->len,
+                                        opt_transitive_grants, NULL);
         if ( rc != GNTST_okay )
             goto out;
         buf->ptr.u.ref = ptr->u.ref;
@@ -3162,6 +3317,174 @@ static long gnttab_copy(
     return rc;
 }
 
+static void gnttab_copy_unpin_window(struct gnttab_copy_window *win)
+{
+    unsigned int i;
+
+    for ( i = 0; i < win->count; i++ )
+        if ( win->grants[i].page )
+            put_page(win->grants[i].page);
+
+    put_domain(win->domain);
+    xvfree(win);
+}
+
+static int gnttab_copy_cache_pin(const struct gnttab_copy_cache *op)
+{
+    struct domain *ld = current->domain, *rd;
+    struct grant_table *lgt = ld->grant_table;
+    struct gnttab_copy_window *win;
+    unsigned int i;
+    int rc;
+
+    if ( !op->count || op->count > GNTCOPY_CACHE_max_count ||
+         op->ref + op->count - 1 < op->ref )
+        return GNTST_bad_gntref;
+
+    if ( !lgt ||
+         read_atomic(&lgt->nr_copy_windows) >= ARRAY_SIZE(lgt->copy_windows) )
+        return GNTST_no_space;
+
+    rd = rcu_lock_domain_by_any_id(op->domid);
+    if ( !rd )
+        return GNTST_bad_domain;
+
+    /* Writable grants may serve as either source or destination. */
+    if ( xsm_grant_copy(XSM_HOOK, rd, ld) ||
+         (!(op->flags & GNTCOPY_CACHE_readonly) &&
+          xsm_grant_copy(XSM_HOOK, ld, rd)) )
+    {
+        rc = GNTST_permission_denied;
+        goto unlock;
+    }
+
+    win = xvzalloc_flex_struct(struct gnttab_copy_window, grants, op->count);
+    if ( !win )
+    {
+        rc = GNTST_no_space;
+        goto unlock;
+    }
+
+    if ( !get_domain(rd) )
+    {
+        xvfree(win);
+        rc = GNTST_bad_domain;
+        goto unlock;
+    }
+
+    win->domain = rd;
+    win->ref = op->ref;
+    win->read_only = op->flags & GNTCOPY_CACHE_readonly;
+
+    for ( rc = GNTST_okay; win->count < op->count; win->count++ )
+    {
+        struct gnttab_copy_grant *grant = &win->grants[win->count];
+        struct page_info *page;
+        uint16_t offset, length;
+        mfn_t mfn;
+
+        rc = acquire_grant_for_copy(rd, op->ref + win->count, ld->domain_id,
+                                    win->read_only, &mfn, &page, &offset,
+                                    &length, false, grant);
+        if ( rc != GNTST_okay )
+            break;
+
+        /* Keep the page, leaving the granting domain free to end the grant. */
+        release_grant_for_copy(rd, op->ref + win->count, win->read_only);
+        grant->page = page;
+    }
+
+    if ( rc == GNTST_okay )
+    {
+        rc = GNTST_no_space;
+
+        grant_write_lock(lgt);
+
+        /* Don't leave windows behind once gnttab_release_mappings() ran. */
+        for ( i = 0; !ld->is_dying && i < ARRAY_SIZE(lgt->copy_windows); i++ )
+            if ( !lgt->copy_windows[i] )
+            {
+                lgt->copy_windows[i] = win;
+                lgt->nr_copy_windows++;
+                rc = GNTST_okay;
+                break;
+            }
+
+        grant_write_unlock(lgt);
+    }
+
+    if ( rc != GNTST_okay )
+        gnttab_copy_unpin_window(win);
+
+ unlock:
+    rcu_unlock_domain(rd);
+
+    return rc;
+}
+
+static int gnttab_copy_cache_unpin(const struct gnttab_copy_cache *op)
+{
+    struct domain *ld = current->domain;
+    struct grant_table *lgt = ld->grant_table;
+    domid_t domid = op->domid == DOMID_SELF ? ld->domain_id : op->domid;
+    struct gnttab_copy_window *win = NULL;
+    unsigned int i;
+
+    if ( !lgt )
+        return GNTST_bad_gntref;
+
+    grant_write_lock(lgt);
+
+    for ( i = 0; i < ARRAY_SIZE(lgt->copy_windows); i++ )
+    {
+        win = lgt->copy_windows[i];
+        if ( win && win->domain->domain_id == domid &&
+             win->ref == op->ref && win->count == op->count )
+        {
+            lgt->copy_windows[i] = NULL;
+            lgt->nr_copy_windows--;
+            break;
+        }
+        win = NULL;
+    }
+
+    grant_write_unlock(lgt);
+
+    if ( !win )
+        return GNTST_bad_gntref;
+
+    gnttab_copy_unpin_window(win);
+
+    return GNTST_okay;
+}
+
+static long
+gnttab_copy_cache(XEN_GUEST_HANDLE_PARAM(gnttab_copy_cache_t) uop,
+                  unsigned int count)
+{
+    unsigned int i;
+    gnttab_copy_cache_t op;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( i && hypercall_preempt_check() )
+            return i;
+        if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+            return -EFAULT;
+        if ( op.flags & ~(GNTCOPY_CACHE_unpin | GNTCOPY_CACHE_readonly) )
+            op.status = GNTST_general_error;
+        else if ( op.flags & GNTCOPY_CACHE_unpin )
+            op.status = gnttab_copy_cache_unpin(&op);
+        else
+            op.status = gnttab_copy_cache_pin(&op);
+        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+            return -EFAULT;
+        guest_handle_add_offset(uop, 1);
+    }
+
+    return 0;
+}
+
 static long
 gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
 {
@@ -3790,6 +4113,22 @@ long do_grant_table_op(
         break;
     }
 
+    case GNTTABOP_copy_cache:
+    {
+        XEN_GUEST_HANDLE_PARAM(gnttab_copy_cache_t) cache =
+            guest_handle_cast(uop, gnttab_copy_cache_t);
+
+        if ( unlikely(!guest_handle_okay(cache, count)) )
+            goto out;
+        rc = gnttab_copy_cache(cache, count);
+        if ( rc > 0 )
+        {
+            guest_handle_add_offset(cache, rc);
+            uop = guest_handle_cast(cache, void);
+        }
+        break;
+    }
+
     default:
         rc = -ENOSYS;
         break;
@@ -3828,6 +4167,29 @@ int gnttab_release_mappings(struct domain *d)
 
     BUG_ON(!d->is_dying);
 
+    while ( gt && gt->nr_copy_windows )
+    {
+        struct gnttab_copy_window *win = NULL;
+        unsigned int i;
+
+        grant_write_lock(gt);
+
+        for ( i = 0; !win; i++ )
+        {
+            ASSERT(i < ARRAY_SIZE(gt->copy_windows));
+            win = gt->copy_windows[i];
+            gt->copy_windows[i] = NULL;
+        }
+        gt->nr_copy_windows--;
+
+        grant_write_unlock(gt);
+
+        gnttab_copy_unpin_window(win);
+
+        if ( hypercall_preempt_check() )
+            return -ERESTART;
+    }
+
     if ( !gt || !gt->maptrack )
         return 0;
 
@@ -70,6 +70,19 @@ static void set_ioreq_server(struct domain *d, unsigned int id,
 #define GET_IOREQ_SERVER(d, id) \
     (d)->ioreq_server.server[id]
 
+/*
+ * Invalidate the results of ioreq_server_select() cached by the domain's
+ * vCPUs.  Must be called after the change affecting selection has been made.
+ */
+static void ioreq_select_cache_flush(struct domain *d)
+{
+    ASSERT(rspin_is_locked(&d->ioreq_server.lock));
+
+    smp_wmb();
+    write_atomic(&d->ioreq_server.select_gen,
+                 d->ioreq_server.select_gen + 1);
+}
+
 static struct ioreq_server *get_ioreq_server(const struct domain *d,
                                              unsigned int id)
 {
@@ -103,6 +116,16 @@ static ioreq_t *get_ioreq(struct ioreq_server *s, struct vcpu *v)
     return &p->vcpu_ioreq[v->vcpu_id];
 }
 
+static ioreq_batch_t *get_ioreq_batch(struct ioreq_server *s, struct vcpu *v)
+{
+    batch_iopage_t *p = s->batch[v->vcpu_id / IOREQ_BATCH_PER_PAGE].va;
+
+    ASSERT((v == current) || !vcpu_runnable(v));
+    ASSERT(p != NULL);
+
+    return &p->vcpu_batch[v->vcpu_id % IOREQ_BATCH_PER_PAGE];
+}
+
 /*
  * This should only be used when d == current->domain or when they're
  * distinct and d is paused. Otherwise the result is stale before
@@ -208,6 +231,111 @@ static bool wait_for_io(struct ioreq_vcpu *sv, ioreq_t *p)
     return true;
 }
 
+/*
+ * MMIO writes which don't take their data from guest memory are posted to
+ * batched servers: the vCPU doesn't wait for them to be handled.
+ */
+static bool ioreq_is_posted(const ioreq_t *p)
+{
+    return p->type == IOREQ_TYPE_COPY && p->dir == IOREQ_WRITE &&
+           !p->data_is_ptr;
+}
+
+static bool ioreq_batch_has_room(struct ioreq_server *s,
+                                 const struct ioreq_vcpu *sv)
+{
+    const ioreq_batch_t *b = get_ioreq_batch(s, sv->vcpu);
+
+    return sv->batch_prod - ACCESS_ONCE(b->req_cons) < IOREQ_BATCH_SLOT_NUM;
+}
+
+static bool ioreq_batch_done(struct ioreq_server *s,
+                             const struct ioreq_vcpu *sv)
+{
+    const ioreq_batch_t *b = get_ioreq_batch(s, sv->vcpu);
+
+    return (int32_t)(ACCESS_ONCE(b->req_cons) - sv->batch_slot) > 0;
+}
+
+static bool ioreq_batch_idle(struct ioreq_server *s,
+                             const struct ioreq_vcpu *sv)
+{
+    const ioreq_batch_t *b = get_ioreq_batch(s, sv->vcpu);
+
+    return ACCESS_ONCE(b->req_cons) == sv->batch_prod;
+}
+
+/*
+ * Queue a request in the vCPU's ring, notifying the emulator only if it may
+ * have gone idle.  Returns false if the ring is full.
+ */
+static bool ioreq_batch_push(struct ioreq_server *s, struct ioreq_vcpu *sv,
+                             const ioreq_t *p)
+{
+    ioreq_batch_t *b = get_ioreq_batch(s, sv->vcpu);
+    uint32_t prod = sv->batch_prod;
+    ioreq_t *slot;
+
+    if ( !ioreq_batch_has_room(s, sv) )
+        return false;
+
+    slot = &b->req[prod % IOREQ_BATCH_SLOT_NUM];
+    *slot = *p;
+    slot->state = STATE_IOREQ_READY;
+    slot->vp_eport = sv->ioreq_evtchn;
+
+    sv->batch_slot = prod++;
+    sv->batch_prod = prod;
+
+    /* Make the request visible /before/ req_prod. */
+    smp_wmb();
+    write_atomic(&b->req_prod, prod);
+
+    /* Publish req_prod /before/ checking whether the emulator went idle. */
+    smp_mb();
+    if ( ACCESS_ONCE(b->req_cons) == sv->batch_slot )
+        notify_via_xen_event_channel(sv->vcpu->domain, sv->ioreq_evtchn);
+
+    return true;
+}
+
+static bool wait_for_batch(struct ioreq_server *s, struct ioreq_vcpu *sv)
+{
+    const ioreq_batch_t *b = get_ioreq_batch(s, sv->vcpu);
+    ioreq_t *p;
+
+    while ( !sv->batch_queued )
+    {
+        if ( ioreq_batch_push(s, sv, &sv->batch_req) )
+        {
+            sv->batch_queued = true;
+            break;
+        }
+
+        wait_on_xen_event_channel(sv->ioreq_evtchn,
+                                  ioreq_batch_has_room(s, sv));
+    }
+
+    /* A posted write only had to wait for room in the ring. */
+    if ( !ioreq_is_posted(&sv->batch_req) )
+    {
+        while ( !ioreq_batch_done(s, sv) )
+            wait_on_xen_event_channel(sv->ioreq_evtchn,
+                                      ioreq_batch_done(s, sv));
+
+        /* Read the response /after/ req_cons. */
+        smp_rmb();
+
+        p = &sv->vcpu->io.req;
+        if ( ioreq_needs_completion(p) )
+            p->data = b->req[sv->batch_slot % IOREQ_BATCH_SLOT_NUM].data;
+    }
+
+    sv->pending = false;
+
+    return true;
+}
+
 bool vcpu_ioreq_handle_completion(struct vcpu *v)
 {
     struct vcpu_io *vio = &v->io;
@@ -217,7 +345,8 @@ bool vcpu_ioreq_handle_completion(struct vcpu *v)
     bool res = true;
 
     while ( (sv = get_pending_vcpu(v, &s)) != NULL )
-        if ( !wait_for_io(sv, get_ioreq(s, v)) )
+        if ( s->nr_batch_pages ? !wait_for_batch(s, sv)
+                               : !wait_for_io(sv, get_ioreq(s, v)) )
             return false;
 
     vio->req.state = ioreq_needs_completion(&vio->req) ?
@@ -258,9 +387,9 @@ bool vcpu_ioreq_handle_completion(struct vcpu *v)
     return res;
 }
 
-static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
+static int ioreq_server_alloc_mfn(struct ioreq_server *s,
+                                  struct ioreq_page *iorp)
 {
-    struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
     struct page_info *page;
 
     if ( iorp->page )
@@ -306,9 +435,8 @@ static int ioreq_server_alloc_mfn(struct ioreq_server *s, bool buf)
     return -ENOMEM;
 }
 
-static void ioreq_server_free_mfn(struct ioreq_server *s, bool buf)
+static void ioreq_server_free_mfn(struct ioreq_page *iorp)
 {
-    struct ioreq_page *iorp = buf ? &s->bufioreq : &s->ioreq;
     struct page_info *page = iorp->page;
 
     if ( !page )
@@ -333,11 +461,16 @@ bool is_ioreq_server_page(struct domain *d, const struct page_info *page)
 
     FOR_EACH_IOREQ_SERVER(d, id, s)
     {
+        unsigned int i;
+
         if ( (s->ioreq.page == page) || (s->bufioreq.page == page) )
-        {
             found = true;
+
+        for ( i = 0; !found && i < s->nr_batch_pages; i++ )
+            found = s->batch[i].page == page;
+
+        if ( found )
             break;
-        }
     }
 
     rspin_unlock(&d->ioreq_server.lock);
@@ -356,6 +489,14 @@ static void ioreq_server_update_evtchn(struct ioreq_server *s,
 
         p->vp_eport = sv->ioreq_evtchn;
     }
+
+    if ( s->nr_batch_pages &&
+         s->batch[sv->vcpu->vcpu_id / IOREQ_BATCH_PER_PAGE].va != NULL )
+    {
+        ioreq_batch_t *b = get_ioreq_batch(s, sv->vcpu);
+
+        b->vp_eport = sv->ioreq_evtchn;
+    }
 }
 
 static int ioreq_server_add_vcpu(struct ioreq_server *s,
@@ -464,27 +605,36 @@ static void ioreq_server_remove_all_vcpus(struct ioreq_server *s)
     spin_unlock(&s->lock);
 }
 
+static void ioreq_server_free_pages(struct ioreq_server *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < s->nr_batch_pages; i++ )
+        ioreq_server_free_mfn(&s->batch[i]);
+
+    ioreq_server_free_mfn(&s->bufioreq);
+    ioreq_server_free_mfn(&s->ioreq);
+}
+
 static int ioreq_server_alloc_pages(struct ioreq_server *s)
 {
+    unsigned int i;
     int rc;
 
-    rc = ioreq_server_alloc_mfn(s, false);
+    rc = ioreq_server_alloc_mfn(s, &s->ioreq);
 
     if ( !rc && (s->bufioreq_handling != HVM_IOREQSRV_BUFIOREQ_OFF) )
-        rc = ioreq_server_alloc_mfn(s, true);
+        rc = ioreq_server_alloc_mfn(s, &s->bufioreq);
+
+    for ( i = 0; !rc && i < s->nr_batch_pages; i++ )
+        rc = ioreq_server_alloc_mfn(s, &s->batch[i]);
 
     if ( rc )
-        ioreq_server_free_mfn(s, false);
+        ioreq_server_free_pages(s);
 
     return rc;
 }
 
-static void ioreq_server_free_pages(struct ioreq_server *s)
-{
-    ioreq_server_free_mfn(s, true);
-    ioreq_server_free_mfn(s, false);
-}
-
 static void ioreq_server_free_rangesets(struct ioreq_server *s)
 {
     unsigned int i;
@@ -548,6 +698,7 @@ static void ioreq_server_enable(struct ioreq_server *s)
     arch_ioreq_server_enable(s);
 
     s->enabled = true;
+    ioreq_select_cache_flush(s->target);
 
     list_for_each_entry ( sv,
                           &s->ioreq_vcpu_list,
@@ -558,6 +709,44 @@ static void ioreq_server_enable(struct ioreq_server *s)
     spin_unlock(&s->lock);
 }
 
+/*
+ * Posted writes still queued in a vCPU's ring would be lost if the server
+ * went away, so it may only be disabled once the emulator has handled them.
+ * Returns whether any vCPU still has requests queued, notifying the emulator
+ * for each of them.  The domain must be paused.
+ */
+static bool ioreq_server_batch_busy(struct ioreq_server *s)
+{
+    struct ioreq_vcpu *sv;
+    bool busy = false;
+
+    spin_lock(&s->lock);
+
+    if ( !s->enabled || !s->nr_batch_pages || !s->batch[0].va )
+        goto done;
+
+    list_for_each_entry ( sv,
+                          &s->ioreq_vcpu_list,
+                          list_entry )
+    {
+        /* Queue a request the (paused) vCPU is waiting to find room for. */
+        if ( sv->pending && !sv->batch_queued &&
+             ioreq_batch_push(s, sv, &sv->batch_req) )
+            sv->batch_queued = true;
+
+        if ( ioreq_batch_idle(s, sv) )
+            continue;
+
+        notify_via_xen_event_channel(s->target, sv->ioreq_evtchn);
+        busy = true;
+    }
+
+ done:
+    spin_unlock(&s->lock);
+
+    return busy;
+}
+
 static void ioreq_server_disable(struct ioreq_server *s)
 {
     spin_lock(&s->lock);
@@ -568,6 +757,7 @@ static void ioreq_server_disable(struct ioreq_server *s)
     arch_ioreq_server_disable(s);
 
     s->enabled = false;
+    ioreq_select_cache_flush(s->target);
 
  done:
     spin_unlock(&s->lock);
@@ -575,10 +765,11 @@ static void ioreq_server_disable(struct ioreq_server *s)
 
 static int ioreq_server_init(struct ioreq_server *s,
                              struct domain *d, int bufioreq_handling,
-                             ioservid_t id)
+                             unsigned int flags, ioservid_t id)
 {
     struct domain *currd = current->domain;
     struct vcpu *v;
+    unsigned int i;
     int rc;
 
     s->target = d;
@@ -593,9 +784,25 @@ static int ioreq_server_init(struct ioreq_server *s,
     s->ioreq.gfn = INVALID_GFN;
     s->bufioreq.gfn = INVALID_GFN;
 
+    if ( flags & XEN_DMOP_IOREQ_SERVER_batch )
+    {
+        BUILD_BUG_ON(sizeof(batch_iopage_t) > PAGE_SIZE);
+
+        s->nr_batch_pages = DIV_ROUND_UP(d->max_vcpus, IOREQ_BATCH_PER_PAGE);
+        s->batch = xzalloc_array(struct ioreq_page, s->nr_batch_pages);
+        if ( !s->batch )
+        {
+            rc = -ENOMEM;
+            goto fail_batch;
+        }
+
+        for ( i = 0; i < s->nr_batch_pages; i++ )
+            s->batch[i].gfn = INVALID_GFN;
+    }
+
     rc = ioreq_server_alloc_rangesets(s, id);
     if ( rc )
-        return rc;
+        goto fail_batch;
 
     s->bufioreq_handling = bufioreq_handling;
 
@@ -614,6 +821,8 @@ static int ioreq_server_init(struct ioreq_server *s,
 
     ioreq_server_free_rangesets(s);
 
+ fail_batch:
+    XFREE(s->batch);
     put_domain(s->emulator);
     return rc;
 }
@@ -636,12 +845,13 @@ static void ioreq_server_deinit(struct ioreq_server *s)
     ioreq_server_free_pages(s);
 
     ioreq_server_free_rangesets(s);
+    XFREE(s->batch);
 
     put_domain(s->emulator);
 }
 
 static int ioreq_server_create(struct domain *d, int bufioreq_handling,
-                               ioservid_t *id)
+                               unsigned int flags, ioservid_t *id)
 {
     struct ioreq_server *s;
     unsigned int i;
@@ -653,6 +863,9 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
     if ( bufioreq_handling > HVM_IOREQSRV_BUFIOREQ_ATOMIC )
         return -EINVAL;
 
+    if ( flags & ~XEN_DMOP_IOREQ_SERVER_batch )
+        return -EINVAL;
+
     s = xzalloc(struct ioreq_server);
     if ( !s )
         return -ENOMEM;
@@ -676,7 +889,7 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
      */
     set_ioreq_server(d, i, s);
 
-    rc = ioreq_server_init(s, d, bufioreq_handling, i);
+    rc = ioreq_server_init(s, d, bufioreq_handling, flags, i);
     if ( rc )
     {
         set_ioreq_server(d, i, NULL);
@@ -718,6 +931,13 @@ static int ioreq_server_destroy(struct domain *d, ioservid_t id)
 
     domain_pause(d);
 
+    rc = -EBUSY;
+    if ( ioreq_server_batch_busy(s) )
+    {
+        domain_unpause(d);
+        goto out;
+    }
+
     arch_ioreq_server_destroy(s);
 
     ioreq_server_disable(s);
@@ -763,6 +983,11 @@ static int ioreq_server_get_info(struct domain *d, ioservid_t id,
 
     if ( ioreq_gfn || bufioreq_gfn )
     {
+        /* The batch pages can only be acquired as a resource. */
+        rc = -EOPNOTSUPP;
+        if ( s->nr_batch_pages )
+            goto out;
+
         rc = arch_ioreq_server_map_pages(s);
         if ( rc )
             goto out;
@@ -830,6 +1055,16 @@ int ioreq_server_get_frame(struct domain *d, ioservid_t id,
 
     default:
         rc = -EINVAL;
+        if ( idx < XENMEM_resource_ioreq_server_frame_batch(0) )
+            break;
+
+        idx -= XENMEM_resource_ioreq_server_frame_batch(0);
+
+        if ( idx >= s->nr_batch_pages )
+            break;
+
+        *mfn = page_to_mfn(s->batch[idx].page);
+        rc = 0;
         break;
     }
 
@@ -839,6 +1074,23 @@ int ioreq_server_get_frame(struct domain *d, ioservid_t id,
     return rc;
 }
 
+/* Number of batch frames of a server, 0 if there is none or it has none. */
+unsigned int ioreq_server_nr_batch_frames(struct domain *d, ioservid_t id)
+{
+    const struct ioreq_server *s;
+    unsigned int nr = 0;
+
+    rspin_lock(&d->ioreq_server.lock);
+
+    s = get_ioreq_server(d, id);
+    if ( s )
+        nr = s->nr_batch_pages;
+
+    rspin_unlock(&d->ioreq_server.lock);
+
+    return nr;
+}
+
 static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
                                      uint32_t type, uint64_t start,
                                      uint64_t end)
@@ -884,6 +1136,8 @@ static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_add_range(r, start, end);
+    if ( !rc )
+        ioreq_select_cache_flush(d);
 
  out:
     rspin_unlock(&d->ioreq_server.lock);
@@ -936,6 +1190,8 @@ static int ioreq_server_unmap_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_remove_range(r, start, end);
+    if ( !rc )
+        ioreq_select_cache_flush(d);
 
  out:
     rspin_unlock(&d->ioreq_server.lock);
@@ -1006,15 +1262,16 @@ static int ioreq_server_set_state(struct domain *d, ioservid_t id,
 
     domain_pause(d);
 
+    rc = 0;
     if ( enabled )
         ioreq_server_enable(s);
+    else if ( ioreq_server_batch_busy(s) )
+        rc = -EBUSY;
     else
         ioreq_server_disable(s);
 
     domain_unpause(d);
 
-    rc = 0;
-
  out:
     rspin_unlock(&d->ioreq_server.lock);
     return rc;
@@ -1078,7 +1335,10 @@ void ioreq_server_destroy_all(struct domain *d)
 
     rspin_lock(&d->ioreq_server.lock);
 
-    /* No need to domain_pause() as the domain is being torn down */
+    /*
+     * No need to domain_pause() as the domain is being torn down.  For the
+     * same reason, requests still queued in batch rings can be dropped.
+     */
 
     FOR_EACH_IOREQ_SERVER(d, id, s)
     {
@@ -1097,17 +1357,13 @@ void ioreq_server_destroy_all(struct domain *d)
     rspin_unlock(&d->ioreq_server.lock);
 }
 
-struct ioreq_server *ioreq_server_select(struct domain *d,
-                                         ioreq_t *p)
+static struct ioreq_server *ioreq_server_lookup(struct domain *d,
+                                                const ioreq_t *p,
+                                                uint8_t type, uint64_t addr)
 {
     struct ioreq_server *s;
-    uint8_t type;
-    uint64_t addr;
     unsigned int id;
 
-    if ( !arch_ioreq_server_get_type_addr(d, p, &type, &addr) )
-        return NULL;
-
     FOR_EACH_IOREQ_SERVER(d, id, s)
     {
         struct rangeset *r;
@@ -1140,11 +1396,7 @@ struct ioreq_server *ioreq_server_select(struct domain *d,
 
         case XEN_DMOP_IO_RANGE_PCI:
             if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
                 return s;
-            }
 
             break;
         }
@@ -1153,6 +1405,70 @@ struct ioreq_server *ioreq_server_select(struct domain *d,
     return NULL;
 }
 
+static unsigned int ioreq_select_cache_idx(uint64_t addr)
+{
+    return (addr ^ (addr >> 12) ^ (addr >> 32)) % NR_IOREQ_SELECT_CACHE;
+}
+
+/*
+ * Selection only depends on the type, address and size of the access, and on
+ * state protected by the ioreq server lock.  Accesses issued by the domain's
+ * own vCPUs are looked up in a small per-vCPU cache first, whose entries are
+ * only valid for as long as the domain's select_gen doesn't change.
+ */
+struct ioreq_server *ioreq_server_select(struct domain *d,
+                                         ioreq_t *p)
+{
+    struct vcpu *curr = current;
+    struct ioreq_select_entry *e = NULL;
+    struct ioreq_server *s;
+    unsigned int gen = 0;
+    uint8_t type;
+    uint64_t addr;
+
+    if ( !arch_ioreq_server_get_type_addr(d, p, &type, &addr) )
+        return NULL;
+
+    if ( d == curr->domain )
+    {
+        gen = ACCESS_ONCE(d->ioreq_server.select_gen);
+        smp_rmb();
+
+        e = &curr->io.select_cache[ioreq_select_cache_idx(addr)];
+        if ( e->s && e->gen == gen && e->type == type && e->addr == addr &&
+             e->size == p->size )
+        {
+            perfc_incr(ioreq_select_cache_hit);
+            s = e->s;
+            goto found;
+        }
+
+        perfc_incr(ioreq_select_cache_miss);
+    }
+
+    s = ioreq_server_lookup(d, p, type, addr);
+    if ( !s )
+        return NULL;
+
+    if ( e )
+    {
+        e->addr = addr;
+        e->s = s;
+        e->gen = gen;
+        e->size = p->size;
+        e->type = type;
+    }
+
+ found:
+    if ( type == XEN_DMOP_IO_RANGE_PCI )
+    {
+        p->type = IOREQ_TYPE_PCI_CONFIG;
+        p->addr = addr;
+    }
+
+    return s;
+}
+
 static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
 {
     struct domain *d = current->domain;
@@ -1257,7 +1573,47 @@ int ioreq_send(struct ioreq_server *s, ioreq_t *proto_p,
     ASSERT(s);
 
     if ( buffered )
+    {
+        /*
+         * Don't let a buffered request overtake posted writes still queued
+         * in the vCPU's ring: queue it behind them instead.  If the ring is
+         * full, the request has to go through the normal path.
+         */
+        if ( s->nr_batch_pages )
+            list_for_each_entry ( sv,
+                                  &s->ioreq_vcpu_list,
+                                  list_entry )
+            {
+                if ( sv->vcpu != curr )
+                    continue;
+
+                if ( !ioreq_batch_idle(s, sv) )
+                    return ioreq_batch_push(s, sv, proto_p)
+                           ? IOREQ_STATUS_HANDLED : IOREQ_STATUS_UNHANDLED;
+
+                break;
+            }
+
         return ioreq_send_buffered(s, proto_p);
+    }
+
+    if ( s->nr_batch_pages && ioreq_is_posted(proto_p) )
+    {
+        list_for_each_entry ( sv,
+                              &s->ioreq_vcpu_list,
+                              list_entry )
+        {
+            if ( sv->vcpu != curr )
+                continue;
+
+            /* If the ring is full, wait for room below. */
+            proto_p->state = STATE_IOREQ_NONE;
+            if ( ioreq_batch_push(s, sv, proto_p) )
+                return IOREQ_STATUS_HANDLED;
+
+            break;
+        }
+    }
 
     if ( unlikely(!vcpu_start_shutdown_deferral(curr)) )
     {
@@ -1290,6 +1646,18 @@ int ioreq_send(struct ioreq_server *s, ioreq_t *proto_p,
 
             proto_p->state = STATE_IOREQ_NONE;
             proto_p->vp_eport = port;
+
+            if ( s->nr_batch_pages )
+            {
+                sv->batch_req = *proto_p;
+
+                /* If the ring is full, wait_for_batch() will queue it. */
+                prepare_wait_on_xen_event_channel(port);
+                sv->batch_queued = ioreq_batch_push(s, sv, proto_p);
+                sv->pending = true;
+                return IOREQ_STATUS_RETRY;
+            }
+
             *p = *proto_p;
 
             prepare_wait_on_xen_event_channel(port);
@@ -1350,10 +1718,10 @@ int ioreq_server_dm_op(struct xen_dm_op *op, struct domain *d, bool *const_op)
         *const_op = false;
 
         rc = -EINVAL;
-        if ( data->pad[0] || data->pad[1] || data->pad[2] )
+        if ( data->pad[0] || data->pad[1] )
             break;
 
-        rc = ioreq_server_create(d, data->handle_bufioreq,
+        rc = ioreq_server_create(d, data->handle_bufioreq, data->flags,
                                  &data->id);
         break;
     }
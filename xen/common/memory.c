@@ -24,6 +24,8 @@
 #include <xen/perfc.h>
 #include <xen/sched.h>
 #include <xen/sections.h>
+#include <xen/softirq.h>
+#include <xen/tasklet.h>
 #include <xen/trace.h>
 #include <xen/types.h>
 #include <asm/current.h>
@@ -156,12 +158,340 @@ static void increase_reservation(struct memop_args *a)
     a->nr_done = i;
 }
 
+/*
+ * Large populate requests may have their allocations, and hence the scrubbing
+ * of any dirty memory handed out, spread across idle cpus of the NUMA node
+ * the calling cpu's allocations would be served from.  The helpers use the
+ * same memflags, leaving the choice of node to the allocator as for serial
+ * requests.  Insertion into the physmap remains with the calling cpu.
+ *
+ * Extents are allocated ahead without an owner, and assigned to the domain
+ * only when inserted.  Those left over when the request gets preempted are
+ * kept by the calling vcpu for the continuation to pick up.
+ */
+static bool __read_mostly opt_populate_parallel = true;
+boolean_param("populate-parallel", opt_populate_parallel);
+
+/* Don't bother with helpers for requests smaller than this many pages. */
+#define POPULATE_MIN_PAGES    (1U << 15)
+/* Upper bounds of extents and pages allocated per round. */
+#define POPULATE_BATCH        1024U
+#define POPULATE_BATCH_PAGES  (1U << 16)
+/* Upper bound of helper cpus per round, in addition to the calling one. */
+#define POPULATE_MAX_HELPERS  7U
+/* Upper bound of pages a helper allocates per run of its tasklet. */
+#define POPULATE_HELPER_PAGES 512U
+
+struct populate_helper {
+    struct tasklet tasklet;
+    struct populate_state *state;
+    unsigned int cpu;
+    /* Extents [start, end) of the round to allocate, nr_done of which were. */
+    unsigned int start, end, nr_done;
+    /* An allocation failed, as opposed to being stopped. */
+    bool failed;
+};
+
+struct populate_state {
+    struct domain *d;
+    domid_t domid;
+    unsigned int order;
+    /* Memflags of the request, and those to allocate extents ahead with. */
+    unsigned int memflags, alloc_memflags;
+    unsigned int batch;
+    /* Falling back to allocating extent by extent on the calling cpu. */
+    bool serial;
+    /* The calling cpu got preempted: helpers are to stop early. */
+    bool stop;
+
+    /*
+     * Extents [base, base + nr) are covered by the last round.  Those not
+     * allocated ahead, or already handed out, have NULL pages[] entries.
+     */
+    unsigned int base, nr;
+    struct page_info *pages[POPULATE_BATCH];
+
+    atomic_t pending;
+    cpumask_t cpus;
+    struct populate_helper helpers[POPULATE_MAX_HELPERS + 1];
+};
+
+/*
+ * Allocate up to nr more of the helper's extents.  The calling cpu's helper
+ * stops at the first extent after its first one with preemption pending.
+ * Returns whether the helper is done, having allocated all of its extents,
+ * failed to allocate one, or been stopped.
+ */
+static bool populate_alloc_extents(struct populate_helper *h, unsigned int nr)
+{
+    struct populate_state *s = h->state;
+    bool caller = h == &s->helpers[0];
+    unsigned int i;
+
+    if ( !caller && ACCESS_ONCE(s->stop) )
+        return true;
+
+    for ( i = h->start + h->nr_done; i < h->end && nr--; i++ )
+    {
+        struct page_info *pg;
+
+        if ( caller && i != h->start && hypercall_preempt_check() )
+        {
+            write_atomic(&s->stop, true);
+            break;
+        }
+
+        pg = alloc_domheap_pages(s->d, s->order, s->alloc_memflags);
+        if ( !pg )
+        {
+            h->failed = true;
+            break;
+        }
+
+        s->pages[i] = pg;
+    }
+
+    h->nr_done = i - h->start;
+
+    return i == h->end || h->failed || ACCESS_ONCE(s->stop);
+}
+
+static void cf_check populate_helper_fn(void *data)
+{
+    struct populate_helper *h = data;
+
+    /* Let other softirqs run between chunks of the helper's extents. */
+    if ( !populate_alloc_extents(h, max(POPULATE_HELPER_PAGES >>
+                                        h->state->order, 1U)) )
+    {
+        tasklet_schedule(&h->tasklet);
+        return;
+    }
+
+    smp_wmb();
+    atomic_dec(&h->state->pending);
+}
+
+/* Free all extents allocated ahead, and the state. */
+static void populate_free(struct populate_state *s)
+{
+    unsigned int i;
+
+    if ( !s )
+        return;
+
+    for ( i = 0; i < s->nr; i++ )
+        if ( s->pages[i] )
+            free_domheap_pages(s->pages[i], s->order);
+
+    xfree(s);
+}
+
+static struct populate_state *populate_init(const struct memop_args *a)
+{
+    struct domain *d = a->domain;
+    struct vcpu *curr = current;
+    struct populate_state *s = curr->populate_state;
+    unsigned int bits = a->memflags >> _MEMF_bits;
+
+    /* Pick up extents allocated ahead for this request before preemption. */
+    curr->populate_state = NULL;
+    if ( s && s->d == d && s->domid == d->domain_id &&
+         s->order == a->extent_order && s->memflags == a->memflags &&
+         a->nr_done >= s->base && a->nr_done < s->base + s->nr )
+        return s;
+    populate_free(s);
+
+    if ( !opt_populate_parallel ||
+         (a->memflags & (MEMF_populate_on_demand | MEMF_no_refcount)) ||
+         is_domain_direct_mapped(d) || is_domain_using_staticmem(d) ||
+         ((unsigned long)(a->nr_extents - a->nr_done) << a->extent_order) <
+         POPULATE_MIN_PAGES )
+        return NULL;
+
+    s = xzalloc(struct populate_state);
+    if ( !s )
+        return NULL;
+
+    s->d = d;
+    s->domid = d->domain_id;
+    s->order = a->extent_order;
+    s->batch = min(POPULATE_BATCH,
+                   max(POPULATE_BATCH_PAGES >> a->extent_order, 1U));
+    s->memflags = a->memflags;
+
+    /* Without an owner, the allocator can't apply the domain's limits. */
+    bits = domain_clamp_alloc_bitsize(d, bits ?: BITS_PER_LONG + PAGE_SHIFT);
+    s->alloc_memflags = (a->memflags & ~MEMF_bits(~0U)) | MEMF_bits(bits) |
+                        MEMF_no_owner;
+
+    return s;
+}
+
+/*
+ * Allocate the next round of nr extents, starting at extent first, using the
+ * calling cpu along with any idle cpus of the domain's nodes.  Only the leading
+ * extents up to the first failed allocation are kept, with anything beyond
+ * it freed again and the remainder of the request continuing serially, for
+ * the outcome to match that of allocating extent by extent.  Extents skipped
+ * because of preemption are allocated serially when needed.
+ */
+static void populate_alloc_round(struct populate_state *s, unsigned int first,
+                                 unsigned int nr)
+{
+    const struct domain *d = s->d;
+    unsigned int cpu, i, nr_helpers = 0, start = 0;
+    nodeid_t node = MEMF_get_node(s->memflags);
+    bool failed = false;
+
+    /*
+     * Without a node asked for, allocations are served from the calling
+     * cpu's node if the domain has affinity to it, and from the domain's
+     * next node otherwise.
+     */
+    if ( node == NUMA_NO_NODE )
+    {
+        node = cpu_to_node(smp_processor_id());
+        if ( !nodemask_test(node, &d->node_affinity) )
+            node = cycle_node(d->last_alloc_node, d->node_affinity);
+    }
+
+    cpumask_clear(&s->cpus);
+    if ( node < MAX_NUMNODES )
+        cpumask_and(&s->cpus, &node_to_cpumask(node), &cpu_online_map);
+    __cpumask_clear_cpu(smp_processor_id(), &s->cpus);
+
+    for_each_cpu ( cpu, &s->cpus )
+    {
+        struct populate_helper *h;
+
+        if ( nr_helpers == POPULATE_MAX_HELPERS || nr_helpers + 1 >= nr )
+            break;
+        if ( !sched_cpu_is_idle(cpu) )
+            continue;
+
+        h = &s->helpers[++nr_helpers];
+        h->cpu = cpu;
+        softirq_tasklet_init(&h->tasklet, populate_helper_fn, h);
+    }
+
+    s->stop = false;
+    for ( i = 0; i <= nr_helpers; i++ )
+    {
+        struct populate_helper *h = &s->helpers[i];
+
+        h->state = s;
+        h->start = start;
+        start += nr / (nr_helpers + 1) + (i < nr % (nr_helpers + 1));
+        h->end = start;
+        h->nr_done = 0;
+        h->failed = false;
+    }
+
+    atomic_set(&s->pending, nr_helpers);
+    for ( i = 1; i <= nr_helpers; i++ )
+        tasklet_schedule_on_cpu(&s->helpers[i].tasklet, s->helpers[i].cpu);
+
+    populate_alloc_extents(&s->helpers[0], UINT_MAX);
+
+    /*
+     * Helpers run in softirq context.  Process our own softirqs while waiting,
+     * in case a helper got moved here by its cpu going offline.  Once we got
+     * preempted, helpers stop after their current chunk.
+     */
+    while ( atomic_read(&s->pending) )
+    {
+        process_pending_softirqs();
+        cpu_relax();
+    }
+    smp_rmb();
+
+    for ( i = 1; i <= nr_helpers; i++ )
+        tasklet_kill(&s->helpers[i].tasklet);
+
+    s->base = first;
+    s->nr = nr;
+    for ( i = 0; i <= nr_helpers; i++ )
+    {
+        const struct populate_helper *h = &s->helpers[i];
+        unsigned int j;
+
+        if ( !failed )
+        {
+            if ( h->failed )
+            {
+                s->nr = h->start + h->nr_done;
+                failed = true;
+            }
+            continue;
+        }
+
+        for ( j = h->start; j < h->start + h->nr_done; j++ )
+        {
+            free_domheap_pages(s->pages[j], s->order);
+            s->pages[j] = NULL;
+        }
+    }
+
+    s->serial = failed;
+}
+
+static struct page_info *populate_get_extent(struct populate_state *s,
+                                             unsigned int i,
+                                             unsigned int nr_extents)
+{
+    struct page_info *pg = NULL;
+
+    if ( !s->serial && (i < s->base || i >= s->base + s->nr) )
+        populate_alloc_round(s, i, min(nr_extents - i, s->batch));
+
+    if ( i >= s->base && i < s->base + s->nr )
+    {
+        pg = s->pages[i - s->base];
+        s->pages[i - s->base] = NULL;
+    }
+
+    if ( !pg )
+        return alloc_domheap_pages(s->d, s->order, s->memflags);
+
+    if ( assign_page(pg, s->order, s->d, s->memflags) )
+    {
+        free_domheap_pages(pg, s->order);
+        return NULL;
+    }
+
+    return pg;
+}
+
+/*
+ * Hand extents allocated ahead of extent next to the continuation of a
+ * preempted request, and free them otherwise.
+ */
+static void populate_done(struct populate_state *s, bool preempted,
+                          unsigned int next)
+{
+    if ( s && preempted && next >= s->base && next < s->base + s->nr )
+    {
+        current->populate_state = s;
+        return;
+    }
+
+    populate_free(s);
+}
+
+void populate_vcpu_teardown(struct vcpu *v)
+{
+    populate_free(v->populate_state);
+    v->populate_state = NULL;
+}
+
 static void populate_physmap(struct memop_args *a)
 {
     struct page_info *page;
     unsigned int i, j;
     xen_pfn_t gpfn;
     struct domain *d = a->domain, *curr_d = current->domain;
+    struct populate_state *ps;
     bool need_tlbflush = false;
     uint32_t tlbflush_timestamp = 0;
 
@@ -194,6 +524,8 @@ static void populate_physmap(struct memop_args *a)
         a->memflags |= MEMF_no_icache_flush;
     }
 
+    ps = populate_init(a);
+
     for ( i = a->nr_done; i < a->nr_extents; i++ )
     {
         mfn_t mfn;
@@ -272,7 +604,9 @@ static void populate_physmap(struct memop_args *a)
             }
             else
             {
-                page = alloc_domheap_pages(d, a->extent_order, a->memflags);
+                page = ps ? populate_get_extent(ps, i, a->nr_extents)
+                          : alloc_domheap_pages(d, a->extent_order,
+                                                a->memflags);
 
                 if ( unlikely(!page) )
                 {
@@ -304,6 +638,8 @@ static void populate_physmap(struct memop_args *a)
     }
 
 out:
+    populate_done(ps, a->preempted, i);
+
     if ( need_tlbflush )
         filtered_flush_tlb_mask(tlbflush_timestamp);
 
@@ -1122,14 +1458,26 @@ static long xatp_permission_check(struct domain *d, unsigned int space)
     return xsm_add_to_physmap(XSM_TARGET, current->domain, d);
 }
 
-static unsigned int ioreq_server_max_frames(const struct domain *d)
+static unsigned int ioreq_server_max_frames(struct domain *d, unsigned int id)
 {
     unsigned int nr = 0;
 
 #ifdef CONFIG_IOREQ_SERVER
+    unsigned int nr_batch;
+
     if ( is_hvm_domain(d) )
+    {
         /* One frame for the buf-ioreq ring, and one frame per 128 vcpus. */
         nr = 1 + DIV_ROUND_UP(d->max_vcpus * sizeof(struct ioreq), PAGE_SIZE);
+
+        /*
+         * The batch frames of a server created with them follow at a fixed
+         * offset: cover the range up to the last one, gap included.
+         */
+        if ( id == (ioservid_t)id &&
+             (nr_batch = ioreq_server_nr_batch_frames(d, id)) != 0 )
+            nr = XENMEM_resource_ioreq_server_frame_batch(nr_batch);
+    }
 #endif
 
     return nr;
@@ -1142,7 +1490,7 @@ static unsigned int ioreq_server_max_frames(const struct domain *d)
  * property of the domain), and describe the full resource (i.e. mapping the
  * result of this call will be the entire resource).
  */
-static unsigned int resource_max_frames(const struct domain *d,
+static unsigned int resource_max_frames(struct domain *d,
                                         unsigned int type, unsigned int id)
 {
     switch ( type )
@@ -1151,7 +1499,7 @@ static unsigned int resource_max_frames(const struct domain *d,
         return gnttab_resource_max_frames(d, id);
 
     case XENMEM_resource_ioreq_server:
-        return ioreq_server_max_frames(d);
+        return ioreq_server_max_frames(d, id);
 
     case XENMEM_resource_vmtrace_buf:
         return d->vmtrace_size >> PAGE_SHIFT;
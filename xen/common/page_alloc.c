@@ -120,6 +120,7 @@
  *   regions within it.
  */
 
+#include <xen/cpu.h>
 #include <xen/domain_page.h>
 #include <xen/event.h>
 #include <xen/init.h>
@@ -474,6 +475,16 @@ static long total_avail_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags, struct domain *d);
+static bool page_cache_free(struct page_info *pg, unsigned int order,
+                            bool need_scrub);
+static bool page_cache_scrub(void);
+static bool drain_page_caches(void);
+static unsigned long page_cache_avail(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int node);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -517,6 +528,10 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
      * must always take the global heap_lock rather than only in the much
      * rarer case that d->outstanding_pages is non-zero
      */
+    if ( pages )
+        /* Claims can only be staked on memory in the heap. */
+        drain_page_caches();
+
     nrspin_lock(&d->page_alloc_lock);
     spin_lock(&heap_lock);
 
@@ -719,6 +734,10 @@ static void check_low_mem_virq(void)
 {
     unsigned long avail_pages = total_avail_pages - outstanding_claims;
 
+    /* Pages held by the page caches are free, too. */
+    if ( unlikely(avail_pages <= low_mem_virq_th) )
+        avail_pages += page_cache_avail(0, NR_ZONES - 1, -1);
+
     if ( unlikely(avail_pages <= low_mem_virq_th) )
     {
         send_global_virq(VIRQ_ENOMEM);
@@ -935,43 +954,24 @@ static void init_free_page_fields(struct page_info *pg)
     page_set_owner(pg, NULL);
 }
 
-/* Allocate 2^@order contiguous pages. */
-static struct page_info *alloc_heap_pages(
+/*
+ * Take 2^@order contiguous pages off the heap, splitting a larger buddy as
+ * necessary.  The pages are marked in use, but retain PGC_need_scrub and
+ * their TLB flush state for finish_alloc_pages().  Returns whether any of
+ * them needs scrubbing in *dirty.
+ */
+static struct page_info *take_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
-    struct domain *d)
+    struct domain *d, bool *dirty)
 {
     nodeid_t node;
     unsigned int i, buddy_order, zone, first_dirty;
     unsigned long request = 1UL << order;
-    struct page_info *pg;
-    bool need_tlbflush = false;
-    uint32_t tlbflush_timestamp = 0;
     unsigned int dirty_cnt = 0;
-    mfn_t mfn;
-
-    /* Make sure there are enough bits in memflags for nodeID. */
-    BUILD_BUG_ON((_MEMF_bits - _MEMF_node) < (8 * sizeof(nodeid_t)));
-
-    ASSERT(zone_lo <= zone_hi);
-    ASSERT(zone_hi < NR_ZONES);
-
-    if ( unlikely(order > MAX_ORDER) )
-        return NULL;
-
-    spin_lock(&heap_lock);
+    struct page_info *pg;
 
-    /*
-     * Claimed memory is considered unavailable unless the request
-     * is made by a domain with sufficient unclaimed pages.
-     */
-    if ( (outstanding_claims + request > total_avail_pages) &&
-          ((memflags & MEMF_no_refcount) ||
-           !d || d->outstanding_pages < request) )
-    {
-        spin_unlock(&heap_lock);
-        return NULL;
-    }
+    ASSERT(spin_is_locked(&heap_lock));
 
     pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d);
     /* Try getting a dirty buddy if we couldn't get a clean one. */
@@ -979,11 +979,7 @@ static struct page_info *alloc_heap_pages(
         pg = get_free_buddy(zone_lo, zone_hi, order,
                             memflags | MEMF_no_scrub, d);
     if ( !pg )
-    {
-        /* No suitable memory blocks. Fail the request. */
-        spin_unlock(&heap_lock);
         return NULL;
-    }
 
     node = page_to_nid(pg);
     zone = page_to_zone(pg);
@@ -1036,9 +1032,34 @@ static struct page_info *alloc_heap_pages(
         /* PGC_need_scrub can only be set if first_dirty is valid */
         ASSERT(first_dirty != INVALID_DIRTY_IDX || !(pg[i].count_info & PGC_need_scrub));
 
+        /* Dirty pages leave the heap's scrub accounting here. */
+        if ( pg[i].count_info & PGC_need_scrub )
+            dirty_cnt++;
+
         /* Preserve PGC_need_scrub so we can check it after lock is dropped. */
         pg[i].count_info = PGC_state_inuse | (pg[i].count_info & PGC_need_scrub);
+    }
+
+    node_need_scrub[node] -= dirty_cnt;
+    *dirty = first_dirty != INVALID_DIRTY_IDX;
+
+    return pg;
+}
+
+/*
+ * Hand out 2^@order pages taken off the heap or a page cache: scrub them as
+ * requested, and flush any stale TLB entries and cache lines.
+ */
+static void finish_alloc_pages(struct page_info *pg, unsigned int order,
+                               unsigned int memflags, bool dirty)
+{
+    unsigned int i;
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+    mfn_t mfn;
 
+    for ( i = 0; i < (1U << order); i++ )
+    {
         if ( !(memflags & MEMF_no_tlbflush) )
             accumulate_tlbflush(&need_tlbflush, &pg[i],
                                 &tlbflush_timestamp);
@@ -1046,10 +1067,7 @@ static struct page_info *alloc_heap_pages(
         init_free_page_fields(&pg[i]);
     }
 
-    spin_unlock(&heap_lock);
-
-    if ( first_dirty != INVALID_DIRTY_IDX ||
-         (scrub_debug && !(memflags & MEMF_no_scrub)) )
+    if ( dirty || (scrub_debug && !(memflags & MEMF_no_scrub)) )
     {
         for ( i = 0; i < (1U << order); i++ )
         {
@@ -1057,19 +1075,10 @@ static struct page_info *alloc_heap_pages(
             {
                 if ( !(memflags & MEMF_no_scrub) )
                     scrub_one_page(&pg[i]);
-
-                dirty_cnt++;
             }
             else if ( !(memflags & MEMF_no_scrub) )
                 check_one_page(&pg[i]);
         }
-
-        if ( dirty_cnt )
-        {
-            spin_lock(&heap_lock);
-            node_need_scrub[node] -= dirty_cnt;
-            spin_unlock(&heap_lock);
-        }
     }
 
     if ( need_tlbflush )
@@ -1082,6 +1091,51 @@ static struct page_info *alloc_heap_pages(
     mfn = page_to_mfn(pg);
     for ( i = 0; i < (1U << order); i++ )
         flush_page_to_ram(mfn_x(mfn) + i, !(memflags & MEMF_no_icache_flush));
+}
+
+/* Allocate 2^@order contiguous pages. */
+static struct page_info *alloc_heap_pages(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    unsigned long request = 1UL << order;
+    struct page_info *pg;
+    bool dirty;
+
+    /* Make sure there are enough bits in memflags for nodeID. */
+    BUILD_BUG_ON((_MEMF_bits - _MEMF_node) < (8 * sizeof(nodeid_t)));
+
+    ASSERT(zone_lo <= zone_hi);
+    ASSERT(zone_hi < NR_ZONES);
+
+    if ( unlikely(order > MAX_ORDER) )
+        return NULL;
+
+    pg = page_cache_alloc(zone_lo, zone_hi, order, memflags, d);
+    if ( pg )
+        return pg;
+
+    spin_lock(&heap_lock);
+
+    /*
+     * Claimed memory is considered unavailable unless the request
+     * is made by a domain with sufficient unclaimed pages.
+     */
+    if ( (outstanding_claims + request > total_avail_pages) &&
+          ((memflags & MEMF_no_refcount) ||
+           !d || d->outstanding_pages < request) )
+        pg = NULL;
+    else
+        pg = take_heap_pages(zone_lo, zone_hi, order, memflags, d, &dirty);
+
+    spin_unlock(&heap_lock);
+
+    /* No suitable memory blocks. Fail the request. */
+    if ( !pg )
+        return NULL;
+
+    finish_alloc_pages(pg, order, memflags, dirty);
 
     return pg;
 }
@@ -1289,6 +1343,9 @@ bool scrub_free_pages(void)
     nodeid_t node;
     unsigned int cnt = 0;
 
+    if ( page_cache_scrub() )
+        return true;
+
     node = node_to_scrub(true);
     if ( node == NUMA_NO_NODE )
         return false;
@@ -1405,11 +1462,39 @@ bool scrub_free_pages(void)
     return node_to_scrub(false) != NUMA_NO_NODE;
 }
 
-static bool mark_page_free(struct page_info *pg, mfn_t mfn)
+/*
+ * Wake up an idle cpu on each node holding dirty memory, for its scrubbing to
+ * start right away rather than whenever these cpus next leave their sleep
+ * state.  Used after a dying domain released all of its memory.
+ */
+void scrub_kick_idle_cpus(void)
 {
-    bool pg_offlined = false;
+    cpumask_t mask;
+    unsigned int node, cpu;
 
-    ASSERT(mfn_x(mfn) == mfn_x(page_to_mfn(pg)));
+    cpumask_clear(&mask);
+
+    for_each_online_node ( node )
+    {
+        if ( !node_need_scrub[node] || nodemask_test(node, &node_scrubbing) )
+            continue;
+
+        for_each_cpu ( cpu, &node_to_cpumask(node) )
+            if ( cpu_online(cpu) && sched_cpu_is_idle(cpu) )
+            {
+                __cpumask_set_cpu(cpu, &mask);
+                break;
+            }
+    }
+
+    if ( !cpumask_empty(&mask) )
+        cpumask_raise_softirq(&mask, SCHEDULE_SOFTIRQ);
+}
+
+/* Returns whether the page was pending offlining, and is offlined now. */
+static bool mark_page_state_free(struct page_info *pg, mfn_t mfn)
+{
+    bool pg_offlined = false;
 
     /*
      * Cannot assume that count_info == 0, as there are some corner cases
@@ -1444,6 +1529,12 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
         BUG();
     }
 
+    return pg_offlined;
+}
+
+/* Detach a page being freed from its owner. */
+static void release_page_owner(struct page_info *pg, mfn_t mfn)
+{
     /* If a page has no owner it will need no safety TLB flush. */
     pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
     if ( pg->u.free.need_tlbflush )
@@ -1452,35 +1543,32 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
     /* This page is not a guest frame any more. */
     page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
     set_gpfn_from_mfn(mfn_x(mfn), INVALID_M2P_ENTRY);
-
-    return pg_offlined;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order, bool need_scrub)
+static bool mark_page_free(struct page_info *pg, mfn_t mfn)
 {
-    unsigned long mask;
-    mfn_t mfn = page_to_mfn(pg);
-    unsigned int i, node = mfn_to_nid(mfn);
-    unsigned int zone = page_to_zone(pg);
-    bool pg_offlined = false;
+    bool pg_offlined;
 
-    ASSERT(order <= MAX_ORDER);
+    ASSERT(mfn_x(mfn) == mfn_x(page_to_mfn(pg)));
 
-    spin_lock(&heap_lock);
+    pg_offlined = mark_page_state_free(pg, mfn);
+    release_page_owner(pg, mfn);
 
-    for ( i = 0; i < (1 << order); i++ )
-    {
-        if ( mark_page_free(&pg[i], mfn_add(mfn, i)) )
-            pg_offlined = true;
+    return pg_offlined;
+}
 
-        if ( need_scrub )
-        {
-            pg[i].count_info |= PGC_need_scrub;
-            poison_one_page(&pg[i]);
-        }
-    }
+/*
+ * Return 2^@order pages, already marked free, to the heap, merging them with
+ * free buddies as far as possible.
+ */
+static void add_free_heap_pages(struct page_info *pg, unsigned int order,
+                                unsigned int zone, bool need_scrub,
+                                bool pg_offlined)
+{
+    unsigned long mask;
+    unsigned int node = mfn_to_nid(page_to_mfn(pg));
+
+    ASSERT(spin_is_locked(&heap_lock));
 
     avail[node][zone] += 1 << order;
     total_avail_pages += 1 << order;
@@ -1551,10 +1639,453 @@ static void free_heap_pages(
 
     if ( pg_offlined )
         reserve_offlined_page(pg);
+}
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    mfn_t mfn = page_to_mfn(pg);
+    unsigned int i, zone = page_to_zone(pg);
+    bool pg_offlined = false;
+
+    ASSERT(order <= MAX_ORDER);
+
+    if ( page_cache_free(pg, order, need_scrub) )
+        return;
+
+    spin_lock(&heap_lock);
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        if ( mark_page_free(&pg[i], mfn_add(mfn, i)) )
+            pg_offlined = true;
+
+        if ( need_scrub )
+        {
+            pg[i].count_info |= PGC_need_scrub;
+            poison_one_page(&pg[i]);
+        }
+    }
+
+    add_free_heap_pages(pg, order, zone, need_scrub, pg_offlined);
+
+    spin_unlock(&heap_lock);
+}
+
+
+/*
+ * Per-CPU caches of free pages of small orders, serving most allocations and
+ * frees without taking heap_lock.  They are refilled from, and drained to,
+ * the heap in batches, and only hold memory of their CPU's node.
+ *
+ * To the heap, cached pages are in use without an owner.  They don't count
+ * towards avail[] or total_avail_pages, so claims can't be staked on them,
+ * but avail_heap_pages() and the low memory VIRQ account for them.  Pages
+ * which get marked for offlining while cached are offlined once they are
+ * returned to the heap.
+ * Dirty chunks are kept at the cold end of the lists, and scrubbed by the
+ * idle loop of the cache's CPU like those in the heap.
+ */
+#define PAGE_CACHE_MAX_ORDER 3
+#define PAGE_CACHE_BATCH     32U  /* Pages moved to or from the heap at once. */
+#define PAGE_CACHE_HIGH      128U /* Pages of each order cached at most. */
+
+struct page_cache {
+    spinlock_t lock;
+    bool enabled;
+    /* May hold pages needing scrubbing. */
+    bool dirty;
+    nodeid_t node;
+    /* Chunks of each order. */
+    unsigned int count[PAGE_CACHE_MAX_ORDER + 1];
+    struct page_list_head list[PAGE_CACHE_MAX_ORDER + 1];
+    /* Cached pages per zone, for avail_heap_pages(). */
+    unsigned long avail[NR_ZONES];
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+
+/* Return chunks of 2^@order cached pages to the heap. */
+static void page_cache_release(struct page_list_head *list,
+                               unsigned int order)
+{
+    struct page_info *pg;
+    unsigned int i;
+
+    spin_lock(&heap_lock);
+
+    while ( (pg = page_list_remove_head(list)) )
+    {
+        mfn_t mfn = page_to_mfn(pg);
+        unsigned int zone = page_to_zone(pg);
+        bool need_scrub = false, pg_offlined = false;
+
+        /* Chunks may have been refilled with partially dirty buddies. */
+        for ( i = 0; i < (1U << order); i++ )
+            if ( pg[i].count_info & PGC_need_scrub )
+                need_scrub = true;
+
+        /* The owners were already released by page_cache_free(). */
+        for ( i = 0; i < (1U << order); i++ )
+        {
+            if ( mark_page_state_free(&pg[i], mfn_add(mfn, i)) )
+                pg_offlined = true;
+
+            if ( need_scrub )
+                pg[i].count_info |= PGC_need_scrub;
+        }
+
+        add_free_heap_pages(pg, order, zone, need_scrub, pg_offlined);
+    }
 
     spin_unlock(&heap_lock);
 }
 
+/* Refill an empty cache with a batch of 2^@order chunks off the heap. */
+static void page_cache_refill(struct page_cache *pc, unsigned int zone_lo,
+                              unsigned int zone_hi, unsigned int order)
+{
+    unsigned int i, nr = max(PAGE_CACHE_BATCH >> order, 1U);
+    struct page_info *pg;
+    bool dirty;
+
+    ASSERT(spin_is_locked(&pc->lock));
+
+    perfc_incr(page_cache_refill);
+
+    spin_lock(&heap_lock);
+
+    /* Leave claimed memory alone. */
+    if ( outstanding_claims + (nr << order) > total_avail_pages )
+        goto out;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        pg = take_heap_pages(zone_lo, zone_hi, order,
+                             MEMF_node(pc->node) | MEMF_exact_node, NULL,
+                             &dirty);
+        if ( !pg )
+            break;
+
+        page_list_add_tail(pg, &pc->list[order]);
+        pc->count[order]++;
+        pc->avail[page_to_zone(pg)] += 1U << order;
+        pc->dirty |= dirty;
+    }
+
+ out:
+    spin_unlock(&heap_lock);
+}
+
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags, struct domain *d)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    nodeid_t node = MEMF_get_node(memflags);
+    struct page_info *pg;
+    unsigned int i, zone;
+    bool dirty = false;
+
+    if ( order > PAGE_CACHE_MAX_ORDER || !pc->enabled ||
+         zone_hi == MEMZONE_XEN )
+        return NULL;
+
+    /* Leave requests for other nodes to the heap. */
+    if ( node != NUMA_NO_NODE
+         ? node != pc->node
+         : d && !nodemask_test(pc->node, &d->node_affinity) )
+        return NULL;
+
+    spin_lock(&pc->lock);
+
+    if ( page_list_empty(&pc->list[order]) )
+        page_cache_refill(pc, zone_lo, zone_hi, order);
+
+    if ( page_list_empty(&pc->list[order]) ||
+         (zone = page_to_zone(page_list_first(&pc->list[order]))) < zone_lo ||
+         zone > zone_hi )
+    {
+        spin_unlock(&pc->lock);
+        perfc_incr(page_cache_alloc_miss);
+        return NULL;
+    }
+
+    pg = page_list_remove_head(&pc->list[order]);
+    pc->count[order]--;
+    pc->avail[zone] -= 1U << order;
+
+    spin_unlock(&pc->lock);
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        unsigned long x = ACCESS_ONCE(pg[i].count_info);
+
+        if ( (x & PGC_state) != PGC_state_inuse )
+        {
+            PAGE_LIST_HEAD(list);
+
+            /* Offlining is pending: hand the chunk to the heap to finish. */
+            page_list_add(pg, &list);
+            page_cache_release(&list, order);
+            perfc_incr(page_cache_alloc_miss);
+            return NULL;
+        }
+
+        if ( x & PGC_need_scrub )
+            dirty = true;
+    }
+
+    if ( d )
+        d->last_alloc_node = pc->node;
+
+    finish_alloc_pages(pg, order, memflags, dirty);
+    perfc_incr(page_cache_alloc);
+
+    return pg;
+}
+
+static bool page_cache_free(struct page_info *pg, unsigned int order,
+                            bool need_scrub)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    mfn_t mfn = page_to_mfn(pg);
+    unsigned int i, zone = page_to_zone(pg);
+    unsigned int batch = max(PAGE_CACHE_BATCH >> order, 1U);
+    PAGE_LIST_HEAD(excess);
+    unsigned long x;
+
+    if ( order > PAGE_CACHE_MAX_ORDER || !pc->enabled ||
+         zone == MEMZONE_XEN || mfn_to_nid(mfn) != pc->node )
+        return false;
+
+    /*
+     * Without heap_lock, the pages can only be moved from one in-use state
+     * to another.  Leave those pending offlining to free_heap_pages().
+     */
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        x = ACCESS_ONCE(pg[i].count_info);
+        if ( (x & (PGC_state | PGC_broken)) != PGC_state_inuse ||
+             cmpxchg(&pg[i].count_info, x, PGC_state_inuse) != x )
+            return false;
+    }
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        release_page_owner(&pg[i], mfn_add(mfn, i));
+
+        if ( need_scrub )
+        {
+            set_bit(_PGC_need_scrub, &pg[i].count_info);
+            poison_one_page(&pg[i]);
+        }
+    }
+
+    spin_lock(&pc->lock);
+
+    /* Hand out clean chunks first, and return dirty ones to the heap first. */
+    if ( need_scrub )
+    {
+        page_list_add_tail(pg, &pc->list[order]);
+        pc->dirty = true;
+    }
+    else
+        page_list_add(pg, &pc->list[order]);
+    pc->avail[zone] += 1U << order;
+
+    /* Return the coldest chunks to the heap once over the limit. */
+    if ( ++pc->count[order] > (PAGE_CACHE_HIGH >> order) )
+    {
+        for ( i = 0; i < batch; i++ )
+        {
+            pg = page_list_last(&pc->list[order]);
+            page_list_del(pg, &pc->list[order]);
+            page_list_add(pg, &excess);
+            pc->avail[page_to_zone(pg)] -= 1U << order;
+        }
+        pc->count[order] -= batch;
+    }
+
+    spin_unlock(&pc->lock);
+
+    if ( !page_list_empty(&excess) )
+    {
+        page_cache_release(&excess, order);
+        perfc_incr(page_cache_drain);
+    }
+
+    perfc_incr(page_cache_free);
+
+    return true;
+}
+
+/*
+ * Scrub dirty pages of this CPU's cache from the idle loop, so that they
+ * needn't be scrubbed when handed out.  Returns whether any are left.
+ */
+static bool page_cache_scrub(void)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    unsigned int cpu = smp_processor_id(), order, i, cnt = 0;
+    struct page_info *pg;
+
+    if ( !pc->enabled || !ACCESS_ONCE(pc->dirty) )
+        return false;
+
+    spin_lock(&pc->lock);
+
+    for ( order = 0; order <= PAGE_CACHE_MAX_ORDER; order++ )
+        page_list_for_each ( pg, &pc->list[order] )
+            for ( i = 0; i < (1U << order); i++ )
+            {
+                if ( !test_bit(_PGC_need_scrub, &pg[i].count_info) )
+                    continue;
+
+                /*
+                 * Scrub a few pages before becoming eligible for preemption,
+                 * and don't keep a drain waiting for too long.
+                 */
+                if ( cnt >= PAGE_CACHE_BATCH ||
+                     (cnt >= 8 && softirq_pending(cpu)) )
+                {
+                    spin_unlock(&pc->lock);
+                    return true;
+                }
+
+                scrub_one_page(&pg[i]);
+                /* Offlining may update count_info concurrently. */
+                clear_bit(_PGC_need_scrub, &pg[i].count_info);
+                cnt++;
+            }
+
+    pc->dirty = false;
+
+    spin_unlock(&pc->lock);
+
+    return false;
+}
+
+/* Return all pages of a cache to the heap.  Returns whether there were any. */
+static bool drain_page_cache(struct page_cache *pc)
+{
+    struct page_list_head list[PAGE_CACHE_MAX_ORDER + 1];
+    unsigned int order;
+    bool drained = false;
+
+    spin_lock(&pc->lock);
+
+    for ( order = 0; order <= PAGE_CACHE_MAX_ORDER; order++ )
+    {
+        INIT_PAGE_LIST_HEAD(&list[order]);
+        page_list_move(&list[order], &pc->list[order]);
+        drained |= pc->count[order];
+        pc->count[order] = 0;
+    }
+    memset(pc->avail, 0, sizeof(pc->avail));
+    pc->dirty = false;
+
+    spin_unlock(&pc->lock);
+
+    if ( !drained )
+        return false;
+
+    for ( order = 0; order <= PAGE_CACHE_MAX_ORDER; order++ )
+        if ( !page_list_empty(&list[order]) )
+            page_cache_release(&list[order], order);
+
+    perfc_incr(page_cache_drain);
+
+    return true;
+}
+
+/*
+ * Return the pages of all caches to the heap.  The per-CPU area of a CPU
+ * going offline meanwhile is freed only after an RCU grace period, which
+ * can't complete while we are running.
+ */
+static bool drain_page_caches(void)
+{
+    unsigned int cpu;
+    bool drained = false;
+
+    for_each_online_cpu ( cpu )
+    {
+        struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+        if ( pc->enabled && drain_page_cache(pc) )
+            drained = true;
+    }
+
+    return drained;
+}
+
+/* Pages in page caches within a zone range, for @node or all nodes (-1). */
+static unsigned long page_cache_avail(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int node)
+{
+    unsigned int cpu, zone;
+    unsigned long pages = 0;
+
+    for_each_online_cpu ( cpu )
+    {
+        const struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+        if ( !pc->enabled || (node != -1 && node != pc->node) )
+            continue;
+
+        for ( zone = zone_lo; zone <= zone_hi; zone++ )
+            pages += ACCESS_ONCE(pc->avail[zone]);
+    }
+
+    return pages;
+}
+
+static int cf_check page_cache_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    unsigned int order;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pc->lock);
+        for ( order = 0; order <= PAGE_CACHE_MAX_ORDER; order++ )
+            INIT_PAGE_LIST_HEAD(&pc->list[order]);
+        pc->node = cpu_to_node(cpu);
+        pc->enabled = pc->node < MAX_NUMNODES;
+        break;
+
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        pc->enabled = false;
+        drain_page_cache(pc);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block page_cache_cpu_nfb = {
+    .notifier_call = page_cache_cpu_callback,
+};
+
+static int __init cf_check page_cache_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    page_cache_cpu_callback(&page_cache_cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&page_cache_cpu_nfb);
+
+    return 0;
+}
+presmp_initcall(page_cache_init);
 
 /*
  * Following rules applied for page offline:
@@ -1661,6 +2192,9 @@ int offline_page(mfn_t mfn, int broken, uint32_t *status)
         return 0;
     }
 
+    /* Free pages held in page caches can then be offlined right away. */
+    drain_page_caches();
+
     spin_lock(&heap_lock);
 
     old_info = mark_page_offline(pg, broken);
@@ -1941,7 +2475,7 @@ static unsigned long avail_heap_pages(
                 free_pages += avail[i][zone];
     }
 
-    return free_pages;
+    return free_pages + page_cache_avail(zone_lo, zone_hi, node);
 }
 
 void __init end_boot_allocator(void)
@@ -2447,6 +2981,7 @@ struct page_info *alloc_domheap_pages(
     struct page_info *pg = NULL;
     unsigned int bits = memflags >> _MEMF_bits, zone_hi = NR_ZONES - 1;
     unsigned int dma_zone;
+    bool drained = false;
 
     ASSERT_ALLOC_CONTEXT();
 
@@ -2459,6 +2994,7 @@ struct page_info *alloc_domheap_pages(
     if ( memflags & MEMF_no_owner )
         memflags |= MEMF_no_refcount;
 
+ retry:
     if ( !dma_bitsize )
         memflags &= ~MEMF_no_dma;
     else if ( (dma_zone = bits_to_zone(dma_bitsize)) < zone_hi )
@@ -2468,7 +3004,22 @@ struct page_info *alloc_domheap_pages(
          ((memflags & MEMF_no_dma) ||
           ((pg = alloc_heap_pages(MEMZONE_XEN + 1, zone_hi, order,
                                   memflags, d)) == NULL)) )
-         return NULL;
+    {
+        /*
+         * As a last resort, return the memory held in page caches to the
+         * heap and try again, for the orders they hold.  Exact node requests
+         * tend to be probes with a fallback of their own, which shouldn't
+         * take every CPU's cache lock.
+         */
+        if ( !drained && order <= PAGE_CACHE_MAX_ORDER &&
+             !(memflags & MEMF_exact_node) && drain_page_caches() )
+        {
+            drained = true;
+            goto retry;
+        }
+
+        return NULL;
+    }
 
     if ( d && !(memflags & MEMF_no_owner) )
     {
@@ -2626,6 +3177,8 @@ static void cf_check pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+    printk("    Page caches: %lukB\n",
+           page_cache_avail(MEMZONE_XEN, NR_ZONES - 1, -1) << (PAGE_SHIFT-10));
 }
 
 static __init int cf_check pagealloc_keyhandler_init(void)
@@ -10,11 +10,12 @@
 #include <xen/sched.h>
 #include <xen/errno.h>
 #include <xen/rangeset.h>
+#include <xen/rbtree.h>
 #include <xsm/xsm.h>
 
-/* An inclusive range [s,e] and pointer to next range in ascending order. */
+/* An inclusive range [s,e], in a tree of ranges ordered by address. */
 struct range {
-    struct list_head list;
+    struct rb_node node;
     unsigned long s, e;
 };
 
@@ -23,8 +24,8 @@ struct rangeset {
     struct list_head rangeset_list;
     struct domain   *domain;
 
-    /* Ordered list of ranges contained in this set, and protecting lock. */
-    struct list_head range_list;
+    /* Ordered tree of ranges contained in this set, and protecting lock. */
+    struct rb_root   range_tree;
 
     /* Number of ranges that can be allocated */
     long             nr_ranges;
@@ -38,20 +39,26 @@ struct rangeset {
 };
 
 /*****************************
- * Private range functions hide the underlying linked-list implemnetation.
+ * Private range functions hide the underlying red-black tree implementation.
  */
 
 /* Find highest range lower than or containing s. NULL if no such range. */
 static struct range *find_range(
     struct rangeset *r, unsigned long s)
 {
+    struct rb_node *n = r->range_tree.rb_node;
     struct range *x = NULL, *y;
 
-    list_for_each_entry ( y, &r->range_list, list )
+    while ( n )
     {
+        y = rb_entry(n, struct range, node);
         if ( y->s > s )
-            break;
-        x = y;
+            n = n->rb_left;
+        else
+        {
+            x = y;
+            n = n->rb_right;
+        }
     }
 
     return x;
@@ -61,34 +68,46 @@ static struct range *find_range(
 static struct range *first_range(
     struct rangeset *r)
 {
-    if ( list_empty(&r->range_list) )
-        return NULL;
-    return list_entry(r->range_list.next, struct range, list);
+    struct rb_node *n = rb_first(&r->range_tree);
+
+    return n ? rb_entry(n, struct range, node) : NULL;
 }
 
 /* Return range following x in ascending order, or NULL if x is the highest. */
 static struct range *next_range(
     struct rangeset *r, struct range *x)
 {
-    if ( x->list.next == &r->range_list )
-        return NULL;
-    return list_entry(x->list.next, struct range, list);
+    struct rb_node *n = rb_next(&x->node);
+
+    return n ? rb_entry(n, struct range, node) : NULL;
 }
 
-/* Insert range y after range x in r. Insert as first range if x is NULL. */
+/* Insert range y into r, which must not overlap any range already in r. */
 static void insert_range(
-    struct rangeset *r, struct range *x, struct range *y)
+    struct rangeset *r, struct range *y)
 {
-    list_add(&y->list, (x != NULL) ? &x->list : &r->range_list);
+    struct rb_node **link = &r->range_tree.rb_node, *parent = NULL;
+    struct range *x;
+
+    while ( *link )
+    {
+        parent = *link;
+        x = rb_entry(parent, struct range, node);
+        ASSERT(y->e < x->s || y->s > x->e);
+        link = (y->s < x->s) ? &parent->rb_left : &parent->rb_right;
+    }
+
+    rb_link_node(&y->node, parent, link);
+    rb_insert_color(&y->node, &r->range_tree);
 }
 
-/* Remove a range from its list and free it. */
+/* Remove a range from its tree and free it. */
 static void destroy_range(
     struct rangeset *r, struct range *x)
 {
     r->nr_ranges++;
 
-    list_del(&x->list);
+    rb_erase(&x->node, &r->range_tree);
     xfree(x);
 }
 
@@ -139,7 +158,7 @@ int rangeset_add_range(
             x->s = s;
             x->e = e;
 
-            insert_range(r, y, x);
+            insert_range(r, x);
         }
         else if ( x->e < e )
             x->e = e;
@@ -211,7 +230,7 @@ int rangeset_remove_range(
             y->e = x->e;
             x->e = s - 1;
 
-            insert_range(r, x, y);
+            insert_range(r, y);
         }
         else if ( (x->s == s) && (x->e <= e) )
             destroy_range(r, x);
@@ -227,7 +246,9 @@ int rangeset_remove_range(
 
         if ( x->s < s )
         {
-            x->e = s - 1;
+            /* x may end below s, in the gap before the range removed. */
+            if ( x->e >= s )
+                x->e = s - 1;
             x = next_range(r, x);
         }
 
@@ -344,7 +365,7 @@ int rangeset_claim_range(struct rangeset *r, unsigned long size,
 
         next->s = start;
         next->e = start + size - 1;
-        insert_range(r, prev, next);
+        insert_range(r, next);
     }
     else
         prev->e += size;
@@ -417,7 +438,7 @@ bool rangeset_contains_singleton(
 bool rangeset_is_empty(
     const struct rangeset *r)
 {
-    return ((r == NULL) || list_empty(&r->range_list));
+    return ((r == NULL) || RB_EMPTY_ROOT(&r->range_tree));
 }
 
 struct rangeset *rangeset_new(
@@ -430,7 +451,7 @@ struct rangeset *rangeset_new(
         return NULL;
 
     rwlock_init(&r->lock);
-    INIT_LIST_HEAD(&r->range_list);
+    r->range_tree = RB_ROOT;
     r->nr_ranges = -1;
 
     BUG_ON(flags & ~(RANGESETF_prettyprint_hex | RANGESETF_no_print));
@@ -512,7 +533,7 @@ void rangeset_domain_destroy(
 
 void rangeset_swap(struct rangeset *a, struct rangeset *b)
 {
-    LIST_HEAD(tmp);
+    struct rb_root tmp;
 
     if ( a < b )
     {
@@ -525,9 +546,9 @@ void rangeset_swap(struct rangeset *a, struct rangeset *b)
         write_lock(&a->lock);
     }
 
-    list_splice_init(&a->range_list, &tmp);
-    list_splice_init(&b->range_list, &a->range_list);
-    list_splice(&tmp, &b->range_list);
+    tmp = a->range_tree;
+    a->range_tree = b->range_tree;
+    b->range_tree = tmp;
 
     write_unlock(&a->lock);
     write_unlock(&b->lock);
@@ -34,6 +34,7 @@
 #include <xen/types.h>
 #include <xen/kernel.h>
 #include <xen/init.h>
+#include <xen/hypfs.h>
 #include <xen/param.h>
 #include <xen/sections.h>
 #include <xen/spinlock.h>
@@ -49,22 +50,48 @@
 
 DEFINE_PER_CPU(unsigned int, rcu_lock_cnt);
 
+/*
+ * Grace periods are tracked in a two level tree, so that CPUs reporting a
+ * quiescent state don't all contend on a single lock and cache line.  Each
+ * leaf covers BITS_PER_LONG consecutive CPUs and has a mask of those which
+ * still need to pass through a quiescent state.  The root only has a bit per
+ * leaf, which gets cleared by the last CPU of the leaf to report.
+ */
+#define RCU_LEAF_CPUS  BITS_PER_LONG
+#define RCU_NR_LEAVES  DIV_ROUND_UP(NR_CPUS, RCU_LEAF_CPUS)
+
+static struct rcu_node {
+    spinlock_t    lock;
+    unsigned long qsmask;   /* CPUs of the leaf yet to quiesce ...         */
+    long          gpnum;    /* ... in this batch.                          */
+} __cacheline_aligned rcu_nodes[RCU_NR_LEAVES];
+
 /* Global control variables for rcupdate callback mechanism. */
 static struct rcu_ctrlblk {
     long cur;           /* Current batch number.                      */
     long completed;     /* Number of the last completed batch         */
     int  next_pending;  /* Is the next batch already waiting?         */
+    long expedite;      /* Last batch to be expedited                 */
+    long expedited;     /* Last batch CPUs have been kicked for       */
+    s_time_t gp_start;  /* Start time of the current batch            */
 
     spinlock_t  lock __cacheline_aligned;
-    cpumask_t   cpumask; /* CPUs that need to switch in order ... */
+    DECLARE_BITMAP(nodemask, RCU_NR_LEAVES); /* Leaves with CPUs that need
+                                              * to switch ... */
     cpumask_t   idle_cpumask; /* ... unless they are already idle */
     /* for current batch to proceed.        */
+    cpumask_t   expedite_waiters; /* CPUs with callbacks in expedited batches */
 } __cacheline_aligned rcu_ctrlblk = {
     .cur = -300,
     .completed = -300,
+    .expedite = -300,
+    .expedited = -300,
     .lock = SPIN_LOCK_UNLOCKED,
 };
 
+/* Grace period statistics, see docs/misc/hypfs-paths.pandoc. */
+static uint64_t rcu_gp_count, rcu_gp_expedited, rcu_gp_time, rcu_gp_time_max;
+
 /*
  * Per-CPU data for Read-Copy Update.
  * nxtlist - new callbacks are added here
@@ -94,6 +121,7 @@ struct rcu_data {
 
     bool            process_callbacks;
     bool            barrier_active;
+    bool            expedite;         /* expedite the queued callbacks */
 };
 
 /*
@@ -193,6 +221,7 @@ static void rcu_barrier_action(void)
      * will have been decremented to 0.
      */
     call_rcu(&head, rcu_barrier_callback);
+    rcu_expedite();
 
     while ( atomic_read(&cpu_count) )
     {
@@ -246,6 +275,22 @@ static inline int rcu_batch_before(long a, long b)
     return (a - b) < 0;
 }
 
+/*
+ * Collect the CPUs still to pass through a quiescent state for the current
+ * batch.  The leaves are read without their locks, so the result is only a
+ * hint, good enough for deciding whom to prod.
+ */
+static void rcu_gp_cpus(const struct rcu_ctrlblk *rcp, cpumask_t *mask)
+{
+    unsigned int i;
+
+    cpumask_clear(mask);
+    for ( i = find_first_bit(rcp->nodemask, RCU_NR_LEAVES);
+          i < RCU_NR_LEAVES;
+          i = find_next_bit(rcp->nodemask, RCU_NR_LEAVES, i + 1) )
+        cpumask_bits(mask)[i] = read_atomic(&rcu_nodes[i].qsmask);
+}
+
 static void force_quiescent_state(struct rcu_data *rdp,
                                   struct rcu_ctrlblk *rcp)
 {
@@ -257,11 +302,62 @@ static void force_quiescent_state(struct rcu_data *rdp,
          * Don't send IPI to itself. With irqs disabled,
          * rdp->cpu is the current cpu.
          */
-        cpumask_andnot(&cpumask, &rcp->cpumask, cpumask_of(rdp->cpu));
+        rcu_gp_cpus(rcp, &cpumask);
+        cpumask_clear_cpu(rdp->cpu, &cpumask);
         cpumask_raise_softirq(&cpumask, RCU_SOFTIRQ);
     }
 }
 
+/**
+ * rcu_expedite - Have the callbacks queued on this CPU invoked promptly.
+ *
+ * Rather than waiting for all other CPUs to pass through a quiescent state
+ * of their own accord, the grace periods the callbacks queued so far depend
+ * on get all CPUs still holding them up kicked into reporting one.  May be
+ * called from any context.
+ */
+void rcu_expedite(void)
+{
+    this_cpu(rcu_data).expedite = true;
+    rcu_check_callbacks(smp_processor_id());
+}
+
+struct rcu_synchronize {
+    struct rcu_head head;
+    bool done;
+};
+
+static void cf_check rcu_synchronize_callback(struct rcu_head *head)
+{
+    struct rcu_synchronize *rs = container_of(head, struct rcu_synchronize,
+                                              head);
+
+    write_atomic(&rs->done, true);
+}
+
+/**
+ * synchronize_rcu_expedited - Wait for an expedited grace period.
+ *
+ * Returns once all RCU read-side critical sections running at the time of
+ * the call have completed.  Must not be called from within one.
+ */
+void synchronize_rcu_expedited(void)
+{
+    struct rcu_synchronize rs = { .done = false };
+
+    ASSERT(!in_irq() && local_irq_is_enabled());
+    ASSERT(rcu_quiesce_allowed());
+
+    call_rcu(&rs.head, rcu_synchronize_callback);
+    rcu_expedite();
+
+    while ( !read_atomic(&rs.done) )
+    {
+        process_pending_softirqs();
+        cpu_relax();
+    }
+}
+
 /**
  * call_rcu - Queue an RCU callback for invocation after a grace period.
  * @head: structure to be used for queueing the RCU updates.
@@ -327,18 +423,36 @@ static void rcu_do_batch(struct rcu_data *rdp)
  * - A new grace period is started.
  *   This is done by rcu_start_batch. The start is not broadcasted to
  *   all cpus, they must pick this up by comparing rcp->cur with
- *   rdp->quiescbatch. All cpus are recorded  in the
- *   rcu_ctrlblk.cpumask bitmap.
+ *   rdp->quiescbatch. All cpus are recorded in the qsmask of their
+ *   leaf in rcu_nodes[], and leaves with any cpu recorded in
+ *   rcu_ctrlblk.nodemask.
  * - All cpus must go through a quiescent state.
  *   Since the start of the grace period is not broadcasted, at least two
  *   calls to rcu_check_quiescent_state are required:
  *   The first call just notices that a new grace period is running. The
  *   following calls check if there was a quiescent state since the beginning
- *   of the grace period. If so, it updates rcu_ctrlblk.cpumask. If
- *   the bitmap is empty, then the grace period is completed.
+ *   of the grace period. If so, it updates the qsmask of its leaf, and the
+ *   nodemask once the leaf is empty. If the nodemask is empty, then the grace
+ *   period is completed.
  *   rcu_check_quiescent_state calls rcu_start_batch(0) to start the next grace
  *   period (if necessary).
+ * Expedited grace periods are no different, except that the cpus are sent
+ * RCU_SOFTIRQ as soon as they start, which makes them go through both steps
+ * right away.
  */
+/*
+ * Kick the cpus holding up the current batch into reporting a quiescent
+ * state.  Caller must hold rcu_ctrlblk.lock.
+ */
+static void rcu_expedite_batch(struct rcu_ctrlblk *rcp)
+{
+    cpumask_t cpumask;
+
+    rcp->expedited = rcp->cur;
+    rcu_gp_cpus(rcp, &cpumask);
+    cpumask_raise_softirq(&cpumask, RCU_SOFTIRQ);
+}
+
 /*
  * Register a new batch of callbacks, and start it up if there is currently no
  * active batch and the batch to be registered has not already occurred.
@@ -346,6 +460,8 @@ static void rcu_do_batch(struct rcu_data *rdp)
  */
 static void rcu_start_batch(struct rcu_ctrlblk *rcp)
 {
+    unsigned int i;
+
     if (rcp->next_pending &&
         rcp->completed == rcp->cur) {
         rcp->next_pending = 0;
@@ -358,30 +474,106 @@ static void rcu_start_batch(struct rcu_ctrlblk *rcp)
 
        /*
         * Make sure the increment of rcp->cur is visible so, even if a
-        * CPU that is about to go idle, is captured inside rcp->cpumask,
+        * CPU that is about to go idle, is captured inside its leaf,
         * rcu_pending() will return false, which then means cpu_quiet()
         * will be invoked, before the CPU would actually enter idle.
         *
         * This barrier is paired with the one in rcu_idle_enter().
         */
         smp_mb();
-        cpumask_andnot(&rcp->cpumask, &cpu_online_map, &rcp->idle_cpumask);
+        for (i = 0; i < DIV_ROUND_UP(nr_cpu_ids, RCU_LEAF_CPUS); i++) {
+            struct rcu_node *rnp = &rcu_nodes[i];
+            unsigned long qsmask = cpumask_bits(&cpu_online_map)[i] &
+                                   ~cpumask_bits(&rcp->idle_cpumask)[i];
+
+            spin_lock(&rnp->lock);
+            rnp->qsmask = qsmask;
+            rnp->gpnum = rcp->cur;
+            spin_unlock(&rnp->lock);
+
+            if (qsmask)
+                __set_bit(i, rcp->nodemask);
+        }
+
+        rcp->gp_start = NOW();
+        if (!rcu_batch_before(rcp->expedite, rcp->cur))
+            rcu_expedite_batch(rcp);
+    }
+}
+
+/*
+ * Account for the batch that just completed, and wake up the cpus waiting
+ * for an expedited one.  Caller must hold rcu_ctrlblk.lock.
+ */
+static void rcu_batch_done(struct rcu_ctrlblk *rcp)
+{
+    s_time_t delta = NOW() - rcp->gp_start;
+
+    rcp->completed = rcp->cur;
+
+    rcu_gp_count++;
+    rcu_gp_time += delta;
+    rcu_gp_time_max = max_t(uint64_t, rcu_gp_time_max, delta);
+    perfc_incr(rcu_grace_period);
+    perfc_incra(rcu_gp_latency,
+                min_t(unsigned int, flsl(delta / MICROSECS(1)),
+                      PERFC_LAST_rcu_gp_latency - PERFC_rcu_gp_latency));
+
+    if (rcp->expedited == rcp->completed) {
+        rcu_gp_expedited++;
+        cpumask_raise_softirq(&rcp->expedite_waiters, RCU_SOFTIRQ);
+        if (rcp->expedite == rcp->completed)
+            cpumask_clear(&rcp->expedite_waiters);
     }
 }
 
 /*
- * cpu went through a quiescent state since the beginning of the grace period.
- * Clear it from the cpu mask and complete the grace period if it was the last
- * cpu. Start another grace period if someone has further entries pending
+ * cpu went through a quiescent state since the beginning of grace period
+ * batch. Clear it from its leaf, and the leaf from the root if it was the
+ * leaf's last cpu. Complete the grace period if it was the last leaf. Start
+ * another grace period if someone has further entries pending.
+ * Must be called without any of the locks held.
  */
-static void cpu_quiet(int cpu, struct rcu_ctrlblk *rcp)
+static void cpu_quiet(unsigned int cpu, struct rcu_ctrlblk *rcp, long batch)
 {
-    cpumask_clear_cpu(cpu, &rcp->cpumask);
-    if (cpumask_empty(&rcp->cpumask)) {
+    struct rcu_node *rnp = &rcu_nodes[cpu / RCU_LEAF_CPUS];
+    unsigned long bit = 1UL << (cpu % RCU_LEAF_CPUS);
+    bool leaf_done;
+
+    spin_lock(&rnp->lock);
+    if (rcu_batch_before(rnp->gpnum, batch)) {
+        /* rcu_start_batch() may still be setting up the leaves. */
+        spin_unlock(&rnp->lock);
+        spin_barrier(&rcp->lock);
+        spin_lock(&rnp->lock);
+    }
+
+    /*
+     * rdp->quiescbatch/rcp->cur and the cpu bitmap can come out of sync
+     * during cpu startup, and an offlined cpu may have reported already.
+     * Ignore the quiescent state.
+     */
+    if (rnp->gpnum != batch || !(rnp->qsmask & bit)) {
+        spin_unlock(&rnp->lock);
+        return;
+    }
+
+    rnp->qsmask &= ~bit;
+    leaf_done = !rnp->qsmask;
+    spin_unlock(&rnp->lock);
+
+    if (!leaf_done)
+        return;
+
+    spin_lock(&rcp->lock);
+    ASSERT(rcp->cur == batch);
+    __clear_bit(cpu / RCU_LEAF_CPUS, rcp->nodemask);
+    if (bitmap_empty(rcp->nodemask, RCU_NR_LEAVES)) {
         /* batch completed ! */
-        rcp->completed = rcp->cur;
+        rcu_batch_done(rcp);
         rcu_start_batch(rcp);
     }
+    spin_unlock(&rcp->lock);
 }
 
 /*
@@ -408,14 +600,31 @@ static void rcu_check_quiescent_state(struct rcu_ctrlblk *rcp,
 
     rdp->qs_pending = 0;
 
-    spin_lock(&rcp->lock);
-    /*
-     * rdp->quiescbatch/rcp->cur and the cpu bitmap can come out of sync
-     * during cpu startup. Ignore the quiescent state.
-     */
-    if (likely(rdp->quiescbatch == rcp->cur))
-        cpu_quiet(rdp->cpu, rcp);
+    cpu_quiet(rdp->cpu, rcp, rdp->quiescbatch);
+}
+
+/*
+ * Get the batch the cpu's callbacks are waiting for expedited, along with
+ * the one in progress, and have the cpu invoke them once it has completed.
+ */
+static void rcu_expedite_callbacks(struct rcu_ctrlblk *rcp,
+                                   struct rcu_data *rdp)
+{
+    /* Callbacks still queued behind curlist get expedited once moved up. */
+    local_irq_disable();
+    if (!rdp->nxtlist)
+        rdp->expedite = false;
+    local_irq_enable();
 
+    if (!rdp->curlist)
+        return;
+
+    spin_lock(&rcp->lock);
+    if (rcu_batch_before(rcp->expedite, rdp->batch))
+        rcp->expedite = rdp->batch;
+    cpumask_set_cpu(rdp->cpu, &rcp->expedite_waiters);
+    if (rcp->cur != rcp->completed && rcp->expedited != rcp->cur)
+        rcu_expedite_batch(rcp);
     spin_unlock(&rcp->lock);
 }
 
@@ -462,6 +671,8 @@ static void __rcu_process_callbacks(struct rcu_ctrlblk *rcp,
     } else {
         local_irq_enable();
     }
+    if (unlikely(rdp->expedite))
+        rcu_expedite_callbacks(rcp, rdp);
     rcu_check_quiescent_state(rcp, rdp);
     if (rdp->donelist)
         rcu_do_batch(rdp);
@@ -580,7 +791,7 @@ static void cf_check rcu_idle_timer_handler(void* data)
 {
     perfc_incr(rcu_idle_timer);
 
-    if ( !cpumask_empty(&rcu_ctrlblk.cpumask) )
+    if ( !bitmap_empty(rcu_ctrlblk.nodemask, RCU_NR_LEAVES) )
         idle_timer_period = min(idle_timer_period + IDLE_TIMER_PERIOD_INCR,
                                 IDLE_TIMER_PERIOD_MAX);
     else
@@ -609,16 +820,22 @@ static void rcu_move_batch(struct rcu_data *this_rdp, struct rcu_head *list,
 static void rcu_offline_cpu(struct rcu_data *this_rdp,
                             struct rcu_ctrlblk *rcp, struct rcu_data *rdp)
 {
+    long batch;
+    bool pending;
+
     kill_timer(&rdp->idle_timer);
 
     /* If the cpu going offline owns the grace period we can block
      * indefinitely waiting for it, so flush it here.
      */
     spin_lock(&rcp->lock);
-    if (rcp->cur != rcp->completed)
-        cpu_quiet(rdp->cpu, rcp);
+    batch = rcp->cur;
+    pending = rcp->cur != rcp->completed;
     spin_unlock(&rcp->lock);
 
+    if (pending)
+        cpu_quiet(rdp->cpu, rcp, batch);
+
     rcu_move_batch(this_rdp, rdp->donelist, rdp->donetail);
     rcu_move_batch(this_rdp, rdp->curlist, rdp->curtail);
     rcu_move_batch(this_rdp, rdp->nxtlist, rdp->nxttail);
@@ -671,6 +888,7 @@ static struct notifier_block cpu_nfb = {
 void __init rcu_init(void)
 {
     void *cpu = (void *)(long)smp_processor_id();
+    unsigned int i;
     static unsigned int __initdata idle_timer_period_ms =
                                     IDLE_TIMER_PERIOD_DEFAULT / MILLISECS(1);
     integer_param("rcu-idle-timer-period-ms", idle_timer_period_ms);
@@ -686,12 +904,38 @@ void __init rcu_init(void)
     }
     idle_timer_period = MILLISECS(idle_timer_period_ms);
 
+    for ( i = 0; i < ARRAY_SIZE(rcu_nodes); i++ )
+    {
+        spin_lock_init(&rcu_nodes[i].lock);
+        rcu_nodes[i].gpnum = rcu_ctrlblk.cur;
+    }
+
     cpumask_clear(&rcu_ctrlblk.idle_cpumask);
     cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
     register_cpu_notifier(&cpu_nfb);
     open_softirq(RCU_SOFTIRQ, rcu_process_callbacks);
 }
 
+#ifdef CONFIG_HYPFS
+static HYPFS_DIR_INIT(rcu_dir, "rcu");
+static HYPFS_UINT_INIT(gp_count, "grace-periods", rcu_gp_count);
+static HYPFS_UINT_INIT(gp_expedited, "expedited", rcu_gp_expedited);
+static HYPFS_UINT_INIT(gp_time, "gp-time", rcu_gp_time);
+static HYPFS_UINT_INIT(gp_time_max, "gp-time-max", rcu_gp_time_max);
+
+static int __init cf_check rcu_hypfs_init(void)
+{
+    hypfs_add_dir(&hypfs_root, &rcu_dir, true);
+    hypfs_add_leaf(&rcu_dir, &gp_count, true);
+    hypfs_add_leaf(&rcu_dir, &gp_expedited, true);
+    hypfs_add_leaf(&rcu_dir, &gp_time, true);
+    hypfs_add_leaf(&rcu_dir, &gp_time_max, true);
+
+    return 0;
+}
+__initcall(rcu_hypfs_init);
+#endif /* CONFIG_HYPFS */
+
 /*
  * The CPU is becoming idle, so no more read side critical
  * sections, and one more step toward grace period.
@@ -704,7 +948,7 @@ void rcu_idle_enter(unsigned int cpu)
      * If some other CPU is starting a new grace period, we'll notice that
      * by seeing a new value in rcp->cur (different than our quiescbatch).
      * That will force us all the way until cpu_quiet(), clearing our bit
-     * in rcp->cpumask, even in case we managed to get in there.
+     * in its leaf's qsmask, even in case we managed to get in there.
      *
      * Se the comment before cpumask_andnot() in  rcu_start_batch().
      */
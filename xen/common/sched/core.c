@@ -31,6 +31,7 @@
 #include <xen/err.h>
 #include <xen/guest_access.h>
 #include <xen/hypercall.h>
+#include <xen/hypfs.h>
 #include <xen/multicall.h>
 #include <xen/cpu.h>
 #include <xen/preempt.h>
@@ -58,6 +59,13 @@ string_param("sched", opt_sched);
 bool sched_smt_power_savings;
 boolean_param("sched_smt_power_savings", sched_smt_power_savings);
 
+/*
+ * Below this percentage of busy pCPUs, prefer partially idle cores over
+ * fully idle ones as well (see sched_smt_pack()).
+ */
+unsigned int __read_mostly sched_smt_pack_load;
+integer_param("sched_smt_pack_load", sched_smt_pack_load);
+
 /* Default scheduling rate limit: 1ms
  * The behavior when sched_ratelimit_us is greater than sched_credit_tslice_ms is undefined
  * */
@@ -88,6 +96,16 @@ DEFINE_PER_CPU(cpumask_t, cpumask_scratch);
 /* How many urgent vcpus. */
 DEFINE_PER_CPU(atomic_t, sched_urgent_count);
 
+/*
+ * With sched-gran > 1, a pCPU whose vcpu of the running unit can't run
+ * (e.g., it is blocked, or the domain has fewer vcpus than the unit has
+ * threads) runs its idle vcpu, on behalf of that unit, while its siblings
+ * run the unit's other vcpus. Account for how long pCPUs are forced idle
+ * like that. A start time of 0 means the pCPU isn't forced idle.
+ */
+static DEFINE_PER_CPU(s_time_t, sched_forced_idle_start);
+static DEFINE_PER_CPU(s_time_t, sched_forced_idle_time);
+
 extern const struct scheduler *__start_schedulers_array[], *__end_schedulers_array[];
 #define NUM_SCHEDULERS (__end_schedulers_array - __start_schedulers_array)
 #define schedulers __start_schedulers_array
@@ -260,6 +278,34 @@ static inline void vcpu_urgent_count_update(struct vcpu *v)
     }
 }
 
+/*
+ * Account the period the vCPU is leaving in the latency histograms: time
+ * spent runnable until getting the CPU (separately after a wakeup and after
+ * a preemption), and time spent running until being preempted.
+ */
+static inline void sched_lat_account(struct vcpu *v, int new_state,
+                                     s_time_t delta)
+{
+    struct sched_lat *sl = v->sched_lat;
+    enum sched_lat_kind lat;
+    unsigned int bucket;
+
+    if ( new_state == RUNSTATE_runnable )
+        sl->woken = v->runstate.state == RUNSTATE_blocked;
+
+    if ( v->runstate.state == RUNSTATE_runnable &&
+         new_state == RUNSTATE_running )
+        lat = sl->woken ? SCHED_LAT_WAKE : SCHED_LAT_WAIT;
+    else if ( v->runstate.state == RUNSTATE_running &&
+              new_state == RUNSTATE_runnable )
+        lat = SCHED_LAT_RUN;
+    else
+        return;
+
+    bucket = delta > 0 ? fls64(delta >> 10) : 0;
+    sl->hist[lat][min(bucket, SCHED_LAT_BUCKETS - 1U)]++;
+}
+
 static inline void vcpu_runstate_change(
     struct vcpu *v, int new_state, s_time_t new_entry_time)
 {
@@ -287,9 +333,33 @@ static inline void vcpu_runstate_change(
         v->runstate.state_entry_time = new_entry_time;
     }
 
+    if ( !is_idle_vcpu(v) )
+        sched_lat_account(v, new_state, delta);
+
     v->runstate.state = new_state;
 }
 
+static void sched_forced_idle_update(unsigned int cpu, bool forced,
+                                     s_time_t now)
+{
+    s_time_t *start = &per_cpu(sched_forced_idle_start, cpu);
+
+    if ( forced && !*start )
+        *start = now;
+    else if ( !forced && *start )
+    {
+        per_cpu(sched_forced_idle_time, cpu) += now - *start;
+        *start = 0;
+    }
+}
+
+static s_time_t sched_forced_idle_time(unsigned int cpu, s_time_t now)
+{
+    s_time_t start = per_cpu(sched_forced_idle_start, cpu);
+
+    return per_cpu(sched_forced_idle_time, cpu) + (start ? now - start : 0);
+}
+
 void sched_guest_idle(void (*idle) (void), unsigned int cpu)
 {
     /*
@@ -304,6 +374,25 @@ void sched_guest_idle(void (*idle) (void), unsigned int cpu)
     atomic_dec(&per_cpu(sched_urgent_count, cpu));
 }
 
+/*
+ * Whether a cpu is running its idle vcpu.  This is a mere hint, meant for
+ * picking cpus to offload work to, as the answer may be stale right away.
+ */
+bool sched_cpu_is_idle(unsigned int cpu)
+{
+    const struct sched_resource *sr;
+    const struct sched_unit *unit;
+    bool idle;
+
+    rcu_read_lock(&sched_res_rculock);
+    sr = get_sched_res(cpu);
+    unit = sr ? ACCESS_ONCE(sr->curr) : NULL;
+    idle = unit && is_idle_unit(unit);
+    rcu_read_unlock(&sched_res_rculock);
+
+    return idle;
+}
+
 void vcpu_runstate_get(const struct vcpu *v,
                        struct vcpu_runstate_info *runstate)
 {
@@ -543,8 +632,15 @@ int sched_init_vcpu(struct vcpu *v)
     struct sched_unit *unit;
     unsigned int processor;
 
+    if ( !is_idle_domain(d) &&
+         (v->sched_lat = xzalloc(struct sched_lat)) == NULL )
+        return 1;
+
     if ( (unit = sched_alloc_unit(v)) == NULL )
+    {
+        XFREE(v->sched_lat);
         return 1;
+    }
 
     if ( is_idle_domain(d) )
         processor = v->vcpu_id;
@@ -554,6 +650,7 @@ int sched_init_vcpu(struct vcpu *v)
     /* Initialise the per-vcpu timers. */
     spin_lock_init(&v->periodic_timer_lock);
     init_timer(&v->periodic_timer, vcpu_periodic_timer_fn, v, processor);
+    timer_set_coalesce(&v->periodic_timer, TIMER_COALESCE_tick);
     init_timer(&v->singleshot_timer, vcpu_singleshot_timer_fn, v, processor);
     init_timer(&v->poll_timer, poll_timer_fn, v, processor);
 
@@ -574,6 +671,7 @@ int sched_init_vcpu(struct vcpu *v)
     {
         sched_free_unit(unit, v);
         rcu_read_unlock(&sched_res_rculock);
+        XFREE(v->sched_lat);
         return 1;
     }
 
@@ -859,6 +957,8 @@ void sched_destroy_vcpu(struct vcpu *v)
 
         rcu_read_unlock(&sched_res_rculock);
     }
+
+    XFREE(v->sched_lat);
 }
 
 int sched_init_domain(struct domain *d, unsigned int poolid)
@@ -2230,6 +2330,9 @@ static void sched_switch_units(struct sched_resource *sr,
 
         if ( is_idle_vcpu(vnext) )
             vnext->sched_unit = next;
+
+        sched_forced_idle_update(cpu, is_idle_vcpu(vnext) &&
+                                      !is_idle_unit(next), now);
     }
 }
 
@@ -2437,6 +2540,7 @@ static struct vcpu *sched_force_context_switch(struct vcpu *vprev,
         {
             vcpu_runstate_change(vprev, RUNSTATE_runnable, now);
             vprev->sched_unit = get_sched_res(cpu)->sched_unit_idle;
+            sched_forced_idle_update(cpu, false, now);
         }
         vcpu_runstate_change(v, RUNSTATE_running, now);
     }
@@ -2460,6 +2564,7 @@ static struct vcpu *sched_force_context_switch(struct vcpu *vprev,
             {
                 v->sched_unit = vprev->sched_unit;
                 vcpu_runstate_change(v, RUNSTATE_running, now);
+                sched_forced_idle_update(cpu, true, now);
             }
         }
     }
@@ -2802,6 +2907,7 @@ static int cpu_schedule_up(unsigned int cpu)
     spin_lock_init(&sr->_lock);
     sr->schedule_lock = &sched_free_cpu_lock;
     init_timer(&sr->s_timer, s_timer_fn, NULL, cpu);
+    timer_set_coalesce(&sr->s_timer, TIMER_COALESCE_sched);
     atomic_set(&per_cpu(sched_urgent_count, cpu), 0);
 
     /* We start with cpu granularity. */
@@ -3342,6 +3448,7 @@ int schedule_cpu_rm(unsigned int cpu, struct cpu_rm_data *data)
 
             /* Init timer. */
             init_timer(&data->sr[idx]->s_timer, s_timer_fn, NULL, cpu_iter);
+            timer_set_coalesce(&data->sr[idx]->s_timer, TIMER_COALESCE_sched);
 
             /* Last resource initializations and insert resource pointer. */
             data->sr[idx]->master_cpu = cpu_iter;
@@ -3448,6 +3555,10 @@ void schedule_dump(struct cpupool *c)
         for_each_cpu (j, sr->cpus)
             if ( i != j )
                 printk("CPU[%02d] current=%pv\n", j, get_cpu_current(j));
+        if ( sr->granularity > 1 )
+            for_each_cpu (j, sr->cpus)
+                printk("CPU[%02d] forced idle=%"PRI_stime"us\n", j,
+                       sched_forced_idle_time(j, NOW()) / MICROSECS(1));
 
         pcpu_schedule_unlock_irqrestore(lock, flags, i);
 
@@ -3474,6 +3585,168 @@ void __init sched_setup_dom0_vcpus(struct domain *d)
 }
 #endif
 
+#ifdef CONFIG_HYPFS
+
+/*
+ * /sched-latency/<domid>/{wake,wait,run}: the latency histograms of all
+ * vCPUs of a domain, summed up.  Each node is a blob of SCHED_LAT_BUCKETS
+ * uint64_t counters, see SCHED_LAT_BUCKETS for the bucket boundaries.
+ */
+static HYPFS_DIR_INIT(sched_lat_domdir, "%u");
+
+static int cf_check sched_lat_dir_read(
+    const struct hypfs_entry *entry, XEN_GUEST_HANDLE_PARAM(void) uaddr)
+{
+    int ret = 0;
+    struct domain *d;
+    struct hypfs_dyndir_id *data;
+
+    data = hypfs_get_dyndata();
+
+    for_each_domain ( d )
+    {
+        data->id = d->domain_id;
+        data->data = d;
+
+        ret = hypfs_read_dyndir_id_entry(&sched_lat_domdir, d->domain_id,
+                                         !d->next_in_list, &uaddr);
+        if ( ret )
+            break;
+    }
+
+    return ret;
+}
+
+static unsigned int cf_check sched_lat_dir_getsize(
+    const struct hypfs_entry *entry)
+{
+    const struct domain *d;
+    unsigned int size = 0;
+
+    for_each_domain ( d )
+        size += hypfs_dynid_entry_size(entry, d->domain_id);
+
+    return size;
+}
+
+static const struct hypfs_entry *cf_check sched_lat_dir_enter(
+    const struct hypfs_entry *entry)
+{
+    struct hypfs_dyndir_id *data;
+
+    data = hypfs_alloc_dyndata(struct hypfs_dyndir_id);
+    if ( !data )
+        return ERR_PTR(-ENOMEM);
+    data->id = DOMID_INVALID;
+
+    rcu_read_lock(&domlist_read_lock);
+
+    return entry;
+}
+
+static void cf_check sched_lat_dir_exit(const struct hypfs_entry *entry)
+{
+    rcu_read_unlock(&domlist_read_lock);
+
+    hypfs_free_dyndata();
+}
+
+static struct hypfs_entry *cf_check sched_lat_dir_findentry(
+    const struct hypfs_entry_dir *dir, const char *name, unsigned int name_len)
+{
+    unsigned long id;
+    const char *end;
+    struct domain *d;
+
+    id = simple_strtoul(name, &end, 10);
+    if ( end != name + name_len || id >= DOMID_FIRST_RESERVED )
+        return ERR_PTR(-ENOENT);
+
+    /* Guarded by the domlist_read_lock taken in sched_lat_dir_enter(). */
+    for_each_domain ( d )
+        if ( d->domain_id == id )
+            return hypfs_gen_dyndir_id_entry(&sched_lat_domdir, id, d);
+
+    return ERR_PTR(-ENOENT);
+}
+
+/* Only gives the leaves their size, the content is summed up on reading. */
+static const uint64_t sched_lat_size[SCHED_LAT_BUCKETS];
+
+static int cf_check sched_lat_read(
+    const struct hypfs_entry *entry, XEN_GUEST_HANDLE_PARAM(void) uaddr);
+
+static const struct hypfs_funcs sched_lat_funcs = {
+    .enter = hypfs_node_enter,
+    .exit = hypfs_node_exit,
+    .read = sched_lat_read,
+    .write = hypfs_write_deny,
+    .getsize = hypfs_getsize,
+    .findentry = hypfs_leaf_findentry,
+};
+
+static HYPFS_FIXEDSIZE_INIT(sched_lat_wake, XEN_HYPFS_TYPE_BLOB, "wake",
+                            sched_lat_size, &sched_lat_funcs, 0);
+static HYPFS_FIXEDSIZE_INIT(sched_lat_wait, XEN_HYPFS_TYPE_BLOB, "wait",
+                            sched_lat_size, &sched_lat_funcs, 0);
+static HYPFS_FIXEDSIZE_INIT(sched_lat_run, XEN_HYPFS_TYPE_BLOB, "run",
+                            sched_lat_size, &sched_lat_funcs, 0);
+
+static int cf_check sched_lat_read(
+    const struct hypfs_entry *entry, XEN_GUEST_HANDLE_PARAM(void) uaddr)
+{
+    const struct hypfs_dyndir_id *data;
+    const struct domain *d;
+    const struct vcpu *v;
+    uint64_t hist[SCHED_LAT_BUCKETS] = {};
+    enum sched_lat_kind lat;
+    unsigned int i;
+
+    data = hypfs_get_dyndata();
+    d = data->data;
+    ASSERT(d);
+
+    if ( entry == &sched_lat_wake.e )
+        lat = SCHED_LAT_WAKE;
+    else if ( entry == &sched_lat_wait.e )
+        lat = SCHED_LAT_WAIT;
+    else
+        lat = SCHED_LAT_RUN;
+
+    /* Counters are updated without synchronization, a snapshot is fine. */
+    for_each_vcpu ( d, v )
+        for ( i = 0; i < SCHED_LAT_BUCKETS; i++ )
+            hist[i] += ACCESS_ONCE(v->sched_lat->hist[lat][i]);
+
+    return copy_to_guest(uaddr, hist, ARRAY_SIZE(hist)) ? -EFAULT : 0;
+}
+
+static const struct hypfs_funcs sched_lat_dir_funcs = {
+    .enter = sched_lat_dir_enter,
+    .exit = sched_lat_dir_exit,
+    .read = sched_lat_dir_read,
+    .write = hypfs_write_deny,
+    .getsize = sched_lat_dir_getsize,
+    .findentry = sched_lat_dir_findentry,
+};
+
+static HYPFS_DIR_INIT_FUNC(sched_lat_dir, "sched-latency",
+                           &sched_lat_dir_funcs);
+
+static int __init cf_check sched_lat_hypfs_init(void)
+{
+    hypfs_add_dir(&hypfs_root, &sched_lat_dir, true);
+    hypfs_add_dyndir(&sched_lat_dir, &sched_lat_domdir);
+    hypfs_add_leaf(&sched_lat_domdir, &sched_lat_wake, true);
+    hypfs_add_leaf(&sched_lat_domdir, &sched_lat_wait, true);
+    hypfs_add_leaf(&sched_lat_domdir, &sched_lat_run, true);
+
+    return 0;
+}
+__initcall(sched_lat_hypfs_init);
+
+#endif /* CONFIG_HYPFS */
+
 #ifdef CONFIG_COMPAT
 #include "compat.c"
 #endif
@@ -13,6 +13,7 @@
 #include <xen/init.h>
 #include <xen/lib.h>
 #include <xen/param.h>
+#include <xen/rbtree.h>
 #include <xen/sched.h>
 #include <xen/sections.h>
 #include <xen/domain.h>
@@ -62,6 +63,7 @@
 #define TRC_CSCHED2_SCHEDULE         TRC_SCHED_CLASS_EVT(CSCHED2, 21)
 #define TRC_CSCHED2_RATELIMIT        TRC_SCHED_CLASS_EVT(CSCHED2, 22)
 #define TRC_CSCHED2_RUNQ_CAND_CHECK  TRC_SCHED_CLASS_EVT(CSCHED2, 23)
+#define TRC_CSCHED2_LOAD_MOVE        TRC_SCHED_CLASS_EVT(CSCHED2, 24)
 
 /*
  * TODO:
@@ -403,6 +405,22 @@ static int __read_mostly opt_underload_balance_tolerance = 0;
 integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 static int __read_mostly opt_overload_balance_tolerance = -3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
+/*
+ * Migration costs, charged by the load balancer against the load difference
+ * a move would remove, and expressed as a percentage of the load of one
+ * fully busy pCPU:
+ *  - cache cost: moving a cache-hot unit to a runqueue that shares no LLC
+ *    with the pCPU it last ran on. A unit is cache-hot if it is running,
+ *    or it has been off the pCPU for less time than it last ran for (i.e.,
+ *    for less than it took to build its footprint);
+ *  - node cost: moving a unit from a runqueue that has pCPUs on one of its
+ *    domain's NUMA nodes (d->node_affinity) to one that has none.
+ * A move is only done if it reduces the imbalance by more than its cost.
+ */
+static unsigned int __read_mostly opt_migrate_cache_cost = 25;
+integer_param("sched_credit2_migrate_cache_cost", opt_migrate_cache_cost);
+static unsigned int __read_mostly opt_migrate_node_cost = 50;
+integer_param("sched_credit2_migrate_node_cost", opt_migrate_node_cost);
 /*
  * Domains subject to a cap receive a replenishment of their runtime budget
  * once every opt_cap_period interval. Default is 10 ms. The amount of budget
@@ -497,7 +515,8 @@ struct csched2_runqueue_data {
     spinlock_t lock;           /* Lock for this runqueue                     */
 
     struct list_head rql;      /* List of runqueues                          */
-    struct list_head runq;     /* Ordered list of runnable vms               */
+    struct rb_root runq;       /* Runnable units, ordered by credit          */
+    struct rb_node *runq_first;/* Unit with the most credit, if any          */
     unsigned int refcnt;       /* How many CPUs reference this runqueue      */
                                /* (including not yet active ones)            */
     unsigned int nr_cpus;      /* How many CPUs are sharing this runqueue    */
@@ -513,6 +532,7 @@ struct csched2_runqueue_data {
         smt_idle,              /* Fully idle-and-untickled cores (see below) */
         tickled,               /* Have been asked to go through schedule     */
         idle;                  /* Currently idle pcpus                       */
+    nodemask_t nodes;          /* NUMA nodes of the CPUs in active           */
 
     struct list_head svc;      /* List of all units assigned to the runqueue */
     unsigned int max_weight;   /* Max weight of the units in this runqueue   */
@@ -561,12 +581,16 @@ struct csched2_unit {
     s_time_t budget_quota;             /* Budget to which unit is entitled    */
 
     s_time_t start_time;               /* Time we were scheduled (for credit) */
+    s_time_t run_start;                /* Time we started the current run     */
+    s_time_t last_runtime;             /* Length of the last run              */
+    s_time_t last_stop;                /* Time the last run ended             */
+    int last_cpu;                      /* Cpu of the last run (-1 if none)    */
 
     /* Individual contribution to load                                        */
     s_time_t load_last_update;         /* Last time average was updated       */
     s_time_t avgload;                  /* Decaying queue load                 */
 
-    struct list_head runq_elem;        /* On the runqueue (rqd->runq)         */
+    struct rb_node runq_elem;          /* On the runqueue (rqd->runq)         */
     struct list_head parked_elem;      /* On the parked_units list            */
     struct list_head rqd_elem;         /* On csched2_runqueue_data's svc list */
     struct csched2_runqueue_data *migrate_rqd; /* Pre-determined migr. target */
@@ -647,13 +671,16 @@ static inline bool has_cap(const struct csched2_unit *svc)
  *
  * Once we have such a mask, it is easy to implement a policy that, either:
  *  - uses fully idle cores first: it is enough to try to schedule the units
- *    on pcpus from smt_idle mask first. This is what happens if
- *    sched_smt_power_savings was not set at boot (default), and it maximizes
- *    true parallelism, and hence performance;
+ *    on pcpus from smt_idle mask first. This maximizes true parallelism, and
+ *    hence performance;
  *  - uses already busy cores first: it is enough to try to schedule the units
- *    on pcpus that are idle, but are not in smt_idle. This is what happens if
- *    sched_smt_power_savings is set at boot, and it allows as more cores as
- *    possible to stay in low power states, minimizing power consumption.
+ *    on pcpus that are idle, but are not in smt_idle. This allows as more
+ *    cores as possible to stay in low power states, minimizing power
+ *    consumption.
+ * Which one we use is decided by sched_smt_pack(), on the load of the runq:
+ * we pack if sched_smt_power_savings was set at boot, or while the load is
+ * below sched_smt_pack_load percent of the runq's pcpus. Otherwise (which,
+ * by default, means always) we spread.
  *
  * This logic is entirely implemented in runq_tickle(), and that is enough.
  * In fact, in this scheduler, placement of an unit on one of the pcpus of a
@@ -833,12 +860,12 @@ static s_time_t c2t(const struct csched2_runqueue_data *rqd, s_time_t credit,
 
 static inline int unit_on_runq(const struct csched2_unit *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
-static inline struct csched2_unit * runq_elem(struct list_head *elem)
+static inline struct csched2_unit * runq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct csched2_unit, runq_elem);
+    return rb_entry(elem, struct csched2_unit, runq_elem);
 }
 
 static inline bool same_node(unsigned int cpua, unsigned int cpub)
@@ -1428,33 +1455,62 @@ update_load(const struct scheduler *ops,
         update_svc_load(ops, svc, change, now);
 }
 
+/* Position of svc in the runqueue. Linear, hence only for tracing. */
+static unsigned int runq_pos(const struct csched2_runqueue_data *rqd,
+                             const struct csched2_unit *svc)
+{
+    const struct rb_node *iter;
+    unsigned int pos = 0;
+
+    for ( iter = rqd->runq_first; iter != &svc->runq_elem;
+          iter = rb_next(iter) )
+        pos++;
+
+    return pos;
+}
+
+/*
+ * The runqueue is an rbtree, sorted by decreasing credit, with units of equal
+ * credit in FIFO order, and the leftmost node cached in runq_first.
+ *
+ * Credits of queued units only ever change all together, in reset_credit(),
+ * and in a way (adding the same amount, then clipping) that preserves their
+ * order, so the tree never needs re-sorting.
+ */
 static void runq_insert(struct csched2_unit *svc)
 {
-    struct list_head *iter;
     unsigned int cpu = sched_unit_master(svc->unit);
-    struct list_head *runq = &c2rqd(cpu)->runq;
-    int pos = 0;
+    struct csched2_runqueue_data *rqd = c2rqd(cpu);
+    struct rb_node **link = &rqd->runq.rb_node, *parent = NULL;
+    bool leftmost = true;
 
     ASSERT(spin_is_locked(get_sched_res(cpu)->schedule_lock));
 
     ASSERT(!unit_on_runq(svc));
     ASSERT(c2r(cpu) == c2r(sched_unit_master(svc->unit)));
 
-    ASSERT(&svc->rqd->runq == runq);
+    ASSERT(svc->rqd == rqd);
     ASSERT(!is_idle_unit(svc->unit));
     ASSERT(!svc->unit->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    while ( *link )
     {
-        struct csched2_unit * iter_svc = runq_elem(iter);
-
-        if ( svc->credit > iter_svc->credit )
-            break;
+        parent = *link;
 
-        pos++;
+        if ( svc->credit > runq_elem(parent)->credit )
+            link = &parent->rb_left;
+        else
+        {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
     }
-    list_add_tail(&svc->runq_elem, iter);
+
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, &rqd->runq);
+    if ( leftmost )
+        rqd->runq_first = &svc->runq_elem;
 
     if ( unlikely(tb_init_done) )
     {
@@ -1464,7 +1520,7 @@ static void runq_insert(struct csched2_unit *svc)
         } d = {
             .unit = svc->unit->unit_id,
             .dom  = svc->unit->domain->domain_id,
-            .pos  = pos,
+            .pos  = runq_pos(rqd, svc),
         };
 
         trace_time(TRC_CSCHED2_RUNQ_POS, sizeof(d), &d);
@@ -1473,8 +1529,14 @@ static void runq_insert(struct csched2_unit *svc)
 
 static inline void runq_remove(struct csched2_unit *svc)
 {
+    struct csched2_runqueue_data *rqd = svc->rqd;
+
     ASSERT(unit_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+
+    if ( rqd->runq_first == &svc->runq_elem )
+        rqd->runq_first = rb_next(&svc->runq_elem);
+    rb_erase(&svc->runq_elem, &rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
 }
 
 static void burn_credits(struct csched2_runqueue_data *rqd,
@@ -1656,7 +1718,7 @@ runq_tickle(const struct scheduler *ops, struct csched2_unit *new, s_time_t now)
          * them first, honoring whatever the spreading-vs-consolidation
          * SMT policy wants us to do.
          */
-        if ( unlikely(sched_smt_power_savings) )
+        if ( sched_smt_pack(rqd->load, rqd->nr_cpus) )
         {
             cpumask_andnot(&mask, &rqd->idle, &rqd->smt_idle);
             cpumask_and(&mask, &mask, online);
@@ -2184,7 +2246,7 @@ csched2_alloc_udata(const struct scheduler *ops, struct sched_unit *unit,
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
 
     svc->sdom = dd;
     svc->unit = unit;
@@ -2206,6 +2268,7 @@ csched2_alloc_udata(const struct scheduler *ops, struct sched_unit *unit,
         svc->weight = 0;
     }
     svc->tickled_cpu = -1;
+    svc->last_cpu = -1;
 
     svc->budget = STIME_MAX;
     svc->budget_quota = 0;
@@ -2569,15 +2632,80 @@ typedef struct {
     s_time_t load_delta;
     struct csched2_unit * best_push_svc, *best_pull_svc;
     /* NB: Read by consider() */
+    const struct csched2_private *prv;
+    s_time_t now;
     struct csched2_runqueue_data *lrqd;
     struct csched2_runqueue_data *orqd;
 } balance_state_t;
 
+/* What makes moving a unit expensive (see migrate_cost()). */
+#define CSCHED2_MCOST_HOT      (1U<<0) /* Unit is cache-hot            */
+#define CSCHED2_MCOST_LLC      (1U<<1) /* ... and leaves its LLC       */
+#define CSCHED2_MCOST_OFF_NODE (1U<<2) /* Unit leaves its NUMA node(s) */
+
+static bool unit_cache_hot(const struct csched2_unit *svc, s_time_t now)
+{
+    if ( svc->flags & CSFLAG_scheduled )
+        return true;
+
+    return svc->last_cpu >= 0 && now - svc->last_stop < svc->last_runtime;
+}
+
+/*
+ * Cost, in load units, of moving svc from its runqueue to trqd. If reasons
+ * is not NULL, the CSCHED2_MCOST_* flags explaining it are stored there.
+ *
+ * d->node_affinity is read without its lock: we only need a hint, and a
+ * stale one costs us one balancing decision at most.
+ */
+static s_time_t migrate_cost(const struct csched2_private *prv,
+                             const struct csched2_unit *svc,
+                             const struct csched2_runqueue_data *trqd,
+                             s_time_t now, unsigned int *reasons)
+{
+    const nodemask_t *node_affinity = &svc->unit->domain->node_affinity;
+    unsigned int flags = 0;
+    s_time_t cost = 0;
+
+    if ( unit_cache_hot(svc, now) )
+    {
+        flags |= CSCHED2_MCOST_HOT;
+        /*
+         * There is no LLC topology in common code, so use the socket
+         * (cpu_core_mask) instead. Runqueues spanning more than one socket
+         * (with credit2_runqueue=node or all) are represented by the socket
+         * of their first pCPU.
+         */
+        if ( svc->last_cpu >= 0 &&
+             !cpumask_test_cpu(svc->last_cpu,
+                               per_cpu(cpu_core_mask,
+                                       cpumask_first(&trqd->active))) )
+        {
+            flags |= CSCHED2_MCOST_LLC;
+            cost += ((s_time_t)opt_migrate_cache_cost <<
+                     prv->load_precision_shift) / 100;
+        }
+    }
+
+    if ( nodes_intersects(svc->rqd->nodes, *node_affinity) &&
+         !nodes_intersects(trqd->nodes, *node_affinity) )
+    {
+        flags |= CSCHED2_MCOST_OFF_NODE;
+        cost += ((s_time_t)opt_migrate_node_cost <<
+                 prv->load_precision_shift) / 100;
+    }
+
+    if ( reasons )
+        *reasons = flags;
+
+    return cost;
+}
+
 static void consider(balance_state_t *st,
                      struct csched2_unit *push_svc,
                      struct csched2_unit *pull_svc)
 {
-    s_time_t l_load, o_load, delta;
+    s_time_t l_load, o_load, delta, cost = 0;
 
     l_load = st->lrqd->b_avgload;
     o_load = st->orqd->b_avgload;
@@ -2594,9 +2722,16 @@ static void consider(balance_state_t *st,
         o_load -= pull_svc->avgload;
     }
 
+    /* What does it cost to move them? */
+    if ( push_svc )
+        cost += migrate_cost(st->prv, push_svc, st->orqd, st->now, NULL);
+    if ( pull_svc )
+        cost += migrate_cost(st->prv, pull_svc, st->lrqd, st->now, NULL);
+
     delta = l_load - o_load;
     if ( delta < 0 )
         delta = -delta;
+    delta += cost;
 
     if ( delta < st->load_delta )
     {
@@ -2692,6 +2827,41 @@ static bool unit_is_migrateable(const struct csched2_unit *svc,
            cpumask_intersects(cpumask_scratch_cpu(cpu), &rqd->active);
 }
 
+/* Account for, and trace, the load balancer's decision to move svc. */
+static void balance_move(const struct csched2_private *prv,
+                         const struct csched2_unit *svc,
+                         const struct csched2_runqueue_data *trqd,
+                         s_time_t load_delta, s_time_t now)
+{
+    unsigned int reasons;
+    s_time_t cost = migrate_cost(prv, svc, trqd, now, &reasons);
+
+    if ( reasons & CSCHED2_MCOST_OFF_NODE )
+        SCHED_STAT_CRANK(migrate_off_node);
+    if ( reasons & CSCHED2_MCOST_LLC )
+        SCHED_STAT_CRANK(migrate_cache_hot);
+
+    if ( unlikely(tb_init_done) )
+    {
+        struct {
+            uint16_t unit, dom;
+            uint16_t rqi, trqi;
+            uint32_t cost, load_delta;
+            uint32_t reasons;
+        } d = {
+            .unit       = svc->unit->unit_id,
+            .dom        = svc->unit->domain->domain_id,
+            .rqi        = svc->rqd->id,
+            .trqi       = trqd->id,
+            .cost       = cost,
+            .load_delta = load_delta,
+            .reasons    = reasons,
+        };
+
+        trace_time(TRC_CSCHED2_LOAD_MOVE, sizeof(d), &d);
+    }
+}
+
 static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 {
     struct csched2_private *prv = csched2_priv(ops);
@@ -2699,7 +2869,8 @@ static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
     bool inner_load_updated = 0;
     struct csched2_runqueue_data *rqd, *max_delta_rqd;
 
-    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL };
+    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL,
+                           .prv = prv, .now = now };
 
     /*
      * Basic algorithm: Push, pull, or swap.
@@ -2866,9 +3037,15 @@ retry:
 
     /* OK, now we have some candidates; do the moving */
     if ( st.best_push_svc )
+    {
+        balance_move(prv, st.best_push_svc, st.orqd, st.load_delta, now);
         migrate(ops, st.best_push_svc, st.orqd, now);
+    }
     if ( st.best_pull_svc )
+    {
+        balance_move(prv, st.best_pull_svc, st.lrqd, st.load_delta, now);
         migrate(ops, st.best_pull_svc, st.lrqd, now);
+    }
 
  out_up:
     spin_unlock(&st.orqd->lock);
@@ -3216,7 +3393,7 @@ csched2_unit_insert(const struct scheduler *ops, struct sched_unit *unit)
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     /* csched2_res_pick() expects the pcpu lock to be held */
     lock = unit_schedule_lock_irq(unit);
@@ -3254,7 +3431,7 @@ csched2_unit_remove(const struct scheduler *ops, struct sched_unit *unit)
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     SCHED_STAT_CRANK(unit_remove);
 
@@ -3276,7 +3453,6 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = c2rqd(cpu);
-    struct list_head *runq = &rqd->runq;
     const struct csched2_private *prv = csched2_priv(ops);
 
     /*
@@ -3314,9 +3490,9 @@ csched2_runtime(const struct scheduler *ops, int cpu,
      * 2) If there's someone waiting whose credit is positive,
      *    run until your credit ~= his.
      */
-    if ( ! list_empty(runq) )
+    if ( rqd->runq_first )
     {
-        struct csched2_unit *swait = runq_elem(runq->next);
+        struct csched2_unit *swait = runq_elem(rqd->runq_first);
 
         if ( ! is_idle_unit(swait->unit)
              && swait->credit > 0 )
@@ -3372,7 +3548,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                struct csched2_unit *scurr,
                int cpu, s_time_t now)
 {
-    struct list_head *iter, *temp;
+    struct rb_node *iter, *next;
     const struct sched_resource *sr = get_sched_res(cpu);
     struct csched2_unit *snext = NULL;
     struct csched2_private *prv = csched2_priv(sr->scheduler);
@@ -3455,9 +3631,12 @@ runq_candidate(struct csched2_runqueue_data *rqd,
         snext = csched2_unit(sched_idle_unit(cpu));
 
  check_runq:
-    list_for_each_safe( iter, temp, &rqd->runq )
+    /* unit_grab_budget() may take the unit it's called for off the runq. */
+    for ( iter = rqd->runq_first; iter != NULL; iter = next )
     {
-        struct csched2_unit * svc = list_entry(iter, struct csched2_unit, runq_elem);
+        struct csched2_unit * svc = runq_elem(iter);
+
+        next = rb_next(iter);
 
         if ( unlikely(tb_init_done) )
         {
@@ -3661,6 +3840,14 @@ static void cf_check csched2_schedule(
          && unit_runnable(currunit) )
         __set_bit(__CSFLAG_delayed_runq_add, &scurr->flags);
 
+    /* Remember where, and for how long, a descheduled unit last ran. */
+    if ( snext != scurr && !is_idle_unit(currunit) )
+    {
+        scurr->last_cpu = sched_cpu;
+        scurr->last_stop = now;
+        scurr->last_runtime = now - scurr->run_start;
+    }
+
     /* Accounting for non-idle tasks */
     if ( !is_idle_unit(snext->unit) )
     {
@@ -3674,6 +3861,7 @@ static void cf_check csched2_schedule(
 
             runq_remove(snext);
             __set_bit(__CSFLAG_scheduled, &snext->flags);
+            snext->run_start = now;
         }
         else
             update_load(ops, rqd, snext, 0, now);
@@ -3699,10 +3887,11 @@ static void cf_check csched2_schedule(
          * returned the first unit in the runqueue, for various reasons
          * (e.g., affinity). Only trigger a reset when it does.
          */
-        if ( list_empty(&rqd->runq) )
+        if ( !rqd->runq_first )
             top_credit = snext->credit;
         else
-            top_credit = max(snext->credit, runq_elem(rqd->runq.next)->credit);
+            top_credit = max(snext->credit,
+                             runq_elem(rqd->runq_first)->credit);
         if ( top_credit <= CSCHED2_CREDIT_RESET )
         {
             reset_credit(sched_cpu, now, snext);
@@ -3775,6 +3964,9 @@ csched2_dump_unit(const struct csched2_private *prv,
     printk(" load=%"PRI_stime" (~%"PRI_stime"%%)", svc->avgload,
            (svc->avgload * 100) >> prv->load_precision_shift);
 
+    if ( svc->last_cpu >= 0 )
+        printk(" last_cpu=%d", svc->last_cpu);
+
     printk("\n");
 }
 
@@ -3878,7 +4070,7 @@ csched2_dump(const struct scheduler *ops)
 
     list_for_each_entry ( rqd, &prv->rql, rql )
     {
-        struct list_head *iter, *runq = &rqd->runq;
+        struct rb_node *iter;
 
         loop = 0;
         /* We need the lock to scan the runqueue. */
@@ -3890,7 +4082,7 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( iter = rqd->runq_first; iter; iter = rb_next(iter) )
         {
             const struct csched2_unit *svc = runq_elem(iter);
 
@@ -3950,7 +4142,9 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
         BUG_ON(!cpumask_empty(&rqd->active));
         rqd->max_weight = 1;
         INIT_LIST_HEAD(&rqd->svc);
-        INIT_LIST_HEAD(&rqd->runq);
+        rqd->runq = RB_ROOT;
+        rqd->runq_first = NULL;
+        nodes_clear(rqd->nodes);
         spin_lock_init(&rqd->lock);
         prv->active_queues++;
     }
@@ -3968,6 +4162,7 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
     __cpumask_set_cpu(cpu, &rqd->idle);
     __cpumask_set_cpu(cpu, &rqd->active);
     __cpumask_set_cpu(cpu, &prv->initialized);
+    node_set(cpu_to_node(cpu), rqd->nodes);
     __cpumask_set_cpu(cpu, &rqd->smt_idle);
 
     rqd->nr_cpus++;
@@ -4069,8 +4264,12 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
     __cpumask_clear_cpu(cpu, &rqd->active);
     __cpumask_clear_cpu(cpu, &rqd->tickled);
 
+    nodes_clear(rqd->nodes);
     for_each_cpu ( rcpu, &rqd->active )
+    {
         __cpumask_clear_cpu(cpu, &csched2_pcpu(rcpu)->sibling_mask);
+        node_set(cpu_to_node(rcpu), rqd->nodes);
+    }
 
     rqd->nr_cpus--;
     ASSERT(cpumask_weight(&rqd->active) == rqd->nr_cpus);
@@ -4161,12 +4360,14 @@ csched2_init(struct scheduler *ops)
            XENLOG_INFO " load_window_shift: %d\n"
            XENLOG_INFO " underload_balance_tolerance: %d\n"
            XENLOG_INFO " overload_balance_tolerance: %d\n"
+           XENLOG_INFO " migrate cache/node cost: %u%%/%u%%\n"
            XENLOG_INFO " runqueues arrangement: %s\n"
            XENLOG_INFO " cap enforcement granularity: %dms\n",
            opt_load_precision_shift,
            opt_load_window_shift,
            opt_underload_balance_tolerance,
            opt_overload_balance_tolerance,
+           opt_migrate_cache_cost, opt_migrate_node_cost,
            opt_runqueue_str[opt_runqueue],
            opt_cap_period);
 
@@ -256,6 +256,43 @@ static void cf_check null_free_domdata(const struct scheduler *ops, void *data)
     }
 }
 
+/*
+ * Is cpu, among the pCPUs in cpus, part of a core with no unit assigned to
+ * any of its threads?
+ */
+static bool core_is_free(const struct null_private *prv, const cpumask_t *cpus,
+                         unsigned int cpu)
+{
+    unsigned int sibling;
+
+    for_each_cpu ( sibling, per_cpu(cpu_sibling_mask, cpu) )
+        if ( cpumask_test_cpu(sibling, cpus) &&
+             !cpumask_test_cpu(sibling, &prv->cpus_free) )
+            return false;
+
+    return true;
+}
+
+/*
+ * Pick one of the free pCPUs in mask, following the SMT placement policy:
+ * when packing, prefer one with busy siblings; when spreading, prefer one
+ * on a fully free core. Returns nr_cpu_ids if mask is empty.
+ */
+static unsigned int pick_free_cpu(const struct null_private *prv,
+                                  const cpumask_t *cpus, const cpumask_t *mask)
+{
+    unsigned int nr_cpus = cpumask_weight(cpus);
+    bool pack = sched_smt_pack(nr_cpus - cpumask_weight(&prv->cpus_free),
+                               nr_cpus);
+    unsigned int cpu;
+
+    for_each_cpu ( cpu, mask )
+        if ( core_is_free(prv, cpus, cpu) != pack )
+            return cpu;
+
+    return cpumask_first(mask);
+}
+
 /*
  * unit to pCPU assignment and placement. This _only_ happens:
  *  - on insert,
@@ -305,7 +342,7 @@ pick_res(const struct null_private *prv, const struct sched_unit *unit)
         /* If not, just go for a free pCPU, within our affinity, if any */
         cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu),
                     &prv->cpus_free);
-        new_cpu = cpumask_first(cpumask_scratch_cpu(cpu));
+        new_cpu = pick_free_cpu(prv, cpus, cpumask_scratch_cpu(cpu));
 
         if ( likely(new_cpu != nr_cpu_ids) )
             goto out;
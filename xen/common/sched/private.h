@@ -631,6 +631,18 @@ affinity_balance_cpumask(const struct sched_unit *unit, int step,
         cpumask_copy(mask, unit->cpu_hard_affinity);
 }
 
+/*
+ * SMT placement policy: should a unit go to an idle thread of a partially
+ * busy core (packing) rather than to a fully idle core (spreading)? We pack
+ * if told to save power, or while fewer than sched_smt_pack_load percent of
+ * the nr_cpus pCPUs we are choosing among are busy.
+ */
+static inline bool sched_smt_pack(unsigned int busy, unsigned int nr_cpus)
+{
+    return unlikely(sched_smt_power_savings) ||
+           busy * 100 < sched_smt_pack_load * nr_cpus;
+}
+
 struct affinity_masks {
     cpumask_var_t hard;
     cpumask_var_t soft;
@@ -13,6 +13,8 @@
 
 #include <xen/init.h>
 #include <xen/lib.h>
+#include <xen/param.h>
+#include <xen/rbtree.h>
 #include <xen/sched.h>
 #include <xen/domain.h>
 #include <xen/delay.h>
@@ -65,25 +67,43 @@
  * When an UNIT has no task but with budget left, its budget is preserved.
  *
  * Queue scheme:
- * A global runqueue and a global depletedqueue for each CPU pool.
+ * The pCPUs of a CPU pool are partitioned in clusters (see rtds_cluster
+ * below), each with its own runqueue, depletedqueue and replenishment
+ * queue and timer. With the default of one cluster for the whole pool,
+ * this is global EDF.
  * The runqueue holds all runnable UNITs with budget,
  * sorted by priority_level and deadline;
  * The depletedqueue holds all UNITs without budget, unsorted;
+ * The replenishment queue holds the UNITs awaiting a replenishment,
+ * sorted by deadline.
+ * The runqueue and the replenishment queue are rbtrees, with their first
+ * element cached.
+ *
+ * EDF is enforced within a cluster. An UNIT only moves to another cluster
+ * when pushed or pulled: when it can't find an idle pCPU in its cluster,
+ * an idle pCPU of another cluster is tickled, and a pCPU with nothing to
+ * run in its own cluster pulls the highest priority UNIT it can run from
+ * the other clusters.
  *
  * Note: cpumask and cpupool is supported.
  */
 
 /*
  * Locking:
- * A global system lock is used to protect the RunQ and DepletedQ.
- * The global lock is referenced by sched_res->schedule_lock
- * from all physical cpus.
+ * Each cluster has a lock protecting its RunQ, DepletedQ and ReplQ. It is
+ * referenced by sched_res->schedule_lock from all the physical cpus of the
+ * cluster.
  *
  * The lock is already grabbed when calling wake/sleep/schedule/ functions
  * in schedule.c
  *
  * The functions involes RunQ and needs to grab locks are:
  *    unit_insert, unit_remove, context_saved, runq_insert
+ *
+ * The private lock (prv->lock) is a rwlock protecting the list of domains
+ * and the list of clusters. It nests outside of the cluster locks, so
+ * the scheduling paths, which already hold a cluster lock, may only
+ * trylock it, and the locks of the other clusters.
  */
 
 
@@ -118,6 +138,47 @@
  */
 #define UPDATE_LIMIT_SHIFT      10
 
+/*
+ * Clusters.
+ *
+ * The pCPUs of a pool are arranged in clusters of:
+ * - cpu: one cluster per logical cpu, i.e., partitioned EDF;
+ * - core: one cluster per physical core;
+ * - socket: one cluster per physical socket;
+ * - node: one cluster per NUMA node;
+ * - all: a single cluster, i.e., global EDF (the default).
+ */
+#define OPT_CLUSTER_CPU     0
+#define OPT_CLUSTER_CORE    1
+#define OPT_CLUSTER_SOCKET  2
+#define OPT_CLUSTER_NODE    3
+#define OPT_CLUSTER_ALL     4
+static const char *const opt_cluster_str[] = {
+    [OPT_CLUSTER_CPU] = "cpu",
+    [OPT_CLUSTER_CORE] = "core",
+    [OPT_CLUSTER_SOCKET] = "socket",
+    [OPT_CLUSTER_NODE] = "node",
+    [OPT_CLUSTER_ALL] = "all"
+};
+static int __read_mostly opt_cluster = OPT_CLUSTER_ALL;
+
+static int __init cf_check parse_rtds_cluster(const char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(opt_cluster_str); i++ )
+    {
+        if ( !strcmp(s, opt_cluster_str[i]) )
+        {
+            opt_cluster = i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+custom_param("rtds_cluster", parse_rtds_cluster);
+
 /*
  * Flags
  */
@@ -176,19 +237,38 @@
 static void cf_check repl_timer_handler(void *data);
 
 /*
- * System-wide private data, include global RunQueue/DepletedQ
- * Global lock is referenced by sched_res->schedule_lock from all
- * physical cpus. It can be grabbed via unit_schedule_lock_irq()
+ * System-wide private data
  */
 struct rt_private {
-    spinlock_t lock;            /* the global coarse-grained lock */
+    rwlock_t lock;              /* protects the domain and cluster lists */
     struct list_head sdom;      /* list of availalbe domains, used for dump */
+    struct list_head clusters;  /* list of clusters */
+
+    cpumask_t idlers;           /* cpus running their idle unit */
+    cpumask_t pushed;           /* idlers claimed by a push, yet to pull */
+};
 
-    struct list_head runq;      /* ordered list of runnable units */
+/*
+ * Cluster of pCPUs, include its RunQueue/DepletedQ
+ * The lock is referenced by sched_res->schedule_lock from all the
+ * physical cpus of the cluster. It can be grabbed via
+ * unit_schedule_lock_irq()
+ */
+struct rt_cluster {
+    spinlock_t lock;            /* lock for the queues of this cluster */
+    struct list_head cl_elem;   /* on the list of clusters */
+    const struct scheduler *ops;
+    unsigned int refcnt;        /* cpus which allocated us as their pdata */
+    unsigned int pick_bias;     /* a cpu of the cluster, for topology */
+    cpumask_t cpus;             /* cpus in this cluster */
+
+    struct rb_root runq;        /* ordered tree of runnable units */
+    struct rb_node *runq_first; /* first unit of the runq */
     struct list_head depletedq; /* unordered list of depleted units */
 
     struct timer repl_timer;    /* replenishment timer */
-    struct list_head replq;     /* ordered list of units that need replenishment */
+    struct rb_root replq;       /* ordered tree of units that need replenishment */
+    struct rb_node *replq_first; /* first unit of the replq */
 
     cpumask_t tickled;          /* cpus been tickled */
 };
@@ -197,8 +277,10 @@ struct rt_private {
  * Virtual CPU
  */
 struct rt_unit {
-    struct list_head q_elem;     /* on the runq/depletedq list */
-    struct list_head replq_elem; /* on the replenishment events list */
+    struct rb_node q_elem;       /* on the runq */
+    struct list_head depletedq_elem; /* on the depletedq */
+    struct rb_node replq_elem;   /* on the replenishment events tree */
+    struct list_head repl_elem;  /* being replenished, in repl_timer_handler */
 
     /* UNIT parameters, in nanoseconds */
     s_time_t period;
@@ -239,19 +321,15 @@ static inline struct rt_unit *rt_unit(const struct sched_unit *unit)
     return unit->priv;
 }
 
-static inline struct list_head *rt_runq(const struct scheduler *ops)
-{
-    return &rt_priv(ops)->runq;
-}
-
-static inline struct list_head *rt_depletedq(const struct scheduler *ops)
+static inline struct rt_cluster *rt_cluster(unsigned int cpu)
 {
-    return &rt_priv(ops)->depletedq;
+    return get_sched_res(cpu)->sched_priv;
 }
 
-static inline struct list_head *rt_replq(const struct scheduler *ops)
+/* The cluster whose queues the unit is on, or would be queued on. */
+static inline struct rt_cluster *unit_cluster(const struct rt_unit *svc)
 {
-    return &rt_priv(ops)->replq;
+    return rt_cluster(sched_unit_master(svc->unit));
 }
 
 static inline bool has_extratime(const struct rt_unit *svc)
@@ -266,32 +344,32 @@ static inline bool has_extratime(const struct rt_unit *svc)
 static int
 unit_on_q(const struct rt_unit *svc)
 {
-   return !list_empty(&svc->q_elem);
+   return !RB_EMPTY_NODE(&svc->q_elem) || !list_empty(&svc->depletedq_elem);
 }
 
 static struct rt_unit *cf_check
-q_elem(struct list_head *elem)
+q_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct rt_unit, q_elem);
+    return rb_entry(elem, struct rt_unit, q_elem);
 }
 
 static struct rt_unit *cf_check
-replq_elem(struct list_head *elem)
+replq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct rt_unit, replq_elem);
+    return rb_entry(elem, struct rt_unit, replq_elem);
 }
 
 static int
 unit_on_replq(const struct rt_unit *svc)
 {
-    return !list_empty(&svc->replq_elem);
+    return !RB_EMPTY_NODE(&svc->replq_elem);
 }
 
 /*
  * If v1 priority >= v2 priority, return value > 0
  * Otherwise, return value < 0
  */
-static s_time_t
+static s_time_t cf_check
 compare_unit_priority(const struct rt_unit *v1, const struct rt_unit *v2)
 {
     int prio = v2->priority_level - v1->priority_level;
@@ -302,6 +380,16 @@ compare_unit_priority(const struct rt_unit *v1, const struct rt_unit *v2)
     return prio;
 }
 
+/*
+ * If v1 deadline <= v2 deadline, return value >= 0
+ * Otherwise, return value < 0
+ */
+static s_time_t cf_check
+compare_unit_deadline(const struct rt_unit *v1, const struct rt_unit *v2)
+{
+    return v2->cur_deadline - v1->cur_deadline;
+}
+
 /*
  * Debug related code, dump unit/cpu information
  */
@@ -353,9 +441,11 @@ rt_dump_pcpu(const struct scheduler *ops, int cpu)
 {
     struct rt_private *prv = rt_priv(ops);
     const struct rt_unit *svc;
+    spinlock_t *lock;
     unsigned long flags;
 
-    spin_lock_irqsave(&prv->lock, flags);
+    read_lock_irqsave(&prv->lock, flags);
+    lock = pcpu_schedule_lock(cpu);
     printk("CPU[%02d]\n", cpu);
     /* current UNIT (nothing to say if that's the idle unit). */
     svc = rt_unit(curr_on_cpu(cpu));
@@ -363,46 +453,54 @@ rt_dump_pcpu(const struct scheduler *ops, int cpu)
     {
         rt_dump_unit(ops, svc);
     }
-    spin_unlock_irqrestore(&prv->lock, flags);
+    pcpu_schedule_unlock(lock, cpu);
+    read_unlock_irqrestore(&prv->lock, flags);
 }
 
 static void cf_check
 rt_dump(const struct scheduler *ops)
 {
-    struct list_head *runq, *depletedq, *replq, *iter;
+    struct list_head *iter;
+    struct rb_node *node;
     struct rt_private *prv = rt_priv(ops);
+    struct rt_cluster *cl;
     const struct rt_unit *svc;
     const struct rt_dom *sdom;
     unsigned long flags;
 
-    spin_lock_irqsave(&prv->lock, flags);
+    read_lock_irqsave(&prv->lock, flags);
 
     if ( list_empty(&prv->sdom) )
         goto out;
 
-    runq = rt_runq(ops);
-    depletedq = rt_depletedq(ops);
-    replq = rt_replq(ops);
-
-    printk("Global RunQueue info:\n");
-    list_for_each ( iter, runq )
+    list_for_each_entry ( cl, &prv->clusters, cl_elem )
     {
-        svc = q_elem(iter);
-        rt_dump_unit(ops, svc);
-    }
+        /* We need the lock to scan the queues. */
+        spin_lock(&cl->lock);
 
-    printk("Global DepletedQueue info:\n");
-    list_for_each ( iter, depletedq )
-    {
-        svc = q_elem(iter);
-        rt_dump_unit(ops, svc);
-    }
+        printk("Cluster %*pbl RunQueue info:\n", CPUMASK_PR(&cl->cpus));
+        for ( node = cl->runq_first; node; node = rb_next(node) )
+        {
+            svc = q_elem(node);
+            rt_dump_unit(ops, svc);
+        }
 
-    printk("Global Replenishment Events info:\n");
-    list_for_each ( iter, replq )
-    {
-        svc = replq_elem(iter);
-        rt_dump_unit(ops, svc);
+        printk("Cluster %*pbl DepletedQueue info:\n", CPUMASK_PR(&cl->cpus));
+        list_for_each ( iter, &cl->depletedq )
+        {
+            svc = list_entry(iter, struct rt_unit, depletedq_elem);
+            rt_dump_unit(ops, svc);
+        }
+
+        printk("Cluster %*pbl Replenishment Events info:\n",
+               CPUMASK_PR(&cl->cpus));
+        for ( node = cl->replq_first; node; node = rb_next(node) )
+        {
+            svc = replq_elem(node);
+            rt_dump_unit(ops, svc);
+        }
+
+        spin_unlock(&cl->lock);
     }
 
     printk("Domain info:\n");
@@ -415,13 +513,17 @@ rt_dump(const struct scheduler *ops)
 
         for_each_sched_unit ( sdom->dom, unit )
         {
+            spinlock_t *lock = unit_schedule_lock(unit);
+
             svc = rt_unit(unit);
             rt_dump_unit(ops, svc);
+
+            unit_schedule_unlock(lock, unit);
         }
     }
 
  out:
-    spin_unlock_irqrestore(&prv->lock, flags);
+    read_unlock_irqrestore(&prv->lock, flags);
 }
 
 /*
@@ -480,6 +582,10 @@ rt_update_deadline(s_time_t now, struct rt_unit *svc)
  * that is being kept ordered by the units' deadlines (as EDF
  * mandates).
  *
+ * The queues are rbtrees with a pointer to their first element, so that
+ * inserting and removing are O(log(n)), while looking at the front of the
+ * queue stays O(1). Units which compare equal are queued FIFO.
+ *
  * For callers' convenience, the unit removing helper returns
  * true if the unit removed was the one at the front of the
  * queue; similarly, the inserting helper returns true if the
@@ -488,56 +594,79 @@ rt_update_deadline(s_time_t now, struct rt_unit *svc)
  * are dealing with).
  */
 static inline bool
-deadline_queue_remove(struct list_head *queue, struct list_head *elem)
+deadline_queue_remove(struct rb_root *queue, struct rb_node **first,
+                      struct rb_node *elem)
 {
-    bool first = false;
+    bool was_first = *first == elem;
+
+    if ( was_first )
+        *first = rb_next(elem);
 
-    if ( queue->next != elem )
-        first = true;
+    rb_erase(elem, queue);
+    RB_CLEAR_NODE(elem);
 
-    list_del_init(elem);
-    return !first;
+    return was_first;
 }
 
 static inline bool
-deadline_queue_insert(struct rt_unit * (*qelem)(struct list_head *),
-                      struct rt_unit *svc, struct list_head *elem,
-                      struct list_head *queue)
+deadline_queue_insert(struct rt_unit * (*qelem)(struct rb_node *),
+                      s_time_t (*compare)(const struct rt_unit *,
+                                          const struct rt_unit *),
+                      struct rt_unit *svc, struct rb_node *elem,
+                      struct rb_root *queue, struct rb_node **first)
 {
-    struct list_head *iter;
-    bool first = true;
+    struct rb_node **node = &queue->rb_node, *parent = NULL;
+    bool leftmost = true;
 
-    list_for_each ( iter, queue )
+    while ( *node )
     {
-        const struct rt_unit * iter_svc = (*qelem)(iter);
-        if ( compare_unit_priority(svc, iter_svc) > 0 )
-            break;
-        first = false;
+        parent = *node;
+        if ( (*compare)(svc, (*qelem)(parent)) > 0 )
+            node = &parent->rb_left;
+        else
+        {
+            node = &parent->rb_right;
+            leftmost = false;
+        }
     }
-    list_add_tail(elem, iter);
-    return first;
+
+    rb_link_node(elem, parent, node);
+    rb_insert_color(elem, queue);
+
+    if ( leftmost )
+        *first = elem;
+
+    return leftmost;
 }
-#define deadline_runq_insert(...) \
-  deadline_queue_insert(&q_elem, ##__VA_ARGS__)
-#define deadline_replq_insert(...) \
-  deadline_queue_insert(&replq_elem, ##__VA_ARGS__)
+#define deadline_runq_insert(svc, cl) \
+  deadline_queue_insert(&q_elem, &compare_unit_priority, svc, \
+                        &(svc)->q_elem, &(cl)->runq, &(cl)->runq_first)
+#define deadline_replq_insert(svc, cl) \
+  deadline_queue_insert(&replq_elem, &compare_unit_deadline, svc, \
+                        &(svc)->replq_elem, &(cl)->replq, &(cl)->replq_first)
 
 static inline void
 q_remove(struct rt_unit *svc)
 {
+    struct rt_cluster *cl = unit_cluster(svc);
+
     ASSERT( unit_on_q(svc) );
-    list_del_init(&svc->q_elem);
+
+    if ( RB_EMPTY_NODE(&svc->q_elem) )
+        list_del_init(&svc->depletedq_elem);
+    else
+        deadline_queue_remove(&cl->runq, &cl->runq_first, &svc->q_elem);
 }
 
 static inline void
 replq_remove(const struct scheduler *ops, struct rt_unit *svc)
 {
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
+    struct rt_cluster *cl = unit_cluster(svc);
 
     ASSERT( unit_on_replq(svc) );
 
-    if ( deadline_queue_remove(replq, &svc->replq_elem) )
+    if ( deadline_queue_remove(&cl->replq, &cl->replq_first,
+                               &svc->replq_elem) )
     {
         /*
          * The replenishment timer needs to be set to fire when a
@@ -545,13 +674,13 @@ replq_remove(const struct scheduler *ops, struct rt_unit *svc)
          * queue is due. If it is such unit that we just removed, we may
          * need to reprogram the timer.
          */
-        if ( !list_empty(replq) )
+        if ( cl->replq_first )
         {
-            const struct rt_unit *svc_next = replq_elem(replq->next);
-            set_timer(&prv->repl_timer, svc_next->cur_deadline);
+            const struct rt_unit *svc_next = replq_elem(cl->replq_first);
+            set_timer(&cl->repl_timer, svc_next->cur_deadline);
         }
         else
-            stop_timer(&prv->repl_timer);
+            stop_timer(&cl->repl_timer);
     }
 }
 
@@ -563,26 +692,24 @@ replq_remove(const struct scheduler *ops, struct rt_unit *svc)
 static void
 runq_insert(const struct scheduler *ops, struct rt_unit *svc)
 {
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *runq = rt_runq(ops);
+    struct rt_cluster *cl = unit_cluster(svc);
 
-    ASSERT( spin_is_locked(&prv->lock) );
+    ASSERT( spin_is_locked(&cl->lock) );
     ASSERT( !unit_on_q(svc) );
     ASSERT( unit_on_replq(svc) );
 
     /* add svc to runq if svc still has budget or its extratime is set */
     if ( svc->cur_budget > 0 ||
          has_extratime(svc) )
-        deadline_runq_insert(svc, &svc->q_elem, runq);
+        deadline_runq_insert(svc, cl);
     else
-        list_add(&svc->q_elem, &prv->depletedq);
+        list_add(&svc->depletedq_elem, &cl->depletedq);
 }
 
 static void
 replq_insert(const struct scheduler *ops, struct rt_unit *svc)
 {
-    struct list_head *replq = rt_replq(ops);
-    struct rt_private *prv = rt_priv(ops);
+    struct rt_cluster *cl = unit_cluster(svc);
 
     ASSERT( !unit_on_replq(svc) );
 
@@ -590,8 +717,8 @@ replq_insert(const struct scheduler *ops, struct rt_unit *svc)
      * The timer may be re-programmed if svc is inserted
      * at the front of the event list.
      */
-    if ( deadline_replq_insert(svc, &svc->replq_elem, replq) )
-        set_timer(&prv->repl_timer, svc->cur_deadline);
+    if ( deadline_replq_insert(svc, cl) )
+        set_timer(&cl->repl_timer, svc->cur_deadline);
 }
 
 /*
@@ -603,7 +730,7 @@ replq_insert(const struct scheduler *ops, struct rt_unit *svc)
 static void
 replq_reinsert(const struct scheduler *ops, struct rt_unit *svc)
 {
-    struct list_head *replq = rt_replq(ops);
+    struct rt_cluster *cl = unit_cluster(svc);
     const struct rt_unit *rearm_svc = svc;
     bool rearm = false;
 
@@ -618,17 +745,18 @@ replq_reinsert(const struct scheduler *ops, struct rt_unit *svc)
      * We may also need to re-program, if svc has been put at the front
      * of the replenishment queue when being re-inserted.
      */
-    if ( deadline_queue_remove(replq, &svc->replq_elem) )
+    if ( deadline_queue_remove(&cl->replq, &cl->replq_first,
+                               &svc->replq_elem) )
     {
-        deadline_replq_insert(svc, &svc->replq_elem, replq);
-        rearm_svc = replq_elem(replq->next);
+        deadline_replq_insert(svc, cl);
+        rearm_svc = replq_elem(cl->replq_first);
         rearm = true;
     }
     else
-        rearm = deadline_replq_insert(svc, &svc->replq_elem, replq);
+        rearm = deadline_replq_insert(svc, cl);
 
     if ( rearm )
-        set_timer(&rt_priv(ops)->repl_timer, rearm_svc->cur_deadline);
+        set_timer(&cl->repl_timer, rearm_svc->cur_deadline);
 }
 
 /*
@@ -646,9 +774,18 @@ rt_res_pick_locked(const struct sched_unit *unit, unsigned int locked_cpu)
     online = cpupool_domain_master_cpumask(unit->domain);
     cpumask_and(cpus, online, unit->cpu_hard_affinity);
 
-    cpu = cpumask_test_cpu(sched_unit_master(unit), cpus)
-            ? sched_unit_master(unit)
-            : cpumask_cycle(sched_unit_master(unit), cpus);
+    cpu = sched_unit_master(unit);
+    if ( !cpumask_test_cpu(cpu, cpus) )
+    {
+        /*
+         * Prefer staying in the current cluster, if that is possible, as
+         * moving to another cluster means moving the unit's queues too.
+         */
+        if ( cpumask_test_cpu(cpu, online) &&
+             cpumask_intersects(cpus, &rt_cluster(cpu)->cpus) )
+            cpumask_and(cpus, cpus, &rt_cluster(cpu)->cpus);
+        cpu = cpumask_cycle(cpu, cpus);
+    }
     ASSERT( !cpumask_empty(cpus) && cpumask_test_cpu(cpu, cpus) );
 
     return get_sched_res(cpu);
@@ -669,6 +806,37 @@ rt_res_pick(const struct scheduler *ops, const struct sched_unit *unit)
     return res;
 }
 
+/*
+ * Move an unit to new_cpu, with the locks of both its current and of its
+ * new cluster held. If the clusters differ, this moves the unit to the
+ * queues of the new one.
+ */
+static void cf_check
+rt_unit_migrate(const struct scheduler *ops, struct sched_unit *unit,
+                unsigned int new_cpu)
+{
+    struct rt_unit *svc = rt_unit(unit);
+    bool on_q = unit_on_q(svc), on_replq = unit_on_replq(svc);
+
+    if ( rt_cluster(new_cpu) == unit_cluster(svc) )
+    {
+        sched_set_res(unit, get_sched_res(new_cpu));
+        return;
+    }
+
+    if ( on_q )
+        q_remove(svc);
+    if ( on_replq )
+        replq_remove(ops, svc);
+
+    sched_set_res(unit, get_sched_res(new_cpu));
+
+    if ( on_replq )
+        replq_insert(ops, svc);
+    if ( on_q )
+        runq_insert(ops, svc);
+}
+
 /*
  * Init/Free related code
  */
@@ -685,11 +853,11 @@ rt_init(struct scheduler *ops)
     if ( prv == NULL )
         goto err;
 
-    spin_lock_init(&prv->lock);
+    printk(" clusters arrangement: %s\n", opt_cluster_str[opt_cluster]);
+
+    rwlock_init(&prv->lock);
     INIT_LIST_HEAD(&prv->sdom);
-    INIT_LIST_HEAD(&prv->runq);
-    INIT_LIST_HEAD(&prv->depletedq);
-    INIT_LIST_HEAD(&prv->replq);
+    INIT_LIST_HEAD(&prv->clusters);
 
     ops->sched_data = prv;
     rc = 0;
@@ -706,22 +874,110 @@ rt_deinit(struct scheduler *ops)
 {
     struct rt_private *prv = rt_priv(ops);
 
-    ASSERT(prv->repl_timer.status == TIMER_STATUS_invalid ||
-           prv->repl_timer.status == TIMER_STATUS_killed);
-
     ops->sched_data = NULL;
     xfree(prv);
 }
 
+static inline bool
+cpu_cluster_match(const struct rt_cluster *cl, unsigned int cpu)
+{
+    unsigned int peer_cpu = cl->pick_bias;
+
+    /* OPT_CLUSTER_CPU will never find an existing cluster. */
+    return opt_cluster == OPT_CLUSTER_ALL ||
+           (opt_cluster == OPT_CLUSTER_CORE &&
+            cpu_to_socket(peer_cpu) == cpu_to_socket(cpu) &&
+            cpu_to_core(peer_cpu) == cpu_to_core(cpu)) ||
+           (opt_cluster == OPT_CLUSTER_SOCKET &&
+            cpu_to_socket(peer_cpu) == cpu_to_socket(cpu)) ||
+           (opt_cluster == OPT_CLUSTER_NODE &&
+            cpu_to_node(peer_cpu) == cpu_to_node(cpu));
+}
+
+/* Find the cluster cpu belongs to, creating it if this is its first cpu. */
+static void *cf_check
+rt_alloc_pdata(const struct scheduler *ops, int cpu)
+{
+    struct rt_private *prv = rt_priv(ops);
+    struct rt_cluster *cl, *cl_new;
+    unsigned long flags;
+
+    /* Prealloc in case we need it - not allowed with interrupts off. */
+    cl_new = xzalloc(struct rt_cluster);
+
+    write_lock_irqsave(&prv->lock, flags);
+
+    list_for_each_entry ( cl, &prv->clusters, cl_elem )
+        if ( cpu_cluster_match(cl, cpu) )
+            goto found;
+
+    if ( !cl_new )
+    {
+        write_unlock_irqrestore(&prv->lock, flags);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    cl = cl_new;
+    cl_new = NULL;
+    spin_lock_init(&cl->lock);
+    cl->ops = ops;
+    cl->pick_bias = cpu;
+    cl->runq = RB_ROOT;
+    cl->runq_first = NULL;
+    INIT_LIST_HEAD(&cl->depletedq);
+    cl->replq = RB_ROOT;
+    cl->replq_first = NULL;
+    list_add_tail(&cl->cl_elem, &prv->clusters);
+
+ found:
+    cl->refcnt++;
+
+    write_unlock_irqrestore(&prv->lock, flags);
+
+    xfree(cl_new);
+
+    return cl;
+}
+
+static void cf_check
+rt_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
+{
+    struct rt_private *prv = rt_priv(ops);
+    struct rt_cluster *cl = pcpu;
+    unsigned long flags;
+
+    if ( !cl )
+        return;
+
+    write_lock_irqsave(&prv->lock, flags);
+
+    ASSERT(cl->refcnt && !cpumask_test_cpu(cpu, &cl->cpus));
+
+    if ( --cl->refcnt )
+        cl = NULL;
+    else
+        list_del(&cl->cl_elem);
+
+    write_unlock_irqrestore(&prv->lock, flags);
+
+    if ( cl )
+    {
+        ASSERT(cl->repl_timer.status == TIMER_STATUS_invalid ||
+               cl->repl_timer.status == TIMER_STATUS_killed);
+        xfree(cl);
+    }
+}
+
 /* Change the scheduler of cpu to us (RTDS). */
 static spinlock_t *cf_check
 rt_switch_sched(struct scheduler *new_ops, unsigned int cpu,
                 void *pdata, void *vdata)
 {
     struct rt_private *prv = rt_priv(new_ops);
+    struct rt_cluster *cl = pdata;
     struct rt_unit *svc = vdata;
 
-    ASSERT(!pdata && svc && is_idle_unit(svc->unit));
+    ASSERT(cl && svc && is_idle_unit(svc->unit));
 
     /*
      * We are holding the runqueue lock already (it's been taken in
@@ -729,45 +985,52 @@ rt_switch_sched(struct scheduler *new_ops, unsigned int cpu,
      * another scheduler, but that is how things need to be, for
      * preventing races.
      */
-    ASSERT(get_sched_res(cpu)->schedule_lock != &prv->lock);
+    ASSERT(get_sched_res(cpu)->schedule_lock != &cl->lock);
+
+    /* No need to save IRQs here, they're already disabled */
+    spin_lock(&cl->lock);
 
     /*
      * If we are the absolute first cpu being switched toward this
-     * scheduler (in which case we'll see TIMER_STATUS_invalid), or the
-     * first one that is added back to the cpupool that had all its cpus
+     * cluster (in which case we'll see TIMER_STATUS_invalid), or the
+     * first one that is added back to a cluster that had all its cpus
      * removed (in which case we'll see TIMER_STATUS_killed), it's our
      * job to (re)initialize the timer.
      */
-    if ( prv->repl_timer.status == TIMER_STATUS_invalid ||
-         prv->repl_timer.status == TIMER_STATUS_killed )
+    if ( cl->repl_timer.status == TIMER_STATUS_invalid ||
+         cl->repl_timer.status == TIMER_STATUS_killed )
     {
-        init_timer(&prv->repl_timer, repl_timer_handler, (void *)new_ops, cpu);
+        init_timer(&cl->repl_timer, repl_timer_handler, cl, cpu);
         dprintk(XENLOG_DEBUG, "RTDS: timer initialized on cpu %u\n", cpu);
     }
 
+    __cpumask_set_cpu(cpu, &cl->cpus);
+    cpumask_set_cpu(cpu, &prv->idlers);
+
+    spin_unlock(&cl->lock);
+
     sched_idle_unit(cpu)->priv = vdata;
 
-    return &prv->lock;
+    return &cl->lock;
 }
 
-static void move_repl_timer(struct rt_private *prv, unsigned int old_cpu)
+static void move_repl_timer(struct rt_cluster *cl, unsigned int old_cpu)
 {
-    cpumask_t *online = get_sched_res(old_cpu)->cpupool->res_valid;
-    unsigned int new_cpu = cpumask_cycle(old_cpu, online);
+    unsigned int new_cpu = cpumask_cycle(old_cpu, &cl->cpus);
 
     /*
-     * Make sure the timer run on one of the cpus that are still available
-     * to this scheduler. If there aren't any left, it means it's the time
+     * Make sure the timer run on one of the cpus that are still part
+     * of the cluster. If there aren't any left, it means it's the time
      * to just kill it.
      */
     if ( new_cpu >= nr_cpu_ids )
     {
-        kill_timer(&prv->repl_timer);
+        kill_timer(&cl->repl_timer);
         dprintk(XENLOG_DEBUG, "RTDS: timer killed on cpu %d\n", old_cpu);
     }
     else
     {
-        migrate_timer(&prv->repl_timer, new_cpu);
+        migrate_timer(&cl->repl_timer, new_cpu);
     }
 }
 
@@ -776,31 +1039,43 @@ rt_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 {
     unsigned long flags;
     struct rt_private *prv = rt_priv(ops);
+    struct rt_cluster *cl = pcpu;
+
+    ASSERT(cl && cpumask_test_cpu(cpu, &cl->cpus));
 
-    spin_lock_irqsave(&prv->lock, flags);
+    spin_lock_irqsave(&cl->lock, flags);
 
-    if ( prv->repl_timer.cpu == cpu )
-        move_repl_timer(prv, cpu);
+    __cpumask_clear_cpu(cpu, &cl->cpus);
+    __cpumask_clear_cpu(cpu, &cl->tickled);
+    cpumask_clear_cpu(cpu, &prv->idlers);
+    cpumask_clear_cpu(cpu, &prv->pushed);
 
-    spin_unlock_irqrestore(&prv->lock, flags);
+    if ( cl->pick_bias == cpu && !cpumask_empty(&cl->cpus) )
+        cl->pick_bias = cpumask_first(&cl->cpus);
+
+    if ( cl->repl_timer.cpu == cpu )
+        move_repl_timer(cl, cpu);
+
+    spin_unlock_irqrestore(&cl->lock, flags);
 }
 
 static void cf_check
 rt_move_timers(const struct scheduler *ops, struct sched_resource *sr)
 {
     unsigned long flags;
-    struct rt_private *prv = rt_priv(ops);
+    struct rt_cluster *cl = sr->sched_priv;
     unsigned int old_cpu;
 
-    spin_lock_irqsave(&prv->lock, flags);
+    spin_lock_irqsave(&cl->lock, flags);
 
-    old_cpu = prv->repl_timer.cpu;
-    if ( prv->repl_timer.status != TIMER_STATUS_invalid &&
-         prv->repl_timer.status != TIMER_STATUS_killed &&
-         !cpumask_test_cpu(old_cpu, sr->cpupool->res_valid) )
-        move_repl_timer(prv, old_cpu);
+    /* Bring the timer back in the cluster, now that sr is up again. */
+    old_cpu = cl->repl_timer.cpu;
+    if ( cl->repl_timer.status != TIMER_STATUS_invalid &&
+         cl->repl_timer.status != TIMER_STATUS_killed &&
+         !cpumask_test_cpu(old_cpu, &cl->cpus) )
+        migrate_timer(&cl->repl_timer, sr->master_cpu);
 
-    spin_unlock_irqrestore(&prv->lock, flags);
+    spin_unlock_irqrestore(&cl->lock, flags);
 }
 
 static void *cf_check
@@ -817,10 +1092,10 @@ rt_alloc_domdata(const struct scheduler *ops, struct domain *dom)
     INIT_LIST_HEAD(&sdom->sdom_elem);
     sdom->dom = dom;
 
-    /* spinlock here to insert the dom */
-    spin_lock_irqsave(&prv->lock, flags);
+    /* lock here to insert the dom */
+    write_lock_irqsave(&prv->lock, flags);
     list_add_tail(&sdom->sdom_elem, &(prv->sdom));
-    spin_unlock_irqrestore(&prv->lock, flags);
+    write_unlock_irqrestore(&prv->lock, flags);
 
     return sdom;
 }
@@ -835,9 +1110,9 @@ rt_free_domdata(const struct scheduler *ops, void *data)
     {
         unsigned long flags;
 
-        spin_lock_irqsave(&prv->lock, flags);
+        write_lock_irqsave(&prv->lock, flags);
         list_del_init(&sdom->sdom_elem);
-        spin_unlock_irqrestore(&prv->lock, flags);
+        write_unlock_irqrestore(&prv->lock, flags);
 
         xfree(sdom);
     }
@@ -853,8 +1128,10 @@ rt_alloc_udata(const struct scheduler *ops, struct sched_unit *unit, void *dd)
     if ( svc == NULL )
         return NULL;
 
-    INIT_LIST_HEAD(&svc->q_elem);
-    INIT_LIST_HEAD(&svc->replq_elem);
+    RB_CLEAR_NODE(&svc->q_elem);
+    INIT_LIST_HEAD(&svc->depletedq_elem);
+    RB_CLEAR_NODE(&svc->replq_elem);
+    INIT_LIST_HEAD(&svc->repl_elem);
     svc->flags = 0U;
     svc->sdom = dd;
     svc->unit = unit;
@@ -1008,20 +1285,20 @@ burn_budget(const struct scheduler *ops, struct rt_unit *svc, s_time_t now)
 }
 
 /*
- * RunQ is sorted. Pick first one within cpumask. If no one, return NULL
- * lock is grabbed before calling this function
+ * RunQ is sorted. Find first one within cpumask. If no one, return NULL
+ * lock of cl is grabbed before calling this function
  */
 static struct rt_unit *
-runq_pick(const struct scheduler *ops, const cpumask_t *mask, unsigned int cpu)
+runq_find(const struct rt_cluster *cl, const cpumask_t *mask,
+          unsigned int cpu)
 {
-    struct list_head *runq = rt_runq(ops);
-    struct list_head *iter;
+    struct rb_node *iter;
     struct rt_unit *svc = NULL;
     struct rt_unit *iter_svc = NULL;
     cpumask_t *cpu_common = cpumask_scratch_cpu(cpu);
     const cpumask_t *online;
 
-    list_for_each ( iter, runq )
+    for ( iter = cl->runq_first; iter; iter = rb_next(iter) )
     {
         iter_svc = q_elem(iter);
 
@@ -1038,6 +1315,18 @@ runq_pick(const struct scheduler *ops, const cpumask_t *mask, unsigned int cpu)
         break;
     }
 
+    return svc;
+}
+
+/*
+ * RunQ is sorted. Pick first one within cpumask. If no one, return NULL
+ * lock is grabbed before calling this function
+ */
+static struct rt_unit *
+runq_pick(const struct rt_cluster *cl, const cpumask_t *mask, unsigned int cpu)
+{
+    struct rt_unit *svc = runq_find(cl, mask, cpu);
+
     if ( unlikely(tb_init_done) && svc )
     {
         struct __packed {
@@ -1056,6 +1345,76 @@ runq_pick(const struct scheduler *ops, const cpumask_t *mask, unsigned int cpu)
     return svc;
 }
 
+/*
+ * Pull the highest priority runnable unit which can run on sched_cpu from
+ * the runqueues of the other clusters, and queue it on the cluster of
+ * sched_cpu, which we have locked. If no one, return NULL
+ *
+ * As we already hold a cluster lock, we can only trylock the private lock
+ * and the other clusters' locks: if that fails, we don't pull from there,
+ * and tell the caller by setting *contended.
+ */
+static struct rt_unit *
+runq_pull(const struct scheduler *ops, unsigned int sched_cpu,
+          unsigned int cpu, bool *contended)
+{
+    struct rt_private *prv = rt_priv(ops);
+    struct rt_cluster *cl = rt_cluster(sched_cpu), *iter_cl;
+    struct rt_cluster *best_cl = NULL;
+    struct rt_unit *svc, *best = NULL;
+
+    if ( !read_trylock(&prv->lock) )
+    {
+        *contended = true;
+        return NULL;
+    }
+
+    list_for_each_entry ( iter_cl, &prv->clusters, cl_elem )
+    {
+        if ( iter_cl == cl || !iter_cl->runq_first )
+            continue;
+
+        if ( !spin_trylock(&iter_cl->lock) )
+        {
+            *contended = true;
+            continue;
+        }
+
+        /* Keep the lock of the cluster of the best candidate so far. */
+        svc = runq_find(iter_cl, cpumask_of(sched_cpu), cpu);
+        if ( svc && unit_runnable(svc->unit) &&
+             (best == NULL || compare_unit_priority(svc, best) > 0) )
+        {
+            if ( best_cl )
+                spin_unlock(&best_cl->lock);
+            best = svc;
+            best_cl = iter_cl;
+        }
+        else
+            spin_unlock(&iter_cl->lock);
+    }
+
+    if ( best )
+    {
+        ASSERT(unit_on_replq(best));
+
+        q_remove(best);
+        replq_remove(ops, best);
+        /* Safe, as we hold the locks of both the old and new cluster. */
+        sched_set_res(best->unit, get_sched_res(sched_cpu));
+        replq_insert(ops, best);
+        runq_insert(ops, best);
+
+        spin_unlock(&best_cl->lock);
+
+        SCHED_STAT_CRANK(migrated);
+    }
+
+    read_unlock(&prv->lock);
+
+    return best;
+}
+
 /*
  * schedule function for rt scheduler.
  * The lock is already grabbed in schedule.c, no need to lock here
@@ -1067,9 +1426,10 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
     const unsigned int cur_cpu = smp_processor_id();
     const unsigned int sched_cpu = sched_get_resource_cpu(cur_cpu);
     struct rt_private *prv = rt_priv(ops);
+    struct rt_cluster *cl = rt_cluster(sched_cpu);
     struct rt_unit *const scurr = rt_unit(currunit);
     struct rt_unit *snext = NULL;
-    bool migrated = false;
+    bool migrated = false, repull = false;
 
     if ( unlikely(tb_init_done) )
     {
@@ -1079,7 +1439,7 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
         } d = {
             .cpu     = cur_cpu,
             .tasklet = tasklet_work_scheduled,
-            .tickled = cpumask_test_cpu(sched_cpu, &prv->tickled),
+            .tickled = cpumask_test_cpu(sched_cpu, &cl->tickled),
             .idle    = is_idle_unit(currunit),
         };
 
@@ -1087,7 +1447,7 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
     }
 
     /* clear ticked bit now that we've been scheduled */
-    cpumask_clear_cpu(sched_cpu, &prv->tickled);
+    cpumask_clear_cpu(sched_cpu, &cl->tickled);
 
     /* burn_budget would return for IDLE UNIT */
     burn_budget(ops, scurr, now);
@@ -1101,7 +1461,7 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
     {
         while ( true )
         {
-            snext = runq_pick(ops, cpumask_of(sched_cpu), cur_cpu);
+            snext = runq_pick(cl, cpumask_of(sched_cpu), cur_cpu);
 
             if ( snext == NULL )
             {
@@ -1122,6 +1482,47 @@ rt_schedule(const struct scheduler *ops, struct sched_unit *currunit,
              ( is_idle_unit(snext->unit) ||
                compare_unit_priority(scurr, snext) > 0 ) )
             snext = scurr;
+
+        /* Nothing to run in our cluster: look for work in the others. */
+        if ( is_idle_unit(snext->unit) )
+        {
+            bool contended = false;
+            struct rt_unit *svc = runq_pull(ops, sched_cpu, cur_cpu,
+                                            &contended);
+
+            if ( svc && unit_runnable_state(svc->unit) )
+            {
+                snext = svc;
+                migrated = true;
+            }
+            /*
+             * A push claimed us for a unit we may not have got at (e.g. its
+             * waker still holds the lock of its cluster). Nobody will tickle
+             * us again, so retry rather than leaving it waiting.
+             */
+            else if ( contended && cpumask_test_cpu(sched_cpu, &prv->pushed) )
+                repull = true;
+        }
+    }
+
+    /* Let the other clusters know whether we have work. */
+    if ( repull )
+    {
+        SCHED_STAT_CRANK(pull_retried);
+        cpu_raise_softirq(cur_cpu, SCHEDULE_SOFTIRQ);
+    }
+    else
+    {
+        if ( is_idle_unit(snext->unit) && !tasklet_work_scheduled )
+        {
+            if ( !cpumask_test_cpu(sched_cpu, &prv->idlers) )
+                cpumask_set_cpu(sched_cpu, &prv->idlers);
+        }
+        else if ( cpumask_test_cpu(sched_cpu, &prv->idlers) )
+            cpumask_clear_cpu(sched_cpu, &prv->idlers);
+
+        if ( cpumask_test_cpu(sched_cpu, &prv->pushed) )
+            cpumask_clear_cpu(sched_cpu, &prv->pushed);
     }
 
     if ( snext != scurr &&
@@ -1179,10 +1580,12 @@ rt_unit_sleep(const struct scheduler *ops, struct sched_unit *unit)
  * Called by wake() and context_saved()
  * We have a running candidate here, the kick logic is:
  * Among all the cpus that are within the cpu affinity
- * 1) if there are any idle CPUs, kick one.
+ * 1) if there are any idle CPUs in the unit's cluster, kick one.
       For cache benefit, we check new->cpu as first
- * 2) now all pcpus are busy;
- *    among all the running units, pick lowest priority one
+ * 2) if there are any idle CPUs in other clusters, kick one, and it
+ *    will pull the unit (or an higher priority one) from our cluster.
+ * 3) now all pcpus are busy;
+ *    among all the running units of the cluster, pick lowest priority one
  *    if snext has higher priority, kick it.
  *
  * TODO:
@@ -1195,6 +1598,7 @@ static void
 runq_tickle(const struct scheduler *ops, const struct rt_unit *new)
 {
     struct rt_private *prv = rt_priv(ops);
+    struct rt_cluster *cl;
     const struct rt_unit *latest_deadline_unit = NULL; /* lowest priority */
     const struct rt_unit *iter_svc;
     const struct sched_unit *iter_unit;
@@ -1205,9 +1609,11 @@ runq_tickle(const struct scheduler *ops, const struct rt_unit *new)
     if ( new == NULL || is_idle_unit(new->unit) )
         return;
 
+    cl = unit_cluster(new);
     online = cpupool_domain_master_cpumask(new->unit->domain);
     cpumask_and(not_tickled, online, new->unit->cpu_hard_affinity);
-    cpumask_andnot(not_tickled, not_tickled, &prv->tickled);
+    cpumask_and(not_tickled, not_tickled, &cl->cpus);
+    cpumask_andnot(not_tickled, not_tickled, &cl->tickled);
 
     /*
      * 1) If there are any idle CPUs, kick one.
@@ -1233,7 +1639,27 @@ runq_tickle(const struct scheduler *ops, const struct rt_unit *new)
         cpu = cpumask_cycle(cpu, not_tickled);
     }
 
-    /* 2) candicate has higher priority, kick out lowest priority unit */
+    /*
+     * 2) Push toward an idle CPU of another cluster. We claim it by clearing
+     *    its bit in prv->idlers, so that we don't push more units to it
+     *    before it had the chance to pull one, and mark it in prv->pushed,
+     *    so that it keeps trying to pull until it got past all the locks.
+     */
+    cpumask_and(not_tickled, online, new->unit->cpu_hard_affinity);
+    cpumask_and(not_tickled, not_tickled, &prv->idlers);
+    cpumask_andnot(not_tickled, not_tickled, &cl->cpus);
+    for_each_cpu ( cpu, not_tickled )
+    {
+        if ( cpumask_test_and_clear_cpu(cpu, &prv->idlers) )
+        {
+            cpumask_set_cpu(cpu, &prv->pushed);
+            SCHED_STAT_CRANK(tickled_idle_cpu);
+            cpu_to_tickle = cpu;
+            goto out;
+        }
+    }
+
+    /* 3) candicate has higher priority, kick out lowest priority unit */
     if ( latest_deadline_unit != NULL &&
          compare_unit_priority(latest_deadline_unit, new) < 0 )
     {
@@ -1257,7 +1683,8 @@ runq_tickle(const struct scheduler *ops, const struct rt_unit *new)
         trace_time(TRC_RTDS_TICKLE, sizeof(d), &d);
     }
 
-    cpumask_set_cpu(cpu_to_tickle, &prv->tickled);
+    if ( cpumask_test_cpu(cpu_to_tickle, &cl->cpus) )
+        cpumask_set_cpu(cpu_to_tickle, &cl->tickled);
     cpu_raise_softirq(cpu_to_tickle, SCHEDULE_SOFTIRQ);
     return;
 }
@@ -1371,9 +1798,9 @@ rt_dom_cntl(
     struct domain *d,
     struct xen_domctl_scheduler_op *op)
 {
-    struct rt_private *prv = rt_priv(ops);
     struct rt_unit *svc;
     const struct sched_unit *unit;
+    spinlock_t *lock;
     unsigned long flags;
     int rc = 0;
     struct xen_domctl_schedparam_vcpu local_sched;
@@ -1393,14 +1820,14 @@ rt_dom_cntl(
             rc = -EINVAL;
             break;
         }
-        spin_lock_irqsave(&prv->lock, flags);
         for_each_sched_unit ( d, unit )
         {
+            lock = unit_schedule_lock_irqsave(unit, &flags);
             svc = rt_unit(unit);
             svc->period = MICROSECS(op->u.rtds.period); /* transfer to nanosec */
             svc->budget = MICROSECS(op->u.rtds.budget);
+            unit_schedule_unlock_irqrestore(lock, flags, unit);
         }
-        spin_unlock_irqrestore(&prv->lock, flags);
         break;
     case XEN_DOMCTL_SCHEDOP_getvcpuinfo:
     case XEN_DOMCTL_SCHEDOP_putvcpuinfo:
@@ -1421,15 +1848,16 @@ rt_dom_cntl(
 
             if ( op->cmd == XEN_DOMCTL_SCHEDOP_getvcpuinfo )
             {
-                spin_lock_irqsave(&prv->lock, flags);
-                svc = rt_unit(d->vcpu[local_sched.vcpuid]->sched_unit);
+                unit = d->vcpu[local_sched.vcpuid]->sched_unit;
+                lock = unit_schedule_lock_irqsave(unit, &flags);
+                svc = rt_unit(unit);
                 local_sched.u.rtds.budget = svc->budget / MICROSECS(1);
                 local_sched.u.rtds.period = svc->period / MICROSECS(1);
                 if ( has_extratime(svc) )
                     local_sched.u.rtds.flags |= XEN_DOMCTL_SCHEDRT_extra;
                 else
                     local_sched.u.rtds.flags &= ~XEN_DOMCTL_SCHEDRT_extra;
-                spin_unlock_irqrestore(&prv->lock, flags);
+                unit_schedule_unlock_irqrestore(lock, flags, unit);
 
                 if ( copy_to_guest_offset(op->u.v.vcpus, index,
                                           &local_sched, 1) )
@@ -1449,15 +1877,16 @@ rt_dom_cntl(
                     break;
                 }
 
-                spin_lock_irqsave(&prv->lock, flags);
-                svc = rt_unit(d->vcpu[local_sched.vcpuid]->sched_unit);
+                unit = d->vcpu[local_sched.vcpuid]->sched_unit;
+                lock = unit_schedule_lock_irqsave(unit, &flags);
+                svc = rt_unit(unit);
                 svc->period = period;
                 svc->budget = budget;
                 if ( local_sched.u.rtds.flags & XEN_DOMCTL_SCHEDRT_extra )
                     __set_bit(__RTDS_extratime, &svc->flags);
                 else
                     __clear_bit(__RTDS_extratime, &svc->flags);
-                spin_unlock_irqrestore(&prv->lock, flags);
+                unit_schedule_unlock_irqrestore(lock, flags, unit);
             }
             /* Process a most 64 vCPUs without checking for preemptions. */
             if ( (++index > 63) && hypercall_preempt_check() )
@@ -1473,40 +1902,47 @@ rt_dom_cntl(
 }
 
 /*
- * The replenishment timer handler picks units
- * from the replq and does the actual replenishment.
+ * The replenishment timer handler of a cluster picks units
+ * from its replq and does the actual replenishment.
  */
 static void cf_check repl_timer_handler(void *data)
 {
     s_time_t now;
-    const struct scheduler *ops = data;
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
-    struct list_head *runq = rt_runq(ops);
-    struct list_head *iter, *tmp;
+    struct rt_cluster *cl = data;
+    const struct scheduler *ops = cl->ops;
+    struct rb_node *iter;
+    struct list_head *tmp_iter, *tmp;
     struct rt_unit *svc;
     LIST_HEAD(tmp_replq);
 
-    spin_lock_irq(&prv->lock);
+    spin_lock_irq(&cl->lock);
 
     now = NOW();
 
     /*
      * Do the replenishment and move replenished units
      * to the temporary list to tickle.
-     * If svc is on run queue, we need to put it at
-     * the correct place since its deadline changes.
      */
-    list_for_each_safe ( iter, tmp, replq )
+    while ( (iter = cl->replq_first) != NULL )
     {
         svc = replq_elem(iter);
 
         if ( now < svc->cur_deadline )
             break;
 
-        list_del(&svc->replq_elem);
+        deadline_queue_remove(&cl->replq, &cl->replq_first, iter);
         rt_update_deadline(now, svc);
-        list_add(&svc->replq_elem, &tmp_replq);
+        list_add(&svc->repl_elem, &tmp_replq);
+    }
+
+    /*
+     * Reinsert the units back to replenishement events list, at their
+     * new deadline. If svc is on run queue, we need to put it at
+     * the correct place since its deadline changes.
+     */
+    list_for_each_entry ( svc, &tmp_replq, repl_elem )
+    {
+        deadline_replq_insert(svc, cl);
 
         if ( unit_on_q(svc) )
         {
@@ -1520,16 +1956,15 @@ static void cf_check repl_timer_handler(void *data)
      * If an updated unit is running, tickle the head of the
      * runqueue if it has a higher priority.
      * If an updated unit was depleted and on the runqueue, tickle it.
-     * Finally, reinsert the units back to replenishement events list.
      */
-    list_for_each_safe ( iter, tmp, &tmp_replq )
+    list_for_each_safe ( tmp_iter, tmp, &tmp_replq )
     {
-        svc = replq_elem(iter);
+        svc = list_entry(tmp_iter, struct rt_unit, repl_elem);
 
         if ( curr_on_cpu(sched_unit_master(svc->unit)) == svc->unit &&
-             !list_empty(runq) )
+             cl->runq_first )
         {
-            struct rt_unit *next_on_runq = q_elem(runq->next);
+            struct rt_unit *next_on_runq = q_elem(cl->runq_first);
 
             if ( compare_unit_priority(svc, next_on_runq) < 0 )
                 runq_tickle(ops, next_on_runq);
@@ -1538,8 +1973,7 @@ static void cf_check repl_timer_handler(void *data)
                   unit_on_q(svc) )
             runq_tickle(ops, svc);
 
-        list_del(&svc->replq_elem);
-        deadline_replq_insert(svc, &svc->replq_elem, replq);
+        list_del_init(&svc->repl_elem);
     }
 
     /*
@@ -1547,10 +1981,10 @@ static void cf_check repl_timer_handler(void *data)
      * set the next replenishment to happen at the deadline of
      * the one in the front.
      */
-    if ( !list_empty(replq) )
-        set_timer(&prv->repl_timer, replq_elem(replq->next)->cur_deadline);
+    if ( cl->replq_first )
+        set_timer(&cl->repl_timer, replq_elem(cl->replq_first)->cur_deadline);
 
-    spin_unlock_irq(&prv->lock);
+    spin_unlock_irq(&cl->lock);
 }
 
 static const struct scheduler sched_rtds_def = {
@@ -1564,6 +1998,8 @@ static const struct scheduler sched_rtds_def = {
     .init           = rt_init,
     .deinit         = rt_deinit,
     .switch_sched   = rt_switch_sched,
+    .alloc_pdata    = rt_alloc_pdata,
+    .free_pdata     = rt_free_pdata,
     .deinit_pdata   = rt_deinit_pdata,
     .alloc_domdata  = rt_alloc_domdata,
     .free_domdata   = rt_free_domdata,
@@ -1575,6 +2011,7 @@ static const struct scheduler sched_rtds_def = {
     .adjust         = rt_dom_cntl,
 
     .pick_resource  = rt_res_pick,
+    .migrate        = rt_unit_migrate,
     .do_schedule    = rt_schedule,
     .sleep          = rt_unit_sleep,
     .wake           = rt_unit_wake,
@@ -8,6 +8,8 @@
 #include <xen/init.h>
 #include <xen/types.h>
 #include <xen/errno.h>
+#include <xen/guest_access.h>
+#include <xen/hypfs.h>
 #include <xen/sched.h>
 #include <xen/lib.h>
 #include <xen/param.h>
@@ -29,12 +31,59 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/* Keep active timers in a timer wheel instead of the timer heap. */
+static bool __read_mostly opt_timer_wheel;
+boolean_param("timer-wheel", opt_timer_wheel);
+
+/* How late timers of each coalescing class may expire, in ns. */
+static unsigned int __read_mostly coalesce_window[TIMER_COALESCE_nr];
+static bool __read_mostly timer_coalescing;
+
+static int __init cf_check parse_timer_coalesce(const char *s)
+{
+    static const char *const names[TIMER_COALESCE_nr] = {
+        [TIMER_COALESCE_tick]  = "tick",
+        [TIMER_COALESCE_vpt]   = "vpt",
+        [TIMER_COALESCE_sched] = "sched",
+    };
+    const char *ss;
+    long long val;
+    unsigned int i;
+    int rc = 0;
+
+    do {
+        ss = strchr(s, ',');
+        if ( !ss )
+            ss = strchr(s, '\0');
+
+        for ( i = TIMER_COALESCE_tick; i < TIMER_COALESCE_nr; i++ )
+            if ( !parse_signed_integer(names[i], s, ss, &val) )
+                break;
+
+        /* Windows are given in microseconds, up to a second. */
+        if ( i < TIMER_COALESCE_nr && val >= 0 && val <= 1000000 )
+            coalesce_window[i] = val * 1000;
+        else
+            rc = -EINVAL;
+
+        s = ss + 1;
+    } while ( *ss );
+
+    return rc;
+}
+custom_param("timer-coalesce", parse_timer_coalesce);
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
     struct timer  *list;
+    struct timer_wheel *wheel;
     struct timer  *running;
     struct list_head inactive;
+    /* Deadline which would have been programmed without coalescing. */
+    s_time_t       plain_deadline;
+    /* Timer interrupts saved by coalescing. */
+    unsigned long  irqs_saved;
 } __cacheline_aligned;
 
 static DEFINE_PER_CPU(struct timers, timers);
@@ -176,6 +225,295 @@ static int add_to_list(struct timer **pprev, struct timer *t)
 }
 
 
+/****************************************************************************
+ * TIMER WHEEL OPERATIONS.
+ *
+ * Time is divided into ticks of 2^wheel_shift ns, no longer than timer_slop.
+ * Each level of the wheel has WHEEL_SIZE buckets, each spanning WHEEL_SIZE
+ * times as many ticks as a bucket of the level below.  A timer is filed at
+ * the lowest level on which its tick shares the enclosing bucket of the next
+ * level up with the wheel's base, the tick up to which timers have been
+ * processed.  Buckets of higher levels are cascaded into lower ones when the
+ * base reaches them.  Timers beyond the reach of all levels are kept on an
+ * unsorted overflow list.
+ */
+
+#define WHEEL_BITS    6
+#define WHEEL_SIZE    (1U << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS  6
+#define WHEEL_BUCKETS (WHEEL_LEVELS * WHEEL_SIZE)
+
+struct timer_wheel {
+    uint64_t base;
+    /* Earliest time the wheel needs attention, as last computed. */
+    s_time_t deadline;
+    DECLARE_BITMAP(pending, WHEEL_BUCKETS);
+    struct list_head bucket[WHEEL_BUCKETS];
+    struct list_head overflow;
+};
+
+static unsigned int __read_mostly wheel_shift;
+
+static uint64_t wheel_tick(s_time_t t)
+{
+    return t > 0 ? (uint64_t)t >> wheel_shift : 0;
+}
+
+/* Bucket for a timer expiring in @tick, or WHEEL_BUCKETS for overflow. */
+static unsigned int wheel_bucket(uint64_t base, uint64_t tick)
+{
+    unsigned int level;
+
+    if ( tick <= base )
+        return base & WHEEL_MASK;
+
+    level = (fls64(tick ^ base) - 1) / WHEEL_BITS;
+    if ( level >= WHEEL_LEVELS )
+        return WHEEL_BUCKETS;
+
+    return level * WHEEL_SIZE + ((tick >> (level * WHEEL_BITS)) & WHEEL_MASK);
+}
+
+/*
+ * First tick after @w->base at which a pending bucket needs processing, and
+ * that bucket (WHEEL_BUCKETS for the overflow list).  ~0 if there is none.
+ */
+static uint64_t wheel_next(const struct timer_wheel *w, unsigned int *bucket)
+{
+    unsigned int level, shift, pos, b;
+
+    for ( level = 0; level < WHEEL_LEVELS; level++ )
+    {
+        shift = level * WHEEL_BITS;
+        pos = (w->base >> shift) & WHEEL_MASK;
+        b = find_next_bit(w->pending, (level + 1) * WHEEL_SIZE,
+                          level * WHEEL_SIZE + pos + 1);
+        if ( b < (level + 1) * WHEEL_SIZE )
+        {
+            *bucket = b;
+            return ((w->base >> shift) - pos + (b - level * WHEEL_SIZE)) <<
+                   shift;
+        }
+    }
+
+    *bucket = WHEEL_BUCKETS;
+    if ( list_empty(&w->overflow) )
+        return ~0ULL;
+
+    shift = WHEEL_LEVELS * WHEEL_BITS;
+    return ((w->base >> shift) + 1) << shift;
+}
+
+/* Delete @t from @w. The hardware never needs reprogramming early. */
+static int remove_from_wheel(struct timer_wheel *w, struct timer *t)
+{
+    struct list_head *next = t->inactive.next;
+
+    /* Last timer in its bucket?  Its only neighbour is then the bucket. */
+    if ( next == t->inactive.prev &&
+         next >= &w->bucket[0] && next < &w->bucket[WHEEL_BUCKETS] )
+        __clear_bit(next - w->bucket, w->pending);
+
+    list_del(&t->inactive);
+
+    return 0;
+}
+
+/* Add new entry @t to @w. Return TRUE if due before the wheel's deadline. */
+static int add_to_wheel(struct timer_wheel *w, struct timer *t)
+{
+    unsigned int b = wheel_bucket(w->base, wheel_tick(t->expires));
+
+    /* Overflow timers only need the wheel to be looked at eventually. */
+    if ( b == WHEEL_BUCKETS )
+    {
+        list_add_tail(&t->inactive, &w->overflow);
+        return w->deadline == STIME_MAX;
+    }
+
+    list_add_tail(&t->inactive, &w->bucket[b]);
+    __set_bit(b, w->pending);
+
+    return t->expires < w->deadline;
+}
+
+/* Re-file all timers of bucket @b relative to the current base. */
+static void wheel_cascade(struct timer_wheel *w, unsigned int b)
+{
+    struct list_head *head = b < WHEEL_BUCKETS ? &w->bucket[b] : &w->overflow;
+    struct timer *t, *tmp;
+    LIST_HEAD(cascade);
+
+    if ( b < WHEEL_BUCKETS )
+        __clear_bit(b, w->pending);
+    list_splice_init(head, &cascade);
+
+    list_for_each_entry_safe ( t, tmp, &cascade, inactive )
+    {
+        list_del(&t->inactive);
+        add_to_wheel(w, t);
+    }
+}
+
+static struct timer *wheel_first(const struct timer_wheel *w)
+{
+    unsigned int b = find_first_bit(w->pending, WHEEL_BUCKETS);
+
+    if ( b < WHEEL_BUCKETS )
+        return list_first_entry(&w->bucket[b], struct timer, inactive);
+
+    return list_first_entry_or_null(&w->overflow, struct timer, inactive);
+}
+
+/* Earliest time at which the wheel needs attention, or STIME_MAX. */
+static s_time_t wheel_deadline(const struct timer_wheel *w)
+{
+    const struct timer *t;
+    s_time_t deadline = STIME_MAX;
+    unsigned int b;
+    uint64_t next;
+
+    /* Level 0 buckets hold timers to expire: find the exact deadline. */
+    b = find_next_bit(w->pending, WHEEL_SIZE, w->base & WHEEL_MASK);
+    if ( b < WHEEL_SIZE )
+    {
+        list_for_each_entry ( t, &w->bucket[b], inactive )
+            deadline = min(deadline, t->expires);
+        return deadline;
+    }
+
+    /* Otherwise wake up when the next higher level bucket wants cascading. */
+    next = wheel_next(w, &b);
+    if ( next > ((uint64_t)STIME_MAX >> wheel_shift) )
+        return STIME_MAX;
+
+    return next << wheel_shift;
+}
+
+static struct timer_wheel *alloc_wheel(void)
+{
+    struct timer_wheel *w = xzalloc(struct timer_wheel);
+    unsigned int i;
+
+    if ( !w )
+        return NULL;
+
+    w->base = wheel_tick(NOW());
+    w->deadline = STIME_MAX;
+    for ( i = 0; i < WHEEL_BUCKETS; i++ )
+        INIT_LIST_HEAD(&w->bucket[i]);
+    INIT_LIST_HEAD(&w->overflow);
+
+    return w;
+}
+
+
+/****************************************************************************
+ * TIMER COALESCING.
+ *
+ * Timers may expire late by up to the window of their coalescing class.  The
+ * deadline is pushed out to the latest time all timers tolerate, such that
+ * timers expiring within each other's windows share a single interrupt.
+ */
+
+static s_time_t latest_expiry(const struct timer *t)
+{
+    unsigned int window = coalesce_window[t->coalesce];
+
+    return t->expires < STIME_MAX - window ? t->expires + window : STIME_MAX;
+}
+
+/* Upper bound of heap entries looked at when coalescing. */
+#define HEAP_COALESCE_MAX 128
+
+/* Latest deadline the timers of @heap tolerate. */
+static s_time_t heap_coalesce(struct timer **heap)
+{
+    unsigned int size = heap_metadata(heap)->size, pos = 1, nr = 0;
+    s_time_t deadline = STIME_MAX;
+
+    /*
+     * Walk the heap in pre-order, skipping subtrees rooted at timers which
+     * expire past the deadline: those further down expire later still.
+     */
+    while ( pos )
+    {
+        if ( pos <= size && heap[pos]->expires < deadline )
+        {
+            if ( nr++ < HEAP_COALESCE_MAX )
+            {
+                deadline = min(deadline, latest_expiry(heap[pos]));
+                pos <<= 1;
+                continue;
+            }
+
+            /*
+             * Out of budget: skip the subtree, without letting any of its
+             * timers expire late.  Only the roots of the subtrees left are
+             * looked at from now on.
+             */
+            deadline = heap[pos]->expires;
+        }
+
+        /* Move on to the next right sibling of @pos or of its ancestors. */
+        while ( pos & 1 )
+            pos >>= 1;
+        if ( pos )
+            pos |= 1;
+    }
+
+    return deadline;
+}
+
+static s_time_t list_coalesce(const struct timer *t, s_time_t deadline)
+{
+    for ( ; t != NULL && t->expires < deadline; t = t->list_next )
+        deadline = min(deadline, latest_expiry(t));
+
+    return deadline;
+}
+
+static s_time_t wheel_coalesce(const struct timer_wheel *w)
+{
+    uint64_t start = w->base & ~(uint64_t)WHEEL_MASK;
+    s_time_t deadline;
+    const struct timer *t;
+    unsigned int b;
+
+    /* Nothing to expire before buckets of higher levels need cascading. */
+    b = find_next_bit(w->pending, WHEEL_SIZE, w->base & WHEEL_MASK);
+    if ( b >= WHEEL_SIZE )
+        return wheel_deadline(w);
+
+    /* Higher levels may hold timers due as soon as level 0 wraps. */
+    deadline = (start + WHEEL_SIZE) << wheel_shift;
+
+    for ( ; b < WHEEL_SIZE && (s_time_t)((start + b) << wheel_shift) < deadline;
+          b = find_next_bit(w->pending, WHEEL_SIZE, b + 1) )
+        list_for_each_entry ( t, &w->bucket[b], inactive )
+            deadline = min(deadline, latest_expiry(t));
+
+    return deadline;
+}
+
+/* Latest deadline the active timers of @ts tolerate. */
+static s_time_t coalesce_deadline(const struct timers *ts)
+{
+    if ( ts->wheel )
+        return wheel_coalesce(ts->wheel);
+
+    return list_coalesce(ts->list, heap_coalesce(ts->heap));
+}
+
+/* Is @t due before what its CPU may have programmed by coalescing? */
+static bool needs_earlier_deadline(const struct timer *t)
+{
+    return timer_coalescing &&
+           latest_expiry(t) < per_cpu(timer_deadline, t->cpu);
+}
+
+
 /****************************************************************************
  * TIMER OPERATIONS.
  */
@@ -193,6 +531,9 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        rc = remove_from_wheel(timers->wheel, t);
+        break;
     default:
         rc = 0;
         BUG();
@@ -209,6 +550,12 @@ static int add_entry(struct timer *t)
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    if ( timers->wheel )
+    {
+        t->status = TIMER_STATUS_in_wheel;
+        return add_to_wheel(timers->wheel, t);
+    }
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -227,7 +574,7 @@ static inline void activate_timer(struct timer *timer)
     timer->status = TIMER_STATUS_invalid;
     list_del(&timer->inactive);
 
-    if ( add_entry(timer) )
+    if ( add_entry(timer) || needs_earlier_deadline(timer) )
         cpu_raise_softirq(timer->cpu, TIMER_SOFTIRQ);
 }
 
@@ -311,6 +658,21 @@ void init_timer(
 }
 
 
+void timer_set_coalesce(struct timer *timer, enum timer_coalesce coalesce)
+{
+    unsigned long flags;
+
+    ASSERT(coalesce < TIMER_COALESCE_nr);
+
+    if ( !timer_lock_irqsave(timer, flags) )
+        return;
+
+    timer->coalesce = coalesce;
+
+    timer_unlock_irqrestore(timer, flags);
+}
+
+
 void set_timer(struct timer *timer, s_time_t expires)
 {
     unsigned long flags;
@@ -450,6 +812,13 @@ static void execute_timer(struct timers *ts, struct timer *t)
     t->status = TIMER_STATUS_inactive;
     list_add(&t->inactive, &ts->inactive);
 
+    /* Would this timer have needed an interrupt of its own? */
+    if ( ts->plain_deadline && t->expires > ts->plain_deadline )
+    {
+        ts->irqs_saved++;
+        ts->plain_deadline = t->expires + timer_slop;
+    }
+
     ts->running = t;
     spin_unlock_irq(&ts->lock);
     (*fn)(data);
@@ -458,6 +827,70 @@ static void execute_timer(struct timers *ts, struct timer *t)
 }
 
 
+/* Execute ready wheel timers. Return the earliest deadline. */
+static s_time_t wheel_run_timers(struct timers *ts)
+{
+    struct timer_wheel *w = ts->wheel;
+    struct timer *t, *tmp;
+    s_time_t now = NOW();
+    uint64_t next, target = wheel_tick(now);
+    unsigned int b;
+    LIST_HEAD(ready);
+
+    /* Timers queued before this CPU had its wheel set up. */
+    while ( unlikely((t = ts->list) != NULL) )
+    {
+        ts->list = t->list_next;
+        t->status = TIMER_STATUS_invalid;
+        add_entry(t);
+    }
+
+    for ( ; ; )
+    {
+        b = w->base & WHEEL_MASK;
+
+        /*
+         * Collect the ready timers of the current bucket.  While ts->lock is
+         * dropped to run one, others may be stopped or set, which takes them
+         * off the ready list again.
+         */
+        list_for_each_entry_safe ( t, tmp, &w->bucket[b], inactive )
+            if ( t->expires < now )
+                list_move_tail(&t->inactive, &ready);
+        if ( list_empty(&w->bucket[b]) )
+            __clear_bit(b, w->pending);
+
+        if ( !list_empty(&ready) )
+        {
+            while ( !list_empty(&ready) )
+            {
+                t = list_first_entry(&ready, struct timer, inactive);
+                list_del(&t->inactive);
+                execute_timer(ts, t);
+            }
+            continue;
+        }
+
+        if ( w->base >= target )
+            break;
+
+        next = wheel_next(w, &b);
+        if ( next > target )
+        {
+            w->base = target;
+            continue;
+        }
+
+        w->base = next;
+        if ( b >= WHEEL_SIZE )
+            wheel_cascade(w, b);
+    }
+
+    w->deadline = wheel_deadline(w);
+
+    return w->deadline;
+}
+
 static void cf_check timer_softirq_action(void)
 {
     struct timer  *t, **heap, *next;
@@ -467,6 +900,13 @@ static void cf_check timer_softirq_action(void)
     ts = &this_cpu(timers);
     heap = ts->heap;
 
+    if ( ts->wheel )
+    {
+        spin_lock_irq(&ts->lock);
+        deadline = wheel_run_timers(ts);
+        goto program;
+    }
+
     /* If we overflowed the heap, try to allocate a larger heap. */
     if ( unlikely(ts->list != NULL) )
     {
@@ -530,7 +970,19 @@ static void cf_check timer_softirq_action(void)
         deadline = heap[1]->expires;
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
+
+ program:
     now = NOW();
+
+    ts->plain_deadline = 0;
+    if ( timer_coalescing && deadline != STIME_MAX )
+    {
+        ts->plain_deadline = MAX(deadline, now + timer_slop);
+        deadline = coalesce_deadline(ts);
+        if ( ts->wheel )
+            ts->wheel->deadline = deadline;
+    }
+
     this_cpu(timer_deadline) =
         (deadline == STIME_MAX) ? 0 : MAX(deadline, now + timer_slop);
 
@@ -574,10 +1026,57 @@ static void cf_check dump_timerq(unsigned char key)
             dump_timer(ts->heap[j], now);
         for ( t = ts->list; t != NULL; t = t->list_next )
             dump_timer(t, now);
+        if ( ts->wheel )
+        {
+            for ( j = 0; j < WHEEL_BUCKETS; j++ )
+                list_for_each_entry ( t, &ts->wheel->bucket[j], inactive )
+                    dump_timer(t, now);
+            list_for_each_entry ( t, &ts->wheel->overflow, inactive )
+                dump_timer(t, now);
+        }
         spin_unlock_irqrestore(&ts->lock, flags);
     }
 }
 
+#ifdef CONFIG_HYPFS
+/* Only gives the leaf its size: the value is summed up at read time. */
+static uint64_t irqs_saved_size;
+
+static int cf_check irqs_saved_read(const struct hypfs_entry *entry,
+                                    XEN_GUEST_HANDLE_PARAM(void) uaddr)
+{
+    uint64_t saved = 0;
+    unsigned int cpu;
+
+    for_each_online_cpu ( cpu )
+        saved += per_cpu(timers, cpu).irqs_saved;
+
+    return copy_to_guest(uaddr, &saved, 1) ? -EFAULT : 0;
+}
+
+static const struct hypfs_funcs irqs_saved_funcs = {
+    .enter = hypfs_node_enter,
+    .exit = hypfs_node_exit,
+    .read = irqs_saved_read,
+    .write = hypfs_write_deny,
+    .getsize = hypfs_getsize,
+    .findentry = hypfs_leaf_findentry,
+};
+
+static HYPFS_DIR_INIT(timer_dir, "timer");
+static HYPFS_FIXEDSIZE_INIT(irqs_saved, XEN_HYPFS_TYPE_UINT, "irqs-saved",
+                            irqs_saved_size, &irqs_saved_funcs, 0);
+
+static int __init cf_check timer_hypfs_init(void)
+{
+    hypfs_add_dir(&hypfs_root, &timer_dir, true);
+    hypfs_add_leaf(&timer_dir, &irqs_saved, true);
+
+    return 0;
+}
+__initcall(timer_hypfs_init);
+#endif /* CONFIG_HYPFS */
+
 static void migrate_timers_from_cpu(unsigned int old_cpu)
 {
     unsigned int new_cpu = cpumask_any(&cpu_online_map);
@@ -601,12 +1100,13 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         spin_lock(&old_ts->lock);
     }
 
-    while ( (t = heap_metadata(old_ts->heap)->size
-             ? old_ts->heap[1] : old_ts->list) != NULL )
+    while ( (t = heap_metadata(old_ts->heap)->size ? old_ts->heap[1]
+             : old_ts->list ?: (old_ts->wheel ? wheel_first(old_ts->wheel)
+                                              : NULL)) != NULL )
     {
         remove_entry(t);
         write_atomic(&t->cpu, new_cpu);
-        notify |= add_entry(t);
+        notify |= add_entry(t) || needs_earlier_deadline(t);
     }
 
     while ( !list_empty(&old_ts->inactive) )
@@ -617,6 +1117,10 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         list_add(&t->inactive, &new_ts->inactive);
     }
 
+    /* Keep the statistic of the CPU going away. */
+    new_ts->irqs_saved += old_ts->irqs_saved;
+    old_ts->irqs_saved = 0;
+
     spin_unlock(&old_ts->lock);
     spin_unlock_irq(&new_ts->lock);
 
@@ -643,6 +1147,12 @@ static void free_percpu_timers(unsigned int cpu)
     }
     else
         ASSERT(ts->heap == dummy_heap);
+
+    if ( ts->wheel )
+    {
+        ASSERT(!wheel_first(ts->wheel));
+        XFREE(ts->wheel);
+    }
 }
 
 static int cf_check cpu_callback(
@@ -661,6 +1171,12 @@ static int cf_check cpu_callback(
             spin_lock_init(&ts->lock);
             ts->heap = dummy_heap;
         }
+        if ( opt_timer_wheel && !ts->wheel )
+        {
+            ts->wheel = alloc_wheel();
+            if ( !ts->wheel )
+                return notifier_from_errno(-ENOMEM);
+        }
         break;
 
     case CPU_UP_CANCELED:
@@ -692,9 +1208,17 @@ static struct notifier_block cpu_nfb = {
 void __init timer_init(void)
 {
     void *cpu = (void *)(long)smp_processor_id();
+    unsigned int i;
 
     open_softirq(TIMER_SOFTIRQ, timer_softirq_action);
 
+    /* Wheel ticks no longer than the slop, but not absurdly short either. */
+    wheel_shift = max_t(int, fls(timer_slop) - 1, 10);
+
+    for ( i = 0; i < TIMER_COALESCE_nr; i++ )
+        if ( coalesce_window[i] )
+            timer_coalescing = true;
+
     cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
     register_cpu_notifier(&cpu_nfb);
 
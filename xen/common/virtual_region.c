@@ -123,7 +123,7 @@ void unregister_virtual_region(struct virtual_region *r)
     remove_virtual_region(r);
 
     /* Assert that no CPU might be using the removed region. */
-    rcu_barrier();
+    synchronize_rcu_expedited();
 }
 
 #ifdef CONFIG_X86
@@ -1,12 +1,16 @@
 #include <xen/bitmap.h>
+#include <xen/cpu.h>
 #include <xen/sections.h>
 #include <xen/init.h>
 #include <xen/mm.h>
+#include <xen/percpu.h>
+#include <xen/perfc.h>
 #include <xen/pfn.h>
 #include <xen/spinlock.h>
 #include <xen/types.h>
 #include <xen/vmap.h>
 #include <xen/xvmalloc.h>
+#include <asm/flushtlb.h>
 #include <asm/page.h>
 
 static DEFINE_SPINLOCK(vm_lock);
@@ -57,8 +61,8 @@ void __init vm_init_type(enum vmap_region type, void *start, void *end)
     populate_pt_range(va, vm_low[type] - nr);
 }
 
-static void *vm_alloc(unsigned int nr, unsigned int align,
-                      enum vmap_region t)
+static void *vm_alloc_range(unsigned int nr, unsigned int align,
+                            enum vmap_region t)
 {
     unsigned int start, bit;
 
@@ -191,7 +195,8 @@ static unsigned int vm_size(const void *va, enum vmap_region type)
     return min(end, vm_top[type]) - start;
 }
 
-static void vm_free(const void *va)
+/* Must be called with vm_lock held. */
+static void vm_free_locked(const void *va)
 {
     enum vmap_region type = VMAP_DEFAULT;
     unsigned int bit = vm_index(va, type);
@@ -208,7 +213,6 @@ static void vm_free(const void *va)
         return;
     }
 
-    spin_lock(&vm_lock);
     if ( bit < vm_low[type] )
     {
         vm_low[type] = bit - 1;
@@ -218,9 +222,255 @@ static void vm_free(const void *va)
     while ( __test_and_clear_bit(bit, vm_bitmap(type)) )
         if ( ++bit == vm_top[type] )
             break;
+}
+
+static void vm_free(const void *va)
+{
+    spin_lock(&vm_lock);
+    vm_free_locked(va);
     spin_unlock(&vm_lock);
 }
 
+/*
+ * Per-CPU caches of single page areas in VMAP_DEFAULT, the size used by
+ * map_domain_page_global() and most ioremap()s.  They're taken from the bitmap
+ * VMAP_CACHE_NR / 2 at a time, as one run of twice as many pages with every
+ * other page turned into the guard page of the next area.  A cache's lock
+ * is only contended for when the caches are drained, because an allocation
+ * failed or the CPU went offline.  To the bitmap, cached areas are in use.
+ */
+#define VMAP_CACHE_NR 16U
+
+struct vm_cache {
+    spinlock_t lock;
+    const void *va[VMAP_CACHE_NR];
+    unsigned int count;
+};
+
+static DEFINE_PER_CPU(struct vm_cache, vm_cache);
+
+static void vm_cache_refill(struct vm_cache *vc)
+{
+    unsigned int i, bit, nr = VMAP_CACHE_NR / 2;
+    void *va;
+
+    ASSERT(spin_is_locked(&vc->lock));
+
+    va = vm_alloc_range(2 * nr, 1, VMAP_DEFAULT);
+    if ( !va )
+        return;
+
+    bit = PFN_DOWN(va - vm_base[VMAP_DEFAULT]);
+
+    spin_lock(&vm_lock);
+    for ( i = nr; i--; )
+    {
+        __clear_bit(bit + 2 * i + 1, vm_bitmap(VMAP_DEFAULT));
+        vc->va[vc->count++] = va + 2 * i * PAGE_SIZE;
+    }
+    spin_unlock(&vm_lock);
+
+    perfc_incr(vmap_cache_refill);
+}
+
+static void *vm_cache_alloc(void)
+{
+    struct vm_cache *vc = &this_cpu(vm_cache);
+    void *va = NULL;
+
+    spin_lock(&vc->lock);
+
+    if ( !vc->count )
+        vm_cache_refill(vc);
+    if ( vc->count )
+        va = (void *)vc->va[--vc->count];
+
+    spin_unlock(&vc->lock);
+
+    if ( va )
+        perfc_incr(vmap_cache_alloc);
+
+    return va;
+}
+
+/* Free an area whose mappings are gone from all TLBs already. */
+static void vm_release(const void *va)
+{
+    struct vm_cache *vc = &this_cpu(vm_cache);
+
+    if ( vm_size(va, VMAP_DEFAULT) == 1 )
+    {
+        spin_lock(&vc->lock);
+        if ( vc->count < VMAP_CACHE_NR )
+        {
+            vc->va[vc->count++] = va;
+            va = NULL;
+        }
+        spin_unlock(&vc->lock);
+    }
+
+    if ( va )
+        vm_free(va);
+}
+
+/* Return a cache's areas to the bitmap.  Returns whether there were any. */
+static bool vm_cache_drain(struct vm_cache *vc)
+{
+    bool drained;
+
+    spin_lock(&vc->lock);
+
+    drained = vc->count;
+    if ( drained )
+    {
+        spin_lock(&vm_lock);
+        while ( vc->count )
+            vm_free_locked(vc->va[--vc->count]);
+        spin_unlock(&vm_lock);
+    }
+
+    spin_unlock(&vc->lock);
+
+    return drained;
+}
+
+/*
+ * Return the areas of all caches to the bitmap.  The per-CPU area of a CPU
+ * going offline meanwhile is freed only after an RCU grace period, which
+ * can't complete while we are running.
+ */
+static bool vm_cache_drain_all(void)
+{
+    unsigned int cpu;
+    bool drained = false;
+
+    for_each_online_cpu ( cpu )
+        if ( vm_cache_drain(&per_cpu(vm_cache, cpu)) )
+            drained = true;
+
+    return drained;
+}
+
+static int cf_check vm_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct vm_cache *vc = &per_cpu(vm_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&vc->lock);
+        break;
+
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        vm_cache_drain(vc);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block vm_cpu_nfb = {
+    .notifier_call = vm_cpu_callback,
+};
+
+static int __init cf_check vm_cache_init(void)
+{
+    spin_lock_init(&this_cpu(vm_cache).lock);
+    register_cpu_notifier(&vm_cpu_nfb);
+
+    return 0;
+}
+presmp_initcall(vm_cache_init);
+
+#ifdef MAP_NO_FLUSH
+/*
+ * Lazily unmapped areas.  vunmap_lazy() only clears the PTEs, leaving the
+ * TLB shootdown to vm_purge(), which flushes once for up to VMAP_LAZY_NR
+ * areas.  Until then, the areas stay allocated so that their addresses can't
+ * be reused while stale translations may exist.  vunmap() itself flushes
+ * right away: its callers commonly free the memory next, as do those of
+ * unmap_domain_page_global() and vfree().
+ */
+#define VMAP_LAZY_NR 64U
+
+static DEFINE_SPINLOCK(vm_lazy_lock);
+static const void *vm_lazy[VMAP_LAZY_NR];
+static unsigned int vm_lazy_nr;
+
+static bool vm_purge(void)
+{
+    const void *lazy[VMAP_LAZY_NR];
+    unsigned int i, nr;
+
+    spin_lock(&vm_lazy_lock);
+    nr = vm_lazy_nr;
+    memcpy(lazy, vm_lazy, nr * sizeof(*lazy));
+    vm_lazy_nr = 0;
+    spin_unlock(&vm_lazy_lock);
+
+    if ( !nr )
+        return false;
+
+    flush_tlb_all_global();
+    perfc_incr(vmap_flush_purge);
+
+    spin_lock(&vm_lock);
+    for ( i = 0; i < nr; i++ )
+        vm_free_locked(lazy[i]);
+    spin_unlock(&vm_lock);
+
+    return true;
+}
+
+static void vm_free_lazy(const void *va)
+{
+    spin_lock(&vm_lazy_lock);
+    while ( vm_lazy_nr == VMAP_LAZY_NR )
+    {
+        spin_unlock(&vm_lazy_lock);
+        vm_purge();
+        spin_lock(&vm_lazy_lock);
+    }
+    vm_lazy[vm_lazy_nr++] = va;
+    spin_unlock(&vm_lazy_lock);
+
+    perfc_incr(vmap_flush_deferred);
+}
+#else
+static bool vm_purge(void)
+{
+    return false;
+}
+#endif
+
+static void *vm_alloc(unsigned int nr, unsigned int align,
+                      enum vmap_region t)
+{
+    void *va;
+    bool retry;
+
+    if ( nr == 1 && align <= 1 && t == VMAP_DEFAULT &&
+         (va = vm_cache_alloc()) != NULL )
+        return va;
+
+    va = vm_alloc_range(nr, align, t);
+    if ( va )
+        return va;
+
+    /* Lazily unmapped or cached areas may be all that's in the way. */
+    retry = vm_purge();
+    if ( t == VMAP_DEFAULT && vm_cache_drain_all() )
+        retry = true;
+
+    return retry ? vm_alloc_range(nr, align, t) : NULL;
+}
+
 void *__vmap(const mfn_t *mfn, unsigned int granularity,
              unsigned int nr, unsigned int align, unsigned int flags,
              enum vmap_region type)
@@ -260,17 +510,36 @@ unsigned int vmap_size(const void *va)
     return pages;
 }
 
-void vunmap(const void *va)
+static void _vunmap(const void *va, bool lazy)
 {
     unsigned long addr = (unsigned long)va;
     unsigned pages = vmap_size(va);
 
+#ifdef MAP_NO_FLUSH
+    if ( lazy )
+    {
+        map_pages_to_xen(addr, INVALID_MFN, pages, _PAGE_NONE | MAP_NO_FLUSH);
+        vm_free_lazy(va);
+        return;
+    }
+#endif
+
 #ifndef _PAGE_NONE
     destroy_xen_mappings(addr, addr + PAGE_SIZE * pages);
 #else /* Avoid tearing down intermediate page tables. */
     map_pages_to_xen(addr, INVALID_MFN, pages, _PAGE_NONE);
 #endif
-    vm_free(va);
+    vm_release(va);
+}
+
+void vunmap(const void *va)
+{
+    _vunmap(va, false);
+}
+
+void vunmap_lazy(const void *va)
+{
+    _vunmap(va, true);
 }
 
 static void *vmalloc_type(size_t size, enum vmap_region type)
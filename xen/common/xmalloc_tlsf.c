@@ -23,8 +23,12 @@
  * Adapted for Xen by Dan Magenheimer (dan.magenheimer@oracle.com)
  */
 
+#include <xen/cpu.h>
+#include <xen/init.h>
 #include <xen/irq.h>
+#include <xen/keyhandler.h>
 #include <xen/mm.h>
+#include <xen/percpu.h>
 #include <xen/pfn.h>
 #include <asm/time.h>
 #include <asm/page.h>
@@ -108,6 +112,8 @@ struct xmem_pool {
     /* Basic stats */
     unsigned long used_size;
     unsigned long num_regions;
+    unsigned long lock_acquired;
+    unsigned long lock_contended;
 
     /* User provided functions for expanding/shrinking pool */
     xmem_pool_get_memory *get_mem;
@@ -382,57 +388,42 @@ void xmem_pool_destroy(struct xmem_pool *pool)
     free_xenheap_pages(pool,pool_order);
 }
 
-void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
+static void pool_lock(struct xmem_pool *pool)
 {
-    struct bhdr *b, *b2, *next_b, *region;
-    int fl, sl;
-    unsigned long tmp_size;
-
-    ASSERT_ALLOC_CONTEXT();
-
-    if ( size < MIN_BLOCK_SIZE )
-        size = MIN_BLOCK_SIZE;
-    else
+    if ( !spin_trylock(&pool->lock) )
     {
-        tmp_size = ROUNDUP_SIZE(size);
-        /* Guard against overflow. */
-        if ( tmp_size < size )
-            return NULL;
-        size = tmp_size;
+        spin_lock(&pool->lock);
+        pool->lock_contended++;
     }
+    pool->lock_acquired++;
+}
 
-    /* Rounding up the requested size and calculating fl and sl */
+/*
+ * Take a block of at least *size bytes off the free lists, rounding *size up
+ * to the list it's searched in.  Returns NULL if the pool needs to grow.
+ * Caller must hold the pool lock.
+ */
+static void *alloc_block(unsigned long *size, struct xmem_pool *pool)
+{
+    struct bhdr *b, *b2, *next_b;
+    int fl, sl;
+    unsigned long tmp_size;
 
-    spin_lock(&pool->lock);
- retry_find:
-    MAPPING_SEARCH(&size, &fl, &sl);
+    MAPPING_SEARCH(size, &fl, &sl);
 
     /* Searching a free block */
     if ( !(b = FIND_SUITABLE_BLOCK(pool, &fl, &sl)) )
-    {
-        /* Not found */
-        if ( size > (pool->grow_size - 2 * BHDR_OVERHEAD) )
-            goto out_locked;
-        if ( pool->max_size && (pool->num_regions * pool->grow_size
-                                > pool->max_size) )
-            goto out_locked;
-        spin_unlock(&pool->lock);
-        if ( (region = pool->get_mem(pool->grow_size)) == NULL )
-            goto out;
-        spin_lock(&pool->lock);
-        ADD_REGION(region, pool->grow_size, pool);
-        goto retry_find;
-    }
+        return NULL;
     EXTRACT_BLOCK_HDR(b, pool, fl, sl);
 
     /*-- found: */
     next_b = GET_NEXT_BLOCK(b->ptr.buffer, b->size & BLOCK_SIZE_MASK);
     /* Should the block be split? */
-    tmp_size = (b->size & BLOCK_SIZE_MASK) - size;
+    tmp_size = (b->size & BLOCK_SIZE_MASK) - *size;
     if ( tmp_size >= sizeof(struct bhdr) )
     {
         tmp_size -= BHDR_OVERHEAD;
-        b2 = GET_NEXT_BLOCK(b->ptr.buffer, size);
+        b2 = GET_NEXT_BLOCK(b->ptr.buffer, *size);
 
         b2->size = tmp_size | FREE_BLOCK | PREV_USED;
         b2->prev_hdr = b;
@@ -442,7 +433,7 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
         MAPPING_INSERT(tmp_size, &fl, &sl);
         INSERT_BLOCK(b2, pool, fl, sl);
 
-        b->size = size | (b->size & PREV_STATE);
+        b->size = *size | (b->size & PREV_STATE);
     }
     else
     {
@@ -452,8 +443,50 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
 
     pool->used_size += (b->size & BLOCK_SIZE_MASK) + BHDR_OVERHEAD;
 
-    spin_unlock(&pool->lock);
     return (void *)b->ptr.buffer;
+}
+
+void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
+{
+    struct bhdr *region;
+    unsigned long tmp_size;
+    void *p;
+
+    ASSERT_ALLOC_CONTEXT();
+
+    if ( size < MIN_BLOCK_SIZE )
+        size = MIN_BLOCK_SIZE;
+    else
+    {
+        tmp_size = ROUNDUP_SIZE(size);
+        /* Guard against overflow. */
+        if ( tmp_size < size )
+            return NULL;
+        size = tmp_size;
+    }
+
+    /* Rounding up the requested size and calculating fl and sl */
+
+    pool_lock(pool);
+ retry_find:
+    if ( !(p = alloc_block(&size, pool)) )
+    {
+        /* Not found */
+        if ( size > (pool->grow_size - 2 * BHDR_OVERHEAD) )
+            goto out_locked;
+        if ( pool->max_size && (pool->num_regions * pool->grow_size
+                                > pool->max_size) )
+            goto out_locked;
+        spin_unlock(&pool->lock);
+        if ( (region = pool->get_mem(pool->grow_size)) == NULL )
+            goto out;
+        pool_lock(pool);
+        ADD_REGION(region, pool->grow_size, pool);
+        goto retry_find;
+    }
+
+    spin_unlock(&pool->lock);
+    return p;
 
     /* Failed alloc */
  out_locked:
@@ -463,19 +496,17 @@ void *xmem_pool_alloc(unsigned long size, struct xmem_pool *pool)
     return NULL;
 }
 
-void xmem_pool_free(void *ptr, struct xmem_pool *pool)
+/*
+ * Return a block to the free lists, merging it with its free neighbours.
+ * Caller must hold the pool lock.
+ */
+static void free_block(void *ptr, struct xmem_pool *pool)
 {
     struct bhdr *b, *tmp_b;
     int fl = 0, sl = 0;
 
-    ASSERT_ALLOC_CONTEXT();
-
-    if ( unlikely(ptr == NULL) )
-        return;
-
     b = (struct bhdr *)((char *) ptr - BHDR_OVERHEAD);
 
-    spin_lock(&pool->lock);
     b->size |= FREE_BLOCK;
     pool->used_size -= (b->size & BLOCK_SIZE_MASK) + BHDR_OVERHEAD;
     b->ptr.free_ptr = (struct free_ptr) { NULL, NULL};
@@ -504,14 +535,24 @@ void xmem_pool_free(void *ptr, struct xmem_pool *pool)
         pool->put_mem(b);
         pool->num_regions--;
         pool->used_size -= BHDR_OVERHEAD; /* sentinel block header */
-        goto out;
+        return;
     }
 
     INSERT_BLOCK(b, pool, fl, sl);
 
     tmp_b->size |= PREV_FREE;
     tmp_b->prev_hdr = b;
- out:
+}
+
+void xmem_pool_free(void *ptr, struct xmem_pool *pool)
+{
+    ASSERT_ALLOC_CONTEXT();
+
+    if ( unlikely(ptr == NULL) )
+        return;
+
+    pool_lock(pool);
+    free_block(ptr, pool);
     spin_unlock(&pool->lock);
 }
 
@@ -569,6 +610,197 @@ static void tlsf_init(void)
     BUG_ON(!xenpool);
 }
 
+/*
+ * Per-CPU caches of small blocks in front of the xmalloc pool.
+ *
+ * Blocks of up to XMALLOC_CACHE_MAX bytes are kept on a list per size class
+ * (in MEM_ALIGN steps), so that most small xmalloc()/xfree() calls don't
+ * need the pool lock.  xmalloc() can't be used in interrupt context, hence a
+ * CPU's cache is only ever touched by the CPU itself, or once it's offline.
+ * To the pool, cached blocks are in use.
+ */
+#define XMALLOC_CACHE_MAX     256U
+#define XMALLOC_CACHE_CLASSES (XMALLOC_CACHE_MAX / MEM_ALIGN)
+#define XMALLOC_CACHE_BYTES   1024U /* Bytes cached per size class at most. */
+
+struct xmalloc_cache {
+    struct {
+        void *head;             /* Linked through the blocks' first word. */
+        unsigned int count;
+    } class[XMALLOC_CACHE_CLASSES];
+
+    unsigned long hits;
+    unsigned long refills;
+    unsigned long flushes;
+};
+
+static DEFINE_PER_CPU(struct xmalloc_cache, xmalloc_cache);
+
+/*
+ * Cached blocks are poisoned past the word linking them, and checked when
+ * leaving the cache, like free blocks in the pool.
+ */
+static void xmalloc_cache_poison(void *p)
+{
+    const struct bhdr *b = p - BHDR_OVERHEAD;
+
+    if ( IS_ENABLED(CONFIG_XMEM_POOL_POISON) )
+        memset(p + sizeof(void *), POISON_BYTE,
+               (b->size & BLOCK_SIZE_MASK) - sizeof(void *));
+}
+
+static void xmalloc_cache_check(const void *p)
+{
+    const struct bhdr *b = p - BHDR_OVERHEAD;
+
+    if ( IS_ENABLED(CONFIG_XMEM_POOL_POISON) &&
+         memchr_inv(p + sizeof(void *), POISON_BYTE,
+                    (b->size & BLOCK_SIZE_MASK) - sizeof(void *)) )
+    {
+        printk(XENLOG_ERR "XMEM Pool corruption found");
+        BUG();
+    }
+}
+
+/* Blocks of size class @idx cached at most; half of that move at once. */
+static unsigned int xmalloc_cache_high(unsigned int idx)
+{
+    return max(XMALLOC_CACHE_BYTES / ((idx + 1) * (unsigned int)MEM_ALIGN),
+               4U);
+}
+
+static void xmalloc_cache_refill(struct xmalloc_cache *xc, unsigned int idx)
+{
+    unsigned int i, nr = xmalloc_cache_high(idx) / 2;
+    unsigned long size;
+    void *p;
+
+    xc->refills++;
+
+    pool_lock(xenpool);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        size = (idx + 1) * MEM_ALIGN;
+        if ( (p = alloc_block(&size, xenpool)) == NULL )
+            break;
+
+        xmalloc_cache_poison(p);
+        *(void **)p = xc->class[idx].head;
+        xc->class[idx].head = p;
+        xc->class[idx].count++;
+    }
+
+    spin_unlock(&xenpool->lock);
+}
+
+/* Return up to @nr blocks of size class @idx to the pool. */
+static void xmalloc_cache_flush(struct xmalloc_cache *xc, unsigned int idx,
+                        unsigned int nr)
+{
+    void *p;
+
+    pool_lock(xenpool);
+
+    while ( nr-- && (p = xc->class[idx].head) != NULL )
+    {
+        xc->class[idx].head = *(void **)p;
+        xc->class[idx].count--;
+        xmalloc_cache_check(p);
+        free_block(p, xenpool);
+    }
+
+    spin_unlock(&xenpool->lock);
+
+    xc->flushes++;
+}
+
+static void *xmalloc_cache_alloc(unsigned long size)
+{
+    struct xmalloc_cache *xc = &this_cpu(xmalloc_cache);
+    unsigned int idx;
+    void *p;
+
+    size = (size < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : ROUNDUP_SIZE(size);
+    idx = size / MEM_ALIGN - 1;
+
+    if ( !xc->class[idx].head )
+    {
+        xmalloc_cache_refill(xc, idx);
+
+        /* Let the pool grow, if need be. */
+        if ( !xc->class[idx].head )
+            return NULL;
+    }
+
+    p = xc->class[idx].head;
+    xc->class[idx].head = *(void **)p;
+    xc->class[idx].count--;
+    xc->hits++;
+
+    xmalloc_cache_check(p);
+
+    return p;
+}
+
+static bool xmalloc_cache_free(void *p)
+{
+    struct xmalloc_cache *xc = &this_cpu(xmalloc_cache);
+    const struct bhdr *b = p - BHDR_OVERHEAD;
+    unsigned long size = b->size & BLOCK_SIZE_MASK;
+    unsigned int idx;
+
+    if ( size > XMALLOC_CACHE_MAX )
+        return false;
+
+    ASSERT(size >= MIN_BLOCK_SIZE && !(size & (MEM_ALIGN - 1)));
+    idx = size / MEM_ALIGN - 1;
+
+    xmalloc_cache_poison(p);
+    *(void **)p = xc->class[idx].head;
+    xc->class[idx].head = p;
+
+    if ( ++xc->class[idx].count > xmalloc_cache_high(idx) )
+        xmalloc_cache_flush(xc, idx, xmalloc_cache_high(idx) / 2);
+
+    return true;
+}
+
+static int cf_check xmalloc_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct xmalloc_cache *xc = &per_cpu(xmalloc_cache, cpu);
+    unsigned int idx;
+
+    switch ( action )
+    {
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        for ( idx = 0; idx < XMALLOC_CACHE_CLASSES; idx++ )
+            if ( xc->class[idx].head )
+                xmalloc_cache_flush(xc, idx, UINT_MAX);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block xmalloc_cpu_nfb = {
+    .notifier_call = xmalloc_cpu_callback,
+};
+
+static int __init cf_check xmalloc_cache_init(void)
+{
+    register_cpu_notifier(&xmalloc_cpu_nfb);
+
+    return 0;
+}
+presmp_initcall(xmalloc_cache_init);
+
 /*
  * xmalloc()
  */
@@ -625,7 +857,9 @@ void *_xmalloc(unsigned long size, unsigned long align)
     if ( !xenpool )
         tlsf_init();
 
-    if ( size < PAGE_SIZE )
+    if ( size <= XMALLOC_CACHE_MAX )
+        p = xmalloc_cache_alloc(size);
+    if ( p == NULL && size < PAGE_SIZE )
         p = xmem_pool_alloc(size, xenpool);
     if ( p == NULL )
         return xmalloc_whole_pages(size - align + MEM_ALIGN, align);
@@ -737,5 +971,81 @@ void xfree(void *p)
     /* Strip alignment padding. */
     p = strip_padding(p);
 
-    xmem_pool_free(p, xenpool);
+    if ( !xmalloc_cache_free(p) )
+        xmem_pool_free(p, xenpool);
+}
+
+static void dump_pool(struct xmem_pool *pool)
+{
+    unsigned long free_size = 0, free_blocks = 0, largest = 0, size;
+    unsigned long acquired, contended;
+    const struct bhdr *b;
+    unsigned int fl, sl;
+
+    /* Not pool_lock(): that would skew the statistics shown. */
+    spin_lock(&pool->lock);
+
+    for ( fl = 0; fl < REAL_FLI; fl++ )
+        for ( sl = 0; sl < MAX_SLI; sl++ )
+            for ( b = pool->matrix[fl][sl]; b; b = b->ptr.free_ptr.next )
+            {
+                size = b->size & BLOCK_SIZE_MASK;
+                free_size += size;
+                free_blocks++;
+                largest = max(largest, size);
+            }
+
+    acquired = pool->lock_acquired;
+    contended = pool->lock_contended;
+
+    printk("Pool '%s': %lu regions of %lukB, %lukB used\n",
+           pool->name, pool->num_regions, pool->grow_size >> 10,
+           pool->used_size >> 10);
+    printk("  %lukB free in %lu blocks, largest %lu bytes\n",
+           free_size >> 10, free_blocks, largest);
+
+    spin_unlock(&pool->lock);
+
+    printk("  lock taken %lu times, %lu contended\n", acquired, contended);
+}
+
+static void cf_check dump_xmalloc(unsigned char key)
+{
+    unsigned long cached[XMALLOC_CACHE_CLASSES] = {};
+    unsigned long hits = 0, refills = 0, flushes = 0;
+    struct xmem_pool *pool;
+    unsigned int cpu, idx;
+
+    printk("'%c' pressed -> dumping xmalloc pools\n", key);
+
+    spin_lock(&pool_list_lock);
+    list_for_each_entry ( pool, &pool_list_head, list )
+        dump_pool(pool);
+    spin_unlock(&pool_list_lock);
+
+    for_each_online_cpu ( cpu )
+    {
+        const struct xmalloc_cache *xc = &per_cpu(xmalloc_cache, cpu);
+
+        for ( idx = 0; idx < XMALLOC_CACHE_CLASSES; idx++ )
+            cached[idx] += xc->class[idx].count;
+        hits += xc->hits;
+        refills += xc->refills;
+        flushes += xc->flushes;
+    }
+
+    printk("Per-CPU caches: %lu hits, %lu refills, %lu flushes\n",
+           hits, refills, flushes);
+    for ( idx = 0; idx < XMALLOC_CACHE_CLASSES; idx++ )
+        if ( cached[idx] )
+            printk("  %4lu bytes: %lu blocks cached\n",
+                   (idx + 1) * MEM_ALIGN, cached[idx]);
+}
+
+static int __init cf_check xmalloc_keyhandler_init(void)
+{
+    register_keyhandler('X', dump_xmalloc, "dump xmalloc pool info", 1);
+
+    return 0;
 }
+__initcall(xmalloc_keyhandler_init);
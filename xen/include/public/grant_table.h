@@ -298,6 +298,7 @@ typedef uint16_t grant_status_t;
 #define GNTTABOP_get_version          10
 #define GNTTABOP_swap_grant_ref	      11
 #define GNTTABOP_cache_flush	      12
+#define GNTTABOP_copy_cache           13
 #endif /* __XEN_INTERFACE_VERSION__ */
 /* ` } */
 
@@ -582,6 +583,39 @@ struct gnttab_cache_flush {
 typedef struct gnttab_cache_flush gnttab_cache_flush_t;
 DEFINE_XEN_GUEST_HANDLE(gnttab_cache_flush_t);
 
+/*
+ * GNTTABOP_copy_cache: Pin a window of <count> consecutive grant references,
+ * starting at <ref>, of domain <domid> for use by GNTTABOP_copy, or unpin such
+ * a window again.  GNTTABOP_copy operations against pinned references avoid
+ * looking up the granted frame anew for every operation.  Unlike mapped
+ * grants, pinned grants are in use only during copies, and the granting
+ * domain can end them as usual.  The next copy against an ended grant, or one
+ * referring to a different frame than when pinned, fails with
+ * GNTST_bad_gntref, and unpins that grant: later copies acquire it anew.
+ * NOTES:
+ *  1. Transitive grants can't be pinned.
+ *  2. A window is unpinned by passing GNTCOPY_CACHE_unpin along with the
+ *     <domid>, <ref> and <count> it was pinned with.
+ *  3. Without GNTCOPY_CACHE_readonly grants are pinned for writing, and can
+ *     serve as either source or destination of a copy.
+ */
+#define _GNTCOPY_CACHE_unpin      (0)
+#define GNTCOPY_CACHE_unpin       (1<<_GNTCOPY_CACHE_unpin)
+#define _GNTCOPY_CACHE_readonly   (1)
+#define GNTCOPY_CACHE_readonly    (1<<_GNTCOPY_CACHE_readonly)
+#define GNTCOPY_CACHE_max_count   1024
+struct gnttab_copy_cache {
+    /* IN parameters. */
+    domid_t domid;
+    uint16_t flags;
+    grant_ref_t ref;
+    uint32_t count;
+    /* OUT parameters. */
+    int16_t status;             /* => enum grant_status */
+};
+typedef struct gnttab_copy_cache gnttab_copy_cache_t;
+DEFINE_XEN_GUEST_HANDLE(gnttab_copy_cache_t);
+
 #endif /* __XEN_INTERFACE_VERSION__ */
 
 /*
@@ -44,13 +44,22 @@ typedef uint16_t ioservid_t;
  * hvm_op.h. If the value is HVM_IOREQSRV_BUFIOREQ_OFF then  the buffered
  * ioreq ring will not be allocated and hence all emulation requests to
  * this server will be synchronous.
+ *
+ * If <flags> contains XEN_DMOP_IOREQ_SERVER_batch then synchronous emulation
+ * requests are queued in per-vCPU rings of batch_iopage_t (see
+ * hvm/ioreq.h), allowing MMIO writes to be posted.  These pages can only be
+ * mapped using XENMEM_acquire_resource.
  */
 #define XEN_DMOP_create_ioreq_server 1
 
 struct xen_dm_op_create_ioreq_server {
     /* IN - should server handle buffered ioreqs */
     uint8_t handle_bufioreq;
-    uint8_t pad[3];
+    /* IN - XEN_DMOP_IOREQ_SERVER_* */
+    uint8_t flags;
+#define _XEN_DMOP_IOREQ_SERVER_batch 0
+#define XEN_DMOP_IOREQ_SERVER_batch (1U << _XEN_DMOP_IOREQ_SERVER_batch)
+    uint8_t pad[2];
     /* OUT - server id */
     ioservid_t id;
 };
@@ -146,6 +155,11 @@ typedef struct xen_dm_op_ioreq_server_range xen_dm_op_ioreq_server_range_t;
  * Note that the contents of the ioreq_gfn and bufioreq_gfn (see
  * XEN_DMOP_get_ioreq_server_info) are not meaningful until the IOREQ Server
  * is in the enabled state.
+ *
+ * A server created with XEN_DMOP_IOREQ_SERVER_batch can't be disabled while
+ * any vCPU's ring still holds requests: -EBUSY is returned and the event
+ * channels of those vCPUs are notified.  The emulator should handle the
+ * requests and retry.
  */
 #define XEN_DMOP_set_ioreq_server_state 5
 
@@ -162,6 +176,8 @@ typedef struct xen_dm_op_set_ioreq_server_state xen_dm_op_set_ioreq_server_state
  * XEN_DMOP_destroy_ioreq_server: Destroy the IOREQ Server <id>.
  *
  * Any registered I/O ranges will be automatically deregistered.
+ * As for XEN_DMOP_set_ioreq_server_state, -EBUSY is returned while requests
+ * are still queued for a server created with XEN_DMOP_IOREQ_SERVER_batch.
  */
 #define XEN_DMOP_destroy_ioreq_server 6
 
@@ -81,6 +81,49 @@ struct buffered_iopage {
 }; /* NB. Size of this structure must be no greater than one page. */
 typedef struct buffered_iopage buffered_iopage_t;
 
+/*
+ * Batched synchronous requests, used by ioreq servers created with
+ * XEN_DMOP_IOREQ_SERVER_batch.
+ *
+ * Each vCPU gets a ring of IOREQ_BATCH_SLOT_NUM request slots, used instead
+ * of its slot in the shared_iopage (which still carries vp_eport).  Xen
+ * writes a request to req[req_prod % IOREQ_BATCH_SLOT_NUM] and then
+ * increments req_prod.  The emulator handles requests in order, writing
+ * back the data of reads before incrementing req_cons past them.
+ *
+ * MMIO writes not referring to guest memory are posted: the vCPU carries on
+ * without waiting for them to be handled.  For all other requests the vCPU
+ * waits until req_cons has moved past the request.
+ *
+ * Xen only notifies the event channel if the ring was idle, i.e. if req_cons
+ * was equal to req_prod before the new request was added.  The emulator must
+ * therefore re-check req_prod (after a full barrier) once it has updated
+ * req_cons, before waiting for the next notification.  It notifies the event
+ * channel once per pass over the ring, after having updated req_cons.
+ *
+ * Requests are handled in the order they were sent across this ring and the
+ * buffered ring.  While a vCPU's ring holds requests, buffered requests from
+ * that vCPU are queued in the ring as well, behind the posted writes, and
+ * are treated like them.  In turn, the emulator must handle the requests in
+ * the buffered ring (re-reading its write_pointer after having read req_prod)
+ * before those it finds in the batch ring.
+ */
+#define IOREQ_BATCH_SLOT_NUM      8
+struct ioreq_batch {
+    uint32_t req_prod;          /* written by Xen */
+    uint32_t req_cons;          /* written by the emulator */
+    uint32_t vp_eport;          /* as in the vCPU's shared_iopage slot */
+    uint32_t _pad[5];
+    struct ioreq req[IOREQ_BATCH_SLOT_NUM];
+};
+typedef struct ioreq_batch ioreq_batch_t;
+
+#define IOREQ_BATCH_PER_PAGE     14 /* 288 bytes each */
+struct batch_iopage {
+    struct ioreq_batch vcpu_batch[IOREQ_BATCH_PER_PAGE];
+}; /* NB. Size of this structure must be no greater than one page. */
+typedef struct batch_iopage batch_iopage_t;
+
 /*
  * ACPI Control/Event register locations. Location is controlled by a
  * version number in HVM_PARAM_ACPI_IOPORTS_LOCATION.
@@ -664,6 +664,14 @@ struct xen_mem_acquire_resource {
 
 #define XENMEM_resource_ioreq_server_frame_bufioreq 0
 #define XENMEM_resource_ioreq_server_frame_ioreq(n) (1 + (n))
+/*
+ * Batch frames (XEN_DMOP_IOREQ_SERVER_batch) start well above the ioreq
+ * frames, so that neither range has to be moved if the other one grows.
+ * Only servers created with them have batch frames.  The size of their
+ * resource then extends to the last batch frame, including the frames in
+ * between the ranges, which can't be mapped.
+ */
+#define XENMEM_resource_ioreq_server_frame_batch(n) ((1u << 16) + (n))
 
     /*
      * IN/OUT - If the tools domain is PV then, upon return, frame_list
@@ -34,6 +34,14 @@ struct ioreq_vcpu {
     struct vcpu      *vcpu;
     evtchn_port_t    ioreq_evtchn;
     bool             pending;
+
+    /* Batched servers only: private copy of the ring's req_prod. */
+    uint32_t         batch_prod;
+    /* Slot of the pending request, once it has been queued. */
+    uint32_t         batch_slot;
+    bool             batch_queued;
+    /* The pending request, until there is room for it in the ring. */
+    ioreq_t          batch_req;
 };
 
 #define NR_IO_RANGE_TYPES (XEN_DMOP_IO_RANGE_PCI + 1)
@@ -55,6 +63,10 @@ struct ioreq_server {
     struct rangeset        *range[NR_IO_RANGE_TYPES];
     bool                   enabled;
     uint8_t                bufioreq_handling;
+
+    /* Per-vCPU request rings, if created with XEN_DMOP_IOREQ_SERVER_batch */
+    unsigned int           nr_batch_pages;
+    struct ioreq_page      *batch;
 };
 
 static inline paddr_t ioreq_mmio_first_byte(const ioreq_t *p)
@@ -91,6 +103,7 @@ bool is_ioreq_server_page(struct domain *d, const struct page_info *page);
 
 int ioreq_server_get_frame(struct domain *d, ioservid_t id,
                            unsigned int idx, mfn_t *mfn);
+unsigned int ioreq_server_nr_batch_frames(struct domain *d, ioservid_t id);
 int ioreq_server_map_mem_type(struct domain *d, ioservid_t id,
                               uint32_t type, uint32_t flags);
 
@@ -12,6 +12,24 @@ PERFCOUNTER(irqs,                   "#interrupts")
 PERFCOUNTER(ipis,                   "#IPIs")
 
 PERFCOUNTER(rcu_idle_timer,         "RCU: idle_timer")
+PERFCOUNTER(rcu_grace_period,       "RCU: grace periods")
+PERFCOUNTER_ARRAY(rcu_gp_latency,   "RCU: grace period log2(us)", 16)
+
+#ifdef CONFIG_IOREQ_SERVER
+PERFCOUNTER(ioreq_select_cache_hit,  "ioreq: select cache hits")
+PERFCOUNTER(ioreq_select_cache_miss, "ioreq: select cache misses")
+#endif
+
+PERFCOUNTER(page_cache_alloc,       "page cache: alloc")
+PERFCOUNTER(page_cache_alloc_miss,  "page cache: alloc_miss")
+PERFCOUNTER(page_cache_free,        "page cache: free")
+PERFCOUNTER(page_cache_refill,      "page cache: refill")
+PERFCOUNTER(page_cache_drain,       "page cache: drain")
+
+PERFCOUNTER(vmap_cache_alloc,       "vmap cache: alloc")
+PERFCOUNTER(vmap_cache_refill,      "vmap cache: refill")
+PERFCOUNTER(vmap_flush_deferred,    "vmap: TLB flushes deferred")
+PERFCOUNTER(vmap_flush_purge,       "vmap: TLB flushes for purges")
 
 /* Generic scheduler counters (applicable to all schedulers) */
 PERFCOUNTER(sched_irq,              "sched: timer")
@@ -37,6 +55,7 @@ PERFCOUNTER(unit_check,             "sched: unit_check")
 PERFCOUNTER(migrate_running,        "sched: migrate_running")
 PERFCOUNTER(migrate_on_runq,        "sched: migrate_on_runq")
 PERFCOUNTER(migrated,               "sched: migrated")
+PERFCOUNTER(pull_retried,           "sched: pull_retried")
 
 /* credit specific counters */
 #ifdef CONFIG_SCHED_CREDIT
@@ -75,6 +94,8 @@ PERFCOUNTER(runtime_max_timer,      "csched2: runtime_max_timer")
 PERFCOUNTER(pick_resource,          "csched2: pick_resource")
 PERFCOUNTER(need_fallback_cpu,      "csched2: need_fallback_cpu")
 PERFCOUNTER(migrate_resisted,       "csched2: migrate_resisted")
+PERFCOUNTER(migrate_cache_hot,      "csched2: migrate_cache_hot")
+PERFCOUNTER(migrate_off_node,       "csched2: migrate_off_node")
 PERFCOUNTER(credit_reset,           "csched2: credit_reset")
 PERFCOUNTER(deferred_to_tickled_cpu,"csched2: deferred_to_tickled_cpu")
 PERFCOUNTER(tickled_cpu_overwritten,"csched2: tickled_cpu_overwritten")
@@ -176,6 +176,9 @@ void call_rcu(struct rcu_head *head,
 
 void rcu_barrier(void);
 
+void rcu_expedite(void);
+void synchronize_rcu_expedited(void);
+
 void rcu_idle_enter(unsigned int cpu);
 void rcu_idle_exit(unsigned int cpu);
 
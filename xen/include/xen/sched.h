@@ -157,6 +157,19 @@ enum vio_completion {
 #endif
 };
 
+#ifdef CONFIG_IOREQ_SERVER
+#define NR_IOREQ_SELECT_CACHE 8
+
+/* A recently selected ioreq server for an access of a given type/addr/size. */
+struct ioreq_select_entry {
+    uint64_t             addr;
+    struct ioreq_server  *s;
+    unsigned int         gen;
+    uint32_t             size;
+    uint8_t              type;
+};
+#endif
+
 struct vcpu_io {
     /* I/O request in flight to device model. */
     enum vio_completion  completion;
@@ -168,6 +181,28 @@ struct vcpu_io {
     ioreq_t              req;
     /* Arch specific info pertaining to the io request */
     struct arch_vcpu_io  info;
+#ifdef CONFIG_IOREQ_SERVER
+    /* Direct-mapped cache of ioreq_server_select() results. */
+    struct ioreq_select_entry select_cache[NR_IOREQ_SELECT_CACHE];
+#endif
+};
+
+/*
+ * Scheduling latency histograms, kept per vCPU by vcpu_runstate_change().
+ * Bucket 0 counts periods shorter than 1us (2^10ns), bucket i > 0 those in
+ * [2^(9+i), 2^(10+i)) ns, and the last bucket everything longer.
+ */
+#define SCHED_LAT_BUCKETS 24
+enum sched_lat_kind {
+    SCHED_LAT_WAKE,   /* Runnable after a wakeup, until running. */
+    SCHED_LAT_WAIT,   /* Runnable after a preemption, until running. */
+    SCHED_LAT_RUN,    /* Running, until preempted. */
+    SCHED_LAT_NR
+};
+
+struct sched_lat {
+    uint64_t         hist[SCHED_LAT_NR][SCHED_LAT_BUCKETS];
+    bool             woken;   /* Runnable since a wakeup? */
 };
 
 struct vcpu
@@ -206,6 +241,12 @@ struct vcpu
     struct guest_area runstate_guest_area;
     unsigned int     new_state;
 
+    /* Scheduling latency histograms (NULL for idle vCPUs). */
+    struct sched_lat *sched_lat;
+
+    /* Extents allocated ahead by a preempted XENMEM_populate_physmap. */
+    struct populate_state *populate_state;
+
     /* Has the FPU been initialised? */
     bool             fpu_initialised;
     /* Has the FPU been used since it was last saved? */
@@ -632,6 +673,11 @@ struct domain
     struct {
         rspinlock_t             lock;
         struct ioreq_server     *server[MAX_NR_IOREQ_SERVERS];
+        /*
+         * Bumped whenever server selection may change.  Read locklessly to
+         * validate the vCPUs' select_cache entries.
+         */
+        unsigned int            select_gen;
     } ioreq_server;
 #endif
 
@@ -1075,6 +1121,7 @@ void vcpu_runstate_get(const struct vcpu *v,
                        struct vcpu_runstate_info *runstate);
 uint64_t get_cpu_idle_time(unsigned int cpu);
 void sched_guest_idle(void (*idle) (void), unsigned int cpu);
+bool sched_cpu_is_idle(unsigned int cpu);
 void scheduler_enable(void);
 void scheduler_disable(void);
 
@@ -1204,6 +1251,7 @@ static always_inline bool is_iommu_enabled(const struct domain *d)
 }
 
 extern bool sched_smt_power_savings;
+extern unsigned int sched_smt_pack_load;
 extern bool sched_disable_smt_switching;
 
 extern enum cpufreq_controller {
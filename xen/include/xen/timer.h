@@ -24,7 +24,10 @@ struct timer {
         unsigned int heap_offset;
         /* Linked list (TIMER_STATUS_in_list). */
         struct timer *list_next;
-        /* Linked list of inactive timers (TIMER_STATUS_inactive). */
+        /*
+         * Linked list of inactive timers (TIMER_STATUS_inactive), or timer
+         * wheel bucket (TIMER_STATUS_in_wheel).
+         */
         struct list_head inactive;
     };
 
@@ -42,7 +45,24 @@ struct timer {
 #define TIMER_STATUS_killed   2 /* Not in use; cannot be activated. */
 #define TIMER_STATUS_in_heap  3 /* In use; on timer heap.           */
 #define TIMER_STATUS_in_list  4 /* In use; on overflow linked list. */
+#define TIMER_STATUS_in_wheel 5 /* In use; on timer wheel.          */
     uint8_t status;
+
+    /* Coalescing class, see timer_set_coalesce(). */
+    uint8_t coalesce;
+};
+
+/*
+ * Classes of timers which may expire up to a per-class window (set with the
+ * "timer-coalesce" command line option) late, to share a timer interrupt with
+ * other timers on the same CPU.
+ */
+enum timer_coalesce {
+    TIMER_COALESCE_none,
+    TIMER_COALESCE_tick,    /* Guest periodic ticks. */
+    TIMER_COALESCE_vpt,     /* Emulated platform timers. */
+    TIMER_COALESCE_sched,   /* Scheduler time slices. */
+    TIMER_COALESCE_nr
 };
 
 /*
@@ -61,6 +81,9 @@ void init_timer(
     void         *data,
     unsigned int  cpu);
 
+/* Set the coalescing class of a timer. Timers start as TIMER_COALESCE_none. */
+void timer_set_coalesce(struct timer *timer, enum timer_coalesce coalesce);
+
 /* Set the expiry time and activate a timer. */
 void set_timer(struct timer *timer, s_time_t expires);
 
@@ -84,7 +107,7 @@ bool timer_expires_before(struct timer *timer, s_time_t t);
  */
 static inline bool timer_is_active(const struct timer *timer)
 {
-    ASSERT(timer->status <= TIMER_STATUS_in_list);
+    ASSERT(timer->status <= TIMER_STATUS_in_wheel);
     return timer->status >= TIMER_STATUS_in_heap;
 }
 
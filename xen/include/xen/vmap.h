@@ -81,12 +81,22 @@ void *vmap_contig(mfn_t mfn, unsigned int nr);
  * Unmaps a range of virtually contiguous memory from one of the vmap regions
  *
  * The system remembers internally how wide the mapping is and unmaps it all.
- * It also can determine the vmap region type from the `va`.
+ * It also can determine the vmap region type from the `va`.  The mapping is
+ * gone from all TLBs on return, so the memory it referred to may be freed.
  *
  * @param va Virtual base address of the range to unmap
  */
 void vunmap(const void *va);
 
+/*
+ * Same as vunmap(), but the TLB flush may be deferred, to be shared with
+ * other lazily unmapped areas.  Only for memory which doesn't get freed or
+ * reused behind the mapping's back, like MMIO.
+ *
+ * @param va Virtual base address of the range to unmap
+ */
+void vunmap_lazy(const void *va);
+
 /*
  * Allocate `size` octets of possibly non-contiguous physical memory and map
  * them contiguously in the VMAP_DEFAULT vmap region
@@ -127,12 +137,12 @@ void __iomem *ioremap(paddr_t pa, size_t len);
 /* Return the number of pages in the mapping starting at address 'va' */
 unsigned int vmap_size(const void *va);
 
-/* Analogous to vunmap(), but for IO memory mapped via ioremap() */
+/* Analogous to vunmap_lazy(), but for IO memory mapped via ioremap() */
 static inline void iounmap(void __iomem *va)
 {
     unsigned long addr = (unsigned long)(void __force *)va;
 
-    vunmap((void *)(addr & PAGE_MASK));
+    vunmap_lazy((void *)(addr & PAGE_MASK));
 }
 
 /* Pointer to 1 octet past the end of the VMAP_DEFAULT virtual area */